@@ -305,6 +305,9 @@ enum {
 	TCA_HTB_INIT,
 	TCA_HTB_CTAB,
 	TCA_HTB_RTAB,
+	TCA_HTB_DIRECT_QLEN,
+	TCA_HTB_RATE64,
+	TCA_HTB_CEIL64,
 	__TCA_HTB_MAX
 };
 
@@ -603,4 +606,59 @@ struct tc_qfq_stats {
 	__u32 lmax;
 };
 
+/* FQ_CODEL */
+
+enum {
+	TCA_FQ_CODEL_UNSPEC,
+	TCA_FQ_CODEL_TARGET,
+	TCA_FQ_CODEL_LIMIT,
+	TCA_FQ_CODEL_INTERVAL,
+	TCA_FQ_CODEL_ECN,
+	TCA_FQ_CODEL_FLOWS,
+	TCA_FQ_CODEL_QUANTUM,
+	TCA_FQ_CODEL_CE_THRESHOLD,
+	TCA_FQ_CODEL_DROP_BATCH_SIZE,
+	TCA_FQ_CODEL_MEMORY_LIMIT,
+	__TCA_FQ_CODEL_MAX
+};
+
+#define TCA_FQ_CODEL_MAX	(__TCA_FQ_CODEL_MAX - 1)
+
+/* FQ */
+
+enum {
+	TCA_FQ_UNSPEC,
+	TCA_FQ_PLIMIT,		/* limit of total number of packets in queue */
+	TCA_FQ_FLOW_PLIMIT,	/* limit of packets per flow */
+	TCA_FQ_QUANTUM,		/* RR quantum */
+	TCA_FQ_INITIAL_QUANTUM,		/* RR quantum for new flow */
+	TCA_FQ_RATE_ENABLE,	/* enable/disable rate limiting */
+	TCA_FQ_FLOW_DEFAULT_RATE,/* obsolete, do not use */
+	TCA_FQ_FLOW_MAX_RATE,	/* per flow max rate */
+	TCA_FQ_BUCKETS_LOG,	/* log2(number of buckets) */
+	TCA_FQ_FLOW_REFILL_DELAY,	/* flow credit refill delay in usec */
+	__TCA_FQ_MAX
+};
+
+#define TCA_FQ_MAX	(__TCA_FQ_MAX - 1)
+
+/* CAKE */
+
+enum {
+	TCA_CAKE_UNSPEC,
+	TCA_CAKE_PAD,
+	TCA_CAKE_BASE_RATE64,
+	TCA_CAKE_DIFFSERV_MODE,
+	TCA_CAKE_ATM,
+	TCA_CAKE_FLOW_MODE,
+	TCA_CAKE_OVERHEAD,
+	TCA_CAKE_RTT,
+	TCA_CAKE_TARGET,
+	TCA_CAKE_AUTORATE,
+	TCA_CAKE_MEMORY,
+	__TCA_CAKE_MAX
+};
+
+#define TCA_CAKE_MAX	(__TCA_CAKE_MAX - 1)
+
 #endif
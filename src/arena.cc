@@ -0,0 +1,63 @@
+/*
+ *      NiceShaper - Dynamic Traffic Management
+ *
+ *      Copyright (C) 2004-2016 Mariusz Jedwabny <mariusz@jedwabny.net>
+ *
+ *      This file is subject to the terms and conditions of the GNU General Public
+ *      License.  See the file COPYING in the main directory of this archive for
+ *      more details.
+ */
+
+#include "arena.h"
+
+#include <pthread.h>
+
+#include <set>
+#include <string>
+
+StringPool::StringPool()
+{
+    Bytes = 0;
+    pthread_mutex_init(&Lock, NULL);
+}
+
+StringPool::~StringPool()
+{
+    pthread_mutex_destroy(&Lock);
+}
+
+const std::string *StringPool::intern(const std::string &arg)
+{
+    std::pair <std::set <std::string>::iterator, bool> result;
+
+    // Sections are prepared in parallel
+    pthread_mutex_lock(&Lock);
+    result = Strings.insert(arg);
+    if (result.second) Bytes += sizeof(std::string) + result.first->capacity();
+    pthread_mutex_unlock(&Lock);
+
+    // Nodes of the set don't move, thus the address is valid until exit
+    return &(*result.first);
+}
+
+unsigned int StringPool::count()
+{
+    unsigned int result;
+
+    pthread_mutex_lock(&Lock);
+    result = Strings.size();
+    pthread_mutex_unlock(&Lock);
+
+    return result;
+}
+
+size_t StringPool::bytes()
+{
+    size_t result;
+
+    pthread_mutex_lock(&Lock);
+    result = Bytes;
+    pthread_mutex_unlock(&Lock);
+
+    return result;
+}
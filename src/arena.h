@@ -0,0 +1,88 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <pthread.h>
+
+#include <new>
+#include <set>
+#include <string>
+#include <vector>
+
+// Strings repeated by thousands of classes and filters (section names, interfaces) are kept once.
+// Entries are never removed, they are bounded by the configuration which requires restart to change.
+class StringPool {
+    public:
+        StringPool();
+        ~StringPool();
+        const std::string *intern(const std::string &);
+        unsigned int count();
+        size_t bytes();
+    private:
+        std::set <std::string> Strings;
+        size_t Bytes;
+        pthread_mutex_t Lock;
+};
+
+// Objects of one type are carved out of chunks, which keeps objects of a section next to each other.
+// Freed slots are reused by following objects. It isn't thread safe, sections have own arenas.
+template <class T> class ObjectArena {
+    public:
+        ObjectArena() { Live = 0; }
+        ~ObjectArena()
+        {
+            for (unsigned int n=0; n<Chunks.size(); n++) ::operator delete(Chunks.at(n));
+        }
+        void *alloc()
+        {
+            void *slot;
+
+            if (Free.empty()) grow();
+            slot = Free.back();
+            Free.pop_back();
+            Live++;
+
+            return slot;
+        }
+        void destroy(T *obj)
+        {
+            if (obj == NULL) return;
+            obj->~T();
+            Free.push_back(obj);
+            Live--;
+        }
+        unsigned int count() { return Live; }
+        size_t bytes() { return Chunks.size() * CHUNK_OBJECTS * sizeof(T); }
+    private:
+        void grow()
+        {
+            char *chunk = static_cast<char *>(::operator new(CHUNK_OBJECTS * sizeof(T)));
+
+            Chunks.push_back(chunk);
+            // Pushed backwards, thus slots are given in order of addresses
+            for (unsigned int n=CHUNK_OBJECTS; n>0; n--) Free.push_back(chunk + (n-1) * sizeof(T));
+        }
+        //
+        static const unsigned int CHUNK_OBJECTS = 256;
+        std::vector <void *> Chunks;
+        std::vector <void *> Free;
+        unsigned int Live;
+};
+
+// Owned part of an object which is rarely used, it's copied along with the owner
+template <class T> class ColdPart {
+    public:
+        ColdPart() { P = new T(); }
+        ColdPart(const ColdPart &other) { P = new T(*other.P); }
+        ~ColdPart() { delete P; }
+        ColdPart &operator=(const ColdPart &other)
+        {
+            if (this != &other) *P = *other.P;
+            return *this;
+        }
+        T *operator->() { return P; }
+        const T *operator->() const { return P; }
+    private:
+        T *P;
+};
+
+#endif
@@ -75,20 +75,22 @@ std::string aux::trim_strict(std::string source)
 
 std::string aux::awk(std::string source, unsigned int position)
 {
-    std::string result = "", word = "";
-    std::stringstream srcstream(source);
+    const char *ws = " \t\n\v\f\r";
+    size_t word_begin = 0, word_end = 0;
     unsigned int n = 0;
     
-    while (srcstream >> word) 
+    // Hot path of configuration loading, words are located in place instead of through stringstream
+    while (true)
     {
+        word_begin = source.find_first_not_of(ws, word_end);
+        if (word_begin == std::string::npos) break;
+        word_end = source.find_first_of(ws, word_begin);
         n++;
-        if (n == position) {
-            result = word;
-            return result;
-        }
+        if (n == position) return source.substr(word_begin, word_end - word_begin);
+        if (word_end == std::string::npos) break;
     }
 
-    return result;                                                                    
+    return "";
 } 
 
 std::string aux::awk(std::string source, std::string separator, unsigned int position)
@@ -122,48 +124,103 @@ int aux::power( int val , int inc )
     return result;
 }
 
-unsigned int aux::compute_quantum ( unsigned int rate )
+unsigned int aux::compute_quantum ( __u64 rate )
 {
-    unsigned int quantum=rate/8/1500;
+    __u64 quantum=rate/8/1500;
 
     if (!quantum) quantum=1;
+    // Multi-gigabit classes would get quantum far above HTB's sane limit, what hurts fairness between them
+    if (quantum > MAX_QUANTUM) quantum=MAX_QUANTUM;
 
     return quantum;
 }
 
 std::string aux::int_to_str(int arg)
 {
-    std::stringstream srcstream;
-    std::string result;
-    
-    srcstream << arg;
-    srcstream >> result;
-    
-    return result;
+    char buf[U64_CHARS_SIZE+1];
+    unsigned int len = 0;
+
+    if (arg < 0) buf[len++] = '-';
+    // Negation is done on 64 bits, thus the lowest int doesn't overflow
+    len += u64_to_chars(buf+len, (arg < 0) ? static_cast<__u64>(-static_cast<__s64>(arg)) : static_cast<__u64>(arg));
+
+    return std::string(buf, len);
 }
 
 std::string aux::int_to_str(unsigned int arg)
 {
-    std::stringstream srcstream;
-    std::string result;
-    
-    srcstream << arg;
-    srcstream >> result;
-    
-    return result;
+    char buf[U64_CHARS_SIZE];
+
+    return std::string(buf, u64_to_chars(buf, arg));
+}
+
+std::string aux::int_to_str(__u64 arg)
+{
+    char buf[U64_CHARS_SIZE];
+
+    return std::string(buf, u64_to_chars(buf, arg));
 }
 
 std::string aux::int_to_str(int arg, unsigned int pad) 
 {
     std::string buf = int_to_str(arg);
     
-    if ((pad-buf.size()) <= 0) return buf;
+    if (buf.size() >= pad) return buf;
 
     buf.insert(0, pad-buf.size(), '0');
     
     return buf;
 }
 
+unsigned int aux::u64_to_chars(char *buf, __u64 arg)
+{
+    static const char digit_pairs[] = 
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char digits[U64_CHARS_SIZE];
+    char *pos = digits + U64_CHARS_SIZE;
+    unsigned int pair;
+    unsigned int len;
+
+    // Two digits per division, written from the end
+    while (arg >= 100) {
+        pair = static_cast<unsigned int>(arg % 100) * 2;
+        arg /= 100;
+        *--pos = digit_pairs[pair+1];
+        *--pos = digit_pairs[pair];
+    }
+    if (arg >= 10) {
+        pair = static_cast<unsigned int>(arg) * 2;
+        *--pos = digit_pairs[pair+1];
+        *--pos = digit_pairs[pair];
+    }
+    else *--pos = static_cast<char>('0' + arg);
+
+    len = digits + U64_CHARS_SIZE - pos;
+    memcpy(buf, pos, len);
+
+    return len;
+}
+
+unsigned int aux::rate_to_chars(char *buf, __u64 arg, EnumUnits unit)
+{
+    const char *unit_str = unit_to_cstr(unit, false);
+    unsigned int len = u64_to_chars(buf, unit_convert(arg, unit));
+    unsigned int unit_len = strlen(unit_str);
+
+    memcpy(buf+len, unit_str, unit_len);
+
+    return len + unit_len;
+}
+
+void aux::append_u64(std::string &dst, __u64 arg)
+{
+    char buf[U64_CHARS_SIZE];
+
+    dst.append(buf, u64_to_chars(buf, arg));
+}
+
 std::string aux::int_to_hex(int arg)    
 {
     std::stringstream srcstream;
@@ -210,13 +267,8 @@ double aux::str_to_double(std::string arg)
  
 __u64 aux::str_to_u64(std::string arg)
 {
-    std::stringstream srcstream;
-    __u64 result;
-    
-    srcstream << arg;
-    srcstream >> result;
-    
-    return result;
+    // Leading digits are taken as stream would do, status rendering parses every number through it
+    return strtoull(arg.c_str(), NULL, 10);
 }
 
 unsigned int aux::str_fwmark_to_uint(std::string arg)
@@ -238,9 +290,9 @@ bool aux::is_uint (std::string arg)
     return false;
 }
 
-void aux::shift (unsigned int &var1, unsigned int &var2)
+void aux::shift (__u64 &var1, __u64 &var2)
 {
-    unsigned int tmp = var1;
+    __u64 tmp = var1;
 
     var1 = var2;
     var2 = tmp;
@@ -272,13 +324,16 @@ int aux::dot_to_bit(std::string mask)
 std::string aux::bit_to_dot(int arg)
 {
     struct in_addr netwrk;
+    char netwrk_dot[INET_ADDRSTRLEN];
     int n, m;
 
     if (arg < 0 || arg > 32) return "255.255.255.255";
     for (m = 0, n = 0; n < arg; n++) m += 1 << (31 - n);
     netwrk.s_addr = htonl(m);
 
-    return std::string(inet_ntoa(netwrk));
+    if (inet_ntop(AF_INET, &netwrk, netwrk_dot, sizeof(netwrk_dot)) == NULL) return "255.255.255.255";
+
+    return std::string(netwrk_dot);
 }
 
 std::string aux::ip_to_hostname(std::string ipaddr)
@@ -308,7 +363,14 @@ int aux::split_ip(const std::string src, std::string &ipaddr, std::string &ipmas
     } 
     else {
         ipaddr = trim_strict(src);
-        ipmask = "255.255.255.255";
+        ipmask = (ipaddr.find(":") == std::string::npos) ? "255.255.255.255" : "128";
+    }
+
+    // IPv6 mask is kept as a prefix length, iptables and u32 take it in this form
+    if (ipaddr.find(":") != std::string::npos) {
+        if (!test->validIp6(ipaddr)) { log->error(29, src); return -1; }
+        if (!is_uint(ipmask) || (str_to_uint(ipmask) > 128)) { log->error(50, src); return -1; }
+        return 1;
     }
 
     if (!test->validIp(ipaddr)) { log->error(29, src); return -1; }
@@ -321,6 +383,28 @@ int aux::split_ip(const std::string src, std::string &ipaddr, std::string &ipmas
     return 1;
 }
 
+int aux::match_family(const std::string match)
+{
+    std::string param, value;
+    int family = AF_INET;
+    bool ipv4 = false;
+    unsigned int pos = 1;
+
+    // Match is of IPv6 when it tests IPv6 addresses, the one without addresses stays IPv4
+    while (awk(match, ++pos).size()) {
+        param = awk(match, pos);
+        value = awk(match, ++pos);
+        if ((param != "srcip") && (param != "dstip") && (param != "not-srcip") && (param != "not-dstip")
+                && (param != "from-local") && (param != "to-local") && (param != "_auto-srcip-dstip_")) continue;
+        if (value.find(":") != std::string::npos) family = AF_INET6;
+        else ipv4 = true;
+    }
+
+    if ((family == AF_INET6) && ipv4) { log->error(77, match); return -1; }
+
+    return family;
+}
+
 int aux::split_ip_port (std::string arg, std::string &ip_addr, int &ip_port)
 {
     ip_addr = "";
@@ -423,11 +507,13 @@ EnumUnits aux::get_unit(std::string arg)
     if ((unit == "b/s") || (unit == "b")) return BITS;
     else if ((unit == "kb/s") || (unit == "Kb/s") || (unit == "kb") || (unit == "Kb")) return KBITS;
     else if ((unit == "mb/s") || (unit == "Mb/s") || (unit == "mb") || (unit == "Mb")) return MBITS;
+    else if ((unit == "gb/s") || (unit == "Gb/s") || (unit == "gb") || (unit == "Gb")) return GBITS;
 
     // Bytes
     else if ((unit == "B/s") || (unit == "B")) return BYTES;
     else if ((unit == "kB/s") || (unit == "KB/s") || (unit == "kB") || (unit == "KB")) return KBYTES;
     else if ((unit == "mB/s") || (unit == "MB/s") || (unit == "mB") || (unit == "MB")) return MBYTES;
+    else if ((unit == "gB/s") || (unit == "GB/s") || (unit == "gB") || (unit == "GB")) return GBYTES;
 
     else if (unit.empty()) return BITS;
  
@@ -438,27 +524,59 @@ EnumUnits aux::get_unit(std::string arg)
 }
 
 std::string aux::unit_to_str(EnumUnits arg, bool without_ps)
+{
+    return unit_to_cstr(arg, without_ps);
+}
+
+const char *aux::unit_to_cstr(EnumUnits arg, bool without_ps)
 {
     if (arg == BITS) return "b/s";
     else if (arg == KBITS) return "kb/s";
     else if (arg == MBITS) return "Mb/s";
+    else if (arg == GBITS) return "Gb/s";
     else if ((arg == BYTES) && (without_ps)) return "B";
     else if ((arg == KBYTES) && (without_ps)) return "kB";
     else if ((arg == MBYTES) && (without_ps)) return "MB";
+    else if ((arg == GBYTES) && (without_ps)) return "GB";
     else if (arg == BYTES) return "B/s";
     else if (arg == KBYTES)  return "kB/s";
     else if (arg == MBYTES) return "MB/s";
+    else if (arg == GBYTES) return "GB/s";
     else return "";
 }
 
-unsigned int aux::unit_convert(std::string arg, EnumUnits resunit)
+__u64 aux::unit_convert(std::string arg, EnumUnits resunit)
 {
-    return (str_to_uint(arg) * (unsigned int)get_unit(arg) / (unsigned int)resunit);
+    return (str_to_u64(arg) * (__u64)get_unit(arg) / (__u64)resunit);
 }
 
-unsigned int aux::unit_convert(unsigned int arg, EnumUnits resunit)
+__u64 aux::unit_convert(__u64 arg, EnumUnits resunit)
 {
-    return (arg / (unsigned int)resunit);
+    return (arg / (__u64)resunit);
+}
+
+int aux::time_to_usec(std::string arg, unsigned int &usec)
+{
+    size_t pos;
+    std::string unit;
+    __u64 result;
+
+    pos = arg.find_first_not_of("0123456789");
+    if (!pos) return -1;
+    if (pos == std::string::npos) pos = arg.size();
+
+    unit = arg.substr(pos, std::string::npos);
+    result = str_to_u64(arg.substr(0, pos));
+
+    // The same as in tc, plain number is in microseconds
+    if (unit == "ms") result *= 1000;
+    else if (unit == "s") result *= 1000000;
+    else if (!unit.empty() && (unit != "us")) return -1;
+
+    if (result > 0xFFFFFFFFULL) return -1;
+    usec = result;
+
+    return 0;
 }
 
 bool aux::is_in_vector (std::vector <std::string> &fpv, std::string arg)
@@ -7,6 +7,8 @@
 #include "main.h"
 
 namespace aux {
+    const unsigned int U64_CHARS_SIZE = 20; // Digits of the longest __u64
+    const unsigned int RATE_CHARS_SIZE = U64_CHARS_SIZE + 4; // Digits and unit
     // Text processing
     std::string trim (std::string, bool);
     std::string trim_legacy (std::string);
@@ -16,24 +18,30 @@ namespace aux {
     unsigned int awk_size(std::string source);
     // Numbers processing
     int power (int, int);
-    unsigned int compute_quantum (unsigned int);
+    unsigned int compute_quantum (__u64);
     std::string int_to_str(int);
     std::string int_to_str(unsigned int);
+    std::string int_to_str(__u64);
     std::string int_to_str(int, unsigned int);
     std::string int_to_hex(int);
+    // Formatting into caller's buffer, without streams and temporary strings
+    unsigned int u64_to_chars(char *, __u64);
+    unsigned int rate_to_chars(char *, __u64, EnumUnits);
+    void append_u64(std::string &, __u64);
     unsigned int str_to_uint (std::string);
     int str_to_int (std::string);
     double str_to_double (std::string);
     __u64 str_to_u64(std::string);
     unsigned int str_fwmark_to_uint (std::string);
     bool is_uint (std::string);
-    void shift (unsigned int &, unsigned int &);
+    void shift (__u64 &, __u64 &);
     // Net related
     std::string trim_dev (std::string);
     int dot_to_bit (std::string);
     std::string bit_to_dot (int);
     std::string ip_to_hostname (std::string);
     int split_ip (const std::string, std::string &, std::string &);
+    int match_family (const std::string);
     int split_ip_port (std::string, std::string &, int &);
     // Configure processing
     int fpv_section_i (std::vector < std::string >::iterator &, std::vector < std::string >::iterator &, std::vector < std::string > &, std::string); // begin, end, fpv, section 
@@ -41,8 +49,10 @@ namespace aux {
     // Units processing
     EnumUnits get_unit (std::string);
     std::string unit_to_str (EnumUnits arg, bool);
-    unsigned int unit_convert (std::string, EnumUnits);
-    unsigned int unit_convert(unsigned int, EnumUnits);
+    const char *unit_to_cstr (EnumUnits arg, bool);
+    __u64 unit_convert (std::string, EnumUnits);
+    __u64 unit_convert(__u64, EnumUnits);
+    int time_to_usec (std::string, unsigned int &);
     // Vectors related
     bool is_in_vector (std::vector < std::string > &, std::string);
     bool is_in_vector (std::vector < unsigned int > &, unsigned int);
@@ -11,6 +11,7 @@
 #include "class.h"
 
 #include <cstdlib>
+#include <cstring>
 
 #include <iostream>
 #include <string>
@@ -24,20 +25,24 @@
 #include "ifaces.h"
 #include "tests.h"
 #include "aux.h"
+#include "arena.h"
 
-NsClass::NsClass(std::string section_name, unsigned int section_id, unsigned int waitingroom_id, EnumFlowDirection flow_direction, unsigned int section_shape)
+NsClass::NsClass(std::string section_name, unsigned int section_id, unsigned int waitingroom_id, EnumFlowDirection flow_direction, __u64 section_shape, SectionArena *arena)
 {
-    SectionName = section_name;
-    Header = "";
-    Dev = "";
+    SectionName = strpool->intern(section_name);
+    Cold->Header = "";
+    Cold->Definition = "";
+    Dev = strpool->intern("");
     Name = "";
-    EsfqHash = "classic";
-    TcQdiscEsfqAdd = "";
     NsClassType = STANDARD_CLASS;
     TcQdiscType = SFQ;
     FlowDirection = flow_direction;
+    Arena = arena;
     DevId = 0;
+    DevHandle = -1;
     ClassId = 0;
+    QosClassId = 0;
+    ClassIdMissing = false;
     Alive = 0;
     Hold = 30;
     NsLow = 0;
@@ -46,16 +51,24 @@ NsClass::NsClass(std::string section_name, unsigned int section_id, unsigned int
     WaitingRoomId = waitingroom_id;
     HtbRate = 0;
     HtbCeil = 0;
-    HtbPrio = 5;
-    HtbBurst = 0;
-    HtbCBurst = 0;
+    Cold->HtbPrio = 5;
+    Cold->HtbBurst = 0;
+    Cold->HtbCBurst = 0;
     OldHtbCeil = 0;
     OldHtbRate = 0;
     RawBytesCurr = 0;
     RawBytesPrev = 0;
+    RawBytesResync = false;
     Traffic = 0;
-    SfqPerturb = 10;
-    EsfqPerturb = 10;
+    Cold->SfqPerturb = 10;
+    Cold->EsfqPerturb = 10;
+    Cold->EsfqHash = ESFQ_HASH_CLASSIC;
+    memset(&Cold->FqCodelOpts, 0, sizeof(Cold->FqCodelOpts));
+    memset(&Cold->CakeOpts, 0, sizeof(Cold->CakeOpts));
+    memset(&Cold->FqOpts, 0, sizeof(Cold->FqOpts));
+    LeafBacklog = 0;
+    LeafDropsCurr = 0;
+    LeafDropsPrev = 0;
     SectionShape = section_shape;
     Strict = 0.70;
     UseQosClass = true;
@@ -74,7 +87,7 @@ NsClass::~NsClass()
 {
     if (DnswStub) return;
 
-    for (unsigned int n=0; n<TcFilters.size(); n++) delete TcFilters.at(n);
+    for (unsigned int n=0; n<TcFilters.size(); n++) Arena->Filters.destroy(TcFilters.at(n));
 
     TcFilters.clear();
 }
@@ -96,34 +109,34 @@ int NsClass::store(std::string buf)
     value = aux::awk(buf, 3);  
     
     if ((option == "class") || (option == "class-virtual")) { 
-        Header = buf;
-        Dev = aux::trim_dev(aux::awk(buf, 3));
+        Cold->Header = buf;
+        Cold->Definition = "";
+        Dev = strpool->intern(aux::trim_dev(aux::awk(buf, 3)));
         Name = aux::awk(buf, 4);
-        if (!Name.size() || aux::awk(buf, 5).size()) { log->error (SectionName, 24, buf); return -1; }
-        if (!ifaces->isValidSysDev(Dev)) { log->error (SectionName, 16, buf); return -1; }
-        DevId = ifaces->index(Dev);
+        if (!Name.size() || aux::awk(buf, 5).size()) { log->error (*SectionName, 24, buf); return -1; }
+        DevHandle = ifaces->handle(*Dev);
+        if (DevHandle == -1) { log->error (*SectionName, 16, buf); return -1; }
+        DevId = ifaces->index(DevHandle);
         if (option == "class") NsClassType = STANDARD_CLASS;
         else if (option == "class-virtual") NsClassType = VIRTUAL;   
     } 
     else if ((option == "class-wrapper") || (option == "class-do-not-shape")) {
-        Header = buf;
-        Dev = aux::trim_dev(aux::awk(buf, 2));
+        Cold->Header = buf;
+        Cold->Definition = "";
+        Dev = strpool->intern(aux::trim_dev(aux::awk(buf, 2)));
         Name = aux::awk(buf, 3);
-        if (!Name.size() || aux::awk(buf, 4).size()) { log->error (SectionName, 24, buf); return -1; }
-        if (!ifaces->isValidSysDev(Dev)) { log->error (SectionName, 16, buf); return -1; }
-        DevId = ifaces->index(Dev);
+        if (!Name.size() || aux::awk(buf, 4).size()) { log->error (*SectionName, 24, buf); return -1; }
+        DevHandle = ifaces->handle(*Dev);
+        if (DevHandle == -1) { log->error (*SectionName, 16, buf); return -1; }
+        DevId = ifaces->index(DevHandle);
         if (option == "class-wrapper") NsClassType = WRAPPER;
         else if (option == "class-do-not-shape") NsClassType = DONOTSHAPE;
     }
-    else if (option == "_classid_") { 
-        ClassId = aux::str_to_uint (param); 
-        if (sys->computeQosClassId(1, ClassId, &QosClassId) == -1) return -1;
-    }
     else if (option == "_dnswstub-before_") {
         DnswStubBefore = aux::str_to_uint (param);
     }
     else if (option == "match") {
-        if (!DnswStub) TcFilters.push_back(new TcFilter (SectionName, Header, buf, WaitingRoomId, FlowDirection));
+        if (!DnswStub) TcFilters.push_back(new (Arena->Filters.alloc()) TcFilter (&Cold->Header, buf, WaitingRoomId, FlowDirection));
         else DnswStubTcFiltersNum++;
     }
     else if (option == "low") {
@@ -145,46 +158,72 @@ int NsClass::store(std::string buf)
         if (param == "scheduler") {
             if (value == "sfq") TcQdiscType = SFQ;
             else if (value == "esfq") TcQdiscType = ESFQ;
+            else if (value == "fq_codel") TcQdiscType = FQ_CODEL;
+            else if (value == "cake") TcQdiscType = CAKE;
+            else if (value == "fq") TcQdiscType = FQ;
             else if (value == "no") TcQdiscType = NOQDISC;
             else { 
-                log->error (SectionName, 17, buf); 
+                log->error (*SectionName, 17, buf); 
                 return -1; 
             }
         }   
-        else if (param == "prio") HtbPrio = aux::str_to_uint (value);
-        else if (param == "burst") HtbBurst = aux::unit_convert (value, BYTES);
-        else if (param == "cburst") HtbCBurst = aux::unit_convert (value, BYTES);
+        else if (param == "prio") Cold->HtbPrio = aux::str_to_uint (value);
+        else if (param == "burst") Cold->HtbBurst = aux::unit_convert (value, BYTES);
+        else if (param == "cburst") Cold->HtbCBurst = aux::unit_convert (value, BYTES);
         else {
-            log->error (SectionName, 11, buf);
+            log->error (*SectionName, 11, buf);
             return -1;
         }        
     }
     else if (option == "sfq")
     {
-        if (param == "perturb") SfqPerturb = aux::str_to_uint(value);  
+        if (param == "perturb") Cold->SfqPerturb = aux::str_to_uint(value);  
         else { 
-            log->error (SectionName, 11, buf); 
+            log->error (*SectionName, 11, buf); 
             return -1; 
         }   
     }
     else if (option == "esfq") {
         if (param == "hash") {
-            if (value == "classic") EsfqHash = "classic";
-            else if (value == "dst") EsfqHash = "dst";
-            else if (value == "src") EsfqHash = "src";
+            if (value == "classic") Cold->EsfqHash = ESFQ_HASH_CLASSIC;
+            else if (value == "dst") Cold->EsfqHash = ESFQ_HASH_DST;
+            else if (value == "src") Cold->EsfqHash = ESFQ_HASH_SRC;
             else { 
-                log->error (SectionName, 11, buf); 
+                log->error (*SectionName, 11, buf); 
                 return -1; 
             }
         }
-        else if (param == "perturb") EsfqPerturb = aux::str_to_uint(value);  
+        else if (param == "perturb") Cold->EsfqPerturb = aux::str_to_uint(value);  
+        else { 
+            log->error (*SectionName, 11, buf); 
+            return -1; 
+        }
+    }
+    else if ((option == "fq_codel") || (option == "cake") || (option == "fq")) {
+        struct QosLeafOpts *leaf_opts = &Cold->FqCodelOpts;
+        if (option == "cake") leaf_opts = &Cold->CakeOpts;
+        else if (option == "fq") leaf_opts = &Cold->FqOpts;
+
+        if (param == "target") {
+            if (aux::time_to_usec(value, leaf_opts->Target) == -1) { log->error (*SectionName, 11, buf); return -1; }
+        }
+        else if (param == "interval") {
+            if (aux::time_to_usec(value, leaf_opts->Interval) == -1) { log->error (*SectionName, 11, buf); return -1; }
+        }
+        else if (param == "flows") leaf_opts->Flows = aux::str_to_uint(value);
+        else if (param == "limit") leaf_opts->Limit = aux::str_to_uint(value);
+        else if (param == "memory-limit") {
+            // Kernel takes 32 bits value
+            if (aux::unit_convert(value, BYTES) > 0xFFFFFFFFULL) { log->error (*SectionName, 102, buf); return -1; }
+            leaf_opts->MemoryLimit = aux::unit_convert(value, BYTES);
+        }
         else { 
-            log->error (SectionName, 11, buf); 
+            log->error (*SectionName, 11, buf); 
             return -1; 
         }
     }
     else if (option == "alter") {
-        Alter.store(buf);
+        Cold->Alter.store(buf);
     }
     else if (option == "quota") {
         Quota.store(buf);
@@ -192,35 +231,36 @@ int NsClass::store(std::string buf)
     // Deprecated directives
     else if (option == "imq") {
         if (param == "autoredirect") { 
-            log->error(SectionName, 150, buf); 
+            log->error(*SectionName, 150, buf); 
             return -1; 
         }
         else { 
-            log->error(SectionName, 11, buf); 
+            log->error(*SectionName, 11, buf); 
             return -1; 
         }
     }
     else if (option == "type") {
-        log->error(SectionName, 152, buf);
+        log->error(*SectionName, 152, buf);
         return -1;
     }
     
     if (log->getErrorLogged()) return -1;
 
-    if (option != "match") {
-        for (unsigned int n=0; n<TcFilters.size(); n++) {
-            if (TcFilters.at(n)->store(buf) == -1) return -1;
-        }
-    }
+    // Compared on reload to find out which classes are left untouched
+    if (Cold->Header.size()) Cold->Definition += buf + "\n";
 
     return 1;
 }
 
 int NsClass::recoverQos()
 {
-    DevId = ifaces->index(Dev);
+    DevId = ifaces->index(DevHandle);
     Active = false;
     QosInitialized = false;
+    // Interface gives ids from the beginning for the recreated HTB
+    ClassId = 0;
+    QosClassId = 0;
+    ClassIdMissing = false;
 
     for (unsigned int n = 0; n < TcFilters.size(); n++) {
         TcFilters.at(n)->recoverQos();
@@ -229,6 +269,23 @@ int NsClass::recoverQos()
     return 0;
 }
 
+int NsClass::dnswStubClassIdSync()
+{
+    unsigned int class_id;
+
+    if (!DnswStub || (NsClassType != WRAPPER)) return 0;
+
+    // Stub doesn't add any class, it follows the id held by its wrapper, which changes after recovery
+    class_id = ifaces->wrapperClassId(DevHandle, Name);
+    if (class_id == ClassId) return 0;
+
+    ClassId = class_id;
+    QosClassId = 0;
+    if (ClassId && (sys->computeQosClassId(1, ClassId, &QosClassId) == -1)) return -1;
+
+    return 0;
+}
+
 bool NsClass::getIptRequired() 
 {
     if (DnswStub) {
@@ -242,8 +299,8 @@ bool NsClass::getIptRequired()
 bool NsClass::getIptRequiredToOperate()
 {
     if (DnswStub) {
-        if (ifaces->tcFilterType(Dev) == FW) return true;
-        else if (test->ifaceIsImq(Dev) && config->getImqAutoRedirect()) return true;
+        if (ifaces->tcFilterType(DevHandle) == FW) return true;
+        else if (test->ifaceIsImq(*Dev) && config->getImqAutoRedirect()) return true;
         else return false;
     }
 
@@ -253,7 +310,7 @@ bool NsClass::getIptRequiredToOperate()
 bool NsClass::getIptRequiredToCheckActivity() 
 {
     if (DnswStub) {   
-        if (ifaces->tcFilterType(Dev) == FW) return true;
+        if (ifaces->tcFilterType(DevHandle) == FW) return true;
         else if (sys->getMissU32Perf()) return true;
         else return false;
     }
@@ -285,7 +342,7 @@ int NsClass::validateParams()
     else if (NsClassType == WRAPPER) {
         StatusShowHtbCeil = true; StatusShowTraffic = true;
         UseQosClass = true; UseQosFilter = true;
-        if (!NsCeil) { log->error(SectionName, 814, Header); return -1; }
+        if (!NsCeil) { log->error(*SectionName, 814, Cold->Header); return -1; }
         NsLow = HtbRate = HtbCeil = NsCeil;
         HtbParentId = ifaces->htbDNWrapperId();
     }
@@ -295,14 +352,14 @@ int NsClass::validateParams()
         NsLow = 0; NsCeil = 0; HtbRate = 0; HtbCeil = 0;
     } 
 
-    if (getTcFiltersNum() == 0) { log->error (SectionName, 22, Header); return -1; }
+    if (getTcFiltersNum() == 0) { log->error (*SectionName, 22, Cold->Header); return -1; }
 
     if (DnswStub) return 0;
 
     if ((NsClassType == STANDARD_CLASS) || (NsClassType == WRAPPER)) {
-        if ((NsLow > MAX_RATE) || (NsLow && (NsLow < MIN_RATE))) { log->error (SectionName, 806); return -1; }
-        if ((NsCeil > MAX_RATE) || (NsCeil && (NsCeil < MIN_RATE))) { log->error (SectionName, 806); return -1; }
-        if ((Strict < 0) || (Strict > 1)) { log->error(SectionName, 807); return -1; }
+        if ((NsLow > MAX_RATE) || (NsLow && (NsLow < MIN_RATE))) { log->error (*SectionName, 806); return -1; }
+        if ((NsCeil > MAX_RATE) || (NsCeil && (NsCeil < MIN_RATE))) { log->error (*SectionName, 806); return -1; }
+        if ((Strict < 0) || (Strict > 1)) { log->error(*SectionName, 807); return -1; }
         if (!NsLow) NsLow = MIN_RATE;
         if (!NsCeil) NsCeil = SectionShape; 
         if ((NsClassType == STANDARD_CLASS) && (NsCeil > SectionShape)) NsCeil = SectionShape;
@@ -321,27 +378,43 @@ int NsClass::prepareQosClass()
     if (NsLow > NsCeil) NsCeil = NsLow;
     if (!UseQosClass) return 0;
 
-    if (TcQdiscType == ESFQ) {
-        TcQdiscEsfqAdd = "tc qdisc add dev " + Dev + " parent 1:" + aux::int_to_hex(ClassId) + " handle " + aux::int_to_hex(ClassId) + ": esfq perturb " + aux::int_to_str(EsfqPerturb) + " hash " + EsfqHash;
+    return 1;
+}
+
+int NsClass::prepareAndAddQosFilters()
+{
+    if (prepareQosFilters() == -1) return -1;
+
+    return addQosFilters();
+}
+
+int NsClass::prepareQosFilters()
+{
+    if (!UseQosFilter) return 0;
+
+    for (unsigned int n = 0; n < TcFilters.size(); n++)
+    {
+        if (TcFilters.at(n)->prepareTcFilter() == -1) return -1;
+        if (TcFilters.at(0)->tcFilterType() == FW) n=TcFilters.size();
     }
 
     return 1;
 }
 
-int NsClass::prepareAndAddQosFilters()
+int NsClass::addQosFilters()
 {
     bool flow_to_target = false;
 
     if (!UseQosFilter) return 0;
 
-    if (NsClassType == STANDARD_CLASS) flow_to_target = false;
+    // Wrapper gets its class id in add(), traffic waits for it as for standard class
+    if ((NsClassType == STANDARD_CLASS) || (NsClassType == WRAPPER)) flow_to_target = false;
     else flow_to_target = true;
     
     for (unsigned int n = 0; n < TcFilters.size(); n++)
     {
-        if (TcFilters.at(n)->prepareTcFilter() == -1) return -1;
         if (TcFilters.at(n)->add(flow_to_target) == -1) return -1;
-        if (TcFilters.at(n)->tcFilterType() == U32) ifaces->reportTcFilterU32Id(Dev, TcFilters.at(n)->tcFilterId());
+        if (TcFilters.at(n)->tcFilterType() == U32) ifaces->reportTcFilterU32Id(DevHandle, TcFilters.at(n)->tcFilterId());
         if (TcFilters.at(0)->tcFilterType() == FW) n=TcFilters.size();
     }
 
@@ -369,6 +442,11 @@ int NsClass::proceedQosFilterHits(__u32 qos_filter_id, __u64 qos_filter_hits)
 
 int NsClass::proceedReceiptTraffic(__u64 raw_bytes_curr)
 {
+    if (RawBytesResync) {
+        RawBytesCurr = raw_bytes_curr;
+        RawBytesResync = false;
+    }
+
     RawBytesPrev = RawBytesCurr;
     RawBytesCurr = raw_bytes_curr;   
 
@@ -382,15 +460,16 @@ int NsClass::proceedReceiptIptCountersSum(__u64 ipt_counters_sum)
     return 0;
 }
 
-int NsClass::proceedReceiptedTraffic(struct timeval tv_curr, double round_duration)
+int NsClass::proceedReceiptedTraffic(struct timeval tv_curr, double round_duration, struct TriggerTime *trigger_time)
 {
     __u64 round_bits = 0;
 
-    round_bits = (RawBytesCurr - RawBytesPrev) << 3;
+    // Counters may go back if iptables rules were replaced in the meantime
+    if (RawBytesCurr >= RawBytesPrev) round_bits = (RawBytesCurr - RawBytesPrev) << 3;
 
     if (NsClassType == STANDARD_CLASS) {    
-        Quota.totalize(round_bits);
-        proceedTriggers (tv_curr);
+        // Quota limit crossing is handled at once, time driven changes come from the section trigger wheel
+        if ((Quota.totalize(round_bits) == 1) && (trigger_time != NULL)) proceedQuotaTrigger (*trigger_time);
     }
 
     if (round_bits) {
@@ -424,12 +503,12 @@ int NsClass::proceedReceiptedTraffic(struct timeval tv_curr, double round_durati
        }
     }
 
-    Traffic = static_cast<unsigned int>(static_cast<double>(round_bits)/static_cast<double>(round_duration));
+    Traffic = static_cast<__u64>(static_cast<double>(round_bits)/static_cast<double>(round_duration));
 
     return 0;
 }
 
-unsigned int NsClass::trafficPrognosed()
+__u64 NsClass::trafficPrognosed()
 {
     if (Traffic >= HtbCeil) return HtbCeil; 
     else return Traffic;
@@ -439,7 +518,7 @@ unsigned int NsClass::trafficPrognosed()
 
 void NsClass::computeGrade()
 {
-    unsigned int higher_resp_point = NsLow + (NsCeil-NsLow)*Strict;
+    __u64 higher_resp_point = NsLow + (NsCeil-NsLow)*Strict;
 
     if (Traffic <= NsLow) GradeForReducing = 0;    
     else if (Traffic <= higher_resp_point) GradeForReducing=(0.5/Strict)*(static_cast<double>(Traffic-NsLow)/static_cast<double>(NsCeil-NsLow));
@@ -449,21 +528,46 @@ void NsClass::computeGrade()
 
 int NsClass::add()
 {
-    unsigned int quantum = aux::compute_quantum(HtbCeil);
+    __u64 tree_ceil;
+    unsigned int htb_major;
     bool flow_to_target = true;
+    int result = 0;
 
     if (UseQosClass) {
-       if (sys->setQosClass(QOS_ADD, DevId, HtbParentId, ClassId, HtbRate, HtbCeil, HtbPrio, quantum, HtbBurst, HtbCBurst) == -1) return -1;
-       if (TcQdiscType == ESFQ) {
-           if (system(TcQdiscEsfqAdd.c_str()) == -1) return -1;
-       }
-       else if (TcQdiscType != NOQDISC) {
-           if (sys->setQosQdisc(QOS_ADD, DevId, ClassId, ClassId, TcQdiscType, SfqPerturb) == -1) return -1;
-       }
+        if (NsClassType == WRAPPER) ClassId = ifaces->wrapperClassId(DevHandle, Name);
+        else ClassId = ifaces->allocClassId(DevHandle);
+        if (!ClassId) {
+            // Filters are left pointing to the waiting room until some class frees its id
+            if (!ClassIdMissing) log->warning(*SectionName, 22, Cold->Header);
+            ClassIdMissing = true;
+            return 0;
+        }
+        ClassIdMissing = false;
+        if (sys->computeQosClassId(1, ClassId, &QosClassId) == -1) result = -1;
+        resetTrees();
+        for (unsigned int n=0; (result != -1) && (n < TreeShares.size()); n++) {
+            htb_major = ifaces->htbMajor(DevHandle, n);
+            tree_ceil = treeRate(HtbCeil, n);
+            if (sys->setQosClass(QOS_ADD, DevId, HtbParentId, ClassId, treeRate(HtbRate, n), tree_ceil, Cold->HtbPrio, aux::compute_quantum(tree_ceil), Cold->HtbBurst, Cold->HtbCBurst, htb_major) == -1) result = -1;
+            else if (TcQdiscType == ESFQ) {
+                if (sys->setQosQdisc(QOS_ADD, DevId, ClassId, ifaces->htbLeafHandle(DevHandle, ClassId), ESFQ, Cold->EsfqPerturb, Cold->EsfqHash, htb_major, NULL) == -1) result = -1;
+            }
+            else if (TcQdiscType != NOQDISC) {
+                if (sys->setQosQdisc(QOS_ADD, DevId, ClassId, ifaces->htbLeafHandle(DevHandle, ClassId), TcQdiscType, Cold->SfqPerturb, 0, htb_major, leafOpts()) == -1) result = -1;
+            }
+        }
+        // Class isn't initialized, nobody would give the id back
+        if (result == -1) {
+            ifaces->freeClassId(DevHandle, ClassId);
+            ClassId = 0;
+            QosClassId = 0;
+            return -1;
+        }
     }
 
     if (UseQosFilter) {
         for (unsigned int i = 0; i < TcFilters.size(); i++) {
+            if (UseQosClass) TcFilters.at(i)->setFlowId(ClassId);
             if (TcFilters.at(i)->del() == -1) return -1;
             if (TcFilters.at(i)->add(flow_to_target) == -1) return -1;
             if (TcFilters.at(0)->tcFilterType() == FW) i=TcFilters.size();
@@ -475,11 +579,39 @@ int NsClass::add()
     return 1;
 }
 
+int NsClass::activate(time_t tv_sec)
+{
+    if ((NsClassType != STANDARD_CLASS) || DnswStub) return 0;
+    if (Active || QosInitialized) return 0;
+
+    // The same as for the first traffic noticed in a round, the next round judges it as usual
+    Active = true;
+    Alive = tv_sec;
+    OldHtbRate = HtbRate = MIN_RATE;
+    OldHtbCeil = HtbCeil = NsCeil;
+    RawBytesCurr = 0;
+    RawBytesPrev = 0;
+
+    return add();
+}
+
+void NsClass::getHostAddrs(std::vector <std::string> &addrs)
+{
+    std::string addr;
+
+    if (!UseQosFilter) return;
+
+    for (unsigned int n = 0; n < TcFilters.size(); n++) {
+        addr = TcFilters.at(n)->hostAddr();
+        if (addr.size()) addrs.push_back(addr);
+    }
+}
+
 int NsClass::addWAMissLastU32()
 {
     if (!UseQosFilter) return -1;
     if (!TcFilters.size()) return -1;
-    if (ifaces->tcFilterType(Dev) == FW) return -1;
+    if (ifaces->tcFilterType(DevHandle) == FW) return -1;
            
     return TcFilters.back()->addWAMissLastU32();
 }
@@ -487,6 +619,7 @@ int NsClass::addWAMissLastU32()
 int NsClass::del()
 {
     unsigned int quantum = aux::compute_quantum(HtbCeil);
+    unsigned int htb_major;
     bool flow_to_target = false;
 
     if (UseQosFilter)
@@ -499,10 +632,16 @@ int NsClass::del()
     }
 
     if (UseQosClass) {
-        if (TcQdiscType != NOQDISC) {
-            if (sys->setQosQdisc(QOS_DEL, DevId, ClassId, ClassId, TcQdiscType, 0)== -1) return -1;
+        for (unsigned int n=0; n < ifaces->htbTrees(DevHandle); n++) {
+            htb_major = ifaces->htbMajor(DevHandle, n);
+            if (TcQdiscType != NOQDISC) {
+                if (sys->setQosQdisc(QOS_DEL, DevId, ClassId, ClassId, TcQdiscType, 0, 0, htb_major, NULL)== -1) return -1;
+            }
+            if (sys->setQosClass(QOS_DEL, DevId, HtbParentId, ClassId, HtbRate, HtbCeil, Cold->HtbPrio, quantum, Cold->HtbBurst, Cold->HtbCBurst, htb_major) == -1) return -1;
         }
-        if (sys->setQosClass(QOS_DEL, DevId, HtbParentId, ClassId, HtbRate, HtbCeil, HtbPrio, quantum, HtbBurst, HtbCBurst) == -1) return -1;
+        ifaces->freeClassId(DevHandle, ClassId);
+        ClassId = 0;
+        QosClassId = 0;
     }
 
     QosInitialized = false;
@@ -510,9 +649,50 @@ int NsClass::del()
     return 1;
 }
 
-int NsClass::applyChanges(unsigned int working_classes)
+int NsClass::remove()
 {
     unsigned int quantum = aux::compute_quantum(HtbCeil);
+    unsigned int htb_major;
+
+    if (DnswStub) return 0;
+
+    if (UseQosFilter) {
+        for (unsigned int i = 0; i < TcFilters.size(); i++) {
+            if (TcFilters.at(i)->del() == -1) return -1;
+            if (TcFilters.at(0)->tcFilterType() == FW) i=TcFilters.size();
+        }
+    }
+
+    if (UseQosClass && QosInitialized) {
+        for (unsigned int n=0; n < ifaces->htbTrees(DevHandle); n++) {
+            htb_major = ifaces->htbMajor(DevHandle, n);
+            if (TcQdiscType != NOQDISC) {
+                if (sys->setQosQdisc(QOS_DEL, DevId, ClassId, ClassId, TcQdiscType, 0, 0, htb_major, NULL)== -1) return -1;
+            }
+            if (sys->setQosClass(QOS_DEL, DevId, HtbParentId, ClassId, HtbRate, HtbCeil, Cold->HtbPrio, quantum, Cold->HtbBurst, Cold->HtbCBurst, htb_major) == -1) return -1;
+        }
+        ifaces->freeClassId(DevHandle, ClassId);
+        ClassId = 0;
+        QosClassId = 0;
+    }
+
+    QosInitialized = false;
+    Active = false;
+
+    return 1;
+}
+
+void NsClass::resyncRawBytes()
+{
+    // Counters of the class created on reload may be inherited from replaced iptables rules,
+    // the filter hits path feeds a fixed value and must not be touched
+    if (DnswStub || getIptRequiredToCheckActivity() || getIptRequiredToCheckTraffic()) RawBytesResync = true;
+}
+
+int NsClass::applyChanges(unsigned int working_classes)
+{
+    __u64 tree_ceil;
+    bool trees_rebalanced;
 
     if (NsClassType != STANDARD_CLASS) return 0;
 
@@ -523,7 +703,7 @@ int NsClass::applyChanges(unsigned int working_classes)
         if (del() == -1) return -1;
     }
 
-    if (!Active) return 0;
+    if (!Active || !QosInitialized) return 0;
 
     if (HtbCeil > NsCeil) HtbCeil = NsCeil;
     if (HtbCeil < NsLow) HtbCeil = NsLow;
@@ -532,45 +712,135 @@ int NsClass::applyChanges(unsigned int working_classes)
 
     if (HtbRate > HtbCeil) HtbRate = HtbCeil;
 
-    if ((HtbRate == OldHtbRate) && (HtbCeil == OldHtbCeil)) return 0;
+    trees_rebalanced = computeTreeShares();
 
-    if (sys->setQosClass(QOS_MOD, DevId, HtbParentId, ClassId, HtbRate, HtbCeil, HtbPrio, quantum, HtbBurst, HtbCBurst) == -1) return -1;
+    if ((HtbRate == OldHtbRate) && (HtbCeil == OldHtbCeil) && !trees_rebalanced) return 0;
+
+    for (unsigned int n=0; n < TreeShares.size(); n++) {
+        tree_ceil = treeRate(HtbCeil, n);
+        if (sys->setQosClass(QOS_MOD, DevId, HtbParentId, ClassId, treeRate(HtbRate, n), tree_ceil, Cold->HtbPrio, aux::compute_quantum(tree_ceil), Cold->HtbBurst, Cold->HtbCBurst, ifaces->htbMajor(DevHandle, n)) == -1) return -1;
+    }
 
     return 0;
 }
 
-int NsClass::proceedTriggers (struct timeval cttime)
+void NsClass::resetTrees()
+{
+    unsigned int htb_trees = ifaces->htbTrees(DevHandle);
+
+    // Fresh class doesn't know where its flows go, thus starts from the even split
+    TreeShares.assign(htb_trees, 1000 / htb_trees);
+    TreeBytesCurr.assign(htb_trees, 0);
+    TreeBytesPrev.assign(htb_trees, 0);
+}
+
+void NsClass::proceedReceiptTreeBytes(unsigned int tree, __u64 raw_bytes_curr)
+{
+    if (tree >= TreeBytesCurr.size()) return;
+
+    TreeBytesPrev.at(tree) = TreeBytesCurr.at(tree);
+    TreeBytesCurr.at(tree) = raw_bytes_curr;
+}
+
+bool NsClass::computeTreeShares()
+{
+    std::vector <__u64> round_bytes;
+    std::vector <unsigned int> shares;
+    __u64 round_bytes_sum = 0;
+    unsigned int htb_trees = TreeShares.size();
+    unsigned int share_floor, share;
+    bool rebalanced = false;
+
+    if (htb_trees < 2) return false;
+
+    round_bytes.assign(htb_trees, 0);
+    for (unsigned int n=0; n < htb_trees; n++) {
+        if (TreeBytesCurr.at(n) >= TreeBytesPrev.at(n)) round_bytes.at(n) = TreeBytesCurr.at(n) - TreeBytesPrev.at(n);
+        round_bytes_sum += round_bytes.at(n);
+    }
+
+    // Idle round says nothing about the queues, the previous split stays
+    if (!round_bytes_sum) return false;
+
+    share_floor = MQ_QUEUE_SHARE_FLOOR / htb_trees;
+    shares.assign(htb_trees, 0);
+    for (unsigned int n=0; n < htb_trees; n++) {
+        share = share_floor + (1000 - share_floor * htb_trees) * round_bytes.at(n) / round_bytes_sum;
+        if ((share > (TreeShares.at(n) + MQ_QUEUE_SHARE_STEP)) || ((share + MQ_QUEUE_SHARE_STEP) < TreeShares.at(n))) rebalanced = true;
+        shares.at(n) = share;
+    }
+
+    if (!rebalanced) return false;
+
+    TreeShares.swap(shares);
+
+    return true;
+}
+
+void NsClass::proceedReceiptLeafStats(__u32 backlog, __u64 drops)
+{
+    LeafBacklog = backlog;
+    LeafDropsPrev = LeafDropsCurr;
+    LeafDropsCurr = drops;
+}
+
+__u64 NsClass::leafDrops()
+{
+    // Counters start over when the class is recreated
+    if (LeafDropsCurr < LeafDropsPrev) return 0;
+
+    return LeafDropsCurr - LeafDropsPrev;
+}
+
+struct QosLeafOpts *NsClass::leafOpts()
+{
+    if (TcQdiscType == FQ_CODEL) return &Cold->FqCodelOpts;
+    else if (TcQdiscType == CAKE) return &Cold->CakeOpts;
+    else if (TcQdiscType == FQ) return &Cold->FqOpts;
+
+    return NULL;
+}
+
+__u64 NsClass::treeRate(__u64 rate, unsigned int tree)
+{
+    __u64 tree_rate;
+
+    if (TreeShares.size() < 2) return rate;
+
+    tree_rate = rate * TreeShares.at(tree) / 1000;
+    if (tree_rate < MIN_RATE) tree_rate = MIN_RATE;
+
+    return tree_rate;
+}
+
+int NsClass::proceedTriggers (struct TriggerTime &trigger_time)
 {
-    unsigned int dmin;
-    unsigned int wday;
-    unsigned int mday;
-    bool mday_last = false;
     int trigger_state;
-    struct tm *ltime;
 
-    ltime = localtime(&cttime.tv_sec);
-    dmin = ltime->tm_hour*60+ltime->tm_min;
-    wday = ltime->tm_wday;
-    mday = ltime->tm_mday;
-    cttime.tv_sec += 86400;
-    ltime = localtime(&cttime.tv_sec);
-    if (ltime->tm_mday == 1) mday_last = true;
+    if (NsClassType != STANDARD_CLASS) return 0;
 
     // Check alter trigger
-    trigger_state = Alter.check (dmin);
+    trigger_state = Cold->Alter.check (trigger_time.Dmin);
     if ((trigger_state == 1) || (trigger_state == 2)) {
         // Replace (A<=>Q);
-        if (Quota.isActive() && Alter.isUseNsLow() && Quota.isUseNsLow()) aux::shift (Alter.getTriggerNsLowRef(), Quota.getTriggerNsLowRef());
-        else if (Quota.isActive() && Alter.isUseNsCeil() && Quota.isUseNsCeil()) aux::shift (Alter.getTriggerNsCeilRef(), Quota.getTriggerNsCeilRef());
+        if (Quota.isActive() && Cold->Alter.isUseNsLow() && Quota.isUseNsLow()) aux::shift (Cold->Alter.getTriggerNsLowRef(), Quota.getTriggerNsLowRef());
+        else if (Quota.isActive() && Cold->Alter.isUseNsCeil() && Quota.isUseNsCeil()) aux::shift (Cold->Alter.getTriggerNsCeilRef(), Quota.getTriggerNsCeilRef());
         else {
             // Replace (A<=>0);
-            if (Alter.isUseNsLow()) aux::shift (Alter.getTriggerNsLowRef(), NsLow);
-            if (Alter.isUseNsCeil()) aux::shift (Alter.getTriggerNsCeilRef(), NsCeil);
+            if (Cold->Alter.isUseNsLow()) aux::shift (Cold->Alter.getTriggerNsLowRef(), NsLow);
+            if (Cold->Alter.isUseNsCeil()) aux::shift (Cold->Alter.getTriggerNsCeilRef(), NsCeil);
         }
     }
 
+    return proceedQuotaTrigger (trigger_time);
+}
+
+int NsClass::proceedQuotaTrigger (struct TriggerTime &trigger_time)
+{
+    int trigger_state;
+
     // Check quota trigger
-    trigger_state = Quota.check (dmin, wday, mday, mday_last);
+    trigger_state = Quota.check (trigger_time.Dmin, trigger_time.Wday, trigger_time.Mday, trigger_time.MdayLast);
     if ((trigger_state == 1) || (trigger_state == 2)) {
         // Replace (Q<=>0)
         if (Quota.isUseNsLow()) aux::shift (Quota.getTriggerNsLowRef(), NsLow);
@@ -580,6 +850,18 @@ int NsClass::proceedTriggers (struct timeval cttime)
     return 0;
 }
 
+void NsClass::getTriggerMinutes (std::vector <unsigned int> &minutes)
+{
+    minutes.clear();
+
+    if (NsClassType != STANDARD_CLASS) return;
+
+    Cold->Alter.getMinutes(minutes);
+    Quota.getMinutes(minutes);
+
+    return;
+}
+
 std::string NsClass::status()
 {
     std::string result = "";
@@ -594,29 +876,33 @@ std::string NsClass::status()
         else result = Name;
 
         if (StatusShowHtbCeil) {
-            if (!DnswStub) result += " " + aux::int_to_str(HtbCeil) + " " + aux::int_to_str(OldHtbCeil);
-            else result += " " + aux::int_to_str(NsCeil) + " " + aux::int_to_str(NsCeil);
+            result += ' ';
+            aux::append_u64(result, DnswStub ? NsCeil : HtbCeil);
+            result += ' ';
+            aux::append_u64(result, DnswStub ? NsCeil : OldHtbCeil);
         }
         else result += " - -";
 
-        if (StatusShowTraffic) result += " " + aux::int_to_str(Traffic);
+        if (StatusShowTraffic) {
+            result += ' ';
+            aux::append_u64(result, Traffic);
+        }
         else result += " -";
     }
 
     return result;
 }
 
-std::string NsClass::dumpQuotaCounters()
+void NsClass::setQuotaCounters(__u64 counter_day, __u64 counter_week, __u64 counter_month)
 {
-    std::string counters = Quota.dumpCounters();
+    Quota.setCounters (counter_day, counter_week, counter_month);
 
-    if (counters.size()) return (Name + " " + counters);
-    return "";
+    return;
 }
 
-void NsClass::setQuotaCounters(unsigned int counter_day, unsigned int counter_week, unsigned int counter_month)
+void NsClass::getQuotaCounters(__u64 &counter_day, __u64 &counter_week, __u64 &counter_month)
 {
-    Quota.setCounters (counter_day, counter_week, counter_month);
+    Quota.getCounters (counter_day, counter_week, counter_month);
 
     return;
 }
@@ -1,14 +1,36 @@
 #ifndef TCCLASS_H
 #define TCCLASS_H
 
+#include "arena.h"
 #include "filter.h"
+#include "sys.h"
 #include "trigger.h"
 
+struct SectionArena;
+
+// Parameters used only when QoS objects of the class are set up, and the definition compared on reload.
+// They are kept apart, thus the state judged every round of thousands of classes stays dense.
+struct NsClassCold {
+    std::string Header;
+    std::string Definition;
+    TriggerAlter Alter;
+    unsigned int HtbPrio;
+    unsigned int HtbBurst;
+    unsigned int HtbCBurst;
+    unsigned int SfqPerturb;
+    unsigned int EsfqPerturb;
+    unsigned int EsfqHash;
+    struct QosLeafOpts FqCodelOpts;
+    struct QosLeafOpts CakeOpts;
+    struct QosLeafOpts FqOpts;
+};
+
 class NsClass {
     public:
-        NsClass(std::string, unsigned int, unsigned int, EnumFlowDirection, unsigned int);
+        NsClass(std::string, unsigned int, unsigned int, EnumFlowDirection, __u64, SectionArena *);
         ~NsClass();
         void setAsDnswStub();
+        int dnswStubClassIdSync();
         int store(std::string);
         int recoverQos();
         bool getIptRequired();
@@ -18,20 +40,31 @@ class NsClass {
         int validateParams();
         int prepareQosClass();
         int prepareAndAddQosFilters();
+        int prepareQosFilters();
+        int addQosFilters();
         int proceedQosFilterHits(__u32, __u64);
         int proceedReceiptTraffic(__u64 raw_bytes);
+        void proceedReceiptTreeBytes(unsigned int, __u64);
+        void proceedReceiptLeafStats(__u32, __u64);
         int proceedReceiptIptCountersSum(__u64);
-        int proceedReceiptedTraffic(struct timeval, double);
-        unsigned int trafficPrognosed();
+        int proceedReceiptedTraffic(struct timeval, double, struct TriggerTime *);
+        __u64 trafficPrognosed();
         void computeGrade();
         int add();
         int addWAMissLastU32();
+        int activate(time_t);
+        void getHostAddrs(std::vector <std::string> &);
         int del();
+        int remove();
+        void resyncRawBytes();
         int applyChanges(unsigned int workings_count);
-        int proceedTriggers (struct timeval);
+        int proceedTriggers (struct TriggerTime &);
+        void getTriggerMinutes (std::vector <unsigned int> &);
         std::string status();
-        std::string dumpQuotaCounters();
-        void setQuotaCounters (unsigned int, unsigned int, unsigned int);
+        void setQuotaCounters (__u64, __u64, __u64);
+        void getQuotaCounters (__u64 &, __u64 &, __u64 &);
+        bool getQuotaDirty() { return Quota.isDirty(); }
+        void setQuotaDirty(bool dirty) { Quota.setDirty(dirty); }
         //
         unsigned int getHold() { return Hold; } 
         bool getUseQosClass() { return UseQosClass; }
@@ -40,70 +73,94 @@ class NsClass {
         bool getQosInitialized() { return QosInitialized; }
         EnumNsClassType type() { return NsClassType; }
         __u32 qosClassId() { return QosClassId; }
-        unsigned int traffic() { return Traffic; }        
-        unsigned int htbCeil() { return HtbCeil; }
-        unsigned int htbBurst() { return HtbBurst; }
-        unsigned int htbCBurst() { return HtbCBurst; }
-        unsigned int nsLow() { return NsLow; }
-        unsigned int nsCeil() { return NsCeil; }
+        __u64 traffic() { return Traffic; }        
+        __u32 leafBacklog() { return LeafBacklog; }
+        __u64 leafDrops();
+        bool congested() { return (LeafBacklog || leafDrops()); }
+        __u64 htbCeil() { return HtbCeil; }
+        __u64 oldHtbCeil() { return OldHtbCeil; }
+        unsigned int htbBurst() { return Cold->HtbBurst; }
+        unsigned int htbCBurst() { return Cold->HtbCBurst; }
+        __u64 nsLow() { return NsLow; }
+        __u64 nsCeil() { return NsCeil; }
         double gradeForReducing() { return GradeForReducing; }
         std::string name() { return Name; }
-        void decHtbCeil( unsigned int decrease ) { HtbCeil -= decrease; }
-        void incHtbCeil( unsigned int increase ) { HtbCeil += increase; }
-        void setHtbCeil( unsigned int htb_ceil ) { HtbCeil = htb_ceil; }
-        void setTraffic( unsigned int traffic ) { Traffic = traffic; }
+        std::string getHeader() { return Cold->Header; }
+        std::string getDefinition() { return Cold->Definition; }
+        void decHtbCeil( __u64 decrease ) { HtbCeil -= decrease; }
+        void incHtbCeil( __u64 increase ) { HtbCeil += increase; }
+        void setHtbCeil( __u64 htb_ceil ) { HtbCeil = htb_ceil; }
+        void setTraffic( __u64 traffic ) { Traffic = traffic; }
         unsigned int getTcFiltersNum();
         unsigned int getDnswStubBefore() { return DnswStubBefore; }
-        std::string getDev() { return Dev; }
+        std::string getDev() { return *Dev; }
+        int getDevHandle() { return DevHandle; }
+        unsigned int getDevId() { return DevId; }
         __u32 getTcFilterU32MaxId();
     private:
-        std::string SectionName;
-        std::string Header;
-        std::string Dev;
-        std::string Name;
-        std::string EsfqHash;
-        std::string TcQdiscEsfqAdd;
+        int proceedQuotaTrigger (struct TriggerTime &);
+        void resetTrees();
+        bool computeTreeShares();
+        __u64 treeRate(__u64, unsigned int);
+        struct QosLeafOpts *leafOpts();
+        // Judged every round
+        __u64 Traffic;
+        __u64 HtbCeil;
+        __u64 OldHtbCeil;
+        __u64 NsLow;
+        __u64 NsCeil;
+        __u64 HtbRate;
+        __u64 OldHtbRate;
+        __u64 RawBytesCurr;
+        __u64 RawBytesPrev;
+        __u64 RawBytesIptPrev;
+        double GradeForReducing; // 0 to 1
+        double Strict;
+        __u32 LeafBacklog;
+        __u64 LeafDropsCurr;
+        __u64 LeafDropsPrev;
+        unsigned int Alive;
+        unsigned int Hold;
         EnumNsClassType NsClassType;
+        bool Active;      
+        bool QosInitialized;
+        bool RawBytesResync;
+        bool UseQosClass;
+        bool UseQosFilter;
+        TriggerQuota Quota;
+        //
+        const std::string *SectionName; // Interned
+        const std::string *Dev; // Interned
+        std::string Name;
         EnumTcQdiscType TcQdiscType;
         EnumFlowDirection FlowDirection;
-        TriggerAlter Alter;
-        TriggerQuota Quota;
         unsigned int DevId;
+        int DevHandle;
         unsigned int ClassId;
         __u32 QosClassId;
-        unsigned int Alive;
-        unsigned int Hold;
-        unsigned int NsLow;
-        unsigned int NsCeil;
+        bool ClassIdMissing;
         unsigned int HtbParentId;
         unsigned int WaitingRoomId;
-        unsigned int HtbRate;
-        unsigned int HtbCeil;
-        unsigned int HtbPrio;
-        unsigned int HtbBurst;
-        unsigned int HtbCBurst;
-        unsigned int OldHtbRate;
-        unsigned int OldHtbCeil;
-        unsigned int SfqPerturb;
-        unsigned int EsfqPerturb;
-        unsigned int SectionShape;
-        unsigned int Traffic;
-        __u64 RawBytesCurr;
-        __u64 RawBytesPrev;
-        __u64 RawBytesIptPrev;
-        double GradeForReducing; // 0 to 1
-        double Strict;
-        bool UseQosClass;
-        bool UseQosFilter;
+        __u64 SectionShape;
         bool StatusShowHtbCeil;
         bool StatusShowTraffic;
-        bool Active;      
-        bool QosInitialized;
+        ColdPart <NsClassCold> Cold;
+        SectionArena *Arena;
         std::vector <TcFilter *> TcFilters;
+        // Multi-queue related, shares of HTB trees are in permille
+        std::vector <unsigned int> TreeShares;
+        std::vector <__u64> TreeBytesCurr;
+        std::vector <__u64> TreeBytesPrev;
         // Dnsw stub related
         bool DnswStub;
         unsigned int DnswStubBefore;
         unsigned int DnswStubTcFiltersNum;
 };
 
+// Classes and filters of a section, shared by its running and reloaded sets of classes
+struct SectionArena {
+    ObjectArena <NsClass> Classes;
+    ObjectArena <TcFilter> Filters;
+};
+
 #endif
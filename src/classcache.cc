@@ -0,0 +1,252 @@
+/*
+ *      NiceShaper - Dynamic Traffic Management
+ *
+ *      Copyright (C) 2004-2016 Mariusz Jedwabny <mariusz@jedwabny.net>
+ *
+ *      This file is subject to the terms and conditions of the GNU General Public
+ *      License.  See the file COPYING in the main directory of this archive for
+ *      more details.
+ */
+
+#include "classcache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+ClassCache::ClassCache(std::string path)
+{
+    Path = path;
+}
+
+ClassCache::~ClassCache()
+{
+    // Nothing
+}
+
+int ClassCache::load(__u64 key, std::vector <std::string> &fpv, std::set <unsigned int> &fwmarks_partly, std::set <unsigned int> &fwmarks_fully)
+{
+    struct stat cache_stat;
+    struct ClassCacheHeader header;
+    std::vector <std::string> fpv_cached;
+    std::set <unsigned int> fwmarks_partly_cached, fwmarks_fully_cached;
+    std::string buf;
+    const char *pos, *end;
+    size_t cache_size;
+    __u64 source_hash, source_hash_curr;
+    __u32 fwmark;
+    bool valid;
+    int fd;
+    void *segment;
+
+    fd = open(Path.c_str(), O_RDONLY);
+    if (fd == -1) return -1;
+
+    if ((fstat(fd, &cache_stat) == -1) || (static_cast<size_t>(cache_stat.st_size) < sizeof(struct ClassCacheHeader))) {
+        close(fd);
+        return -1;
+    }
+
+    cache_size = cache_stat.st_size;
+    segment = mmap(NULL, cache_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (segment == MAP_FAILED) return -1;
+
+    memcpy(&header, segment, sizeof(struct ClassCacheHeader));
+    pos = reinterpret_cast<const char *>(segment) + sizeof(struct ClassCacheHeader);
+    end = reinterpret_cast<const char *>(segment) + cache_size;
+
+    valid = (header.Magic == CLASS_CACHE_MAGIC) && (header.Version == CLASS_CACHE_VERSION) && (header.Key == key)
+        && (header.Checksum == hash(pos, end - pos, CLASS_CACHE_HASH_BASIS));
+
+    // Each source file, included ones too, has to be unchanged since the cache was written
+    for (unsigned int n=0; valid && (n < header.SourcesCount); n++) {
+        valid = getString(pos, end, buf) && getU64(pos, end, source_hash)
+            && (hashFile(buf, source_hash_curr) != -1) && (source_hash == source_hash_curr);
+    }
+
+    if (valid) fpv_cached.reserve(header.LinesCount);
+    for (unsigned int n=0; valid && (n < header.LinesCount); n++) {
+        if ((valid = getString(pos, end, buf))) fpv_cached.push_back(buf);
+    }
+
+    for (unsigned int n=0; valid && (n < header.FWMarksPartlyCount); n++) {
+        if ((valid = getU32(pos, end, fwmark))) fwmarks_partly_cached.insert(fwmark);
+    }
+
+    for (unsigned int n=0; valid && (n < header.FWMarksFullyCount); n++) {
+        if ((valid = getU32(pos, end, fwmark))) fwmarks_fully_cached.insert(fwmark);
+    }
+
+    if (pos != end) valid = false;
+
+    munmap(segment, cache_size);
+
+    if (!valid) return -1;
+
+    fpv.swap(fpv_cached);
+    fwmarks_partly.swap(fwmarks_partly_cached);
+    fwmarks_fully.swap(fwmarks_fully_cached);
+
+    return 0;
+}
+
+int ClassCache::save(__u64 key, std::vector <std::string> &sources, std::vector <std::string> &fpv, std::set <unsigned int> &fwmarks_partly, std::set <unsigned int> &fwmarks_fully)
+{
+    std::string path_tmp = Path + ".tmp";
+    std::vector <char> buf;
+    std::set <unsigned int>::iterator fi;
+    struct ClassCacheHeader header;
+    __u64 source_hash;
+    size_t body_size = 0;
+    int fd;
+
+    for (unsigned int n=0; n < fpv.size(); n++) body_size += sizeof(__u32) + fpv.at(n).size();
+
+    buf.reserve(sizeof(struct ClassCacheHeader) + body_size);
+    buf.resize(sizeof(struct ClassCacheHeader));
+
+    for (unsigned int n=0; n < sources.size(); n++) {
+        if (hashFile(sources.at(n), source_hash) == -1) return -1;
+        putString(buf, sources.at(n));
+        putU64(buf, source_hash);
+    }
+
+    for (unsigned int n=0; n < fpv.size(); n++) putString(buf, fpv.at(n));
+    for (fi = fwmarks_partly.begin(); fi != fwmarks_partly.end(); fi++) putU32(buf, *fi);
+    for (fi = fwmarks_fully.begin(); fi != fwmarks_fully.end(); fi++) putU32(buf, *fi);
+
+    memset(&header, 0, sizeof(struct ClassCacheHeader));
+    header.Magic = CLASS_CACHE_MAGIC;
+    header.Version = CLASS_CACHE_VERSION;
+    header.Key = key;
+    header.SourcesCount = sources.size();
+    header.LinesCount = fpv.size();
+    header.FWMarksPartlyCount = fwmarks_partly.size();
+    header.FWMarksFullyCount = fwmarks_fully.size();
+    header.Checksum = hash(&buf[sizeof(struct ClassCacheHeader)], buf.size() - sizeof(struct ClassCacheHeader), CLASS_CACHE_HASH_BASIS);
+    memcpy(&buf[0], &header, sizeof(struct ClassCacheHeader));
+
+    // Cache is only an accelerator, torn file is rejected by checksum thus fsync isn't needed
+    fd = open(path_tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) return -1;
+
+    if (write(fd, &buf[0], buf.size()) != static_cast<ssize_t>(buf.size())) {
+        close(fd);
+        unlink(path_tmp.c_str());
+        return -1;
+    }
+
+    close(fd);
+
+    if (rename(path_tmp.c_str(), Path.c_str()) == -1) {
+        unlink(path_tmp.c_str());
+        return -1;
+    }
+
+    return 0;
+}
+
+__u64 ClassCache::hash(const char *data, size_t size, __u64 seed)
+{
+    const unsigned char *pos = reinterpret_cast<const unsigned char *>(data);
+    __u64 result = seed;
+
+    // FNV-1a, seed allows to chain a few buffers into one key
+    for (size_t n=0; n<size; n++) {
+        result ^= pos[n];
+        result *= CLASS_CACHE_HASH_PRIME;
+    }
+
+    return result;
+}
+
+int ClassCache::hashFile(std::string path, __u64 &result)
+{
+    struct stat src_stat;
+    void *src_map;
+    int fd;
+
+    fd = open(path.c_str(), O_RDONLY);
+    if ((fd == -1) || (fstat(fd, &src_stat) == -1)) {
+        if (fd != -1) close(fd);
+        return -1;
+    }
+
+    if (!src_stat.st_size) {
+        close(fd);
+        result = CLASS_CACHE_HASH_BASIS;
+        return 0;
+    }
+
+    src_map = mmap(NULL, src_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (src_map == MAP_FAILED) return -1;
+
+    madvise(src_map, src_stat.st_size, MADV_SEQUENTIAL);
+    result = hash(reinterpret_cast<const char *>(src_map), src_stat.st_size, CLASS_CACHE_HASH_BASIS);
+
+    munmap(src_map, src_stat.st_size);
+
+    return 0;
+}
+
+void ClassCache::putU32(std::vector <char> &buf, __u32 value)
+{
+    buf.insert(buf.end(), reinterpret_cast<const char *>(&value), reinterpret_cast<const char *>(&value) + sizeof(value));
+}
+
+void ClassCache::putU64(std::vector <char> &buf, __u64 value)
+{
+    buf.insert(buf.end(), reinterpret_cast<const char *>(&value), reinterpret_cast<const char *>(&value) + sizeof(value));
+}
+
+void ClassCache::putString(std::vector <char> &buf, std::string &value)
+{
+    putU32(buf, value.size());
+    buf.insert(buf.end(), value.begin(), value.end());
+}
+
+bool ClassCache::getU32(const char *&pos, const char *end, __u32 &value)
+{
+    if (static_cast<size_t>(end - pos) < sizeof(value)) return false;
+
+    memcpy(&value, pos, sizeof(value));
+    pos += sizeof(value);
+
+    return true;
+}
+
+bool ClassCache::getU64(const char *&pos, const char *end, __u64 &value)
+{
+    if (static_cast<size_t>(end - pos) < sizeof(value)) return false;
+
+    memcpy(&value, pos, sizeof(value));
+    pos += sizeof(value);
+
+    return true;
+}
+
+bool ClassCache::getString(const char *&pos, const char *end, std::string &value)
+{
+    __u32 size;
+
+    if (!getU32(pos, end, size)) return false;
+    if (static_cast<size_t>(end - pos) < size) return false;
+
+    value.assign(pos, size);
+    pos += size;
+
+    return true;
+}
+
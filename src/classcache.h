@@ -0,0 +1,49 @@
+#ifndef CLASSCACHE_H
+#define CLASSCACHE_H
+
+#include <linux/types.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "main.h"
+
+// Parsed classes file is kept in binary form, thus unchanged restarts don't parse it again.
+// Any change of below layout or of the parser output requires CLASS_CACHE_VERSION to be increased.
+const __u32 CLASS_CACHE_MAGIC = 0x4E534343; // "NSCC"
+const __u32 CLASS_CACHE_VERSION = 2;
+const __u64 CLASS_CACHE_HASH_BASIS = 14695981039346656037ULL;
+const __u64 CLASS_CACHE_HASH_PRIME = 1099511628211ULL;
+
+struct ClassCacheHeader {
+    __u32 Magic;
+    __u32 Version;
+    __u64 Key;
+    __u32 SourcesCount;
+    __u32 LinesCount;
+    __u32 FWMarksPartlyCount;
+    __u32 FWMarksFullyCount;
+    __u64 Checksum; // Covers everything behind the header
+};
+
+class ClassCache {
+    public:
+        ClassCache(std::string);
+        ~ClassCache();
+        int load(__u64, std::vector <std::string> &, std::set <unsigned int> &, std::set <unsigned int> &);
+        int save(__u64, std::vector <std::string> &, std::vector <std::string> &, std::set <unsigned int> &, std::set <unsigned int> &);
+        static __u64 hash(const char *, size_t, __u64);
+        static int hashFile(std::string, __u64 &);
+    private:
+        void putU32(std::vector <char> &, __u32);
+        void putU64(std::vector <char> &, __u64);
+        void putString(std::vector <char> &, std::string &);
+        bool getU32(const char *&, const char *, __u32 &);
+        bool getU64(const char *&, const char *, __u64 &);
+        bool getString(const char *&, const char *, std::string &);
+        //
+        std::string Path;
+};
+
+#endif
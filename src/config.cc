@@ -13,32 +13,46 @@
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include <iostream>
-#include <fstream>
+#include <map>
+#include <set>
 
 #include "main.h"
 #include "aux.h"
 #include "logger.h"
 #include "ifaces.h"
 #include "tests.h"
+#include "classcache.h"
 
 Config::Config ()
 {
     ListenerIp = "127.0.0.1";
     ListenerPort = 6423;
     ListenerPassword = "";
+    ListenerSocketPath = "/var/run/niceshaper.sock";
     StatusUnit = KBITS;
     StatusFilePath = "";
     StatusFileOwner = "root";
     StatusFileGroup = "root";     
     StatusFileMode = "0644";
     StatusFileRewrite = 30;
+    StatusFileFormat = SF_TEXT;
+    StatusFileFsync = false;
+    StatusShmPath = "";
     StatusShowClasses = SC_WORKING;
     StatusShowSum = SS_BOTTOM;
     StatusShowDoNotShape = false;
     ImqAutoRedirect = true;
+    Ipv6 = false;
+    QuotaFlushInterval = 10;
     AutoHostsBasis = "";
+    ClassesCachePath = "";
     
     // Create random password
     std::string random_password_chars = "abcdefghyjklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUWXYZ1234567890";
@@ -82,25 +96,24 @@ Config::~Config ()
     //
 }
 
-std::string Config::getLine(std::ifstream &src_file)
+std::string Config::getLine(const char *&pos, const char *end)
 {
     bool state_store = true, potential_block_comment_tag = false, state_block_comment = false;
-    int buf_counter = 0;    
-    char sbuf[MAX_LONG_BUF_SIZE];
     char cbuf;
+    std::string sbuf;
     std::string buf;
 
-    sbuf[0]=0;
-    while (src_file.read(&cbuf, 1))
+    while (pos < end)
     {
+        cbuf = *pos++;
+
         // completing one line
         // ASCII: '<'=60, '#'=35, '>'=62
         if (!state_block_comment) {
             if (potential_block_comment_tag) {
                 if ((cbuf == 35) && state_store ) {
                     state_block_comment = true;
-                    buf_counter--;
-                    sbuf[buf_counter]=0;
+                    sbuf.erase(sbuf.size()-1);
                     continue;
                 }
                 potential_block_comment_tag = false;
@@ -112,7 +125,6 @@ std::string Config::getLine(std::ifstream &src_file)
                 if ( cbuf == 62 ) {
                     state_block_comment = false;
                     state_store = true;
-                    sbuf[buf_counter]=0;
                     continue;
                 }
                 potential_block_comment_tag = false;
@@ -127,56 +139,82 @@ std::string Config::getLine(std::ifstream &src_file)
         }
         if (cbuf == 10) state_store = true;     // 'NewLine'
 
-        if ( state_store && !state_block_comment)
-        {
-            sbuf[buf_counter]=cbuf;
-            buf_counter++;
-        }
+        if ( state_store && !state_block_comment) sbuf += cbuf;
 
         if ( cbuf != 10 ) continue; 
         // end of completing line
 
-        sbuf[buf_counter]=0;
-        buf_counter=0;
         state_store = true;             
 
-        buf = aux::trim_strict(std::string(sbuf));
-        sbuf[0]=0;              
+        buf = aux::trim_strict(sbuf);
+        sbuf.clear();
 
         if (buf.empty()) continue;
         else return buf;
     }
 
-    sbuf[buf_counter]=0;
-    buf = aux::trim_strict(std::string(sbuf));
+    buf = aux::trim_strict(sbuf);
 
     return buf; 
 }
 
 int Config::convertToFpv (std::string confdir, std::string src_file, EnumNsFileType type, std::vector <std::string> &fpv)
 {
-    std::string option, value1, value2;
-    bool running_class = false;    
-    bool loop_macro_collect = false;
-    bool loop_macro_serve = false;
-    unsigned int loop_macro_pos = 0;
-    unsigned int fwmark;
-    std::vector <std::string> loop_macro;
-    std::string loop_macro_header = "";
-    std::ifstream ifd;
-    std::string buf;
+    struct stat src_stat;
+    void *src_map = NULL;
+    int fd;
+    int result;
 
     if ((type != CONFTYPE) && (type != CLASSTYPE)) return -1;
 
     if (src_file.substr(0, 1) != "/") src_file = confdir + "/" + src_file; 
 
-    ifd.open(src_file.c_str());
-    if (!ifd) {
+    // Classes cache is valid as long as all of these files are unchanged
+    if (type == CLASSTYPE) ClassFileSources.push_back(src_file);
+
+    // Whole file is mapped and lexed in place, instead of being read byte by byte
+    fd = open(src_file.c_str(), O_RDONLY);
+    if ((fd == -1) || (fstat(fd, &src_stat) == -1)) {
+        if (fd != -1) close(fd);
         if (type == CONFTYPE) log->error(46, src_file);
         if (type == CLASSTYPE) log->error(47, src_file);
         return -1;
     }
 
+    if (src_stat.st_size) {
+        src_map = mmap(NULL, src_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (src_map == MAP_FAILED) {
+            close(fd);
+            if (type == CONFTYPE) log->error(46, src_file);
+            if (type == CLASSTYPE) log->error(47, src_file);
+            return -1;
+        }
+        madvise(src_map, src_stat.st_size, MADV_SEQUENTIAL);
+    }
+
+    close(fd);
+
+    result = parseToFpv(confdir, reinterpret_cast<const char *>(src_map), src_stat.st_size, type, fpv);
+
+    if (src_map != NULL) munmap(src_map, src_stat.st_size);
+
+    return result;
+}
+
+int Config::parseToFpv (std::string confdir, const char *src, size_t src_size, EnumNsFileType type, std::vector <std::string> &fpv)
+{
+    std::string option, value1, value2;
+    bool running_class = false;    
+    bool loop_macro_collect = false;
+    bool loop_macro_serve = false;
+    unsigned int loop_macro_pos = 0;
+    unsigned int fwmark;
+    std::vector <std::string> loop_macro;
+    std::string loop_macro_header = "";
+    const char *src_pos = src;
+    const char *src_end = src + src_size;
+    std::string buf;
+
     while (true)
     {
         if (loop_macro_serve) {
@@ -188,7 +226,7 @@ int Config::convertToFpv (std::string confdir, std::string src_file, EnumNsFileT
             loop_macro_pos++;
         }
         else {
-            buf = getLine(ifd);
+            buf = getLine(src_pos, src_end);
             if (buf.empty()) break;
         }
 
@@ -219,14 +257,14 @@ int Config::convertToFpv (std::string confdir, std::string src_file, EnumNsFileT
 
         // Firstly proceed including
         if (option == "include") {
-            if (loop_macro_collect) { ifd.close(); log->error(852); return -1; }
-            if (includeToFpv(confdir, buf, type, fpv) == -1) { ifd.close(); return -1; }
+            if (loop_macro_collect) { log->error(852); return -1; }
+            if (includeToFpv(confdir, buf, type, fpv) == -1) return -1;
             continue;
         }
 
         // Secondly proceed directives, depending on config type (main config or classes config)
         if (type == CONFTYPE) {
-            if (directiveSplit(buf, fpv) == -1) { ifd.close(); return -1; }
+            if (directiveSplit(buf, fpv) == -1) return -1;
         }
         else if (type == CLASSTYPE) {
             if ((option == "class") || (option == "class-virtual")) {
@@ -240,7 +278,7 @@ int Config::convertToFpv (std::string confdir, std::string src_file, EnumNsFileT
             }
 
             if (running_class || (option == "host")) {
-                if (directiveSplit (buf, fpv) == -1) { ifd.close(); return -1; }
+                if (directiveSplit (buf, fpv) == -1) return -1;
                 if (option == "host") running_class = false;
             }
             else if (option == "user") {
@@ -255,20 +293,17 @@ int Config::convertToFpv (std::string confdir, std::string src_file, EnumNsFileT
                 if (aux::value_of_param(buf, "set-mark").size()) { log->error(860, buf); return -1; } // DEPRECATED
                 if (aux::value_of_param(buf, "mark").size()) {
                     fwmark = aux::str_fwmark_to_uint(aux::value_of_param(buf, "mark"));
-                    if (!aux::is_in_vector (FWMarksProtectedPartly, fwmark)) FWMarksProtectedPartly.push_back(fwmark);
+                    FWMarksProtectedPartly.insert(fwmark);
                 }
             }
             else if (option == "set-mark") {
                 fwmark = aux::str_fwmark_to_uint(value1);
-                if (aux::is_in_vector (FWMarksProtectedFully, fwmark)) { log->error(862, buf); return -1; }
-                FWMarksProtectedFully.push_back(fwmark);
-                FWMarksProtectedPartly.push_back(fwmark);
+                if (!FWMarksProtectedFully.insert(fwmark).second) { log->error(862, buf); return -1; }
+                FWMarksProtectedPartly.insert(fwmark);
             }
         }
     }
 
-    ifd.close();
-
     for (unsigned int n=0; n<fpv.size(); n++) fpv.at(n) = aux::trim_strict(fpv.at(n));
 
     return 0;
@@ -307,26 +342,139 @@ int Config::removeConfTypeGarbage (std::vector <std::string> &fpv)
     return 0; 
 }
 
-int Config::addIDs (std::vector <std::string> &fpv)
+int Config::loadClassFile (std::string confdir, std::string src_file, std::vector <std::string> &fpv, std::vector <std::string> &fpv_prev)
+{
+    ClassCache classes_cache(ClassesCachePath);
+    __u64 classes_cache_key = 0;
+
+    // Protected fwmarks are collected again, thus classes file can be loaded repeatedly
+    FWMarksProtectedPartly.clear();
+    FWMarksProtectedFully.clear();
+    ClassFileSources.clear();
+    fpv.clear();
+
+    if (ClassesCachePath.size()) classes_cache_key = classesCacheKey(confdir, src_file);
+
+    // Ids depend on the previous classes, thus only the parser output is cached
+    if (ClassesCachePath.size() && (classes_cache.load(classes_cache_key, fpv, FWMarksProtectedPartly, FWMarksProtectedFully) != -1)) {
+        log->info(17, ClassesCachePath);
+    }
+    else {
+        if (convertToFpv(confdir, src_file, CLASSTYPE, fpv) == -1) return -1;
+        if (ClassesCachePath.size() && (classes_cache.save(classes_cache_key, ClassFileSources, fpv, FWMarksProtectedPartly, FWMarksProtectedFully) == -1)) {
+            log->warning(21, ClassesCachePath);
+        }
+    }
+
+    if (addIDs(fpv, fpv_prev) == -1) return -1;
+    if (reOrder(fpv) == -1) return -1;
+
+    return 0;
+}
+
+int Config::partitionClassFile (std::vector <std::string> &fpv, ClassFilePartition &partition)
+{
+    std::string option, section;
+    std::vector <std::string> *block = NULL;
+    unsigned int headers = 0;
+
+    partition.SectionsClasses.clear();
+    partition.SectionsHeaders.clear();
+    partition.DnswClasses.clear();
+    partition.DnswHeaders.clear();
+
+    for (unsigned int n=0; n < fpv.size(); n++)
+    {
+        option = aux::awk(fpv.at(n), 1);
+
+        if ((option == "class") || (option == "class-virtual")) {
+            section = aux::awk(fpv.at(n), 2);
+            block = &partition.SectionsClasses[section];
+            partition.SectionsHeaders[section].push_back(headers++);
+        }
+        else if ((option == "class-wrapper") || (option == "class-do-not-shape")) {
+            block = &partition.DnswClasses;
+            partition.DnswHeaders.push_back(headers++);
+        }
+
+        // Lines before the first class header don't belong to any class
+        if (block != NULL) block->push_back(fpv.at(n));
+    }
+
+    return 0;
+}
+
+__u64 Config::classesCacheKey (std::string confdir, std::string src_file)
+{
+    std::string key;
+
+    // Beside the files themselves, parser output depends on the version and on the global section
+    key = VERSION + "\n" + confdir + "\n" + src_file + "\n" + AutoHostsBasis + "\n";
+    for (unsigned int n=0; n < RunningSections.size(); n++) key += RunningSections.at(n) + "\n";
+
+    return ClassCache::hash(key.c_str(), key.size(), CLASS_CACHE_HASH_BASIS);
+}
+
+int Config::addIDs (std::vector <std::string> &fpv, std::vector <std::string> &fpv_prev)
 {
-    unsigned int classid = FIRST_CLASS_ID;
     unsigned int filterid;
     unsigned int class_fwmark; 
+    unsigned int filterid_assigned;
+    unsigned int block_filterid_pos;
     bool class_set_mark_occured;
-    bool filterid_early_generated;
     bool filtertest_needs_fw;
+    bool block_end;
     std::string buf, option, value1;
-    std::string auxbuf, auxoption, auxvalue1;
+    std::string auxoption;
     std::string class_dev;
-    std::vector <unsigned int> fwmarks_protected_partly (FWMarksProtectedPartly);
+    std::string class_key, match_key;
+    std::set <unsigned int> fwmarks_protected_partly (FWMarksProtectedPartly);
+    std::set <unsigned int> prev_filterids;
+    std::map <std::string, unsigned int> reuse_filterids;
+    std::map <std::string, unsigned int>::iterator ri;
+    std::map <std::string, unsigned int> match_occurrences;
+    std::vector <unsigned int> block_filterids;
+    std::vector <std::string> fpv_src;
+    std::vector <bool> fpv_dropped;
     unsigned int pos;
 
     filterid = 0;
     class_fwmark = 0;
+    block_filterid_pos = 0;
+    class_set_mark_occured = false;
+
+    // While reloading, unchanged filters get the ids they already have in the kernel.
+    // Ids of the previous configuration aren't given to new objects.
+    // Class ids aren't assigned here, class gets one from its interface only while it's active.
+    class_key = "";
+    for (unsigned int n=0; n < fpv_prev.size(); n++)
+    {
+        buf = fpv_prev.at(n);
+        option = aux::awk(buf, 1);
 
-    for (unsigned int n=0; n < fpv.size(); n++)
+        if (aux::is_in_vector(ProperClassesTypes, option)) {
+            class_key = buf;
+        }
+        else if ((option == "match") && (buf.find(" _filterid_ ") != std::string::npos)) {
+            match_key = class_key + "\n" + buf.substr(0, buf.find(" _filterid_ "));
+            match_key += "\n" + aux::int_to_str(match_occurrences[match_key]++);
+            reuse_filterids[match_key] = aux::str_to_uint(aux::value_of_param(buf, "_filterid_"));
+            prev_filterids.insert(reuse_filterids[match_key]);
+        }
+    }
+
+    match_occurrences.clear();
+
+    // Result is built in a single pass, inserting into and erasing from the middle of a huge fpv was quadratic
+    fpv_src.swap(fpv);
+    fpv.reserve(fpv_src.size() + fpv_src.size() / 2);
+    fpv_dropped.resize(fpv_src.size(), false);
+
+    for (unsigned int n=0; n < fpv_src.size(); n++)
     {
-        buf = fpv.at(n);
+        if (fpv_dropped.at(n)) continue;
+
+        buf = fpv_src.at(n);
         option = aux::awk(buf, 1);
 
         if (aux::is_in_vector(config->ProperClassesTypes, option)) {
@@ -338,35 +486,54 @@ int Config::addIDs (std::vector <std::string> &fpv)
                 if (aux::awk(buf, 3).size() > MAX_CLASS_NAME_SIZE) { log->error(55, buf); return -1; }
                 class_dev = aux::trim_dev(aux::awk(buf, 2));
             }
+            class_key = buf;
             class_set_mark_occured = false;
-            // Generate _classid_
-            classid++;
-            if ((classid-FIRST_CLASS_ID) >= MAX_CLASSES_COUNT) { log->error(813, aux::int_to_str(MAX_CLASSES_COUNT)); return -1; }
-            fpv.insert(fpv.begin()+n+1, ("_classid_ " + aux::int_to_str(classid)));
-            n++;
-            // Generate _filterid_
-            filterid++;
-            while (aux::is_in_vector(fwmarks_protected_partly, filterid)) filterid++;
-            filterid_early_generated = true;
+            fpv.push_back(buf);
+            // Generate _filterid_ for each match of class, first of them is generated even if class hasn't got any match
+            block_filterids.clear();
+            block_filterid_pos = 0;
+            for (unsigned int m=n+1; true; m++)
+            {
+                block_end = ((m >= fpv_src.size()) || aux::is_in_vector(ProperClassesTypes, aux::awk(fpv_src.at(m), 1)));
+                if (block_end && block_filterids.size()) break;
+                if (!block_end && (aux::awk(fpv_src.at(m), 1) != "match")) continue;
+
+                ri = reuse_filterids.end();
+                if (!block_end) {
+                    match_key = class_key + "\n" + fpv_src.at(m);
+                    match_key += "\n" + aux::int_to_str(match_occurrences[match_key]++);
+                    ri = reuse_filterids.find(match_key);
+                }
+
+                if ((ri != reuse_filterids.end()) && !fwmarks_protected_partly.count(ri->second)) {
+                    block_filterids.push_back(ri->second);
+                }
+                else {
+                    filterid++;
+                    while (fwmarks_protected_partly.count(filterid) || prev_filterids.count(filterid)) filterid++;
+                    block_filterids.push_back(filterid);
+                }
+                fwmarks_protected_partly.insert(block_filterids.back());
+
+                if (block_end) break;
+            }
             // Copy first _filterid_ in class to _set-mark_ if set-mark is not found
-            for (unsigned int m=n; m < fpv.size(); m++)
+            class_fwmark = block_filterids.at(0);
+            for (unsigned int m=n+1; m < fpv_src.size(); m++)
             {
-                auxbuf = fpv.at(m);
-                auxoption = aux::awk(auxbuf, 1);
-                auxvalue1 = aux::awk(auxbuf, 2);
+                if (fpv_dropped.at(m)) continue;
+
+                auxoption = aux::awk(fpv_src.at(m), 1);
 
                 if (auxoption == "set-mark")  {
-                    class_fwmark = aux::str_fwmark_to_uint(auxvalue1);
-                    fpv.erase(fpv.begin()+m);
-                    m=fpv.size();
+                    class_fwmark = aux::str_fwmark_to_uint(aux::awk(fpv_src.at(m), 2));
+                    fpv_dropped.at(m) = true;
                     class_set_mark_occured = true;
+                    break;
                 }
-                else if ((auxoption == "class") || (m == (fpv.size()-1))) {
-                    class_fwmark = filterid;
-                    fwmarks_protected_partly.push_back(filterid);
-                    m=fpv.size();
-                }
+                else if (auxoption == "class") break;
             }
+            continue;
         }
         else if (option == "match")
         {
@@ -374,13 +541,14 @@ int Config::addIDs (std::vector <std::string> &fpv)
             if (aux::value_of_param(buf, "_set-mark_").size()) { log->error(858, buf); return -1; }
 
             // Assign filterid
-            if (filterid_early_generated) { 
-                filterid_early_generated = false; 
-            } 
+            if (block_filterid_pos < block_filterids.size()) {
+                filterid_assigned = block_filterids.at(block_filterid_pos++);
+            }
             else {
                 filterid++;
-                while (aux::is_in_vector(fwmarks_protected_partly, filterid)) filterid++;
-                fwmarks_protected_partly.push_back(filterid);
+                while (fwmarks_protected_partly.count(filterid) || prev_filterids.count(filterid)) filterid++;
+                fwmarks_protected_partly.insert(filterid);
+                filterid_assigned = filterid;
             }
 
             // Check for fw filter requirements
@@ -406,13 +574,15 @@ int Config::addIDs (std::vector <std::string> &fpv)
                 }
             }
 
-            fpv.at(n) += " _filterid_ " + aux::int_to_str(filterid);
-            if (ifaces->tcFilterType(class_dev) == FW) fpv.at(n) += " _set-mark_ " + aux::int_to_str(class_fwmark);
+            buf += " _filterid_ " + aux::int_to_str(filterid_assigned);
+            if (ifaces->tcFilterType(class_dev) == FW) buf += " _set-mark_ " + aux::int_to_str(class_fwmark);
         }
         else if (option == "_classid_") {
             log->error(858, buf);
             return -1;
         }
+
+        fpv.push_back(buf);
     }
 
     return 0;
@@ -596,33 +766,39 @@ int Config::directiveSplit (std::string arg, std::vector < std::string > &fpv)
     // type1 directives. 
     // has 1 required value and nothing else, 
     static char t1_src[10][MAX_SHORT_BUF_SIZE] = { "ceil", "hold", "lang", "low", "mode", "rate", "reload", "set-mark", "strict" };
-    std::vector <std::string> t1 (t1_src, t1_src + sizeof(t1_src)/sizeof(t1_src[0]));
+    static std::vector <std::string> t1 (t1_src, t1_src + sizeof(t1_src)/sizeof(t1_src[0]));
 
     // type2 directives.
     // gets all given values as his own. Need at least 1 value.
     static char t2_src[5][MAX_SHORT_BUF_SIZE] = { "debug", "mark-on-ifaces", "local-subnets", "run", "fallback" };
-    std::vector <std::string> t2 (t2_src, t2_src + sizeof(t2_src)/sizeof(t2_src[0]));
+    static std::vector <std::string> t2 (t2_src, t2_src + sizeof(t2_src)/sizeof(t2_src[0]));
 
     // type4 directives
     // by iteration, gets pairs of words ( parameter and value ), 
     // it's syntax error if parameter is unknown or one of pair elements is empty.
-    static char t4_src[14][17][MAX_SHORT_BUF_SIZE] = {{ "log", "file", "syslog", "terminal" },
+    static char t4_src[18][20][MAX_SHORT_BUF_SIZE] = {{ "log", "file", "syslog", "terminal" },
         { "users", "replace-classes", "download-section", "upload-section", "iface-inet", "resolve-hostname" },
-        { "status", "unit", "classes", "sum", "listen", "password", "do-not-shape", "file", "owner", "group", "mode", "rewrite", "file-owner", "file-group", "file-mode", "file-rewrite" },
-        { "stats",  "unit", "classes", "sum", "listen", "password", "do-not-shape", "file", "owner", "group", "mode", "rewrite", "file-owner", "file-group", "file-mode", "file-rewrite" },
-        { "listen", "address", "password" },
-        { "section", "shape", "speed", "htb-burst", "htb-cburst" },
+        { "status", "unit", "classes", "sum", "listen", "password", "do-not-shape", "file", "owner", "group", "mode", "rewrite", "file-owner", "file-group", "file-mode", "file-rewrite", "file-format", "file-fsync", "shm" },
+        { "stats",  "unit", "classes", "sum", "listen", "password", "do-not-shape", "file", "owner", "group", "mode", "rewrite", "file-owner", "file-group", "file-mode", "file-rewrite", "file-format", "file-fsync", "shm" },
+        { "listen", "address", "password", "socket" },
+        { "section", "shape", "speed", "htb-burst", "htb-cburst", "congestion-signal", "activation", "reload-min", "reload-max" },
         { "htb", "scheduler", "prio", "burst", "cburst" },
         { "sfq", "perturb" },
         { "esfq", "hash", "perturb" },
-        { "iptables", "download-hook", "upload-hook", "target", "imq-autoredirect" },
+        { "fq_codel", "target", "interval", "flows", "limit", "memory-limit" },
+        { "cake", "target", "interval", "memory-limit" },
+        { "fq", "flows", "limit" },
+        { "iptables", "download-hook", "upload-hook", "target", "imq-autoredirect", "backend" },
         { "imq", "autoredirect" },
         { "alter", "low", "ceil", "rate", "time-period" },
-        { "quota", "low", "ceil", "rate", "day", "week", "month", "file", "reset-hour", "reset-wday", "reset-mday" },
-        { "auto-hosts" }};
-    static char t4iface_src[5][MAX_SHORT_BUF_SIZE] = { "speed", "do-not-shape-method", "unclassified-method", "fallback-rate", "mode" };
-    std::vector <std::string> t4;
-    for (unsigned int i=0; i<(sizeof(t4_src)/sizeof(t4_src[0])); i++) {
+        { "quota", "low", "ceil", "rate", "day", "week", "month", "file", "reset-hour", "reset-wday", "reset-mday", "flush-interval" },
+        { "auto-hosts" },
+        { "cache", "classes" }};
+    static char t4iface_src[7][MAX_SHORT_BUF_SIZE] = { "speed", "do-not-shape-method", "unclassified-method", "fallback-rate", "mode", "mq", "ingress" };
+    static std::vector <std::string> t4;
+    std::vector <std::string> t4_params;
+    // Directive tables are built once, not for every line of configuration
+    for (unsigned int i=t4.size(); i<(sizeof(t4_src)/sizeof(t4_src[0])); i++) {
         if (std::string(std::string(t4_src[i][0])).size()) t4.push_back(std::string(t4_src[i][0]));
         else break;
     }
@@ -630,12 +806,12 @@ int Config::directiveSplit (std::string arg, std::vector < std::string > &fpv)
     // type5 directives
     // special directives, copy whole line without changes.             
     static char t5_src[6][MAX_SHORT_BUF_SIZE] = { "class", "class-virtual", "class-wrapper", "class-do-not-shape", "match", "include" };
-    std::vector <std::string> t5 (t5_src, t5_src + sizeof(t5_src)/sizeof(t5_src[0]));
+    static std::vector <std::string> t5 (t5_src, t5_src + sizeof(t5_src)/sizeof(t5_src[0]));
     
     // type6host directive.
     // special directive, some kind of macro.
     static char t6host_src[1][MAX_SHORT_BUF_SIZE] = { "host" };
-    std::vector <std::string> t6host (t6host_src, t6host_src + sizeof(t6host_src)/sizeof(t6host_src[0]));
+    static std::vector <std::string> t6host (t6host_src, t6host_src + sizeof(t6host_src)/sizeof(t6host_src[0]));
 
     pos = 1;
     if (aux::awk(arg, pos) == "default") pos++;
@@ -673,11 +849,13 @@ int Config::directiveSplit (std::string arg, std::vector < std::string > &fpv)
     for (unsigned int i=0; i<=t4.size(); i++) {
         if (i == t4.size()) {
             if ((aux::awk(option, "-", 1) != "iface") || (aux::awk(option, "-", 2).empty())) break;
-            if (!ifaces->isValidSysDev(aux::trim_dev(option.substr(option.find("-")+1, std::string::npos)))) { log->error(16, arg); return -1; }
+            // IFB may not exist yet, it's created for the ingress of other interface
+            if (!ifaces->isValidSysDev(aux::trim_dev(option.substr(option.find("-")+1, std::string::npos)))
+                    && !test->ifaceIsIfb(aux::trim_dev(option.substr(option.find("-")+1, std::string::npos)))) { log->error(16, arg); return -1; }
         } 
         if ((i == t4.size()) || (option == t4.at(i))) {
-            if (i==t4.size()) t4.assign(t4iface_src, t4iface_src + sizeof(t4iface_src)/sizeof(t4iface_src[0]));
-            else t4.assign(t4_src[i]+1, t4_src[i]+sizeof(t4_src[i])/sizeof(t4_src[i][0]));
+            if (i==t4.size()) t4_params.assign(t4iface_src, t4iface_src + sizeof(t4iface_src)/sizeof(t4iface_src[0]));
+            else t4_params.assign(t4_src[i]+1, t4_src[i]+sizeof(t4_src[i])/sizeof(t4_src[i][0]));
 
             do {
                 param = aux::awk(arg, ++pos);
@@ -686,7 +864,7 @@ int Config::directiveSplit (std::string arg, std::vector < std::string > &fpv)
                     log->error(24, arg);
                     return -1;
                 }
-                if (!aux::is_in_vector(t4, param) && (option != "auto-hosts")) {
+                if (!aux::is_in_vector(t4_params, param) && (option != "auto-hosts")) {
                     log->error(11, arg);
                     return -1;
                 }
@@ -710,7 +888,7 @@ int Config::directiveSplit (std::string arg, std::vector < std::string > &fpv)
             host_elems = aux::awk_size(host_header);
             host_ip = aux::awk(host_header, host_elems-1);
             host_name = aux::awk(host_header, host_elems);
-            if (!test->validIp(host_ip)) { log->error(29, arg); return -1; }   
+            if (!test->validIp(host_ip) && !test->validIp6(host_ip)) { log->error(29, arg); return -1; }   
             // Auto Host
             if (host_elems == 3) {
                 if (aux::awk_size(AutoHostsBasis) == 0) { log->error(815, arg); return -1; }
@@ -774,6 +952,8 @@ int Config::addLocalSubnet (std::string local_subnet)
     if (aux::split_ip(local_subnet, addr, mask) == -1 ) return -1;
     
     LocalSubnets.push_back(std::string(addr) + "/" + std::string(mask));
+    // IPv6 subnet turns on classification of both families
+    if (addr.find(":") != std::string::npos) Ipv6 = true;
 
     return 0;
 }
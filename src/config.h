@@ -1,19 +1,31 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include <map>
+#include <set>
 #include <string>
 #include <vector>
 
 #include "main.h"
 
+// Classes file split by sections in a single pass, thus sections don't scan the whole file each
+struct ClassFilePartition {
+    std::map <std::string, std::vector <std::string> > SectionsClasses; // class and class-virtual blocks
+    std::map <std::string, std::vector <unsigned int> > SectionsHeaders; // their positions among all classes headers
+    std::vector <std::string> DnswClasses; // class-wrapper and class-do-not-shape blocks
+    std::vector <unsigned int> DnswHeaders;
+};
+
 class Config 
 {
     public:
         Config ();
         ~Config ();
         int convertToFpv (std::string, std::string, EnumNsFileType, std::vector <std::string> &);
+        int loadClassFile (std::string, std::string, std::vector <std::string> &, std::vector <std::string> &);
+        int partitionClassFile (std::vector <std::string> &, ClassFilePartition &);
         int removeConfTypeGarbage (std::vector <std::string> &);
-        int addIDs (std::vector <std::string> &);
+        int addIDs (std::vector <std::string> &, std::vector <std::string> &);
         int reOrder (std::vector <std::string> &);
         int proceedLoopMacro(std::string, std::vector <std::string> &);
         int includeToFpv (std::string, std::string, EnumNsFileType, std::vector <std::string> &);
@@ -21,32 +33,45 @@ class Config
         std::string getListenerIp () { return ListenerIp; }
         int getListenerPort () { return ListenerPort; }
         std::string getListenerPassword () { return ListenerPassword; }
+        std::string getListenerSocketPath () { return ListenerSocketPath; }
         std::string getStatusFilePath () { return StatusFilePath; }
         std::string getStatusFileOwner () { return StatusFileOwner; }
         std::string getStatusFileGroup () { return StatusFileGroup; }
         std::string getStatusFileMode () { return StatusFileMode; }
         int getStatusFileRewrite () { return StatusFileRewrite; }
+        EnumStatusFileFormat getStatusFileFormat () { return StatusFileFormat; }
+        bool getStatusFileFsync () { return StatusFileFsync; }
+        std::string getStatusShmPath () { return StatusShmPath; }
         EnumStatusShowClasses getStatusShowClasses () { return StatusShowClasses; }
         EnumStatusShowSum getStatusShowSum () { return StatusShowSum; }
         bool getStatusShowDoNotShape () { return StatusShowDoNotShape; }
         bool getImqAutoRedirect () { return ImqAutoRedirect; }
+        bool getIpv6 () { return Ipv6; }
         void addRunningSection (std::string running_section) { RunningSections.push_back(running_section); }
         void setStatusUnit (EnumUnits status_unit) { StatusUnit = status_unit; }
         int setListenerAddress (std::string);   
         void setListenerPassword (std::string listener_password) { ListenerPassword = listener_password; }
+        void setListenerSocketPath (std::string listener_socket_path) { ListenerSocketPath = listener_socket_path; }
         void setStatusFilePath (std::string status_file_path) { StatusFilePath = status_file_path; }
         void setStatusFileOwner (std::string status_file_owner) { StatusFileOwner = status_file_owner; }
         void setStatusFileGroup (std::string status_file_group) { StatusFileGroup = status_file_group; }
         void setStatusFileMode (std::string status_file_mode) { StatusFileMode = status_file_mode; }
         void setStatusFileRewrite (int status_file_rewrite) { StatusFileRewrite = status_file_rewrite; } 
+        void setStatusFileFormat (EnumStatusFileFormat status_file_format) { StatusFileFormat = status_file_format; }
+        void setStatusFileFsync (bool status_file_fsync) { StatusFileFsync = status_file_fsync; }
+        void setStatusShmPath (std::string status_shm_path) { StatusShmPath = status_shm_path; }
         void setStatusShowClasses (EnumStatusShowClasses status_show_classes) { StatusShowClasses = status_show_classes; }
         void setStatusShowSum (EnumStatusShowSum status_show_sum) { StatusShowSum = status_show_sum; }
         void setStatusShowDoNotShape (bool status_show_do_not_shape) { StatusShowDoNotShape = status_show_do_not_shape; }
         void setImqAutoRedirect (bool imq_auto_redirect) { ImqAutoRedirect = imq_auto_redirect; }
         int addLocalSubnet (std::string);
         int addAutoHostsBasis (std::string, std::string);
+        unsigned int getQuotaFlushInterval() { return QuotaFlushInterval; }
+        void setQuotaFlushInterval(unsigned int quota_flush_interval) { QuotaFlushInterval = quota_flush_interval; }
         unsigned int getReqRecoverWait() { return ReqRecoverWait; }
         unsigned int getStartStopDots() { return StartStopDots; }
+        std::string getClassesCachePath() { return ClassesCachePath; }
+        void setClassesCachePath(std::string classes_cache_path) { ClassesCachePath = classes_cache_path; }
         //
         std::vector <std::string> ProperClassesTypes;
         std::vector <std::string> FilterTestsNeedFW;
@@ -54,23 +79,33 @@ class Config
         std::vector <std::string> LocalSubnets;
         std::string AutoHostsBasis;
     private:
-        std::string getLine(std::ifstream &);
+        std::string getLine(const char *&, const char *);
+        int parseToFpv (std::string, const char *, size_t, EnumNsFileType, std::vector <std::string> &);
         int directiveSplit (std::string, std::vector <std::string> &); 
+        __u64 classesCacheKey (std::string, std::string);
         std::string ListenerIp;
         int ListenerPort;
         std::string ListenerPassword;
+        std::string ListenerSocketPath;
         std::string StatusFilePath;
         std::string StatusFileOwner;
         std::string StatusFileGroup;
         std::string StatusFileMode;
+        std::string StatusShmPath;
         EnumUnits StatusUnit;
         EnumStatusShowClasses StatusShowClasses;
         EnumStatusShowSum StatusShowSum;
         int StatusFileRewrite;
+        EnumStatusFileFormat StatusFileFormat;
+        bool StatusFileFsync;
         bool StatusShowDoNotShape;
         bool ImqAutoRedirect;
-        std::vector <unsigned int> FWMarksProtectedPartly;
-        std::vector <unsigned int> FWMarksProtectedFully;
+        bool Ipv6;
+        std::set <unsigned int> FWMarksProtectedPartly;
+        std::set <unsigned int> FWMarksProtectedFully;
+        std::vector <std::string> ClassFileSources;
+        std::string ClassesCachePath;
+        unsigned int QuotaFlushInterval;
         unsigned int ReqRecoverWait; 
         unsigned int StartStopDots;
 };
@@ -0,0 +1,155 @@
+/*
+ *      NiceShaper - Dynamic Traffic Management
+ *
+ *      Copyright (C) 2004-2016 Mariusz Jedwabny <mariusz@jedwabny.net>
+ *
+ *      This file is subject to the terms and conditions of the GNU General Public
+ *      License.  See the file COPYING in the main directory of this archive for
+ *      more details.
+ */
+
+#include "conntrack.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+
+#include <string>
+#include <vector>
+
+#include "main.h"
+#include "logger.h"
+
+CtEvents::CtEvents()
+{
+    Fd = -1;
+}
+
+CtEvents::~CtEvents()
+{
+    close();
+}
+
+int CtEvents::open()
+{
+    struct sockaddr_nl local;
+
+    if (Fd != -1) return 0;
+
+    Fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_NETFILTER);
+    if (Fd == -1) { log->warning(23, strerror(errno)); return -1; }
+
+    memset(&local, 0, sizeof(local));
+    local.nl_family = AF_NETLINK;
+    local.nl_groups = 1 << (NFNLGRP_CONNTRACK_NEW - 1);
+    if (bind(Fd, (struct sockaddr *)&local, sizeof(local)) == -1) {
+        log->warning(23, strerror(errno));
+        close();
+        return -1;
+    }
+
+    // Supervisor polls it between rounds, reading must never block
+    if (fcntl(Fd, F_SETFL, fcntl(Fd, F_GETFL) | O_NONBLOCK) == -1) {
+        log->warning(23, strerror(errno));
+        close();
+        return -1;
+    }
+
+    return 0;
+}
+
+void CtEvents::close()
+{
+    if (Fd != -1) ::close(Fd);
+
+    Fd = -1;
+}
+
+int CtEvents::receive(std::vector <std::string> &addrs)
+{
+    static char buf[RECV_BUF_SIZE];
+    const struct nlmsghdr *h;
+    const char *attrs[CTA_MAX+1];
+    int lens[CTA_MAX+1];
+    int len, payload_len;
+
+    if (Fd == -1) return -1;
+
+    // Burst of new flows is read in batches, the rest waits for the next poll
+    for (unsigned int n=0; n < RECV_BATCH_MAX; n++) {
+        len = recv(Fd, buf, sizeof(buf), 0);
+        if (len == -1) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+            // Overrun, lost flows are noticed by the filters in the next round
+            if ((errno == ENOBUFS) || (errno == EINTR)) continue;
+            return -1;
+        }
+
+        for (h = reinterpret_cast<const struct nlmsghdr *>(buf); NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+            if (NFNL_SUBSYS_ID(h->nlmsg_type) != NFNL_SUBSYS_CTNETLINK) continue;
+            if (NFNL_MSG_TYPE(h->nlmsg_type) != IPCTNL_MSG_CT_NEW) continue;
+            payload_len = h->nlmsg_len - NLMSG_SPACE(sizeof(struct nfgenmsg));
+            if (payload_len < 0) continue;
+            attrParse(reinterpret_cast<const char *>(NLMSG_DATA(h)) + NLMSG_ALIGN(sizeof(struct nfgenmsg)), payload_len, attrs, lens, CTA_MAX);
+            // Both directions, the host may be either initiator or target of the flow, also behind NAT
+            if (attrs[CTA_TUPLE_ORIG]) tupleParse(attrs[CTA_TUPLE_ORIG], lens[CTA_TUPLE_ORIG], addrs);
+            if (attrs[CTA_TUPLE_REPLY]) tupleParse(attrs[CTA_TUPLE_REPLY], lens[CTA_TUPLE_REPLY], addrs);
+        }
+    }
+
+    return 0;
+}
+
+void CtEvents::tupleParse(const char *data, int len, std::vector <std::string> &addrs)
+{
+    const char *tuple_attrs[CTA_TUPLE_MAX+1];
+    int tuple_lens[CTA_TUPLE_MAX+1];
+    const char *ip_attrs[CTA_IP_MAX+1];
+    int ip_lens[CTA_IP_MAX+1];
+    char addr[INET6_ADDRSTRLEN];
+
+    attrParse(data, len, tuple_attrs, tuple_lens, CTA_TUPLE_MAX);
+    if (tuple_attrs[CTA_TUPLE_IP] == NULL) return;
+
+    attrParse(tuple_attrs[CTA_TUPLE_IP], tuple_lens[CTA_TUPLE_IP], ip_attrs, ip_lens, CTA_IP_MAX);
+
+    for (unsigned int type = CTA_IP_V4_SRC; type <= CTA_IP_V6_DST; type++) {
+        if (ip_attrs[type] == NULL) continue;
+        if ((type <= CTA_IP_V4_DST) && (ip_lens[type] == 4)) {
+            if (inet_ntop(AF_INET, ip_attrs[type], addr, sizeof(addr)) != NULL) addrs.push_back(addr);
+        }
+        else if ((type >= CTA_IP_V6_SRC) && (ip_lens[type] == 16)) {
+            if (inet_ntop(AF_INET6, ip_attrs[type], addr, sizeof(addr)) != NULL) addrs.push_back(addr);
+        }
+    }
+}
+
+void CtEvents::attrParse(const char *data, int len, const char *attrs[], int lens[], unsigned int max)
+{
+    const struct nlattr *attr;
+    unsigned int type;
+
+    for (unsigned int n=0; n<=max; n++) {
+        attrs[n] = NULL;
+        lens[n] = 0;
+    }
+
+    while ((data != NULL) && (len >= static_cast<int>(NLA_HDRLEN))) {
+        attr = reinterpret_cast<const struct nlattr *>(data);
+        if ((attr->nla_len < NLA_HDRLEN) || (attr->nla_len > len)) break;
+        type = attr->nla_type & NLA_TYPE_MASK;
+        if (type <= max) {
+            attrs[type] = data + NLA_HDRLEN;
+            lens[type] = attr->nla_len - NLA_HDRLEN;
+        }
+        len -= NLA_ALIGN(attr->nla_len);
+        data += NLA_ALIGN(attr->nla_len);
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef CONNTRACK_H
+#define CONNTRACK_H
+
+#include <string>
+#include <vector>
+
+// Listener of conntrack NEW events, it gives addresses of freshly created flows,
+// thus classes waiting for traffic can be activated between rounds.
+class CtEvents {
+    public:
+        CtEvents();
+        ~CtEvents();
+        int open();
+        void close();
+        int fd() { return Fd; }
+        int receive(std::vector <std::string> &);
+    private:
+        void tupleParse(const char *, int, std::vector <std::string> &);
+        void attrParse(const char *, int, const char *[], int [], unsigned int);
+        //
+        int Fd;
+        static const unsigned int RECV_BUF_SIZE = 65536;
+        static const unsigned int RECV_BATCH_MAX = 64;
+};
+
+#endif
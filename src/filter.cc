@@ -20,6 +20,7 @@
 #include <iostream>
 
 #include "main.h"
+#include "arena.h"
 #include "aux.h"
 #include "config.h"
 #include "logger.h"
@@ -27,9 +28,8 @@
 #include "ifaces.h"
 #include "tests.h"
 
-TcFilter::TcFilter(std::string section_name, std::string class_header, std::string match, unsigned int waitingroom_id, EnumFlowDirection flow_direction)
+TcFilter::TcFilter(const std::string *class_header, std::string match, unsigned int waitingroom_id, EnumFlowDirection flow_direction)
 {
-    SectionName = section_name;
     FilterId = aux::str_to_uint(aux::value_of_param(match, "_filterid_")); 
     sys->computeQosFilterId(FilterId, &TcFilterId);
     HandleFWMark = 0;
@@ -38,8 +38,9 @@ TcFilter::TcFilter(std::string section_name, std::string class_header, std::stri
     DestMark = false;
     UseTcFilter = true;
     IptVirtualAlter = false;
-    Dev = "";
+    Dev = strpool->intern("");
     DevId = 0; 
+    DevHandle = -1;
     NsClassType = STANDARD_CLASS;
     TcFilterType = U32;
     FlowDirection = flow_direction;
@@ -68,59 +69,75 @@ TcFilter::~TcFilter()
     //
 }
 
-int TcFilter::store(std::string buf)
+void TcFilter::setFlowId(unsigned int flow_id)
 {
-    std::string option, value1, value2;
-
-    option = aux::awk(buf, 1);
-    value1 = aux::awk(buf, 2);
-    value2 = aux::awk(buf, 3);
-
-    if (option == "_classid_") {
-        FlowId = aux::str_to_uint(value1);
-    }
-
-    return 0;
+    FlowId = flow_id;
 }
 
 int TcFilter::validateParams()
 {
     std::string option, value1, value2;
     
-    option = aux::awk(ClassHeader, 1);
-    value1 = aux::awk(ClassHeader, 2);
-    value2 = aux::awk(ClassHeader, 3);
+    option = aux::awk(*ClassHeader, 1);
+    value1 = aux::awk(*ClassHeader, 2);
+    value2 = aux::awk(*ClassHeader, 3);
 
     if (option == "class") {
         NsClassType = STANDARD_CLASS;
-        Dev = aux::trim_dev(value2);
+        Dev = strpool->intern(aux::trim_dev(value2));
         UseTcFilter = true;
     }
     else if (option == "class-virtual") { 
         NsClassType = VIRTUAL;
-        Dev = aux::trim_dev(value2);
+        Dev = strpool->intern(aux::trim_dev(value2));
         IptVirtualAlter = true;
         UseTcFilter = false;
     } 
     else if (option == "class-wrapper") {
         NsClassType = WRAPPER;
-        Dev = aux::trim_dev(value1);
+        Dev = strpool->intern(aux::trim_dev(value1));
         UseTcFilter = true;
     }
     else if (option == "class-do-not-shape") { 
         NsClassType = DONOTSHAPE;
-        Dev = aux::trim_dev(value1);
-        if (ifaces->isDNShapeMethodSafe(Dev)) FlowId = ifaces->htbDNWrapperId();
+        Dev = strpool->intern(aux::trim_dev(value1));
+        if (ifaces->isDNShapeMethodSafe(ifaces->handle(*Dev))) FlowId = ifaces->htbDNWrapperId();
         else FlowId = 0;
         UseTcFilter = true;
     } 
 
-    DevId = ifaces->index(Dev);
-    TcFilterType = ifaces->tcFilterType(Dev);
+    DevHandle = ifaces->handle(*Dev);
+    DevId = ifaces->index(DevHandle);
+    TcFilterType = ifaces->tcFilterType(DevHandle);
 
     return 0;
 }
 
+std::string TcFilter::hostAddr()
+{
+    std::string value, addr, mask;
+    unsigned char buf[sizeof(struct in6_addr)];
+    char result[INET6_ADDRSTRLEN];
+    int family;
+
+    // Only the filter of a single host address identifies its class, wider ones are left for the rounds
+    value = aux::value_of_param(Match, (FlowDirection == DWLOAD) ? "dstip" : "srcip");
+    if (value.empty()) value = aux::value_of_param(Match, "_auto-srcip-dstip_");
+    if (value.empty()) return "";
+
+    if (aux::split_ip(value, addr, mask) == -1) return "";
+
+    family = (addr.find(":") == std::string::npos) ? AF_INET : AF_INET6;
+    if ((family == AF_INET) && (mask != "255.255.255.255")) return "";
+    if ((family == AF_INET6) && (mask != "128")) return "";
+
+    // Written the same way as addresses of conntrack events
+    if (inet_pton(family, addr.c_str(), buf) != 1) return "";
+    if (inet_ntop(family, buf, result, sizeof(result)) == NULL) return "";
+
+    return result;
+}
+
 bool TcFilter::getIptRequired()
 {
     if (getIptRequiredToOperate() || getIptRequiredToCheckActivity() || getIptRequiredToCheckTraffic()) return true;   
@@ -131,7 +148,7 @@ bool TcFilter::getIptRequired()
 bool TcFilter::getIptRequiredToOperate()
 {
     if (TcFilterType == FW) return true;
-    else if (test->ifaceIsImq(Dev) && config->getImqAutoRedirect()) return true;
+    else if (test->ifaceIsImq(*Dev) && config->getImqAutoRedirect()) return true;
 
     return false;
 }
@@ -156,48 +173,66 @@ int TcFilter::prepareTcFilter()
 {
     std::string option, value;
     std::string addr, mask;
+    int family;
+    bool ipv6;
     unsigned int n=0;
 
     if (!UseTcFilter) return 0;
     if (TcFilterType != U32)  return 0;
 
+    if ((family = aux::match_family("match " + Match)) == -1) return -1;
+    ipv6 = (family == AF_INET6);
+    if (ipv6 && !config->getIpv6()) { log->error(78, Match); return -1; }
+
     TcU32Selector.sel.flags |= TC_U32_TERMINAL;
+    // Filters of both families share the same table, they are told apart by the version field
+    if (config->getIpv6()) {
+        // match u8 0x40 0xf0 at 0 (0x60 for IPv6)
+        if (parseU8(&TcU32Selector.sel, 0, 0, ipv6 ? "0x60" : "0x40", "0xf0") == -1) { log->error(66, Match); return -1; }
+    }
+
     while ((aux::awk( Match, ++n)).size()) {
         option = aux::awk( Match, n );
         value = aux::awk( Match, ++n );
         if ( option == "proto" ) {
             if ( value == "tcp" ) { 
-                // match ip protocol 6 0xff
-                if (parseU8(&TcU32Selector.sel, 9, 0, "6", "0xff") == -1) { log->error(66, Match); return -1; }
+                // match ip protocol 6 0xff (ip6 protocol at offset 6)
+                if (parseU8(&TcU32Selector.sel, ipv6 ? 6 : 9, 0, "6", "0xff") == -1) { log->error(66, Match); return -1; }
             }                     
             else if ( value == "udp" ) { 
                 // match ip protocol 17 0xff
-                if (parseU8(&TcU32Selector.sel, 9, 0, "17", "0xff") == -1) { log->error(66, Match); return -1; }
+                if (parseU8(&TcU32Selector.sel, ipv6 ? 6 : 9, 0, "17", "0xff") == -1) { log->error(66, Match); return -1; }
             } 
             else if ( value == "icmp" ) { 
-                // match ip protocol 1 0xff
-                if (parseU8(&TcU32Selector.sel, 9, 0, "1", "0xff" ) == -1) { log->error(66, Match); return -1; }
+                // match ip protocol 1 0xff (ip6 protocol 58)
+                if (parseU8(&TcU32Selector.sel, ipv6 ? 6 : 9, 0, ipv6 ? "58" : "1", "0xff" ) == -1) { log->error(66, Match); return -1; }
             } 
             else { log->error(67, Match); return -1; }
         }
         else if ((option == "srcip") || (option == "from-local")) {
-            // match ip dst " + addr + "/" + mask
+            // match ip src " + addr + "/" + mask
             if (aux::split_ip(value, addr, mask) == -1) { log->error(60, Match); return -1; }
-            if (parseIpAddr(&TcU32Selector.sel, 12, addr.c_str(), mask) == -1) { log->error(66, Match); return -1; } 
+            if (ipv6) {
+                if (parseIp6Addr(&TcU32Selector.sel, 8, addr.c_str(), mask) == -1) { log->error(66, Match); return -1; }
+            }
+            else if (parseIpAddr(&TcU32Selector.sel, 12, addr.c_str(), mask) == -1) { log->error(66, Match); return -1; } 
         }
         else if ((option == "dstip") || (option == "to-local")) {
             // match ip dst " + addr + "/" + mask
-            if ((option == "to-local") && (!test->ifaceIsImq(Dev))) { log->error(865, Match); return -1; }
+            if ((option == "to-local") && !test->ifaceIsImq(*Dev) && ifaces->ingressOf(*Dev).empty()) { log->error(865, Match); return -1; }
             if (aux::split_ip(value, addr, mask) == -1) { log->error(60, Match); return -1; }
-            if (parseIpAddr(&TcU32Selector.sel, 16, addr.c_str(), mask) == -1) { log->error(66, Match); return -1; } 
+            if (ipv6) {
+                if (parseIp6Addr(&TcU32Selector.sel, 24, addr.c_str(), mask) == -1) { log->error(66, Match); return -1; }
+            }
+            else if (parseIpAddr(&TcU32Selector.sel, 16, addr.c_str(), mask) == -1) { log->error(66, Match); return -1; } 
         }
         else if (( option == "srcport" ) || ( option == "sport" )) {
-            // match ip sport " + value + " 0xffff
-            if (parseU16(&TcU32Selector.sel, 20, 0, value.c_str(), "0xffff") == -1) { log->error(66, Match); return -1; } 
+            // match ip sport " + value + " 0xffff (transport header follows fixed 40 bytes of ip6)
+            if (parseU16(&TcU32Selector.sel, ipv6 ? 40 : 20, 0, value.c_str(), "0xffff") == -1) { log->error(66, Match); return -1; } 
         }
         else if (( option == "dstport" ) || ( option == "dport" )) {
             // match ip dport " + value + " 0xffff
-            if (parseU16(&TcU32Selector.sel, 22, 0, value.c_str(), "0xffff") == -1) { log->error(66, Match); return -1; } 
+            if (parseU16(&TcU32Selector.sel, ipv6 ? 42 : 22, 0, value.c_str(), "0xffff") == -1) { log->error(66, Match); return -1; } 
         }
     }
 
@@ -206,7 +241,7 @@ int TcFilter::prepareTcFilter()
 
 int TcFilter::recoverQos()
 {
-    DevId = ifaces->index(Dev);
+    DevId = ifaces->index(DevHandle);
 
     memset(&TcU32Selector, 0, sizeof(TcU32Selector));
 
@@ -219,11 +254,13 @@ int TcFilter::add(bool flow_to_target)
 
     if (!flow_to_target) flowid = WaitingRoomId;
 
-    if (TcFilterType == U32) {
-        if (sys->setQosFilter(QOS_ADD, DevId, FilterId, flowid, TcFilterType, &TcU32Selector) == -1) { return -1; }
-    }
-    else if (TcFilterType == FW) {
-        if (sys->setQosFilter(QOS_ADD, DevId, HandleFWMark, flowid, TcFilterType, NULL) == -1) { return -1; }
+    for (unsigned int n=0; n < ifaces->htbTrees(DevHandle); n++) {
+        if (TcFilterType == U32) {
+            if (sys->setQosFilter(QOS_ADD, DevId, FilterId, flowid, TcFilterType, &TcU32Selector, ifaces->htbMajor(DevHandle, n)) == -1) { return -1; }
+        }
+        else if (TcFilterType == FW) {
+            if (sys->setQosFilter(QOS_ADD, DevId, HandleFWMark, flowid, TcFilterType, NULL, ifaces->htbMajor(DevHandle, n)) == -1) { return -1; }
+        }
     }
  
     return 0;
@@ -234,7 +271,9 @@ int TcFilter::addWAMissLastU32()
     unsigned int flowid = WaitingRoomId;
 
     if (TcFilterType == U32) {
-        if (sys->setQosFilter(QOS_ADD, DevId, 0xFFF, flowid, TcFilterType, &TcU32Selector) == -1) return -1;
+        for (unsigned int n=0; n < ifaces->htbTrees(DevHandle); n++) {
+            if (sys->setQosFilter(QOS_ADD, DevId, 0xFFF, flowid, TcFilterType, &TcU32Selector, ifaces->htbMajor(DevHandle, n)) == -1) return -1;
+        }
         return 0;
     }
 
@@ -243,11 +282,13 @@ int TcFilter::addWAMissLastU32()
 
 int TcFilter::del()
 {
-    if (TcFilterType == U32) {
-        if (sys->setQosFilter(QOS_DEL, DevId, FilterId, 0, TcFilterType, NULL) == -1) { return -1; }
-    }
-    else if (TcFilterType == FW) {
-        if (sys->setQosFilter(QOS_DEL, DevId, HandleFWMark, 0, TcFilterType, NULL) == -1) { return -1; }
+    for (unsigned int n=0; n < ifaces->htbTrees(DevHandle); n++) {
+        if (TcFilterType == U32) {
+            if (sys->setQosFilter(QOS_DEL, DevId, FilterId, 0, TcFilterType, NULL, ifaces->htbMajor(DevHandle, n)) == -1) { return -1; }
+        }
+        else if (TcFilterType == FW) {
+            if (sys->setQosFilter(QOS_DEL, DevId, HandleFWMark, 0, TcFilterType, NULL, ifaces->htbMajor(DevHandle, n)) == -1) { return -1; }
+        }
     }
     
     return 0;
@@ -288,6 +329,32 @@ int TcFilter::parseIpAddr(struct tc_u32_sel *sel, int off, const char *param1, s
     return 0;
 }
 
+int TcFilter::parseIp6Addr(struct tc_u32_sel *sel, int off, const char *param1, std::string param2)
+{
+    struct in6_addr addr;
+    unsigned int bitlen;
+    __u32 key, mask;
+
+    if (inet_pton(AF_INET6, param1, &addr) != 1) return -1;
+    if ((bitlen = aux::str_to_uint(param2)) > 128) return -1;
+
+    // Only words covered by the prefix are tested, /64 takes two keys
+    for (int n=0; (n < 4) && bitlen; n++) {
+        memcpy(&key, &addr.s6_addr[n*4], 4);
+        if (bitlen >= 32) {
+            mask = 0xFFFFFFFF;
+            bitlen -= 32;
+        }
+        else {
+            mask = htonl(0xFFFFFFFF<<(32-bitlen));
+            bitlen = 0;
+        }
+        if (packKey(sel, key, mask, off+n*4, 0) == -1) return -1;
+    }
+
+    return 0;
+}
+
 int TcFilter::parseU16(struct tc_u32_sel *sel, int off, int offmask, const char *param1, const char *param2)
 {
     __u32 key;
@@ -337,7 +404,7 @@ int TcFilter::packKey(struct tc_u32_sel *sel, __u32 key, __u32 mask, int off, in
         }
     }
 
-    if (hwm >= 128)
+    if (hwm >= static_cast<int>(U32_SEL_MAX_KEYS))
         return -1;
     if (off % 4)
         return -1;
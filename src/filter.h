@@ -13,9 +13,9 @@
 
 class TcFilter {
     public:
-        TcFilter(std::string, std::string, std::string, unsigned int, EnumFlowDirection);
+        TcFilter(const std::string *, std::string, unsigned int, EnumFlowDirection);
         ~TcFilter();
-        int store(std::string);
+        void setFlowId(unsigned int);
         int validateParams();
         int prepareTcFilter();
         int recoverQos();
@@ -25,12 +25,14 @@ class TcFilter {
         __u32 tcFilterId() { return TcFilterId; }
         EnumTcFilterType tcFilterType() { return TcFilterType; }
         unsigned int checkTrafficFromIpt(std::vector  <std::string> &);
+        std::string hostAddr();
         bool getIptRequired();
         bool getIptRequiredToOperate();
         bool getIptRequiredToCheckActivity();
         bool getIptRequiredToCheckTraffic();
    private:
         int parseIpAddr(struct tc_u32_sel *, int, const char *, std::string);
+        int parseIp6Addr(struct tc_u32_sel *, int, const char *, std::string);
         int getU32(__u32 *val, const char *arg, int base);
         int parseU16(struct tc_u32_sel *sel, int off, int offmask, const char *, const char *);
         int parseU8(struct tc_u32_sel *sel, int off, int offmask, const char *, const char *);
@@ -41,15 +43,14 @@ class TcFilter {
         int getAddrIpv4(__u8 *ap, const char *cp);
         //
         struct tcu32sel TcU32Selector;
-        std::string SectionName;
-        std::string ClassHeader;
-        std::string Dev;
+        const std::string *ClassHeader; // Owned by the class, which outlives its filters
+        const std::string *Dev; // Interned
         std::string Match;
-        std::string IptMatch;
         EnumNsClassType NsClassType;
         EnumTcFilterType TcFilterType;
         EnumFlowDirection FlowDirection;
         unsigned int DevId;
+        int DevHandle;
         unsigned int WaitingRoomId;
         unsigned int FilterId;
         unsigned int HandleFWMark;
@@ -10,10 +10,10 @@
 
 #include "ifaces.h"
 
-#include <sys/ioctl.h>
-#include <net/if.h>
 #include <sys/socket.h>
-#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
 #include <unistd.h>
 
 #include <string>
@@ -22,6 +22,8 @@
 #include <cstring>
 #include <cstdlib>
 
+#include "libnetlink.h"
+
 #include "main.h"
 #include "aux.h"
 #include "logger.h"
@@ -41,11 +43,18 @@ Iface::Iface(int iface_index, std::string iface_name)
     Sections.clear();
     SectionsSpeedSum = 0;
     HtbFallbackId = 9;
+    IngressOf = -1;
+    IngressInitialized = false;
+    Created = false;
     TcFilterType = U32;
     FlowDirection = UNSPEC;
     sys->computeQosFilterId(0xFFF, &TcFilterU32MinId);
     sys->computeQosFilterId(0x000, &TcFilterU32MaxId);
     WAMissLastU32Used = false;
+    Mq = false;
+    TxQueues = 1;
+    HtbTrees = 1;
+    ClassIdNext = FIRST_CLASS_ID;
 }
 
 Iface::~Iface()
@@ -56,6 +65,11 @@ Iface::~Iface()
 IfacesMap::IfacesMap () 
 {
     HtbDNWrapperId = 8;
+    pthread_mutex_init(&FlowDirectionLock, NULL);
+    pthread_mutex_init(&ClassIdsLock, NULL);
+
+    // Subscribe before the dump, thus no change is missed between them
+    LinkMonitorActive = (RTNetlink::rtnl_open(&LinkMonitor, RTMGRP_LINK) != -1);
 
     discover();
 }
@@ -70,170 +84,259 @@ IfacesMap::~IfacesMap ()
     for (unsigned int n=0; n < SysNetDevices.size(); n++) 
     { 
         dev = SysNetDevices.at(n);
-        if (dev->Controlled && dev->QosInitialized) sys->setQosQdisc(QOS_DEL, dev->Index, TC_H_ROOT, 1, HTB, 0);
+        if (dev->Controlled && dev->QosInitialized) sys->setQosQdisc(QOS_DEL, dev->Index, TC_H_ROOT, 1, HTB, 0, 0, 1, NULL);
+        if (dev->IngressInitialized) sys->setIngressRedirect(QOS_DEL, index(dev->IngressOf), 0);
+        if (dev->Created) sys->delLink(dev->Index);
     }
     sys->rtnlClose();
+
+    if (LinkMonitorActive) RTNetlink::rtnl_close(&LinkMonitor);
+
+    pthread_mutex_destroy(&FlowDirectionLock);
+    pthread_mutex_destroy(&ClassIdsLock);
 }
 
 int IfacesMap::discover()
 {
-    // Complete system devices
-    struct ifreq *ifr;
-    struct ifreq ifr2;
-    struct ifconf ifc;
-    unsigned int query_devs=0;
-    int iface_num;
-    int sd;
-
-    sd = socket (PF_INET, SOCK_STREAM, 0);
-
-    do {
-        if (query_devs) delete [] ifr;
-        query_devs++;
-        ifr = new ifreq[query_devs];
-        ifc.ifc_len = query_devs * sizeof (struct ifreq);
-        ifc.ifc_req = ifr;
-        ioctl (sd, SIOCGIFCONF, &ifc);
-    } while (query_devs == ifc.ifc_len / sizeof(struct ifreq));
-
-    for (unsigned int i = 0; i < (ifc.ifc_len / sizeof (struct ifreq)); i++) {
-        strncpy(ifr2.ifr_name, ifr[i].ifr_name, sizeof(ifr2.ifr_name));
-        ioctl (sd, SIOCGIFINDEX, &ifr2);
-        iface_num = ifaceNum(std::string(ifr[i].ifr_name));
-        if (iface_num == -1) {
-            SysNetDevices.push_back(new Iface(ifr2.ifr_ifindex, std::string(ifr[i].ifr_name)));
-        }
-        else {
-            SysNetDevices.at(iface_num)->Index = ifr2.ifr_ifindex;
-        }
+    RTNetlink::rtnl_handle rth;
+
+    // Complete system devices, address-less ones (IFB, IMQ, unnumbered PPP) too
+    if (RTNetlink::rtnl_open(&rth, 0) == -1) return -1;
+
+    if (RTNetlink::rtnl_wilddump_request(&rth, AF_UNSPEC, RTM_GETLINK) < 0) {
+        log->error(52, "Cannot send dump request");
+        RTNetlink::rtnl_close(&rth);
+        return -1;
     }
 
-    // Checking for IMQ devices.
-    int n = 0;
-    do {
-	    int ifindex = 0;
-
-        sprintf(ifr2.ifr_name, "imq%d", n);
-        if (ioctl(sd, SIOCGIFINDEX, &ifr2) < 0) break;
-     	ifindex = ifr2.ifr_ifindex;
-        if (ioctl(sd, SIOCGIFFLAGS, &ifr2) < 0) break;
-        iface_num = ifaceNum(std::string(ifr2.ifr_name));
-        if (iface_num == -1) {
-            SysNetDevices.push_back(new Iface(ifindex, std::string(ifr2.ifr_name)));
-        }
-        else {
-            SysNetDevices.at(iface_num)->Index = ifindex;
-        }
-        n++;
-    } while (n);
- 
-    close(sd);
+    // Indexes may change after rediscovery (e.g. recreated ppp interface)
+    IndexHandles.clear();
+
+    if (RTNetlink::rtnl_dump_filter(&rth, linkDumpEntry, this, NULL, NULL, QOS_CLASS) < 0) {
+        log->error(52, "Dump terminated");
+        RTNetlink::rtnl_close(&rth);
+        return -1;
+    }
+
+    RTNetlink::rtnl_close(&rth);
 
     return 0;
 }
 
-int IfacesMap::ifaceNum(std::string dev)
+int IfacesMap::refresh()
 {
-    for (unsigned int n=0; n < SysNetDevices.size(); n++) {
-        if (SysNetDevices.at(n)->Name == dev) return n;
+    // Without notifications, or if some of them were lost, full dump is the only option
+    if (!LinkMonitorActive) return discover();
+
+    if (RTNetlink::rtnl_listen_pending(&LinkMonitor, linkDumpEntry, this) == -1) return discover();
+
+    return 0;
+}
+
+int IfacesMap::linkDumpEntry(struct sockaddr_nl *who, struct nlmsghdr *n, void *ifaces_map)
+{
+    return reinterpret_cast<IfacesMap *>(ifaces_map)->proceedLink(n);
+}
+
+int IfacesMap::proceedLink(struct nlmsghdr *n)
+{
+    struct ifinfomsg *ifi = reinterpret_cast<struct ifinfomsg *>(NLMSG_DATA(n));
+    struct rtattr *tb[IFLA_MAX+1];
+    std::map <int, int>::iterator hi;
+    std::string name;
+    int len = n->nlmsg_len;
+    int iface_num;
+
+    if ((n->nlmsg_type != RTM_NEWLINK) && (n->nlmsg_type != RTM_DELLINK)) return 0;
+
+    len -= NLMSG_LENGTH(sizeof(*ifi));
+    if (len < 0) return 0;
+
+    memset(tb, 0, sizeof(tb));
+    RTNetlink::parse_rtattr(tb, IFLA_MAX, IFLA_RTA(ifi), len);
+
+    if (tb[IFLA_IFNAME] == NULL) return 0;
+
+    name = std::string(reinterpret_cast<char *>(RTA_DATA(tb[IFLA_IFNAME])), strnlen(reinterpret_cast<char *>(RTA_DATA(tb[IFLA_IFNAME])), RTA_PAYLOAD(tb[IFLA_IFNAME])));
+    iface_num = handle(name);
+
+    if (n->nlmsg_type == RTM_DELLINK) {
+        // Handle is kept, configuration still refers to it and device may come back
+        hi = IndexHandles.find(ifi->ifi_index);
+        if ((hi != IndexHandles.end()) && (hi->second == iface_num)) IndexHandles.erase(hi);
+        return 0;
     }
 
-    return -1;
+    if (iface_num == -1) {
+        SysNetDevices.push_back(new Iface(ifi->ifi_index, name));
+        iface_num = SysNetDevices.size()-1;
+        Handles[SysNetDevices.back()->Name] = iface_num;
+    }
+    else if (SysNetDevices.at(iface_num)->Index != ifi->ifi_index) {
+        hi = IndexHandles.find(SysNetDevices.at(iface_num)->Index);
+        if ((hi != IndexHandles.end()) && (hi->second == iface_num)) IndexHandles.erase(hi);
+        SysNetDevices.at(iface_num)->Index = ifi->ifi_index;
+    }
+
+    IndexHandles[ifi->ifi_index] = iface_num;
+
+    if (tb[IFLA_NUM_TX_QUEUES] && (RTA_PAYLOAD(tb[IFLA_NUM_TX_QUEUES]) >= sizeof(__u32))) {
+        SysNetDevices.at(iface_num)->TxQueues = *reinterpret_cast<__u32 *>(RTA_DATA(tb[IFLA_NUM_TX_QUEUES]));
+    }
+
+    return 0;
+}
+
+Iface *IfacesMap::device(int handle)
+{
+    if ((handle < 0) || (static_cast<unsigned int>(handle) >= SysNetDevices.size())) return NULL;
+
+    return SysNetDevices[handle];
+}
+
+int IfacesMap::handle(std::string dev)
+{
+    std::map <std::string, int>::iterator hi;
+
+    hi = Handles.find(dev);
+    if (hi == Handles.end()) return -1;
+
+    return hi->second;
+}
+
+int IfacesMap::handleByIndex(int iface_index)
+{
+    std::map <int, int>::iterator hi;
+
+    hi = IndexHandles.find(iface_index);
+    if (hi == IndexHandles.end()) return -1;
+
+    return hi->second;
 }
 
 int IfacesMap::index(std::string dev)
 {
-    if (ifaceNum(dev) == -1) return -1;
+    return index(handle(dev));
+}
+
+int IfacesMap::index(int dev_handle)
+{
+    Iface *dev = device(dev_handle);
 
-    return SysNetDevices.at(ifaceNum(dev))->Index;
+    if (dev == NULL) return -1;
+
+    return dev->Index;
 }
 
 bool IfacesMap::isValidSysDev(std::string dev)
 {
-    if (ifaceNum(dev) == -1) return false;
+    if (handle(dev) == -1) return false;
 
     return true;
 }
 
-void IfacesMap::setAsControlled(std::string dev)
+void IfacesMap::setAsControlled(std::string dev_name)
 {
-    if (ifaceNum(dev) == -1) return;
+    Iface *dev = device(handle(dev_name));
+
+    if (dev == NULL) return;
 
-    SysNetDevices.at(ifaceNum(dev))->Controlled = true;
+    dev->Controlled = true;
 }
 
-void IfacesMap::setDNShapeMethodSafe(std::string dev, bool arg)
+void IfacesMap::setDNShapeMethodSafe(std::string dev_name, bool arg)
 {
-    if (ifaceNum(dev) == -1) return;
+    Iface *dev = device(handle(dev_name));
 
-    SysNetDevices.at(ifaceNum(dev))->DNShapeMethodSafe = arg;
+    if (dev == NULL) return;
+
+    dev->DNShapeMethodSafe = arg;
 }
 
 bool IfacesMap::isDNShapeMethodSafe(std::string dev)
 {
-    if (ifaceNum(dev) == -1) return true;
+    return isDNShapeMethodSafe(handle(dev));
+}
+
+bool IfacesMap::isDNShapeMethodSafe(int dev_handle)
+{
+    Iface *dev = device(dev_handle);
+
+    if (dev == NULL) return true;
 
-    return SysNetDevices.at(ifaceNum(dev))->DNShapeMethodSafe;
+    return dev->DNShapeMethodSafe;
 }
 
-void IfacesMap::setHtbDNWrapperClass(std::string dev, bool arg)
+void IfacesMap::setHtbDNWrapperClass(std::string dev_name, bool arg)
 {
-    if (ifaceNum(dev) == -1) return;
+    Iface *dev = device(handle(dev_name));
 
-    SysNetDevices.at(ifaceNum(dev))->HtbDNWrapperClass = arg;
+    if (dev == NULL) return;
+
+    dev->HtbDNWrapperClass = arg;
 }
 
-void IfacesMap::setUnclassifiedMethodFallbackClass(std::string dev, bool arg)
+void IfacesMap::setUnclassifiedMethodFallbackClass(std::string dev_name, bool arg)
 {
-    if (ifaceNum(dev) == -1) return;
+    Iface *dev = device(handle(dev_name));
+
+    if (dev == NULL) return;
 
-    if (arg == true) SysNetDevices.at(ifaceNum(dev))->HtbFallbackId = 9;
-    else SysNetDevices.at(ifaceNum(dev))->HtbFallbackId = 0;
+    if (arg == true) dev->HtbFallbackId = 9;
+    else dev->HtbFallbackId = 0;
 }
 
-void IfacesMap::setSpeed(std::string dev, unsigned int iface_speed)
+void IfacesMap::setSpeed(std::string dev_name, __u64 iface_speed)
 {
-    if (ifaceNum(dev) == -1) return;
+    Iface *dev = device(handle(dev_name));
+
+    if (dev == NULL) return;
 
-    SysNetDevices.at(ifaceNum(dev))->Speed = iface_speed;
+    dev->Speed = iface_speed;
 }
 
-unsigned int IfacesMap::speed(std::string dev)
+__u64 IfacesMap::speed(std::string dev_name)
 {
-    if (ifaceNum(dev) == -1) return MAX_RATE;
+    Iface *dev = device(handle(dev_name));
 
-    return SysNetDevices.at(ifaceNum(dev))->Speed;
+    if (dev == NULL) return MAX_RATE;
+
+    return dev->Speed;
 }
 
-void IfacesMap::setFallbackRate(std::string dev, unsigned int rate)
+void IfacesMap::setFallbackRate(std::string dev_name, __u64 rate)
 {
-    if (ifaceNum(dev) == -1) return;
+    Iface *dev = device(handle(dev_name));
+
+    if (dev == NULL) return;
 
-    SysNetDevices.at(ifaceNum(dev))->FallbackRate = rate;
+    dev->FallbackRate = rate;
 }
 
-void IfacesMap::addSection(std::string dev, std::string section)
+void IfacesMap::addSection(std::string dev_name, std::string section)
 {
-    if (ifaceNum(dev) == -1) return;
+    Iface *dev = device(handle(dev_name));
+
+    if (dev == NULL) return;
     
-    if (!aux::is_in_vector(SysNetDevices.at(ifaceNum(dev))->Sections, section)) SysNetDevices.at(ifaceNum(dev))->Sections.push_back(section);
+    if (!aux::is_in_vector(dev->Sections, section)) dev->Sections.push_back(section);
 }
 
-bool IfacesMap::isInSections(std::string dev, std::string section) 
+bool IfacesMap::isInSections(std::string dev_name, std::string section) 
 {
-    if (ifaceNum(dev) == -1) return false;
+    Iface *dev = device(handle(dev_name));
+
+    if (dev == NULL) return false;
 
-    return (aux::is_in_vector(SysNetDevices.at(ifaceNum(dev))->Sections, section));
+    return (aux::is_in_vector(dev->Sections, section));
 }
 
-int IfacesMap::addToSectionsSpeedSum(std::string dev_name, unsigned int speed)
+int IfacesMap::addToSectionsSpeedSum(std::string dev_name, __u64 speed)
 {
-    Iface *dev;
+    Iface *dev = device(handle(dev_name));
 
-    if (ifaceNum(dev_name) == -1) return -1;
+    if (dev == NULL) return -1;
 
-    dev = SysNetDevices.at(ifaceNum(dev_name));
-    
     if (dev->HtbDNWrapperClass) {
         if (!dev->Speed) { log->error(103, ""); return -1; }
         if (speed >= (dev->Speed - dev->SectionsSpeedSum - MIN_RATE)) { log->error (803, (dev_name + " speed " + aux::int_to_str(dev->Speed) + "b/s")); return -1; }
@@ -244,28 +347,65 @@ int IfacesMap::addToSectionsSpeedSum(std::string dev_name, unsigned int speed)
     return 0;
 }
 
-void IfacesMap::setTcFilterType(std::string dev, EnumTcFilterType tc_filter_type)
+void IfacesMap::setTcFilterType(std::string dev_name, EnumTcFilterType tc_filter_type)
 {
-    if (ifaceNum(dev) == -1) return;
+    Iface *dev = device(handle(dev_name));
+
+    if (dev == NULL) return;
 
-    SysNetDevices.at(ifaceNum(dev))->TcFilterType = tc_filter_type;
+    dev->TcFilterType = tc_filter_type;
 }
 
 EnumTcFilterType IfacesMap::tcFilterType(std::string dev)
 {
-    if (ifaceNum(dev) == -1) return U32;
+    return tcFilterType(handle(dev));
+}
+
+EnumTcFilterType IfacesMap::tcFilterType(int dev_handle)
+{
+    Iface *dev = device(dev_handle);
 
-    return SysNetDevices.at(ifaceNum(dev))->TcFilterType;
+    if (dev == NULL) return U32;
+
+    return dev->TcFilterType;
 }
 
 int IfacesMap::initHtbOnControlled()
 {
-    unsigned int fallback_rate;
-    unsigned int dnwrapper_rate = 0;
+    __u64 fallback_rate;
+    __u64 dnwrapper_rate = 0;
+    unsigned int htb_major;
     Iface *dev;
 
     if (sys->rtnlOpen() == -1) return -1;
 
+    // IFB devices have to exist and receive the traffic before HTB goes on them
+    for (unsigned int n=0; n < SysNetDevices.size(); n++) 
+    {   
+        dev = SysNetDevices.at(n);
+        if (!dev->Controlled || (dev->IngressOf == -1)) continue;
+
+        // Marks are set by iptables, ingress redirect takes packets before it
+        if (dev->TcFilterType == FW) { sys->rtnlClose(); log->error(870, dev->Name); return -1; }
+
+        if (handleByIndex(dev->Index) != static_cast<int>(n)) {
+            if (sys->addIfbLink(dev->Name) == -1) { sys->rtnlClose(); log->error(871, dev->Name); return -1; }
+            dev->Created = true;
+            if ((discover() == -1) || (handleByIndex(dev->Index) != static_cast<int>(n))) { sys->rtnlClose(); log->error(16, dev->Name); return -1; }
+        }
+
+        // Device created here isn't left behind by the failed setup
+        if ((sys->setLinkUp(dev->Index) == -1)
+                || (sys->setIngressRedirect(QOS_DEL, index(dev->IngressOf), 0) == -1)
+                || (sys->setIngressRedirect(QOS_ADD, index(dev->IngressOf), dev->Index) == -1)) {
+            if (dev->Created && (sys->delLink(dev->Index) != -1)) dev->Created = false;
+            sys->rtnlClose();
+            log->error(871, dev->Name);
+            return -1;
+        }
+        dev->IngressInitialized = true;
+    }
+
     // Clear and create new HTB structure 
     for (unsigned int n=0; n < SysNetDevices.size(); n++) 
     {   
@@ -273,7 +413,7 @@ int IfacesMap::initHtbOnControlled()
         if (!dev->Controlled) continue;
             
         if (test->ifaceIsImq(dev->Name)) {
-            if (system(std::string("ip link set " + dev->Name + " up").c_str()) == -1) { return -1; }
+            if (sys->setLinkUp(dev->Index) == -1) { sys->rtnlClose(); return -1; }
         }
 
         if (dev->HtbDNWrapperClass) {
@@ -282,22 +422,44 @@ int IfacesMap::initHtbOnControlled()
             dnwrapper_rate = dev->Speed - (dev->SectionsSpeedSum + dev->FallbackRate);
         }  
 
-        // Ugly hack!!
-        if (system(std::string("tc qdisc del dev " + dev->Name + " root 2> /dev/null > /dev/null").c_str()) == -1) { sys->rtnlClose(); return -1; }
-        //if (sys->tcQdisc(QOS_DEL, dev->Index, TC_H_ROOT, 1, HTB, 0) == -1) { sys->rtnlClose(); return -1; }
-        if (sys->setQosQdisc(QOS_ADD, dev->Index, TC_H_ROOT, 1, HTB, dev->HtbFallbackId) == -1) { sys->rtnlClose(); return -1; }
-        dev->QosInitialized = true;
-        // HTB default - initial creation
-        if (dev->HtbFallbackId) {
-            fallback_rate = dev->SectionsSpeedSum;
-            if (fallback_rate == 0) fallback_rate = dev->FallbackRate;
-            if (sys->setQosClass(QOS_ADD, dev->Index, 0, dev->HtbFallbackId, fallback_rate, fallback_rate, 7, aux::compute_quantum(fallback_rate), 0 , 0) == -1) { sys->rtnlClose(); return -1; }
-            if (sys->setQosQdisc(QOS_ADD, dev->Index, dev->HtbFallbackId, dev->HtbFallbackId, SFQ, 10) == -1) { sys->rtnlClose(); return -1; }
+        // Fresh HTB hasn't got any class, ids given before are void
+        pthread_mutex_lock(&ClassIdsLock);
+        dev->ClassIdNext = FIRST_CLASS_ID;
+        dev->ClassIdsFree.clear();
+        dev->WrapperClassIds.clear();
+        pthread_mutex_unlock(&ClassIdsLock);
+
+        dev->HtbTrees = 1;
+        if (dev->Mq && (dev->TxQueues > 1)) dev->HtbTrees = (dev->TxQueues < MAX_MQ_QUEUES) ? dev->TxQueues : MAX_MQ_QUEUES;
+
+        fallback_rate = dev->SectionsSpeedSum;
+        if (fallback_rate == 0) fallback_rate = dev->FallbackRate;
+
+        if (sys->setQosQdisc(QOS_DEL, dev->Index, TC_H_ROOT, 1, HTB, 0, 0, 1, NULL) == -1) { sys->rtnlClose(); return -1; }
+        if (dev->HtbTrees > 1) {
+            if (sys->setQosQdisc(QOS_ADD, dev->Index, TC_H_ROOT, 1, MQ, 0, 0, 1, NULL) == -1) { sys->rtnlClose(); return -1; }
         }
-        // HTB for safe do-not-shape and wrapper classes if exists
-        if (dev->HtbDNWrapperClass) {
-            if (sys->setQosClass(QOS_ADD, dev->Index, 0, HtbDNWrapperId, dnwrapper_rate, dnwrapper_rate, 7, aux::compute_quantum(dnwrapper_rate), 0 , 0) == -1 ) { sys->rtnlClose(); return -1; }
-            if (sys->setQosQdisc(QOS_ADD, dev->Index, HtbDNWrapperId, HtbDNWrapperId, SFQ, 10) == -1 ) { sys->rtnlClose(); return -1; }
+        dev->QosInitialized = true;
+
+        // Unclassified traffic limits can't follow the flows, thus they are split evenly over the trees
+        for (unsigned int m=0; m < dev->HtbTrees; m++) {
+            htb_major = htbMajor(n, m);
+            if (dev->HtbTrees > 1) {
+                if (sys->setQosQdisc(QOS_ADD, dev->Index, m+1, htb_major, HTB, dev->HtbFallbackId, 0, 1, NULL) == -1) { sys->rtnlClose(); return -1; }
+            }
+            else {
+                if (sys->setQosQdisc(QOS_ADD, dev->Index, TC_H_ROOT, htb_major, HTB, dev->HtbFallbackId, 0, 1, NULL) == -1) { sys->rtnlClose(); return -1; }
+            }
+            // HTB default - initial creation
+            if (dev->HtbFallbackId) {
+                if (sys->setQosClass(QOS_ADD, dev->Index, 0, dev->HtbFallbackId, fallback_rate/dev->HtbTrees, fallback_rate/dev->HtbTrees, 7, aux::compute_quantum(fallback_rate/dev->HtbTrees), 0 , 0, htb_major) == -1) { sys->rtnlClose(); return -1; }
+                if (sys->setQosQdisc(QOS_ADD, dev->Index, dev->HtbFallbackId, htbLeafHandle(n, dev->HtbFallbackId), SFQ, 10, 0, htb_major, NULL) == -1) { sys->rtnlClose(); return -1; }
+            }
+            // HTB for safe do-not-shape and wrapper classes if exists
+            if (dev->HtbDNWrapperClass) {
+                if (sys->setQosClass(QOS_ADD, dev->Index, 0, HtbDNWrapperId, dnwrapper_rate/dev->HtbTrees, dnwrapper_rate/dev->HtbTrees, 7, aux::compute_quantum(dnwrapper_rate/dev->HtbTrees), 0 , 0, htb_major) == -1 ) { sys->rtnlClose(); return -1; }
+                if (sys->setQosQdisc(QOS_ADD, dev->Index, HtbDNWrapperId, htbLeafHandle(n, HtbDNWrapperId), SFQ, 10, 0, htb_major, NULL) == -1 ) { sys->rtnlClose(); return -1; }
+            }
         }
 
         dev->WAMissLastU32Used = false;
@@ -320,7 +482,9 @@ int IfacesMap::endUpHtbFallbackOnControlled()
         dev = SysNetDevices.at(n);
         if (!dev->Controlled) continue;
         if (dev->HtbFallbackId) {
-            if (sys->setQosClass(QOS_MOD, dev->Index, 0, dev->HtbFallbackId, dev->FallbackRate, dev->FallbackRate, 7, aux::compute_quantum(dev->FallbackRate), 0 , 0) == -1) { sys->rtnlClose(); return -1; }
+            for (unsigned int m=0; m < dev->HtbTrees; m++) {
+                if (sys->setQosClass(QOS_MOD, dev->Index, 0, dev->HtbFallbackId, dev->FallbackRate/dev->HtbTrees, dev->FallbackRate/dev->HtbTrees, 7, aux::compute_quantum(dev->FallbackRate/dev->HtbTrees), 0 , 0, htbMajor(n, m)) == -1) { sys->rtnlClose(); return -1; }
+            }
         }
     }
 
@@ -334,57 +498,220 @@ unsigned int IfacesMap::htbDNWrapperId()
     return HtbDNWrapperId;
 }
 
-int IfacesMap::setFlowDirection(std::string dev, EnumFlowDirection flow_direction)
+int IfacesMap::setFlowDirection(std::string dev_name, EnumFlowDirection flow_direction)
+{
+    Iface *dev = device(handle(dev_name));
+    int result = 0;
+
+    if (dev == NULL) return -1;
+
+    // Sections sharing the interface may be prepared at the same time
+    pthread_mutex_lock(&FlowDirectionLock);
+    if (dev->FlowDirection == UNSPEC) dev->FlowDirection = flow_direction;
+    else if (dev->FlowDirection != flow_direction) result = -1;
+    pthread_mutex_unlock(&FlowDirectionLock);
+
+    return result;
+}
+
+EnumFlowDirection IfacesMap::getFlowDirection(std::string dev_name)
 {
-    if (ifaceNum(dev) == -1) return -1;
+    Iface *dev = device(handle(dev_name));
 
-    if (SysNetDevices.at(ifaceNum(dev))->FlowDirection == UNSPEC) SysNetDevices.at(ifaceNum(dev))->FlowDirection = flow_direction;
-    else if (SysNetDevices.at(ifaceNum(dev))->FlowDirection != flow_direction) return -1;
+    if (dev == NULL) return UNSPEC;
+
+    return dev->FlowDirection;
+}
+
+void IfacesMap::reportTcFilterU32Id(int dev_handle, __u32 id)
+{
+    Iface *dev = device(dev_handle);
+
+    if (dev == NULL) return;
+
+    if (id < dev->TcFilterU32MinId) dev->TcFilterU32MinId = id;
+    if (id > dev->TcFilterU32MaxId) dev->TcFilterU32MaxId = id;
+}
+
+__u32 IfacesMap::getTcFilterU32MinId(int dev_handle)
+{
+    Iface *dev = device(dev_handle);
+
+    if (dev == NULL) return 0;
+
+    return dev->TcFilterU32MinId;
+}
+
+__u32 IfacesMap::getTcFilterU32MaxId(int dev_handle)
+{
+    Iface *dev = device(dev_handle);
+
+    if (dev == NULL) return 0;
+
+    return dev->TcFilterU32MaxId;
+}
+
+void IfacesMap::setWAMissLastU32Used(int dev_handle, bool used)
+{
+    Iface *dev = device(dev_handle);
+
+    if (dev == NULL) return;
+
+    dev->WAMissLastU32Used = used;
+}
+
+bool IfacesMap::getWAMissLastU32Used(int dev_handle)
+{
+    Iface *dev = device(dev_handle);
+
+    if (dev == NULL) return false;
+
+    return dev->WAMissLastU32Used;
+}
+
+void IfacesMap::setMq(std::string dev_name, bool mq)
+{
+    Iface *dev = device(handle(dev_name));
+
+    if (dev == NULL) return;
+
+    dev->Mq = mq;
+}
+
+int IfacesMap::setIngress(std::string dev_name, std::string ifb_name)
+{
+    int dev_handle = handle(dev_name);
+    int ifb_handle = handle(ifb_name);
+
+    if (dev_handle == -1) return -1;
+
+    // IFB is created at initialization, until then only its handle exists
+    if (ifb_handle == -1) {
+        SysNetDevices.push_back(new Iface(0, ifb_name));
+        ifb_handle = SysNetDevices.size()-1;
+        Handles[SysNetDevices.back()->Name] = ifb_handle;
+    }
+
+    if (ifb_handle == dev_handle) return -1;
+
+    for (unsigned int n=0; n < SysNetDevices.size(); n++) {
+        if ((SysNetDevices.at(n)->IngressOf == dev_handle) && (static_cast<int>(n) != ifb_handle)) return -1;
+    }
+    if ((SysNetDevices.at(ifb_handle)->IngressOf != -1) && (SysNetDevices.at(ifb_handle)->IngressOf != dev_handle)) return -1;
+
+    SysNetDevices.at(ifb_handle)->IngressOf = dev_handle;
 
     return 0;
 }
 
-EnumFlowDirection IfacesMap::getFlowDirection(std::string dev)
+std::string IfacesMap::ingressOf(std::string ifb_name)
+{
+    Iface *dev = device(handle(ifb_name));
+
+    if ((dev == NULL) || (dev->IngressOf == -1)) return "";
+
+    return device(dev->IngressOf)->Name;
+}
+
+unsigned int IfacesMap::htbTrees(int dev_handle)
+{
+    Iface *dev = device(dev_handle);
+
+    if (dev == NULL) return 1;
+
+    return dev->HtbTrees;
+}
+
+unsigned int IfacesMap::htbMajor(int dev_handle, unsigned int tree)
 {
-    if (ifaceNum(dev) == -1) return UNSPEC;
+    // Single tree keeps the classic 1: root, mq root takes 1: itself otherwise
+    if (htbTrees(dev_handle) == 1) return 1;
 
-    return SysNetDevices.at(ifaceNum(dev))->FlowDirection;
+    return tree + 2;
 }
 
-void IfacesMap::reportTcFilterU32Id(std::string dev, __u32 id)
+int IfacesMap::htbTree(int dev_handle, unsigned int htb_major)
 {
-    if (ifaceNum(dev) == -1) return;
+    unsigned int htb_trees = htbTrees(dev_handle);
+
+    if (htb_trees == 1) return (htb_major == 1) ? 0 : -1;
+    if ((htb_major < 2) || (htb_major >= (htb_trees + 2))) return -1;
 
-    if (id < SysNetDevices.at(ifaceNum(dev))->TcFilterU32MinId) SysNetDevices.at(ifaceNum(dev))->TcFilterU32MinId = id;
-    if (id > SysNetDevices.at(ifaceNum(dev))->TcFilterU32MaxId) SysNetDevices.at(ifaceNum(dev))->TcFilterU32MaxId = id;
+    return htb_major - 2;
 }
 
-__u32 IfacesMap::getTcFilterU32MinId(std::string dev)
+unsigned int IfacesMap::htbLeafHandle(int dev_handle, unsigned int class_id)
 {
-    if (ifaceNum(dev) == -1) return 0;
+    // Class id can't be reused as leaf qdisc handle in each of the trees
+    if (htbTrees(dev_handle) > 1) return 0;
 
-    return SysNetDevices.at(ifaceNum(dev))->TcFilterU32MinId;
+    return class_id;
 }
 
-__u32 IfacesMap::getTcFilterU32MaxId(std::string dev)
+unsigned int IfacesMap::allocClassId(int dev_handle)
 {
-    if (ifaceNum(dev) == -1) return 0;
+    Iface *dev = device(dev_handle);
+    unsigned int class_id = 0;
 
-    return SysNetDevices.at(ifaceNum(dev))->TcFilterU32MaxId;
+    if (dev == NULL) return 0;
+
+    // Sections sharing the interface are working in separate threads
+    pthread_mutex_lock(&ClassIdsLock);
+    class_id = classIdTake(dev);
+    pthread_mutex_unlock(&ClassIdsLock);
+
+    return class_id;
 }
 
-void IfacesMap::setWAMissLastU32Used(std::string dev, bool used)
+unsigned int IfacesMap::wrapperClassId(int dev_handle, std::string name)
 {
-    if (ifaceNum(dev) == -1) return;
+    Iface *dev = device(dev_handle);
+    std::map <std::string, unsigned int>::iterator wi;
+    unsigned int class_id = 0;
+
+    if (dev == NULL) return 0;
+
+    // Wrapper and its stubs are in different sections, whichever asks first takes the id for all of them
+    pthread_mutex_lock(&ClassIdsLock);
+    wi = dev->WrapperClassIds.find(name);
+    if (wi != dev->WrapperClassIds.end()) class_id = wi->second;
+    else {
+        class_id = classIdTake(dev);
+        if (class_id) dev->WrapperClassIds[name] = class_id;
+    }
+    pthread_mutex_unlock(&ClassIdsLock);
 
-    SysNetDevices.at(ifaceNum(dev))->WAMissLastU32Used = used;
+    return class_id;
 }
 
-bool IfacesMap::getWAMissLastU32Used(std::string dev)
+void IfacesMap::freeClassId(int dev_handle, unsigned int class_id)
 {
-    if (ifaceNum(dev) == -1) return false;
+    Iface *dev = device(dev_handle);
+    std::map <std::string, unsigned int>::iterator wi;
 
-    return SysNetDevices.at(ifaceNum(dev))->WAMissLastU32Used;
+    if ((dev == NULL) || (class_id < FIRST_CLASS_ID) || (class_id > LAST_CLASS_ID)) return;
+
+    pthread_mutex_lock(&ClassIdsLock);
+    for (wi = dev->WrapperClassIds.begin(); wi != dev->WrapperClassIds.end(); wi++) {
+        if (wi->second != class_id) continue;
+        dev->WrapperClassIds.erase(wi);
+        break;
+    }
+    dev->ClassIdsFree.push_back(class_id);
+    pthread_mutex_unlock(&ClassIdsLock);
 }
 
+unsigned int IfacesMap::classIdTake(Iface *dev)
+{
+    unsigned int class_id = 0;
 
+    if (dev->ClassIdsFree.size()) {
+        class_id = dev->ClassIdsFree.back();
+        dev->ClassIdsFree.pop_back();
+    }
+    else if (dev->ClassIdNext <= LAST_CLASS_ID) {
+        class_id = dev->ClassIdNext++;
+    }
+
+    return class_id;
+}
@@ -1,16 +1,21 @@
 #ifndef IFACESMAP_H
 #define IFACESMAP_H
 
+#include <pthread.h>
+
+#include <map>
 #include <string>
 #include <vector>
 
+#include "libnetlink.h"
+
 #include "main.h"
 
 class Iface
 {
     friend class IfacesMap;
     public:
-        Iface(int ifr_ifindex, std::string ifr_name);
+        Iface(int iface_index, std::string iface_name);
         ~Iface();
     private:
         int Index;
@@ -19,16 +24,26 @@ class Iface
         bool QosInitialized;
         bool DNShapeMethodSafe;
         bool HtbDNWrapperClass;
-        unsigned int Speed;
-        unsigned int FallbackRate;
+        __u64 Speed;
+        __u64 FallbackRate;
         std::vector <std::string> Sections;
-        unsigned int SectionsSpeedSum;
+        __u64 SectionsSpeedSum;
         unsigned int HtbFallbackId; 
+        // IFB fed by ingress of other interface, handle of it or -1
+        int IngressOf;
+        bool IngressInitialized;
+        bool Created;
         EnumTcFilterType TcFilterType;
         EnumFlowDirection FlowDirection; 
         __u32 TcFilterU32MinId;
         __u32 TcFilterU32MaxId;
         bool WAMissLastU32Used;
+        bool Mq;
+        unsigned int TxQueues;
+        unsigned int HtbTrees;
+        unsigned int ClassIdNext;
+        std::vector <unsigned int> ClassIdsFree;
+        std::map <std::string, unsigned int> WrapperClassIds; // Shared with stubs in other sections
 };
 
 class IfacesMap
@@ -37,35 +52,63 @@ class IfacesMap
         IfacesMap();
         ~IfacesMap();
         int discover();
+        int refresh();
+        static int linkDumpEntry(struct sockaddr_nl *, struct nlmsghdr *, void *);
+        // Handles are resolved once at configuration time and stay valid after rediscovery
+        int handle(std::string);
+        int handleByIndex(int);
         int index(std::string);
+        int index(int);
         bool isValidSysDev(std::string);
         void setAsControlled(std::string);
         void setDNShapeMethodSafe(std::string, bool);
         bool isDNShapeMethodSafe(std::string);
+        bool isDNShapeMethodSafe(int);
         void setHtbDNWrapperClass(std::string, bool);
         void setUnclassifiedMethodFallbackClass(std::string, bool);
-        void setSpeed(std::string, unsigned int);
-        unsigned int speed(std::string);
-        void setFallbackRate(std::string, unsigned int);
+        void setSpeed(std::string, __u64);
+        __u64 speed(std::string);
+        void setFallbackRate(std::string, __u64);
         void addSection(std::string, std::string);
         bool isInSections(std::string, std::string); 
-        int addToSectionsSpeedSum(std::string, unsigned int);
+        int addToSectionsSpeedSum(std::string, __u64);
         void setTcFilterType(std::string, EnumTcFilterType);
         EnumTcFilterType tcFilterType(std::string);
+        EnumTcFilterType tcFilterType(int);
         int initHtbOnControlled();
         int endUpHtbFallbackOnControlled();
         unsigned int htbDNWrapperId();
         int setFlowDirection(std::string, EnumFlowDirection);
         EnumFlowDirection getFlowDirection(std::string);
-        void reportTcFilterU32Id(std::string, __u32);
-        __u32 getTcFilterU32MinId(std::string);
-        __u32 getTcFilterU32MaxId(std::string);
-        void setWAMissLastU32Used(std::string, bool);
-        bool getWAMissLastU32Used(std::string);
+        void reportTcFilterU32Id(int, __u32);
+        __u32 getTcFilterU32MinId(int);
+        __u32 getTcFilterU32MaxId(int);
+        void setWAMissLastU32Used(int, bool);
+        bool getWAMissLastU32Used(int);
+        void setMq(std::string, bool);
+        int setIngress(std::string, std::string); // iface, ifb
+        std::string ingressOf(std::string);
+        // HTB trees are fixed at initialization, one per TX queue in multi-queue mode
+        unsigned int htbTrees(int);
+        unsigned int htbMajor(int, unsigned int);
+        int htbTree(int, unsigned int);
+        unsigned int htbLeafHandle(int, unsigned int);
+        // The same minor is used in each of the HTB trees (majors) of the interface
+        unsigned int allocClassId(int);
+        unsigned int wrapperClassId(int, std::string);
+        void freeClassId(int, unsigned int);
     private:
-        int ifaceNum(std::string);
+        unsigned int classIdTake(Iface *);
+        int proceedLink(struct nlmsghdr *);
+        Iface *device(int);
         unsigned int HtbDNWrapperId;  
         std::vector <Iface *> SysNetDevices;
+        std::map <std::string, int> Handles;
+        std::map <int, int> IndexHandles;
+        RTNetlink::rtnl_handle LinkMonitor;
+        bool LinkMonitorActive;
+        pthread_mutex_t FlowDirectionLock;
+        pthread_mutex_t ClassIdsLock;
 };
 
 #endif
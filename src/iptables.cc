@@ -10,9 +10,13 @@
 
 #include "iptables.h"
 
+#include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
+#include <signal.h>
+#include <arpa/inet.h>
 
+#include <map>
+#include <set>
 #include <string>
 #include <vector>
 #include <fstream>
@@ -22,6 +26,7 @@
 #include "config.h"
 #include "logger.h"
 #include "ifaces.h"
+#include "nftables.h"
 #include "tests.h"
 
 Iptables::Iptables()
@@ -30,6 +35,7 @@ Iptables::Iptables()
     HookUpload = "POSTROUTING";
     ChainDwload = "ns_dwload";
     ChainUpload = "ns_upload";
+    NftTable = "niceshaper";
     Target = "ACCEPT";
     RequiredForDwload = false;
     RequiredForUpload = false;
@@ -39,6 +45,7 @@ Iptables::Iptables()
     Fallback = false;
     Initialized = false;
     CacheExpireUsec = 99999; // 0.1s
+    Nft = new NfTables;
     //
     ProperHooks.push_back("PREROUTING");
     ProperHooks.push_back("POSTROUTING");
@@ -50,22 +57,31 @@ Iptables::Iptables()
 Iptables::~Iptables()
 {
     clean();
+
+    delete Nft;
 }
 
 int Iptables::clean()
 {
+    std::vector <std::string> restore;
+
     if (!RequiredForDwload && !RequiredForUpload) return 0;
 
     if (!Initialized) return 0;
 
-    for (unsigned int n=0; n<RulesDestroy.size(); n++) { 
-        execSysCmd("iptables -t mangle " + RulesDestroy.at(n) + " 2>/dev/null");
+    // Hooks and chains are removed in one transaction, packets never see them half removed
+    if (Fallback) nftRemove();
+    else {
+        if (saveForeignRules(restore, false) != -1) restoreRules(restore, "", false);
+        if (config->getIpv6() && (saveForeignRules(restore, true) != -1)) restoreRules(restore, "", true);
     }
 
     Initialized = false;
 
+    NftSets.clear();
+    NftSlots.clear();
+
     Rules.clear();
-    RulesDestroy.clear();
     AssignHelperDwload.clear();
     AssignHelperUpload.clear();
 
@@ -123,18 +139,364 @@ void Iptables::setRequirementsIfRequired(bool required_for_dwload, bool required
     if (required_for_check_upload) RequiredForCheckUpload = true;
 }
 
-int Iptables::execSysCmd(std::string command)
+bool Iptables::familyRule(std::string rule, bool ipv6)
+{
+    // Rules of IPv6 matches are tagged with -6, chains exist in both families
+    if (aux::awk(rule, 1) == "-N") return true;
+
+    return ((aux::awk(rule, 3) == "-6") == ipv6);
+}
+
+void Iptables::chainFamilies(std::string chain, bool &ipv4, bool &ipv6)
+{
+    std::string rule;
+
+    ipv4 = false;
+    ipv6 = false;
+
+    for (unsigned int n=0; n<Rules.size(); n++) {
+        rule = aux::trim_legacy(Rules.at(n));
+        if ((aux::awk(rule, 1) != "-A") || (aux::awk(rule, 2) != chain)) continue;
+        if (familyRule(rule, true)) ipv6 = true;
+        else ipv4 = true;
+        if (ipv4 && ipv6) return;
+    }
+}
+
+int Iptables::saveForeignRules(std::vector <std::string> &restore, bool ipv6)
+{
+    char cbuf[MAX_LONG_BUF_SIZE];
+    std::string command = ipv6 ? "ip6tables-save" : "iptables-save";
+    std::string buf, chain;
+    unsigned int pos;
+    bool own;
+    FILE *fp;
+
+    restore.clear();
+
+    fp = popen((command + " -c -t mangle").c_str(), "r");
+    if (!fp) {
+        log->error(705, command);
+        return -1;
+    }
+
+    // Rules of other applications are kept along with their counters, NiceShaper ones are
+    // dropped, also the remains of a killed instance
+    while (fgets(cbuf, MAX_LONG_BUF_SIZE, fp)) {
+        buf = aux::trim_legacy(std::string(cbuf));
+        if (buf.empty() || (buf.at(0) == '#') || (buf == "*mangle") || (buf == "COMMIT")) continue;
+        own = false;
+        if (buf.at(0) == ':') {
+            chain = buf.substr(1, buf.find(' ')-1);
+            own = (chain == ChainDwload) || (chain == ChainUpload);
+        }
+        else {
+            pos = (buf.at(0) == '[') ? 2 : 1;
+            chain = aux::awk(buf, pos+1);
+            if ((aux::awk(buf, pos) == "-A") && ((chain == ChainDwload) || (chain == ChainUpload))) own = true;
+            while (!own && aux::awk(buf, ++pos).size()) {
+                if ((aux::awk(buf, pos) != "-j") && (aux::awk(buf, pos) != "-g")) continue;
+                chain = aux::awk(buf, ++pos);
+                own = (chain == ChainDwload) || (chain == ChainUpload);
+            }
+        }
+        if (!own) restore.push_back(buf);
+    }
+
+    if (pclose(fp) != 0) {
+        log->error(705, command);
+        return -1;
+    }
+
+    return 0;
+}
+
+int Iptables::restoreRules(std::vector <std::string> &restore, std::string options, bool ipv6)
+{
+    std::string command = (ipv6 ? "ip6tables-restore -c" : "iptables-restore -c") + options;
+    std::string batch_file = ipv6 ? ip6tfile : iptfile;
+    void (*sigpipe_handler)(int);
+    FILE *fp;
+    int status;
+
+    if (Debug) {
+        log->info(7, command);
+        if (writeBatchFile(restore, batch_file) != -1) log->info(100, batch_file);
+    }
+
+    fp = popen(command.c_str(), "w");
+    if (!fp) {
+        log->error(705, command);
+        return -1;
+    }
+
+    // Batch is fed through the pipe, iptables-restore commits the whole table at once
+    sigpipe_handler = signal(SIGPIPE, SIG_IGN);
+    fputs("*mangle\n", fp);
+    for (unsigned int n=0; n<restore.size(); n++) {
+        fputs(restore.at(n).c_str(), fp);
+        fputc('\n', fp);
+    }
+    fputs("COMMIT\n", fp);
+    status = pclose(fp);
+    signal(SIGPIPE, sigpipe_handler);
+
+    if (status != 0) {
+        if (!Debug) writeBatchFile(restore, batch_file);
+        log->error(705, batch_file);
+        return -1;
+    }
+
+    return 0;
+}
+
+int Iptables::writeBatchFile(std::vector <std::string> &restore, std::string batch_file)
+{
+    std::ofstream ofd;
+
+    ofd.open(batch_file.c_str());
+    if (!ofd.is_open()) {
+        log->warning(15, batch_file);
+        return -1;
+    }
+
+    ofd << "*mangle" << std::endl;
+    for (unsigned int n=0; n<restore.size(); n++) ofd << restore.at(n) << std::endl;
+    ofd << "COMMIT" << std::endl;
+    ofd.close();
+
+    return 0;
+}
+
+int Iptables::nftReplace(std::vector <std::string> &rule_counters)
+{
+    std::vector <std::string> hooks, nft_rules;
+    std::vector <__u64> nft_packets, nft_bytes;
+    std::vector <NftSet> sets;
+    std::map <std::string, std::vector <NftSlot> > slots;
+    std::map <std::string, unsigned int> chain_rules;
+    std::map <std::string, int> open_sets;
+    std::set <std::pair <int, __u32> > keys;
+    NftHost host, next_host;
+    NftSlot slot;
+    std::string rule, chain, group;
+    unsigned long long packets, bytes;
+    unsigned int unit_size;
+    bool compiled;
+
+    for (unsigned int n=0; n<Rules.size(); n+=unit_size) {
+        unit_size = 1;
+        rule = aux::trim_legacy(Rules.at(n));
+        chain = aux::awk(rule, 2);
+        if (aux::awk(rule, 1) != "-A") continue;
+        packets = 0;
+        bytes = 0;
+        if ((n < rule_counters.size()) && rule_counters.at(n).size()) sscanf(rule_counters.at(n).c_str(), "[%llu:%llu]", &packets, &bytes);
+
+        // Rules of single hosts go to sets, marking rule is merged with the following one of the same host
+        compiled = false;
+        if (((chain == ChainDwload) || (chain == ChainUpload)) && (nftHostRule(rule, host) != -1)) {
+            compiled = (host.Target != "MARK");
+            if (!compiled && (n+1 < Rules.size()) && (nftHostRule(aux::trim_legacy(Rules.at(n+1)), next_host) != -1)
+                    && (next_host.Chain == host.Chain) && (next_host.Field == host.Field) && (next_host.Addr == host.Addr)
+                    && (next_host.Iface == host.Iface) && (next_host.Target != "MARK")) {
+                host.Target = next_host.Target;
+                unit_size = 2;
+                compiled = true;
+            }
+        }
+
+        if (!compiled) {
+            slot.Set = -1;
+            slot.Index = chain_rules[chain]++;
+            slot.Shadowed = false;
+            slots[chain].push_back(slot);
+            open_sets[chain] = -1;
+            nft_rules.push_back(rule);
+            nft_packets.push_back(packets);
+            nft_bytes.push_back(bytes);
+            continue;
+        }
+
+        // Consecutive hosts with the same interface and target share a set and a single lookup rule
+        group = host.Field + " " + host.Iface + (host.Marking ? " MARK " : " ") + host.Target;
+        if ((open_sets.find(chain) == open_sets.end()) || (open_sets[chain] == -1) || (sets.at(open_sets[chain]).Group != group)) {
+            open_sets[chain] = sets.size();
+            sets.push_back(NftSet());
+            sets.back().Name = chain + "_" + aux::int_to_str(static_cast<unsigned int>(sets.size()-1));
+            sets.back().Chain = chain;
+            sets.back().Group = group;
+            sets.back().Map = host.Marking;
+            chain_rules[chain]++;
+            nft_rules.push_back("-A " + chain + " " + host.Iface + " --" + host.Field + (host.Marking ? "-mark-map " : "-lookup ") + sets.back().Name + " -j " + host.Target);
+            nft_packets.push_back(0);
+            nft_bytes.push_back(0);
+        }
+
+        slot.Set = open_sets[chain];
+        slot.Index = host.Addr;
+        // Only the first rule of a repeated host matches, as it would in the chain
+        slot.Shadowed = !keys.insert(std::make_pair(slot.Set, host.Addr)).second;
+        if (!slot.Shadowed) {
+            sets.at(slot.Set).Keys.push_back(host.Addr);
+            if (host.Marking) sets.at(slot.Set).Marks.push_back(host.Mark);
+            sets.at(slot.Set).Packets.push_back(packets);
+            sets.at(slot.Set).Bytes.push_back(bytes);
+        }
+        for (unsigned int m=0; m<unit_size; m++) slots[chain].push_back(slot);
+    }
+
+    if (Nft->open() == -1) return -1;
+
+    Nft->begin();
+    // Table of the previous run or of a killed instance is replaced at once
+    Nft->replaceTable(NftTable);
+
+    for (unsigned int n=0; n<Rules.size(); n++) {
+        rule = aux::trim_legacy(Rules.at(n));
+        chain = aux::awk(rule, 2);
+        if ((aux::awk(rule, 1) == "-N") || ((aux::awk(rule, 1) == "-A") && aux::is_in_vector(ProperHooks, chain) && !aux::is_in_vector(hooks, chain))) {
+            if (aux::awk(rule, 1) == "-A") hooks.push_back(chain);
+            if (Debug) log->info(7, "nft add chain " + NftTable + " " + chain);
+            Nft->addChain(NftTable, chain);
+        }
+    }
+
+    for (unsigned int n=0; n<sets.size(); n++) {
+        if (Debug) log->info(7, "nft add " + std::string(sets.at(n).Map ? "map " : "set ") + NftTable + " " + sets.at(n).Name + " (" + aux::int_to_str(static_cast<unsigned int>(sets.at(n).Keys.size())) + ")");
+        Nft->addSet(NftTable, sets.at(n).Name, sets.at(n).Map);
+        Nft->addSetElements(NftTable, sets.at(n).Name, sets.at(n).Keys, sets.at(n).Marks, sets.at(n).Packets, sets.at(n).Bytes);
+        // Only names and keys are needed to read counters
+        std::vector <__u32>().swap(sets.at(n).Marks);
+        std::vector <__u64>().swap(sets.at(n).Packets);
+        std::vector <__u64>().swap(sets.at(n).Bytes);
+    }
+
+    for (unsigned int n=0; n<nft_rules.size(); n++) {
+        if (Debug) log->info(7, "nft " + nft_rules.at(n));
+        if (Nft->addRule(NftTable, nft_rules.at(n), nft_packets.at(n), nft_bytes.at(n)) == -1) return -1;
+    }
+
+    if (Nft->commit() == -1) return -1;
+
+    NftSets.swap(sets);
+    NftSlots.swap(slots);
+
+    return 0;
+}
+
+int Iptables::nftHostRule(std::string rule, NftHost &host)
 {
-    if (Debug) log->info(7, command);
+    std::string option, value, mask;
+    struct in_addr in;
+    unsigned int pos = 2;
+
+    host.Chain = aux::awk(rule, 2);
+    host.Field = "";
+    host.Iface = "";
+    host.Target = "";
+    host.Marking = false;
+    host.Mark = 0;
+
+    while (aux::awk(rule, ++pos).size()) {
+        option = aux::awk(rule, pos);
+        // Negated is only the class interface in PREROUTING
+        if (option == "!") {
+            if ((aux::awk(rule, pos+1) != "-i") || aux::awk(rule, pos+2).empty() || host.Iface.size()) return -1;
+            host.Iface = "! -i " + aux::awk(rule, pos+2);
+            pos += 2;
+            continue;
+        }
+        value = aux::awk(rule, ++pos);
+        if (value.empty() || (value == "!")) return -1;
+        if (((option == "-s") || (option == "-d")) && host.Field.empty()) {
+            if (value.find('/') == std::string::npos) return -1;
+            mask = value.substr(value.find('/')+1);
+            if ((mask != "255.255.255.255") && (mask != "32")) return -1;
+            if (inet_pton(AF_INET, value.substr(0, value.find('/')).c_str(), &in) != 1) return -1;
+            host.Field = (option == "-s") ? "saddr" : "daddr";
+            host.Addr = in.s_addr;
+        }
+        else if ((option == "-o") && host.Iface.empty()) {
+            host.Iface = "-o " + value;
+        }
+        else if ((option == "-j") && host.Target.empty()) {
+            host.Target = value;
+        }
+        else if ((option == "--set-mark") && !host.Marking) {
+            if (value.find_first_not_of("0123456789") != std::string::npos) return -1;
+            host.Marking = true;
+            host.Mark = strtoul(value.c_str(), NULL, 10);
+        }
+        else return -1;
+    }
 
-    if (system(command.c_str()) == -1) return -1;
+    if (host.Field.empty() || host.Iface.empty()) return -1;
+    if ((host.Target == "MARK") != host.Marking) return -1;
+    if ((host.Target != "MARK") && (host.Target != "ACCEPT") && (host.Target != "RETURN")) return -1;
 
     return 0;
 }
 
+int Iptables::nftChainCounters(std::string chain, std::vector <__u64> &packets, std::vector <__u64> &bytes)
+{
+    std::vector <__u64> rule_packets, rule_bytes, set_packets, set_bytes;
+    std::vector <__u32> keys;
+    std::map <std::pair <int, __u32>, std::pair <__u64, __u64> > elements;
+    std::map <std::pair <int, __u32>, std::pair <__u64, __u64> >::iterator ei;
+    std::vector <NftSlot> &slots = NftSlots[chain];
+
+    packets.clear();
+    bytes.clear();
+
+    if (Nft->readChainCounters(NftTable, chain, rule_packets, rule_bytes) == -1) return -1;
+
+    for (unsigned int n=0; n<NftSets.size(); n++) {
+        if (NftSets.at(n).Chain != chain) continue;
+        if (Nft->readSetCounters(NftTable, NftSets.at(n).Name, keys, set_packets, set_bytes) == -1) return -1;
+        for (unsigned int m=0; m<keys.size(); m++) {
+            elements[std::make_pair(static_cast<int>(n), keys.at(m))] = std::make_pair(set_packets.at(m), set_bytes.at(m));
+        }
+    }
+
+    // Counters are laid out in order of the chain rules, the same as iptables lists them
+    for (unsigned int n=0; n<slots.size(); n++) {
+        if (slots.at(n).Shadowed) {
+            packets.push_back(0);
+            bytes.push_back(0);
+        }
+        else if (slots.at(n).Set == -1) {
+            if (slots.at(n).Index >= rule_packets.size()) return -1;
+            packets.push_back(rule_packets.at(slots.at(n).Index));
+            bytes.push_back(rule_bytes.at(slots.at(n).Index));
+        }
+        else {
+            ei = elements.find(std::make_pair(slots.at(n).Set, slots.at(n).Index));
+            if (ei == elements.end()) return -1;
+            packets.push_back(ei->second.first);
+            bytes.push_back(ei->second.second);
+        }
+    }
+
+    return 0;
+}
+
+int Iptables::nftRemove()
+{
+    if (Nft->open() == -1) return -1;
+
+    if (Debug) log->info(7, "nft delete table " + NftTable);
+
+    Nft->begin();
+    Nft->delTable(NftTable);
+
+    return Nft->commit();
+}
+
 int Iptables::prepare(std::vector <std::string> &fpv_class_file, std::vector <Worker *> &workers)
 {
-    std::string buf;
+    std::string buf, family;
+    bool ipv4_dwload, ipv6_dwload, ipv4_upload, ipv6_upload;
 
     if (!RequiredForDwload && !RequiredForUpload) return 0;
 
@@ -142,27 +504,24 @@ int Iptables::prepare(std::vector <std::string> &fpv_class_file, std::vector <Wo
     if (RequiredForUpload) Rules.push_back(" -N " + ChainUpload);
 
     for (unsigned int n=0; n<config->LocalSubnets.size(); n++) {
+        family = (config->LocalSubnets.at(n).find(":") != std::string::npos) ? " -6" : "";
         if (RequiredForDwload) {
-            buf = HookDwload + " -d " + config->LocalSubnets.at(n) + " -j " + ChainDwload;
+            buf = HookDwload + family + " -d " + config->LocalSubnets.at(n) + " -j " + ChainDwload;
             Rules.push_back(" -A " + buf);
-            RulesDestroy.push_back(" -D " + buf);
         }
         if (RequiredForUpload) {
-            buf = HookUpload + " -s "  + config->LocalSubnets.at(n) + " -j " + ChainUpload;
+            buf = HookUpload + family + " -s "  + config->LocalSubnets.at(n) + " -j " + ChainUpload;
             Rules.push_back(" -A " + buf);
-            RulesDestroy.push_back(" -D " + buf);
         }
     }
 
     if (prepareRules(fpv_class_file, workers) == -1) { log->error(799); return -1; }
 
-    if (RequiredForDwload) {
-        RulesDestroy.push_back(" -F " + ChainDwload);
-        RulesDestroy.push_back(" -X " + ChainDwload);
-    }
-    if (RequiredForUpload) {
-        RulesDestroy.push_back(" -F " + ChainUpload);
-        RulesDestroy.push_back(" -X " + ChainUpload);
+    // Chains with rules of both families are listed by iptables and ip6tables each round, single dump of nf_tables covers both
+    if (!Fallback && config->getIpv6()) {
+        chainFamilies(ChainDwload, ipv4_dwload, ipv6_dwload);
+        chainFamilies(ChainUpload, ipv4_upload, ipv6_upload);
+        if ((ipv4_dwload && ipv6_dwload) || (ipv4_upload && ipv6_upload)) log->warning(24);
     }
 
     return 0;
@@ -170,98 +529,262 @@ int Iptables::prepare(std::vector <std::string> &fpv_class_file, std::vector <Wo
 
 int Iptables::init()
 {
-    std::ofstream ofd;
-    FILE *fp;
-    char cbuf[MAX_LONG_BUF_SIZE];
-    unsigned int bsize = 0;
-    std::string buf;
+    std::vector <std::string> restore, rule_counters;
+    std::string rule;
 
     if (!RequiredForDwload && !RequiredForUpload) return 0;
 
-    if (Fallback) log->setDoNotPutNewLineChar (true);
-
     log->info(10);
 
-    // Clear iptables from rubbish remains
-    buf = "";
-    do {
-        if (buf.empty()) buf=ChainDwload;
-        else buf=ChainUpload;
-        execSysCmd ("for n in `iptables -t mangle -L PREROUTING -nv --line-numbers | grep " + buf + " | awk '{print $1}' | sort -r`; do iptables -t mangle -D PREROUTING $n; done");
-        execSysCmd ("for n in `iptables -t mangle -L POSTROUTING -nv --line-numbers | grep " + buf + " | awk '{print $1}' | sort -r`; do iptables -t mangle -D POSTROUTING $n; done");
-        execSysCmd ("for n in `iptables -t mangle -L -nv | grep 'Chain " + buf + "' | awk '{print $2}'`; do iptables -t mangle -F $n ; iptables -t mangle -X $n; done");
-    } while (buf != ChainUpload);        
+    TVChainUploadPrev.tv_sec = 0;
+    TVChainDwloadPrev.tv_sec = 0;
+
+    if (Fallback) {
+        rule_counters.resize(Rules.size());
+        if (nftReplace(rule_counters) == -1) return -1;
+    }
+    else {
+        // Rubbish remains are filtered out of the saved table, which is restored with the new rules at once
+        for (int ipv6=0; ipv6<=static_cast<int>(config->getIpv6()); ipv6++) {
+            if (saveForeignRules(restore, ipv6) == -1) return -1;
+            for (unsigned int n=0; n<Rules.size(); n++) {
+                rule = aux::trim_legacy(Rules.at(n));
+                if (familyRule(rule, ipv6)) restore.push_back(rule);
+            }
+            if (restoreRules(restore, "", ipv6) == -1) return -1;
+        }
+    }
 
     Initialized = true;
 
-    TVChainUploadPrev.tv_sec = 0;
+    return 0;
+}
+
+int Iptables::reload(std::vector <std::string> &fpv_class_file, std::vector <Worker *> &workers, bool required_for_dwload, bool required_for_check_dwload, bool required_for_upload, bool required_for_check_upload)
+{
+    std::vector <std::string> rules_prev;
+    std::vector <unsigned int> assign_helper_dwload_prev, assign_helper_upload_prev;
+    std::vector <std::string> chains, chain_counters;
+    std::map <std::string, std::string> counters;
+    std::map <std::string, std::string>::iterator ci;
+    std::map <std::string, unsigned int> occurrences;
+    std::map <std::string, int> hooks;
+    std::map <std::string, int>::iterator hi;
+    std::vector <std::string> restore, restore6, rule_counters;
+    std::vector <std::string> *restore_ptr;
+    std::string rule, key;
+    unsigned int chain_counters_pos;
+
+    // Chains are created or dropped as a whole, as it would be at start
+    if (!Initialized || (required_for_dwload != RequiredForDwload) || (required_for_upload != RequiredForUpload)) {
+        clean();
+        Rules.clear();
+        AssignHelperDwload.clear();
+        AssignHelperUpload.clear();
+        RequiredForDwload = required_for_dwload;
+        RequiredForCheckDwload = required_for_check_dwload;
+        RequiredForUpload = required_for_upload;
+        RequiredForCheckUpload = required_for_check_upload;
+        if (prepare(fpv_class_file, workers) == -1) return -1;
+        return init();
+    }
+
+    RequiredForCheckDwload = required_for_check_dwload;
+    RequiredForCheckUpload = required_for_check_upload;
+
+    if (RequiredForDwload) chains.push_back(ChainDwload);
+    if (RequiredForUpload) chains.push_back(ChainUpload);
+
+    // Counters are carried over to the same rules, read them in the order of chain rules
+    for (unsigned int n=0; n<chains.size(); n++) {
+        if (readChainCounters(chains.at(n), chain_counters) == -1) return -1;
+        chain_counters_pos = 0;
+        for (unsigned int m=0; m<Rules.size(); m++) {
+            rule = aux::trim_legacy(Rules.at(m));
+            if ((aux::awk(rule, 1) != "-A") || (aux::awk(rule, 2) != chains.at(n))) continue;
+            key = rule + "\n" + aux::int_to_str(occurrences[rule]++);
+            if (chain_counters_pos < chain_counters.size()) counters[key] = chain_counters.at(chain_counters_pos++);
+        }
+    }
+
+    for (unsigned int n=0; n<Rules.size(); n++) {
+        rule = aux::trim_legacy(Rules.at(n));
+        if ((aux::awk(rule, 1) == "-A") && aux::is_in_vector(ProperHooks, aux::awk(rule, 2))) hooks[rule.substr(3)]--;
+    }
+
+    rules_prev.swap(Rules);
+    assign_helper_dwload_prev.swap(AssignHelperDwload);
+    assign_helper_upload_prev.swap(AssignHelperUpload);
+
+    if (prepare(fpv_class_file, workers) == -1) {
+        Rules.swap(rules_prev);
+        AssignHelperDwload.swap(assign_helper_dwload_prev);
+        AssignHelperUpload.swap(assign_helper_upload_prev);
+        return -1;
+    }
+
+    for (unsigned int n=0; n<Rules.size(); n++) {
+        rule = aux::trim_legacy(Rules.at(n));
+        if ((aux::awk(rule, 1) == "-A") && aux::is_in_vector(ProperHooks, aux::awk(rule, 2))) hooks[rule.substr(3)]++;
+    }
+
+    // Only the hooks difference is applied, chains are replaced at once
+    for (unsigned int n=0; n<chains.size(); n++) {
+        restore.push_back(":" + chains.at(n) + " - [0:0]");
+        restore6.push_back(":" + chains.at(n) + " - [0:0]");
+    }
+
+    for (hi = hooks.begin(); hi != hooks.end(); hi++) {
+        restore_ptr = familyRule("-A " + hi->first, true) ? &restore6 : &restore;
+        for (int n=hi->second; n<0; n++) restore_ptr->push_back("-D " + hi->first);
+        for (int n=0; n<hi->second; n++) restore_ptr->push_back("-A " + hi->first);
+    }
+
+    occurrences.clear();
+    rule_counters.resize(Rules.size());
+    for (unsigned int n=0; n<Rules.size(); n++) {
+        rule = aux::trim_legacy(Rules.at(n));
+        if ((aux::awk(rule, 1) != "-A") || !aux::is_in_vector(chains, aux::awk(rule, 2))) continue;
+        key = rule + "\n" + aux::int_to_str(occurrences[rule]++);
+        ci = counters.find(key);
+        if (ci != counters.end()) rule_counters.at(n) = ci->second;
+        restore_ptr = familyRule(rule, true) ? &restore6 : &restore;
+        restore_ptr->push_back(rule_counters.at(n).size() ? rule_counters.at(n) + " " + rule : rule);
+    }
+
     TVChainDwloadPrev.tv_sec = 0;
+    TVChainUploadPrev.tv_sec = 0;
+    ChainRawCountersDwload.clear();
+    ChainRawCountersUpload.clear();
 
-    if (!Fallback) {
-        ofd.open(iptfile.c_str());
-        if (ofd.is_open()) {
-            fp = popen("iptables-save -t mangle", "r");
-            if (!fp) {
-                log->error(0);
-                return -1; 
-            }
-            while (fgets(cbuf, MAX_LONG_BUF_SIZE, fp)) {
-                buf = aux::trim_legacy(std::string(cbuf));
-                if (buf.find_first_of("#") != std::string::npos) buf.erase(buf.find_first_of("#"));
-                if (buf == "COMMIT") continue;  
-                ofd << buf << std::endl;
-            }
-            pclose(fp);
+    // Fallback replaces the whole table, as hooks don't carry counters
+    if (Fallback) return nftReplace(rule_counters);
 
-            for (unsigned int i=0; i<Rules.size(); i++) {
-                ofd << aux::trim_legacy(Rules.at(i)) << std::endl;
-            }
+    if (restoreRules(restore, " --noflush", false) == -1) return -1;
+    if (config->getIpv6()) return restoreRules(restore6, " --noflush", true);
 
-            ofd << "COMMIT" << std::endl;
+    return 0;
+}
+
+int Iptables::validate(std::vector <std::string> &fpv_class_file, std::vector <Worker *> &workers, bool required_for_dwload_next, bool required_for_upload_next)
+{
+    std::vector <std::string> rules;
+    std::vector <unsigned int> assign_helper_dwload, assign_helper_upload;
+    bool required_for_dwload = RequiredForDwload;
+    bool required_for_upload = RequiredForUpload;
+    int result;
+
+    if (!required_for_dwload_next && !required_for_upload_next) return 0;
+
+    // Dry run of rules generation, running rules are left untouched
+    rules.swap(Rules);
+    assign_helper_dwload.swap(AssignHelperDwload);
+    assign_helper_upload.swap(AssignHelperUpload);
+    RequiredForDwload = required_for_dwload_next;
+    RequiredForUpload = required_for_upload_next;
+
+    result = prepareRules(fpv_class_file, workers);
+
+    Rules.swap(rules);
+    AssignHelperDwload.swap(assign_helper_dwload);
+    AssignHelperUpload.swap(assign_helper_upload);
+    RequiredForDwload = required_for_dwload;
+    RequiredForUpload = required_for_upload;
+
+    return result;
+}
 
-            ofd.flush();
-            ofd.close();
+int Iptables::readChainCounters(std::string chain, std::vector <std::string> &chain_counters)
+{
+    std::vector <__u64> packets, bytes;
+    std::string buf;
 
-            // Apply 
-            if (execSysCmd("iptables-restore < " + iptfile) == -1) { log->error(705, iptfile); return -1; }
-            if (!Debug) unlink (iptfile.c_str());
-            else log->info (100, iptfile);
+    chain_counters.clear();
+
+    if (chainCounters(chain, packets, bytes) == -1) {
+        log->error(12, chain);
+        return -1;
+    }
+
+    for (unsigned int n=0; n<packets.size(); n++) {
+        buf = "[";
+        aux::append_u64(buf, packets.at(n));
+        buf += ":";
+        aux::append_u64(buf, bytes.at(n));
+        chain_counters.push_back(buf + "]");
+    }
+
+    return 0;
+}
+
+int Iptables::chainCounters(std::string chain, std::vector <__u64> &packets, std::vector <__u64> &bytes)
+{
+    std::vector <__u64> packets6, bytes6;
+    std::vector <__u64> packets4, bytes4;
+    std::string rule;
+    unsigned int pos4 = 0;
+    unsigned int pos6 = 0;
+    bool ipv4, ipv6;
+
+    packets.clear();
+    bytes.clear();
+
+    // Table of nf_tables holds both families, its chain is in the order of rules already
+    if (Fallback) return nftChainCounters(chain, packets, bytes);
+
+    if (!config->getIpv6()) return listChain(chain, false, packets, bytes);
+
+    // Family without rules in the chain isn't listed, thus IPv6 costs a second listing only when classes match IPv6 addresses
+    chainFamilies(chain, ipv4, ipv6);
+    if (!ipv6) return listChain(chain, false, packets, bytes);
+    if (!ipv4) return listChain(chain, true, packets, bytes);
+
+    if (listChain(chain, false, packets4, bytes4) == -1) return -1;
+    if (listChain(chain, true, packets6, bytes6) == -1) return -1;
+
+    // Counters of both families are merged back into the order of chain rules
+    for (unsigned int n=0; n<Rules.size(); n++) {
+        rule = aux::trim_legacy(Rules.at(n));
+        if ((aux::awk(rule, 1) != "-A") || (aux::awk(rule, 2) != chain)) continue;
+        if (familyRule(rule, true)) {
+            if (pos6 >= packets6.size()) return -1;
+            packets.push_back(packets6.at(pos6));
+            bytes.push_back(bytes6.at(pos6++));
         }
         else {
-            log->warning(15, iptfile);
-            Fallback = true;
+            if (pos4 >= packets4.size()) return -1;
+            packets.push_back(packets4.at(pos4));
+            bytes.push_back(bytes4.at(pos4++));
         }
     }
 
-    if (Fallback) 
-    {
-        if (!config->getStartStopDots()) { log->error(999, "!config->getStartStopDots()"); return -1; }
-        for (unsigned int i=0; i<Rules.size(); i++) {
-            if ((Rules.size() < config->getStartStopDots()) || !(i%(Rules.size()/config->getStartStopDots()))) {
-                while (bsize) {
-                    log->setDoNotPutNewLineChar (true);
-                    log->onTerminal ("\b");
-                    bsize--;
-                }
-                buf = aux::int_to_str(static_cast<unsigned int>(i*100/Rules.size()));
-                bsize = buf.size()+3;
-                
-                log->setDoNotPutNewLineChar (true);
-                log->onTerminal (".["+buf+"%]");
-            }
-            execSysCmd ("iptables -t mangle " + Rules.at(i));
-        }
-        if (bsize) {
-            while (bsize) {
-                log->setDoNotPutNewLineChar (true);
-                log->onTerminal ("\b");
-                bsize--;
-            }
+    if ((pos4 < packets4.size()) || (pos6 < packets6.size())) return -1;
+
+    return 0;
+}
+
+int Iptables::listChain(std::string chain, bool ipv6, std::vector <__u64> &packets, std::vector <__u64> &bytes)
+{
+    char cbuf[MAX_LONG_BUF_SIZE];
+    std::string buf;
+    FILE *fp;
+
+    fp = popen(((ipv6 ? "ip6tables -t mangle -L " : "iptables -t mangle -L ") + chain + " -vnx").c_str(), "r");
+    if (!fp) return -1;
+
+    for (unsigned int n=1; n<=2; n++) {
+        if (fgets(cbuf, MAX_LONG_BUF_SIZE, fp) == NULL) {
+            pclose(fp);
+            return -1;
         }
-        log->setDoNotPutNewLineChar (true);
-        log->onTerminal ("[100%]");
+    }
 
+    while (fgets(cbuf, MAX_LONG_BUF_SIZE, fp)) {
+        buf = std::string(cbuf);
+        packets.push_back(aux::str_to_u64(aux::awk(buf, 1)));
+        bytes.push_back(aux::str_to_u64(aux::awk(buf, 2)));
     }
+    pclose(fp);
 
     return 0;
 }
@@ -337,7 +860,12 @@ int Iptables::genRulesFromNSMatch(std::string src, unsigned int worker_vid, enum
         return -1;
     }
 
-    if (aux::value_of_param(src, "to-local").size()) {
+    // Ingress of the interface feeding IFB is seen in PREROUTING only
+    if (ifaces->ingressOf(class_iface).size() && (hook_behaviour != "PREROUTING")) {
+        hook_behaviour = "PREROUTING";
+        rule_local_helper_req = true;
+    }
+    else if (aux::value_of_param(src, "to-local").size()) {
         if (hook_behaviour != "PREROUTING") {
             hook_behaviour = "PREROUTING";
             rule_local_helper_req = true;
@@ -384,7 +912,6 @@ int Iptables::genRulesFromNSMatch(std::string src, unsigned int worker_vid, enum
 
     if (rule_local.size()) {
         Rules.push_back(std::string(" -A ") + rule_local);
-        RulesDestroy.push_back(" -D " + rule_local);
     }
 
     if (rule_mark.size()) {
@@ -416,11 +943,20 @@ int Iptables::genFilterFromNSMatch (std::string src, EnumFlowDirection class_flo
     bool filter_iface_required = false;
     std::string filter_iface;
     unsigned int pos;
+    int family;
+    bool ipv6;
 
     result = "";
 
     if (aux::awk(src, 1) != "match") { log->error(60, src); return -1; }
 
+    if ((family = aux::match_family(src)) == -1) return -1;
+    ipv6 = (family == AF_INET6);
+    if (ipv6 && !config->getIpv6()) { log->error(78, src); return -1; }
+
+    // Tag leads the rule, rules of both families are kept together and split by it
+    if (ipv6) result = " -6 ";
+
     if (test->ifaceIsImq(class_iface)) filter_iface_required = true;
 
     // filters which need to be ahead of others 
@@ -431,11 +967,12 @@ int Iptables::genFilterFromNSMatch (std::string src, EnumFlowDirection class_flo
         result += " ";  // Leading whitespace       
         if (param == "proto") {
             if ((value != "tcp") && (value != "udp") && (value != "icmp")) { log->error(67, src); return -1; }
-            result += "-p " + value;
+            if (ipv6 && (value == "icmp")) result += "-p ipv6-icmp";
+            else result += "-p " + value;
             proto_defined = true;
         }
         else if (param == "from-local") {
-            if (!test->validIp(value)) { 
+            if (ipv6 ? !test->validIp6(value) : !test->validIp(value)) { 
                 log->error(29, value);
                 log->error(60, src); 
                 return -1; 
@@ -444,12 +981,12 @@ int Iptables::genFilterFromNSMatch (std::string src, EnumFlowDirection class_flo
             result += " -s " + value;
         }
         else if (param == "to-local") {
-            if (!test->validIp(value)) { 
+            if (ipv6 ? !test->validIp6(value) : !test->validIp(value)) { 
                 log->error(29, value); 
                 log->error(60, src);
                 return -1; 
             }
-            if (!test->ifaceIsImq(class_iface)) { 
+            if (!test->ifaceIsImq(class_iface) && ifaces->ingressOf(class_iface).empty()) { 
                 log->error(865, src); 
                 return -1; 
             }
@@ -556,13 +1093,16 @@ int Iptables::genFilterFromNSMatch (std::string src, EnumFlowDirection class_flo
             result += "-m tos --tos " + value;
         }
         else if ( param == "ttl-lower" ) {
-            result += "-m ttl --ttl-lt " + value;
+            if (ipv6) result += "-m hl --hl-lt " + value;
+            else result += "-m ttl --ttl-lt " + value;
         }
         else if ( param == "ttl-greater" ) {
-            result +=  "-m ttl --ttl-gt " + value;
+            if (ipv6) result += "-m hl --hl-gt " + value;
+            else result +=  "-m ttl --ttl-gt " + value;
         }
         else if ( param == "ttl" ) {
-            result += "-m ttl --ttl " + value;
+            if (ipv6) result += "-m hl --hl-eq " + value;
+            else result += "-m ttl --ttl " + value;
         }    
         else if ( param == "mark" ) {
             if (override_test_mark.empty()) result += "-m mark --mark " + value;
@@ -583,7 +1123,10 @@ int Iptables::genFilterFromNSMatch (std::string src, EnumFlowDirection class_flo
         return -1; 
     }
 
-    if (filter_iface.empty()) {
+    if (filter_iface.empty() && ifaces->ingressOf(class_iface).size()) {
+        result += " -i " + ifaces->ingressOf(class_iface);
+    }
+    else if (filter_iface.empty()) {
         if (hook_behaviour == "PREROUTING") result += " ! -i " + class_iface;
         else if (hook_behaviour == "POSTROUTING") result += " -o " + class_iface;
     }
@@ -594,14 +1137,13 @@ int Iptables::genFilterFromNSMatch (std::string src, EnumFlowDirection class_flo
 
 int Iptables::checkTraffic(EnumFlowDirection flow_direction, unsigned int worker_vid, std::vector <__u64> &section_ordered_counters, std::vector <__u64> &section_ordered_counters_dnsw)
 {
-    char cbuf[MAX_LONG_BUF_SIZE];
     std::string chain;
     std::vector <unsigned int> *assign_helper_ptr;
-    std::vector <std::string> *chain_raw_counters_ptr;
+    std::vector <__u64> *chain_raw_counters_ptr;
+    std::vector <__u64> packets;
     struct timeval tv_curr, *tv_prev_ptr;
     unsigned int duration_time;
     unsigned int chain_raw_counters_pos;
-    FILE *fp;
 
     if (flow_direction == DWLOAD) {
         chain = ChainDwload;
@@ -625,21 +1167,11 @@ int Iptables::checkTraffic(EnumFlowDirection flow_direction, unsigned int worker
 
     if (duration_time >= CacheExpireUsec) {
         *tv_prev_ptr = tv_curr;
-        (*chain_raw_counters_ptr).clear();
-        fp = popen(("iptables -t mangle -L " + chain + " -vnx").c_str(), "r");
-        for (unsigned int n=1; n<=2; n++) {
-            if (fgets(cbuf, MAX_LONG_BUF_SIZE, fp) == NULL) {
-                log->error(12); 
-                log->setReqRecoverIpt(true);
-                pclose(fp);
-                return -1;
-            }
-        }
-
-        while (fgets(cbuf, MAX_LONG_BUF_SIZE, fp)) {
-            (*chain_raw_counters_ptr).push_back(aux::awk(std::string(cbuf), 2));
+        if (chainCounters(chain, packets, *chain_raw_counters_ptr) == -1) {
+            log->error(12, chain);
+            log->setReqRecoverIpt(true);
+            return -1;
         }
-        pclose(fp);
     }
 
     chain_raw_counters_pos = 0;
@@ -653,10 +1185,10 @@ int Iptables::checkTraffic(EnumFlowDirection flow_direction, unsigned int worker
         }
 
         if (assign_helper_ptr->at(n) == worker_vid) {
-            section_ordered_counters.push_back(aux::str_to_u64(chain_raw_counters_ptr->at(chain_raw_counters_pos)));
+            section_ordered_counters.push_back(chain_raw_counters_ptr->at(chain_raw_counters_pos));
         }
         else if (config->getStatusShowDoNotShape() && (assign_helper_ptr->at(n) == 0)) {
-            section_ordered_counters_dnsw.push_back(aux::str_to_u64(chain_raw_counters_ptr->at(chain_raw_counters_pos)));
+            section_ordered_counters_dnsw.push_back(chain_raw_counters_ptr->at(chain_raw_counters_pos));
         }
 
         n++;
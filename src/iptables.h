@@ -1,6 +1,7 @@
 #ifndef IPTABLES_H
 #define IPTABLES_H
 
+#include <map>
 #include <string>
 #include <vector>
 
@@ -8,6 +9,8 @@
 
 #include "worker.h"
 
+class NfTables;
+
 class Iptables {
     public:
         Iptables();
@@ -23,23 +26,65 @@ class Iptables {
         //
         int prepare(std::vector <std::string> &, std::vector <Worker *> &);
         int init();
+        int reload(std::vector <std::string> &, std::vector <Worker *> &, bool, bool, bool, bool);
+        int validate(std::vector <std::string> &, std::vector <Worker *> &, bool, bool);
         int prepareRules(std::vector <std::string> &, std::vector <Worker *> &);
         int genRulesFromNSMatch(std::string, unsigned int, enum EnumNsClassType NsClassType, EnumFlowDirection, std::string);
         int genFilterFromNSMatch(std::string, EnumFlowDirection, std::string, std::string, std::string, std::string &);
         int checkTraffic(EnumFlowDirection, unsigned int, std::vector <__u64> &, std::vector <__u64> &);
     private:
-        int execSysCmd(std::string);
+        // Rule of a single host, such rules are compiled into a set in nf_tables
+        struct NftHost {
+            std::string Chain;
+            std::string Field;
+            __u32 Addr;
+            std::string Iface;
+            std::string Target;
+            bool Marking;
+            __u32 Mark;
+        };
+        // Set of hosts which replaces a run of their rules, with a counter per host
+        struct NftSet {
+            std::string Name;
+            std::string Chain;
+            std::string Group;
+            bool Map;
+            std::vector <__u32> Keys, Marks;
+            std::vector <__u64> Packets, Bytes;
+        };
+        // Where the counter of a chain rule is kept, a rule position or a host address in a set
+        struct NftSlot {
+            int Set;
+            __u32 Index;
+            bool Shadowed;
+        };
+        //
+        bool familyRule(std::string, bool);
+        void chainFamilies(std::string, bool &, bool &);
+        int saveForeignRules(std::vector <std::string> &, bool);
+        int restoreRules(std::vector <std::string> &, std::string, bool);
+        int writeBatchFile(std::vector <std::string> &, std::string);
+        int nftReplace(std::vector <std::string> &);
+        int nftRemove();
+        int nftHostRule(std::string, NftHost &);
+        int nftChainCounters(std::string, std::vector <__u64> &, std::vector <__u64> &);
+        int readChainCounters(std::string, std::vector <std::string> &);
+        int chainCounters(std::string, std::vector <__u64> &, std::vector <__u64> &);
+        int listChain(std::string, bool, std::vector <__u64> &, std::vector <__u64> &);
         //
         std::string HookDwload, HookUpload;
         std::string ChainDwload, ChainUpload;
+        std::string NftTable;
         std::string Target;
         bool RequiredForDwload, RequiredForUpload;
         bool RequiredForCheckDwload, RequiredForCheckUpload;
         std::vector <std::string> Rules;
-        std::vector <std::string> RulesDestroy;
         std::vector <unsigned int> AssignHelperDwload, AssignHelperUpload;
         struct timeval TVChainDwloadPrev, TVChainUploadPrev;
-        std::vector <std::string> ChainRawCountersDwload, ChainRawCountersUpload;
+        std::vector <__u64> ChainRawCountersDwload, ChainRawCountersUpload;
+        NfTables *Nft;
+        std::vector <NftSet> NftSets;
+        std::map <std::string, std::vector <NftSlot> > NftSlots;
         bool Debug;
         bool Fallback;        
         bool Initialized;
@@ -202,8 +202,8 @@ RTNetlink::rtnl_dump_filter(struct rtnl_handle *rth,
                                 return -1;
                         }
 
-                        // err = filter(&nladdr, h, arg1);
-                        if (qos_scope_object == QOS_CLASS) err = sys->qosCheckClassesBytes(&nladdr, h);
+                        if (filter) err = filter(&nladdr, h, arg1);
+                        else if (qos_scope_object == QOS_CLASS) err = sys->qosCheckClassesBytes(&nladdr, h);
                         else if (qos_scope_object == QOS_FILTER) err = sys->qosCheckFiltersHits(&nladdr, h);
                         else err = -1;
 
@@ -414,6 +414,55 @@ RTNetlink::rtnl_listen(struct rtnl_handle *rtnl,
         }
 }
 
+/*
+ * Non blocking variant of rtnl_listen, returns when the socket is drained.
+ * Lost notifications (ENOBUFS) are reported, caller has to dump state again.
+ */
+int
+RTNetlink::rtnl_listen_pending(struct rtnl_handle *rtnl,
+              int (*handler)(struct sockaddr_nl *,struct nlmsghdr *n, void *),
+              void *jarg)
+{
+        int status;
+        struct nlmsghdr *h;
+        struct sockaddr_nl nladdr;
+        struct iovec iov;
+        char   buf[8192];
+        struct msghdr msg = {
+                (void*)&nladdr, sizeof(nladdr),
+                &iov,   1,
+                NULL,   0,
+                0
+        };
+
+        iov.iov_base = buf;
+        iov.iov_len = sizeof(buf);
+
+        while (1) {
+                status = recvmsg(rtnl->fd, &msg, MSG_DONTWAIT);
+
+                if (status < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                                return 0;
+                        return -1;
+                }
+                if (status == 0) {
+                        log->error(52, "EOF on netlink");
+                        return -1;
+                }
+                if (msg.msg_flags & MSG_TRUNC) {
+                        log->error(52, "Message truncated");
+                        return -1;
+                }
+                for (h = (struct nlmsghdr*)buf; NLMSG_OK(h, (size_t)status); h = NLMSG_NEXT(h, status)) {
+                        if (handler(&nladdr, h, jarg) < 0)
+                                return -1;
+                }
+        }
+}
+
 int
 RTNetlink::rtnl_ask(rtnl_handle* rtnl, struct iovec *iov, size_t iovlen,
                                 struct rtnl_dialog *d, char *buf, int len)
@@ -522,7 +571,7 @@ RTNetlink::rtnl_wait(rtnl_handle *rth, struct rtnl_dialog *d, int *err)
                                 if (n->nlmsg_len < NLMSG_LENGTH(sizeof(struct nlmsgerr))) {
                                         log->error(52, "ERROR truncated");
                                         errno = EINVAL;
-                                } else if (e->error == 0) {
+                                } else if ((e->error == 0) || (rth->ignore_errno && (e->error == -rth->ignore_errno))) {
                                         *err = 0;
                                         return NULL;
                                 } else {
@@ -42,6 +42,7 @@ class RTNetlink
                 struct sockaddr_nl      peer;
                 __u32                   seq;
                 __u32                   dump;
+                int                     ignore_errno;   // Answer treated as success, e.g. ENOENT while clearing
         };
 
         struct rtnl_dialog
@@ -81,6 +82,8 @@ class RTNetlink
 
         static int rtnl_listen(struct rtnl_handle *, int (*handler)(struct sockaddr_nl *,struct nlmsghdr *n, void *),
                                void *jarg);
+        static int rtnl_listen_pending(struct rtnl_handle *, int (*handler)(struct sockaddr_nl *,struct nlmsghdr *n, void *),
+                               void *jarg);
         static int rtnl_ask(rtnl_handle *rtnl, struct iovec *iov, size_t iovlen,
                                         struct rtnl_dialog *d, char *buf, int len);
         static struct nlmsghdr* rtnl_wait(rtnl_handle *rth, struct rtnl_dialog *d, int *err);
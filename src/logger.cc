@@ -31,6 +31,7 @@ Logger::Logger ()
     DoNotPutNewLineChar = false;
     MissingNewLineChar = false;
     LogFile = "";
+    pthread_mutex_init(&DumpLock, NULL);
     //
     ReqRecoverQos = false;
     ReqRecoverIpt = false;
@@ -39,7 +40,7 @@ Logger::Logger ()
 
 Logger::~Logger ()
 {
-    // Nothing
+    pthread_mutex_destroy(&DumpLock);
 }
 
 std::string Logger::getErrorMessage(int mesid)
@@ -163,6 +164,12 @@ std::string Logger::getErrorMessage(int mesid)
     else if ((mesid == 75) && (Lang == EN)) message = "Bad filter. Filter interface must be identical as a class's network interface";
     else if ((mesid == 76) && (Lang == PL_UTF8)) message = "Niepoprawny filtr. Interfejs sieciowy testu in-iface nie może być taki sam jak interfejs klasy";
     else if ((mesid == 76) && (Lang == EN)) message = "Bad filter. The in-iface test interface must not be identical to the class interface";
+    else if ((mesid == 77) && (Lang == PL_UTF8)) message = "Niepoprawny filtr. Adresy IPv4 i IPv6 nie mogą być użyte w jednym teście match";
+    else if ((mesid == 77) && (Lang == EN)) message = "Bad filter. IPv4 and IPv6 addresses can't be used within one match";
+    else if ((mesid == 78) && (Lang == PL_UTF8)) message = "Niepoprawny filtr. Adresy IPv6 wymagają podsieci IPv6 w dyrektywie local-subnets";
+    else if ((mesid == 78) && (Lang == EN)) message = "Bad filter. IPv6 addresses require an IPv6 subnet within local-subnets directive";
+    else if ((mesid == 79) && (Lang == PL_UTF8)) message = "Parametr section reload-min nie może być większy, a reload-max mniejszy od wartości reload";
+    else if ((mesid == 79) && (Lang == EN)) message = "Section reload-min must not be bigger and reload-max must not be smaller than reload value";
     // General configuration messages
     else if ((mesid == 101) && ( Lang == PL_UTF8 )) message = "Nieznany parametr lub wartość";
     else if ((mesid == 101) && ( Lang == EN )) message = "Unknown parameter or value";
@@ -203,6 +210,12 @@ std::string Logger::getErrorMessage(int mesid)
     else if ((mesid == 313) && ( Lang == EN )) message = "Communication error. Message too long";
     else if ((mesid == 314) && ( Lang == PL_UTF8 )) message = "Błąd komunikacji. Niepoprawne dane do wysłania";
     else if ((mesid == 314) && ( Lang == EN )) message = "Communication error. Unexpected datas to send";
+    else if ((mesid == 315) && ( Lang == PL_UTF8 )) message = "Publikowanie statusu w pamięci współdzielonej nie jest skonfigurowane, użyj status shm";
+    else if ((mesid == 315) && ( Lang == EN )) message = "Status publishing in shared memory isn't configured, use status shm";
+    else if ((mesid == 316) && ( Lang == PL_UTF8 )) message = "Nie można dołączyć segmentu pamięci współdzielonej statusu";
+    else if ((mesid == 316) && ( Lang == EN )) message = "Can't attach status shared memory segment";
+    else if ((mesid == 317) && ( Lang == PL_UTF8 )) message = "Nie można odczytać spójnego stanu z segmentu pamięci współdzielonej statusu";
+    else if ((mesid == 317) && ( Lang == EN )) message = "Can't read consistent snapshot of status shared memory segment";
     // Process and threads management
     else if ((mesid == 401) && ( Lang == PL_UTF8 )) message = "Utworzenie procesu potomnego zakończone niepowodzeniem. Problem systemowy";
     else if ((mesid == 401) && ( Lang == EN )) message = "Error occurred on fork process. System problem";
@@ -216,6 +229,8 @@ std::string Logger::getErrorMessage(int mesid)
     else if ((mesid == 405) && ( Lang == EN )) message = "Could not create the status writer thread. Serious system problem";
     else if ((mesid == 406) && ( Lang == PL_UTF8 )) message = "Utworzenie mutexa dla sterowania wątkami zakończone niepowodzeniem. Poważny problem systemu operacyjnego";
     else if ((mesid == 406) && ( Lang == EN )) message = "Threads Control Mutex init failed. Serious system problem";
+    else if ((mesid == 407) && ( Lang == PL_UTF8 )) message = "Utworzenie wątku obsługi zapisu liczników quoty zakończone niepowodzeniem. Poważny problem systemu operacyjnego";
+    else if ((mesid == 407) && ( Lang == EN )) message = "Could not create the quota counters writer thread. Serious system problem";
     // QOS
     else if ((mesid == 501) && ( Lang == PL_UTF8 )) message = "Wykryto szkodzenie w strukturze HTB";
     else if ((mesid == 501) && ( Lang == EN )) message = "Damage in HTB framework detected";
@@ -232,10 +247,14 @@ std::string Logger::getErrorMessage(int mesid)
     else if ((mesid == 703) && (Lang == EN)) message = "Missing iptables command";
     else if ((mesid == 704) && (Lang == PL_UTF8)) message = "Brak komendy tc";
     else if ((mesid == 704) && (Lang == EN)) message = "Missing tc command";
-    else if ((mesid == 705) && (Lang == PL_UTF8)) message = "Wykonanie iptables-restore zakończone niepowodzeniem. Należy spróbować z fallback iptables. W celach diagnostycznych pozostawiono wygenerowany plik batch";
-    else if ((mesid == 705) && (Lang == EN)) message = "iptables-restore error occurred. Try run again with fallback iptables directive. To diagnose batch file was not removed";
+    else if ((mesid == 705) && (Lang == PL_UTF8)) message = "Wykonanie iptables-restore zakończone niepowodzeniem, reguły nie zostały zmienione. Należy spróbować z fallback iptables. W celach diagnostycznych pozostawiono wygenerowany plik batch";
+    else if ((mesid == 705) && (Lang == EN)) message = "iptables-restore error occurred, rules were left unchanged. Try run again with fallback iptables directive. To diagnose batch file was left";
     else if ((mesid == 706) && (Lang == PL_UTF8)) message = "Niepoprawna wartość iptables target. Poprawne to ACCEPT i RETURN";
     else if ((mesid == 706) && (Lang == EN)) message = "Bad iptables target value. Must be ACCEPT or RETURN";
+    else if ((mesid == 707) && (Lang == PL_UTF8)) message = "Komunikacja z nf_tables zakończona niepowodzeniem";
+    else if ((mesid == 707) && (Lang == EN)) message = "Communication with nf_tables failed";
+    else if ((mesid == 708) && (Lang == PL_UTF8)) message = "Reguła nie może zostać zainstalowana przez nf_tables";
+    else if ((mesid == 708) && (Lang == EN)) message = "Rule can't be installed through nf_tables";
     else if ((mesid == 799) && (Lang == PL_UTF8)) message = "Wygenerowanie filtrów iptables zakończone niepowodzeniem";
     else if ((mesid == 799) && (Lang == EN)) message = "Generating iptables rules failed";
     // Bad values and configuration syntax error
@@ -249,8 +268,8 @@ std::string Logger::getErrorMessage(int mesid)
     else if ((mesid == 804) && (Lang == EN)) message = "Sections speeds sum and fallback-rate greater or equal than declared iface speed";
     else if ((mesid == 805) && (Lang == PL_UTF8)) message = "Błędna wartość parametru status rewrite. Parametr musi byc z zakresu 1s do 3600s";
     else if ((mesid == 805) && (Lang == EN)) message = "Wrong status rewrite value. Must be in range of 1s to 3600s";
-    else if ((mesid == 806) && (Lang == PL_UTF8)) message = "Wartość nie może być wyższa od " + aux::int_to_str(aux::unit_convert(MAX_RATE, MBITS)) + aux::unit_to_str(MBITS, 0) + " ani niższa od " + aux::int_to_str(aux::unit_convert(MIN_RATE, BITS)) + aux::unit_to_str(BITS, 0);
-    else if ((mesid == 806) && (Lang == EN)) message = "Value cannot be greater than " + aux::int_to_str(aux::unit_convert(MAX_RATE, MBITS)) + aux::unit_to_str(MBITS, 0) + " or less than " + aux::int_to_str(aux::unit_convert(MIN_RATE, BITS)) + aux::unit_to_str(BITS, 0);
+    else if ((mesid == 806) && (Lang == PL_UTF8)) message = "Wartość nie może być wyższa od " + aux::int_to_str(aux::unit_convert(MAX_RATE, GBITS)) + aux::unit_to_str(GBITS, 0) + " ani niższa od " + aux::int_to_str(aux::unit_convert(MIN_RATE, BITS)) + aux::unit_to_str(BITS, 0);
+    else if ((mesid == 806) && (Lang == EN)) message = "Value cannot be greater than " + aux::int_to_str(aux::unit_convert(MAX_RATE, GBITS)) + aux::unit_to_str(GBITS, 0) + " or less than " + aux::int_to_str(aux::unit_convert(MIN_RATE, BITS)) + aux::unit_to_str(BITS, 0);
     else if ((mesid == 807) && (Lang == PL_UTF8)) message = "Strict musi się mieścić w przedziale 0 do 100";
     else if ((mesid == 807) && (Lang == EN)) message = "Strict has to be a value in the range of 0 to 100";
     else if ((mesid == 808) && (Lang == PL_UTF8)) message = "Brak zdefiniowanych podsieci - brak dyrektywy local-subnets";
@@ -263,12 +282,12 @@ std::string Logger::getErrorMessage(int mesid)
     else if ((mesid == 811) && (Lang == EN)) message = "Parameter set-mark requires packet marking on class iface, use mark-on-ifaces";
     else if ((mesid == 812) && (Lang == PL_UTF8)) message = "Podany filtr wymaga markowania pakietów na interfejsie klasy - użyj mark-on-ifaces";
     else if ((mesid == 812) && (Lang == EN)) message = "Given filter requires packet marking on class interface - use mark-on-ifaces";
-    else if ((mesid == 813) && (Lang == PL_UTF8)) message = "Przekroczono dopuszczalną liczbę uruchomionych klas";
-    else if ((mesid == 813) && (Lang == EN)) message = "Allowed classes number exceeded";
     else if ((mesid == 814) && (Lang == PL_UTF8)) message = "Klasa typu wrapper wymaga parametru rate";
     else if ((mesid == 814) && (Lang == EN)) message = "Wrapper class requires the rate parameter";
     else if ((mesid == 815) && (Lang == PL_UTF8)) message = "Host w uproszczonej postaci wymaga skonfigurowanej dyrektywy auto-hosts";
     else if ((mesid == 815) && (Lang == EN)) message = "Simplified host requires the auto-hosts directive to be configured";
+    else if ((mesid == 816) && (Lang == PL_UTF8)) message = "Błędna wartość parametru quota flush-interval. Parametr musi byc z zakresu 1s do 3600s";
+    else if ((mesid == 816) && (Lang == EN)) message = "Wrong quota flush-interval value. Must be in range of 1s to 3600s";
     else if ((mesid == 850) && (Lang == PL_UTF8)) message = "Błąd składni";
     else if ((mesid == 850) && (Lang == EN)) message = "Syntax error";
     else if ((mesid == 851) && (Lang == PL_UTF8)) message = "Makra dozwolone są wyłącznie w plikach klas";
@@ -299,12 +318,22 @@ std::string Logger::getErrorMessage(int mesid)
     else if ((mesid == 863) && (Lang == EN)) message = "Classes names within the section must be unique. Duplicate detected";
     else if ((mesid == 864) && (Lang == PL_UTF8)) message = "Klasa typu virtual nie współpracuje z interfejsami IMQ";
     else if ((mesid == 864) && (Lang == EN)) message = "Virtual class doesn't work with IMQ interfaces";
-    else if ((mesid == 865) && (Lang == PL_UTF8)) message = "Test to-local wymaga interfejsu IMQ, gdyż ingress shaping nie jest obsługiwany";
-    else if ((mesid == 865) && (Lang == EN)) message = "To-local test requires IMQ interface, because ingress shaping is not supported";
+    else if ((mesid == 865) && (Lang == PL_UTF8)) message = "Test to-local wymaga interfejsu IMQ lub IFB ustawionego parametrem iface-<dev> ingress";
+    else if ((mesid == 865) && (Lang == EN)) message = "To-local test requires IMQ interface or IFB interface set by iface-<dev> ingress parameter";
     else if ((mesid == 866) && (Lang == PL_UTF8)) message = "Interfejs sieciowy nie może być współdzielony przez klasy pracujące w trybie download z klasami w trybie upload";
     else if ((mesid == 866) && (Lang == EN)) message = "Network interface can't share both download mode and upload mode classes";
     else if ((mesid == 867) && (Lang == PL_UTF8)) message = "Klasy typów wrapper oraz do-not-shape, jeśli występują samodzielnie na interfejsie (to znaczy, bez towarzystwa klas standardowych), wymagają wskazania kierunku przepływu kontrolowanego na tym interfejsie ruchu. Użyj parametru iface-<dev> mode download|upload";
     else if ((mesid == 867) && (Lang == EN)) message = "The wrapper and do-not-shape classes, if work alone on the interface (it means, not together with standard classes), require to set the flow direction of traffic controlled on this interface. Use iface-<dev> mode download|upload parameter";
+    else if ((mesid == 868) && (Lang == PL_UTF8)) message = "Zmiana interfejsów lub sekcji klas wymaga ponownego uruchomienia NiceShapera";
+    else if ((mesid == 868) && (Lang == EN)) message = "Change of classes interfaces or sections requires NiceShaper restart";
+    else if ((mesid == 869) && (Lang == PL_UTF8)) message = "Przeładowanie klas nie powiodło się, działająca konfiguracja zostaje zachowana";
+    else if ((mesid == 869) && (Lang == EN)) message = "Classes reload failed, running configuration is kept";
+    else if ((mesid == 870) && (Lang == PL_UTF8)) message = "Znakowanie pakietów (mark-on-ifaces) nie działa na interfejsie IFB, ruch trafia na niego przed iptables";
+    else if ((mesid == 870) && (Lang == EN)) message = "Packets marking (mark-on-ifaces) doesn't work on IFB interface, traffic is redirected to it before iptables";
+    else if ((mesid == 871) && (Lang == PL_UTF8)) message = "Nie udało się przekierować ruchu przychodzącego na interfejs IFB";
+    else if ((mesid == 871) && (Lang == EN)) message = "Can't redirect incoming traffic to IFB interface";
+    else if ((mesid == 872) && (Lang == PL_UTF8)) message = "Ruch przychodzący interfejsu może być przekierowany tylko na jeden interfejs IFB, a na interfejs IFB tylko z jednego interfejsu";
+    else if ((mesid == 872) && (Lang == EN)) message = "Incoming traffic of interface can be redirected to one IFB interface only and IFB interface can be fed by one interface only";
     // Internal errors
     else if ((mesid == 998) && (Lang == PL_UTF8)) message = "Błąd wewnętrzny. Nie można było ustalić trybu klasy";
     else if ((mesid == 998) && (Lang == EN)) message = "Internal error. Can't determine class mode";
@@ -341,16 +370,28 @@ std::string Logger::getWarningMessage (int mesid)
     else if (( mesid == 12 ) && ( Lang == EN )) message = "Wrong unit, using b/s instead";
     else if (( mesid == 13 ) && ( Lang == PL_UTF8 )) message = "Błędna jednostka quoty, zostanie użyte MB";
     else if (( mesid == 13 ) && ( Lang == EN )) message = "Wrong quota unit, using MB instead";
-    else if (( mesid == 14 ) && (Lang == PL_UTF8)) message = "Liczniki wyzwalacza quota nie będą zapisywane a inicjalizacja reguł iptables, przechodzi w znacznie wolniejszy tryb fallback! Brakujący ważny katalog";
-    else if (( mesid == 14 ) && (Lang == EN)) message = "Quota counters will be lost after restart. Iptables initialization switched to fallback mode, thus will be much slower! Missing important directory";
-    else if (( mesid == 15 ) && (Lang == PL_UTF8)) message = "Polecenie iptables-restore nie zostanie użyte! Nie można utworzyć pliku";
-    else if (( mesid == 15 ) && (Lang == EN)) message = "The iptables-restore command won't be used! Can't create file";
-    else if (( mesid == 16 ) && (Lang == PL_UTF8)) message = "Tryb szybkiego startu nie zostanie użyty! Brak wymaganego pliku binarnego iptables-save";
-    else if (( mesid == 16 ) && (Lang == EN)) message = "Fallback to slow start method! Missing required iptables-save executable";
-    else if (( mesid == 17 ) && (Lang == PL_UTF8)) message = "Tryb szybkiego startu nie zostanie użyty! Brak wymaganego pliku binarnego iptables-restore";
-    else if (( mesid == 17 ) && (Lang == EN)) message = "Fallback to slow start method! Missing required iptables-restore executable";
+    else if (( mesid == 14 ) && (Lang == PL_UTF8)) message = "Liczniki wyzwalacza quota nie będą zapisywane! Brakujący ważny katalog";
+    else if (( mesid == 14 ) && (Lang == EN)) message = "Quota counters will be lost after restart! Missing important directory";
+    else if (( mesid == 15 ) && (Lang == PL_UTF8)) message = "Plik batch reguł iptables nie zostanie pozostawiony w celach diagnostycznych! Nie można utworzyć pliku";
+    else if (( mesid == 15 ) && (Lang == EN)) message = "Batch of iptables rules won't be kept to diagnose! Can't create file";
+    else if (( mesid == 16 ) && (Lang == PL_UTF8)) message = "Reguły zostaną zainstalowane bezpośrednio przez nf_tables! Brak wymaganego pliku binarnego iptables-save";
+    else if (( mesid == 16 ) && (Lang == EN)) message = "Rules will be installed directly through nf_tables! Missing required iptables-save executable";
+    else if (( mesid == 17 ) && (Lang == PL_UTF8)) message = "Reguły zostaną zainstalowane bezpośrednio przez nf_tables! Brak wymaganego pliku binarnego iptables-restore";
+    else if (( mesid == 17 ) && (Lang == EN)) message = "Rules will be installed directly through nf_tables! Missing required iptables-restore executable";
     else if (( mesid == 18 ) && ( Lang == PL_UTF8 )) message = "Dyrektywa oraz komenda stats są przestarzałe i zastąpione przez status";
     else if (( mesid == 18 ) && ( Lang == EN )) message = "The stats directives and command are deprecated, use status instead";
+    else if (( mesid == 19 ) && ( Lang == PL_UTF8 )) message = "Status nie będzie publikowany w pamięci współdzielonej! Nie można utworzyć segmentu";
+    else if (( mesid == 19 ) && ( Lang == EN )) message = "Status won't be published in shared memory! Can't create segment";
+    else if (( mesid == 20 ) && ( Lang == PL_UTF8 )) message = "Pominięto uszkodzone wpisy dziennika liczników quoty";
+    else if (( mesid == 20 ) && ( Lang == EN )) message = "Damaged records of quota counters journal are skipped";
+    else if (( mesid == 21 ) && ( Lang == PL_UTF8 )) message = "Nie można zapisać pamięci podręcznej pliku klas";
+    else if (( mesid == 21 ) && ( Lang == EN )) message = "Can't write classes file cache";
+    else if (( mesid == 22 ) && ( Lang == PL_UTF8 )) message = "Wszystkie identyfikatory klas interfejsu są zajęte, klasa czeka na zwolnienie któregoś z nich";
+    else if (( mesid == 22 ) && ( Lang == EN )) message = "All class ids of the interface are in use, class waits until one of them is freed";
+    else if (( mesid == 23 ) && ( Lang == PL_UTF8 )) message = "Nie można nasłuchiwać zdarzeń conntrack (nf_conntrack_netlink), klasy będą aktywowane w kolejnych cyklach";
+    else if (( mesid == 23 ) && ( Lang == EN )) message = "Can't listen to conntrack events (nf_conntrack_netlink), classes will be activated by rounds";
+    else if (( mesid == 24 ) && ( Lang == PL_UTF8 )) message = "Przy ruchu IPv6 liczniki reguł są odczytywane osobno przez iptables i ip6tables, zalecane jest iptables backend nftables";
+    else if (( mesid == 24 ) && ( Lang == EN )) message = "With IPv6 traffic rules counters are read by iptables and ip6tables separately, iptables backend nftables is recommended";
     else if ( Lang == PL_UTF8 ) message = "Nieznane ostrzeżenie";
     else message = "Unknown warning";
 
@@ -387,11 +428,21 @@ std::string Logger::getInfoMessage (int mesid)
     else if (( mesid == 12 ) && ( Lang == EN )) message = "Starting recovery procedure";
     else if (( mesid == 13 ) && ( Lang == PL_UTF8 )) message = "Procedura odzyskiwania zakończona sukcesem";
     else if (( mesid == 13 ) && ( Lang == EN )) message = "Recovery procedure proceeded successfully";
+    else if (( mesid == 14 ) && ( Lang == PL_UTF8 )) message = "Przeładowanie klas";
+    else if (( mesid == 14 ) && ( Lang == EN )) message = "Reloading classes";
+    else if (( mesid == 15 ) && ( Lang == PL_UTF8 )) message = "Klasy przeładowane, niezmienione/wszystkie";
+    else if (( mesid == 15 ) && ( Lang == EN )) message = "Classes reloaded, unchanged/all";
+    else if (( mesid == 16 ) && ( Lang == PL_UTF8 )) message = "Zlecono przeładowanie klas, wynik trafi do logu działającego NiceShapera";
+    else if (( mesid == 16 ) && ( Lang == EN )) message = "Classes reload requested, the result goes to the log of running NiceShaper";
+    else if (( mesid == 17 ) && ( Lang == PL_UTF8 )) message = "Plik klas wczytany z pamięci podręcznej";
+    else if (( mesid == 17 ) && ( Lang == EN )) message = "Classes file loaded from cache";
+    else if (( mesid == 18 ) && ( Lang == PL_UTF8 )) message = "Raport pamięci - obiekty żywe/zajęta pamięć";
+    else if (( mesid == 18 ) && ( Lang == EN )) message = "Memory report - alive objects/memory taken";
     else if (( mesid == 45 ) && ( Lang == PL_UTF8 )) message = "NiceShaper nie jest uruchomiony";
     else if (( mesid == 45 ) && ( Lang == EN )) message = "NiceShaper is not running";
     // 
-    else if (( mesid == 100 ) && ( Lang == PL_UTF8 )) message = "Ze względu na użytą dyrektywę debug iptables, plik inicjujący reguły iptables nie zostanie usunięty";
-    else if (( mesid == 100 ) && ( Lang == EN )) message = "Iptables initialization script won't be removed because of debug iptables directive";
+    else if (( mesid == 100 ) && ( Lang == PL_UTF8 )) message = "Ze względu na użytą dyrektywę debug iptables, plik batch reguł iptables został zachowany";
+    else if (( mesid == 100 ) && ( Lang == EN )) message = "Batch of iptables rules is kept because of debug iptables directive";
     else if ( Lang == PL_UTF8 ) message = "Nieznany komunikat";
     else message = "Unknown information";
     
@@ -476,9 +527,12 @@ void Logger::dump (std::string section_name, std::string message, std::string ex
     if (explanation.size()) result += ": " + explanation + ".";
     else result += ".";
 
+    // Sections are prepared in parallel threads at start
+    pthread_mutex_lock(&DumpLock);
     if (LogOnTerminal) onTerminal( result );
     if (LogToSyslog) toSyslog( result );
     if (LogToFile) toLogFile( result );
+    pthread_mutex_unlock(&DumpLock);
 }
 
 void Logger::setLogFile (std::string log_file) 
@@ -541,7 +595,7 @@ void Logger::dumpHelp()
 {
     dumpFooter();
 
-    onTerminal ( "  Usage: niceshaper {start|stop|restart|status|show} [options]              ");
+    onTerminal ( "  Usage: niceshaper {start|stop|restart|reload|status|show} [options]       ");
     onTerminal ( "                                                                            ");
     onTerminal ( "  start|restart options:                                                    ");
     onTerminal ( "  --confdir </path>          - overwrite configuration directory location   ");
@@ -549,6 +603,8 @@ void Logger::dumpHelp()
     onTerminal ( "  --classfile <path>         - overwrite classes file path                  ");
     onTerminal ( "  --no-daemon                - don't move the process into the background   ");
     onTerminal ( "                                                                            ");
+    onTerminal ( "  reload - apply changed classes file without restart (also on SIGHUP)      ");
+    onTerminal ( "                                                                            ");
     onTerminal ( "  status|show - remote niceshaper access options:                           ");
     onTerminal ( "  --remote <ip[:port]>       - connect to remote NiceShaper                 ");
     onTerminal ( "                               (must be configured with status listen)      ");
@@ -557,6 +613,7 @@ void Logger::dumpHelp()
     onTerminal ( "  status options:                                                           ");
     onTerminal ( "  --unit <unit>              - overwrite configured status unit             ");
     onTerminal ( "  --watch <1-60>             - monitor status with given in seconds interval");
+    onTerminal ( "  --source {listener|shm}    - read status from listener or shared memory   ");
     onTerminal ( "                                                                            ");
     onTerminal ( "  show options:                                                             ");
     onTerminal ( "  --running {config|classes} - dump running configuration or classes        ");
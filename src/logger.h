@@ -1,6 +1,8 @@
 #ifndef LOGGER_H
 #define LOGGER_H
 
+#include <pthread.h>
+
 #include <string>
 #include <iostream>
 
@@ -55,6 +57,7 @@ class Logger
         bool DoNotPutNewLineChar;
         bool MissingNewLineChar;
         std::string LogFile;
+        pthread_mutex_t DumpLock;
         //
         bool ReqRecoverQos;
         bool ReqRecoverIpt;
@@ -11,10 +11,12 @@
 #include "main.h"
 
 #include <cstdlib>
+#include <cstring>
 #include <sys/types.h>
 #include <signal.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
@@ -22,25 +24,30 @@
 
 #include <iostream>
 #include <fstream>
+#include <iomanip>
 #include <string>
 #include <vector>
 
+#include "arena.h"
 #include "aux.h"
 #include "config.h"
 #include "ifaces.h"
 #include "iptables.h"
 #include "logger.h"
+#include "shmstatus.h"
 #include "supervisor.h"
 #include "talk.h"
 #include "tests.h"
 
 int starter(bool, std::vector <std::string> &, std::vector <std::string> &);
-int controller(std::string, std::string, std::string, std::string, int, std::string);
-int read_cmdline_params (std::vector <std::string>, bool &, std::string &, std::string &, std::string &, int &, std::string &);
+int controller(std::string, std::string, std::string, std::string, int, std::string, std::string);
+int shm_status_reader(std::string, int);
+int read_cmdline_params (std::vector <std::string>, bool &, std::string &, std::string &, std::string &, int &, std::string &, std::string &);
 int proceed_global_config (std::vector <std::string> &);
 void sig_exit_daemonizer_ok(int);
 void sig_exit_daemonizer_error(int);
 void sig_exit_supervisor(int);
+void sig_reload_supervisor(int);
 int get_rid_of_unused(int unused) { return unused; } // To get rid of inproper compiler warnings
 
 // Externs 
@@ -48,6 +55,7 @@ class Config *config;
 class IfacesMap *ifaces;
 class Iptables *ipt;
 class Logger *log;
+class StringPool *strpool;
 class Sys *sys;
 class Tests *test;
 
@@ -58,6 +66,7 @@ std::string conffile = confdir + "/config.conf";
 std::string classfile = confdir + "/class.conf";
 std::string vardir = "/var/lib/niceshaper";
 std::string iptfile = vardir + "/iptsaverestore.ipt";
+std::string ip6tfile = vardir + "/ip6tsaverestore.ipt";
 std::string svinfofile = vardir + "/supervisor.info";
 
 bool g_devmode = false;
@@ -75,6 +84,7 @@ int main(int argc, char *argv[])
     std::string runtime_param_status_unit = "";
     int runtime_param_status_watch = 0;
     std::string runtime_param_show_running = "";
+    std::string runtime_param_status_source = "";
     char *env_lang = getenv("LANG");
     std::vector <std::string> fpv_conffile;
     std::vector <std::string> fpv_classfile;
@@ -96,11 +106,11 @@ int main(int argc, char *argv[])
     runtime_cmd = runtime_params.at(1);
 
     // Get command line parameters
-    if (read_cmdline_params (runtime_params, runtime_param_daemon_mode, runtime_param_remote_address, runtime_param_remote_password, runtime_param_status_unit, runtime_param_status_watch, runtime_param_show_running) == -1) {
+    if (read_cmdline_params (runtime_params, runtime_param_daemon_mode, runtime_param_remote_address, runtime_param_remote_password, runtime_param_status_unit, runtime_param_status_watch, runtime_param_show_running, runtime_param_status_source) == -1) {
         exit(-1);
     }
 
-    if ((getuid() != 0) && (geteuid() != 0) && !((runtime_cmd == "status") && (runtime_param_remote_address.size()))) {
+    if ((getuid() != 0) && (geteuid() != 0) && !((runtime_cmd == "status") && (runtime_param_remote_address.size() || (runtime_param_status_source == "shm")))) {
         log->error(404);
         exit(-1);
     }
@@ -108,6 +118,7 @@ int main(int argc, char *argv[])
     config = new Config;
     ifaces = new IfacesMap;
     ipt = new Iptables;
+    strpool = new StringPool;
     sys = new Sys;
     test = new Tests;
 
@@ -115,13 +126,13 @@ int main(int argc, char *argv[])
     if (config->convertToFpv (confdir, conffile, CONFTYPE, fpv_conffile) == -1) exit (-1);
 
     if (proceed_global_config(fpv_conffile) == -1) {
-        if ((runtime_cmd != "status") && (runtime_cmd != "stats") && (runtime_cmd != "show") && (runtime_cmd != "stop")) exit (-1);
+        if ((runtime_cmd != "status") && (runtime_cmd != "stats") && (runtime_cmd != "show") && (runtime_cmd != "stop") && (runtime_cmd != "reload")) exit (-1);
     }
 
     if (config->removeConfTypeGarbage (fpv_conffile) == -1) exit (-1);
 
-    if ((runtime_cmd == "status") || (runtime_cmd == "stats") || (runtime_cmd == "show") || (runtime_cmd == "stop") || (runtime_cmd == "restart")) {
-        if (controller (runtime_cmd, runtime_param_remote_address, runtime_param_remote_password, runtime_param_status_unit, runtime_param_status_watch, runtime_param_show_running) == -1) exit (-1);
+    if ((runtime_cmd == "status") || (runtime_cmd == "stats") || (runtime_cmd == "show") || (runtime_cmd == "stop") || (runtime_cmd == "restart") || (runtime_cmd == "reload")) {
+        if (controller (runtime_cmd, runtime_param_remote_address, runtime_param_remote_password, runtime_param_status_unit, runtime_param_status_watch, runtime_param_show_running, runtime_param_status_source) == -1) exit (-1);
         if (runtime_cmd != "restart") exit (0);
     }
 
@@ -137,16 +148,19 @@ int main(int argc, char *argv[])
 
 int starter(bool runtime_param_daemon_mode, std::vector <std::string> &fpv_conffile, std::vector <std::string> &fpv_classfile)
 {
+    std::vector <std::string> fpv_classfile_prev;
     int fork_result;
 
     if (access(pidfile.c_str(), 0) == 0) { log->error(44); return -1; } // NiceShaper already running
 
     log->info(5);
 
-    if (config->convertToFpv (confdir, classfile, CLASSTYPE, fpv_classfile) == -1) return -1;
+    // Development builds measure classes file loading, which extends shaping outage on every restart
+    if (g_devmode) test->timerReset();
 
-    if (config->addIDs(fpv_classfile) == -1) return -1;
-    if (config->reOrder(fpv_classfile) == -1) return -1;
+    if (config->loadClassFile (confdir, classfile, fpv_classfile, fpv_classfile_prev) == -1) return -1;
+
+    if (g_devmode) test->timerPrint();
 
     if (runtime_param_daemon_mode) {
         fork_result = fork();
@@ -170,6 +184,7 @@ int starter(bool runtime_param_daemon_mode, std::vector <std::string> &fpv_conff
 
     signal (SIGTERM, sig_exit_supervisor);
     signal (SIGINT, sig_exit_supervisor);
+    signal (SIGHUP, sig_reload_supervisor);
 
     if (supervisor->init() == -1) {
         if (runtime_param_daemon_mode) kill (getppid(), SIGUSR2);
@@ -202,7 +217,7 @@ int starter(bool runtime_param_daemon_mode, std::vector <std::string> &fpv_conff
     return 0;
 }
 
-int controller(std::string runtime_cmd, std::string runtime_param_remote_address, std::string runtime_param_remote_password, std::string runtime_param_status_unit, int runtime_param_status_watch, std::string runtime_param_show_running)
+int controller(std::string runtime_cmd, std::string runtime_param_remote_address, std::string runtime_param_remote_password, std::string runtime_param_status_unit, int runtime_param_status_watch, std::string runtime_param_show_running, std::string runtime_param_status_source)
 {
     std::vector <std::string> result_vector;
     std::string request = "";
@@ -211,12 +226,19 @@ int controller(std::string runtime_cmd, std::string runtime_param_remote_address
     int dpid;
     int connection_socket;
     struct sockaddr_in address;
+    struct sockaddr_un unix_address;
+    std::string socket_path = "";
     class Talk *talk;
     unsigned int dots_count = 0;
 
     log->setLogOnTerminal(true);
 
-    if ((runtime_cmd == "status") || (runtime_cmd == "stats") || (runtime_cmd == "show")) 
+    if ((runtime_cmd == "status") && (runtime_param_status_source == "shm"))
+    {
+        if (shm_status_reader(runtime_param_status_unit, runtime_param_status_watch) == -1) return -1;
+        exit (0);
+    }
+    else if ((runtime_cmd == "status") || (runtime_cmd == "stats") || (runtime_cmd == "show")) 
     {
         talk = new Talk;
         request = runtime_cmd;
@@ -239,6 +261,7 @@ int controller(std::string runtime_cmd, std::string runtime_param_remote_address
                 if (config->setListenerAddress(aux::awk (buf, ":", 1) + ":" + aux::awk (buf, ":", 2)) == -1) return -1;
                 if (runtime_param_remote_password.size()) request += " --password " + runtime_param_remote_password;
                 else request += " --password " + aux::awk (buf, ":", 3);
+                socket_path = aux::awk (buf, ":", 4);
             }
             else {
                 log->error (201, svinfofile);
@@ -252,20 +275,36 @@ int controller(std::string runtime_cmd, std::string runtime_param_remote_address
         do {
             result_vector.clear();
 
-            if ((connection_socket = socket (AF_INET, SOCK_STREAM, 0)) < 0 ) {
-                log->error (49, "");
-                return -1;
+            // Local socket is tried first, TCP listener is still there if it fails
+            connection_socket = -1;
+            if (socket_path.size() && (socket_path.size() < sizeof(unix_address.sun_path))) {
+                if ((connection_socket = socket (AF_UNIX, SOCK_STREAM, 0)) >= 0) {
+                    memset(&unix_address, 0, sizeof(unix_address));
+                    unix_address.sun_family = AF_UNIX;
+                    strncpy(unix_address.sun_path, socket_path.c_str(), sizeof(unix_address.sun_path)-1);
+                    if (connect(connection_socket, (struct sockaddr*)&unix_address, sizeof(unix_address)) < 0) {
+                        close (connection_socket);
+                        connection_socket = -1;
+                    }
+                }
             }
 
-            bzero((char *) &address, sizeof(address));
-            address.sin_port = htons(config->getListenerPort());
-            address.sin_addr.s_addr = inet_addr(config->getListenerIp().c_str());
-            address.sin_family = AF_INET;
+            if (connection_socket < 0) {
+                if ((connection_socket = socket (AF_INET, SOCK_STREAM, 0)) < 0 ) {
+                    log->error (49, "");
+                    return -1;
+                }
 
-            if (connect(connection_socket, (struct sockaddr*)&address, sizeof(struct sockaddr)) < 0) {
-                log->error (49, "");
-                close (connection_socket);
-                return -1;        
+                bzero((char *) &address, sizeof(address));
+                address.sin_port = htons(config->getListenerPort());
+                address.sin_addr.s_addr = inet_addr(config->getListenerIp().c_str());
+                address.sin_family = AF_INET;
+
+                if (connect(connection_socket, (struct sockaddr*)&address, sizeof(struct sockaddr)) < 0) {
+                    log->error (49, "");
+                    close (connection_socket);
+                    return -1;        
+                }
             }
 
             if (talk->sendText (connection_socket, request) == -1) {
@@ -335,12 +374,87 @@ int controller(std::string runtime_cmd, std::string runtime_param_remote_address
         log->onTerminal (log->getInfoMessage(2));
         if (runtime_cmd == "restart") return 0;
     }
+    else if (runtime_cmd == "reload")
+    {
+        if (!test->fileExists(pidfile)) { log->error(45); return -1; }
+
+        // Get supervisor pid
+        ifd.open(pidfile.c_str());
+        if (!ifd) { log->error(45); return -1;  }
+        getline(ifd, buf);
+        ifd.close();
+        dpid = aux::str_to_int(buf);
+        if (dpid <= 0) { log->error (45); return -1; }
+
+        // Result is logged by the running supervisor
+        if (kill (dpid, SIGHUP) == -1) { log->error(45); return -1; }
+        log->onTerminal (log->getInfoMessage(16));
+    }
     else return -1;
     
     exit (0);
 }
 
-int read_cmdline_params (std::vector <std::string> runtime_params, bool &daemon_mode, std::string &remote_address, std::string &remote_password, std::string &status_unit, int &status_watch, std::string &show_running)
+int shm_status_reader(std::string runtime_param_status_unit, int runtime_param_status_watch)
+{
+    std::vector <ShmStatusRecord> records;
+    struct timeval tv_update;
+    class ShmStatus *shm_status;
+    EnumUnits status_unit;
+    std::string unit, section_name;
+    const int rate_size = aux::int_to_str(MAX_RATE).size() + 4;
+    const int quota_size = 10;
+
+    if (config->getStatusShmPath().empty()) { log->error(315); return -1; }
+
+    if (runtime_param_status_unit.size()) status_unit = aux::get_unit(runtime_param_status_unit);
+    else status_unit = config->getStatusUnit();
+    unit = aux::unit_to_str(status_unit, 0);
+
+    shm_status = new ShmStatus;
+
+    if (shm_status->attach(config->getStatusShmPath()) == -1) {
+        log->error(316, config->getStatusShmPath());
+        delete shm_status;
+        return -1;
+    }
+
+    do {
+        if (shm_status->snapshot(records, tv_update) == -1) {
+            log->error(317, config->getStatusShmPath());
+            delete shm_status;
+            return -1;
+        }
+
+        if (runtime_param_status_watch) system ("clear");
+
+        section_name = "";
+        for (unsigned int n=0; n<records.size(); n++) {
+            ShmStatusRecord &record = records.at(n);
+            if (section_name != std::string(record.SectionName, strnlen(record.SectionName, sizeof(record.SectionName)))) {
+                if (section_name.size()) std::cout << std::endl;
+                section_name = std::string(record.SectionName, strnlen(record.SectionName, sizeof(record.SectionName)));
+                std::cout << std::left << std::setw(MAX_CLASS_NAME_SIZE) << section_name << std::right
+                    << std::setw(rate_size) << "ceil" << std::setw(rate_size) << "last-ceil" << std::setw(rate_size) << "last-traffic"
+                    << std::setw(8) << "active" << std::setw(quota_size) << "day" << std::setw(quota_size) << "week" << std::setw(quota_size) << "month"
+                    << std::setw(quota_size) << "backlog" << std::setw(quota_size) << "drops" << std::endl;
+            }
+            std::cout << std::left << std::setw(MAX_CLASS_NAME_SIZE) << std::string(record.Name, strnlen(record.Name, sizeof(record.Name))) << std::right
+                << std::setw(rate_size) << aux::int_to_str(aux::unit_convert(record.HtbCeil, status_unit)) + unit
+                << std::setw(rate_size) << aux::int_to_str(aux::unit_convert(record.OldHtbCeil, status_unit)) + unit
+                << std::setw(rate_size) << aux::int_to_str(aux::unit_convert(record.Traffic, status_unit)) + unit
+                << std::setw(8) << ((record.Flags & SHM_STATUS_ACTIVE) ? "yes" : "no")
+                << std::setw(quota_size) << record.QuotaDay << std::setw(quota_size) << record.QuotaWeek << std::setw(quota_size) << record.QuotaMonth
+                << std::setw(quota_size) << record.LeafBacklog << std::setw(quota_size) << record.LeafDrops << std::endl;
+        }
+    } while (runtime_param_status_watch && (usleep(runtime_param_status_watch*1000000) != -1));
+
+    delete shm_status;
+
+    return 0;
+}
+
+int read_cmdline_params (std::vector <std::string> runtime_params, bool &daemon_mode, std::string &remote_address, std::string &remote_password, std::string &status_unit, int &status_watch, std::string &show_running, std::string &status_source)
 {
     bool is_set_conffile = false;
     bool is_set_classfile = false;
@@ -389,6 +503,10 @@ int read_cmdline_params (std::vector <std::string> runtime_params, bool &daemon_
             show_running = value;
             if ((value != "config") && (value != "classes")) { log->error (28, param + " " + value); return -1; }
         }
+        else if (param == "--source") { 
+            status_source = value;
+            if ((value != "listener") && (value != "shm")) { log->error (28, param + " " + value); return -1; }
+        }
         else { log->error (28, param); return -1; }    
     }
 
@@ -408,6 +526,18 @@ int proceed_global_config (std::vector <std::string> &fpv_conffile)
             fpvi++;                                                                                    
     }*/
 
+    // IFB interfaces have to be known before any of their own parameters
+    for (fpvi=fpvi_begin; fpvi <= fpvi_end; fpvi++) {
+        option = aux::awk(*fpvi, 1);
+        param = aux::awk(*fpvi, 2);
+        value = aux::trim_dev(aux::awk(*fpvi, 3));
+        if ((aux::awk(option, "-", 1) != "iface") || (param != "ingress")) continue;
+        dev = aux::trim_dev(option.substr(option.find("-")+1, std::string::npos));
+        if (!ifaces->isValidSysDev(dev)) { log->error (16, *fpvi); return -1; }
+        if (!test->ifaceIsIfb(value)) { log->error (11, *fpvi); return -1; }
+        if (ifaces->setIngress(dev, value) == -1) { log->error (872, *fpvi); return -1; }
+    }
+
     fpvi=fpvi_begin;
     while (fpvi <= fpvi_end) {
         option = aux::awk(*fpvi, 1);
@@ -446,6 +576,14 @@ int proceed_global_config (std::vector <std::string> &fpv_conffile)
                 if ((aux::unit_convert(value, BITS) > MAX_RATE) || (aux::unit_convert(value, BITS) < MIN_RATE)) { log->error(806, *fpvi); return -1; }
                 ifaces->setFallbackRate(dev, aux::unit_convert(value, BITS));
             }   
+            else if (param == "mq") {
+                if (value == "yes") ifaces->setMq(dev, true);
+                else if (value == "no") ifaces->setMq(dev, false);
+                else { log->error (11, *fpvi); return -1; }
+            }
+            else if (param == "ingress") {
+                // Already set up
+            }
             else if (param == "mode")
             {
                 if (value == "download") {
@@ -520,6 +658,22 @@ int proceed_global_config (std::vector <std::string> &fpv_conffile)
                     return -1;
                 }
             }
+            else if (param == "file-format") {
+                if (value == "text") config->setStatusFileFormat(SF_TEXT);
+                else if (value == "csv") config->setStatusFileFormat(SF_CSV);
+                else if (value == "json") config->setStatusFileFormat(SF_JSON);
+                else { log->error(11, *fpvi); return -1; }
+            }
+            else if (param == "file-fsync") {
+                if (value == "yes") config->setStatusFileFsync(true);
+                else if (value == "no") config->setStatusFileFsync(false);
+                else { log->error(11, *fpvi); return -1; }
+            }
+            else if (param == "shm") 
+            {
+                if ((value == "no") || value.empty()) config->setStatusShmPath("");
+                else config->setStatusShmPath(value);
+            }
             else if ((param == "owner") || (param == "group") || (param == "mode") || (param == "rewrite")) {
                 log->error(155, *fpvi);
                 return -1;
@@ -532,6 +686,11 @@ int proceed_global_config (std::vector <std::string> &fpv_conffile)
             else if (param == "password") {
                 config->setListenerPassword(value);
             }
+            else if (param == "socket") {
+                if (value == "no") config->setListenerSocketPath("");
+                else if (value.size() >= sizeof(((struct sockaddr_un *)0)->sun_path)) { log->error(11, *fpvi); return -1; }
+                else config->setListenerSocketPath(value);
+            }
         } 
         else if ( option == "log" ) {
             if ( param == "terminal" ) {
@@ -583,8 +742,30 @@ int proceed_global_config (std::vector <std::string> &fpv_conffile)
                 else if (value == "no") config->setImqAutoRedirect(false);
                 else { log->error(11, *fpvi); }
             }
+            else if (param == "backend") {
+                if (value == "nftables") ipt->setFallback(true);
+                else if (value == "iptables-restore") ipt->setFallback(false);
+                else { log->error(11, *fpvi); return -1; }
+            }
             else { log->error( 11, *fpvi ); }
         }       
+        else if (option == "quota")
+        {
+            if (param == "flush-interval") {
+                if ((aux::str_to_int(value) < 1) || (aux::str_to_int(value) > 3600)) { log->error(816, *fpvi); return -1; }
+                config->setQuotaFlushInterval(aux::str_to_int(value));
+            }
+            else { log->error(11, *fpvi); return -1; }
+        }
+        else if (option == "cache")
+        {
+            if (param == "classes") {
+                if (value == "yes") config->setClassesCachePath(vardir + "/classes.cache");
+                else if (value == "no") config->setClassesCachePath("");
+                else { log->error(11, *fpvi); return -1; }
+            }
+            else { log->error(11, *fpvi); return -1; }
+        }
         else if (option == "debug")
         {
             if (param == "iptables") ipt->setDebug(true);
@@ -630,6 +811,16 @@ void sig_exit_daemonizer_error(int sig)
     exit (-1);
 }
 
+void sig_reload_supervisor(int sig)
+{
+    signal(SIGHUP, sig_reload_supervisor);
+
+    get_rid_of_unused (sig);
+
+    // Classes are reloaded by the supervisor's loop, outside of the signal handler
+    if (supervisor != NULL) supervisor->requestReload();
+}
+
 void sig_exit_supervisor(int sig)
 {
     signal(SIGTERM, sig_exit_supervisor);
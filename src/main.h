@@ -12,27 +12,34 @@ const unsigned int MAX_LONG_BUF_SIZE = 1024;
 const unsigned int MAX_SHORT_BUF_SIZE = 64;
 const unsigned int MAX_CLASS_NAME_SIZE = 20;
 const unsigned int MAX_SECTION_NAME_SIZE = 15;
-const unsigned int MAX_RATE = 1000000000;
-const unsigned int MIN_RATE = 8;
+// Rates are in bits per second and are 64-bit wide end to end (10/40/100Gb/s uplinks)
+const __u64 MAX_RATE = 100000000000ULL;
+const __u64 MIN_RATE = 8;
+const unsigned int MAX_QUANTUM = 200000; // Bytes, the same as HTB's own warning threshold
 const unsigned int MAX_CONTROLLER_HANDLERS = 2;
 const unsigned int FIRST_SECTION_ID = 0x10;
 const unsigned int FIRST_WAITINGROOM_ID = 0x100;
 const unsigned int FIRST_CLASS_ID = 0x1000;
 const unsigned int MAX_SECTIONS_COUNT = FIRST_WAITINGROOM_ID - FIRST_SECTION_ID - 0x2;
-const unsigned int MAX_CLASSES_COUNT = 0xEFFF - FIRST_CLASS_ID;
+const unsigned int LAST_CLASS_ID = 0xEFFF; // Class ids are given only to active classes, separately for each interface
 const unsigned int MAX_MACRO_SEQ = 65535;
+// Multi-queue mode builds one HTB tree per TX queue under the mq root, majors 2: and up
+const unsigned int MAX_MQ_QUEUES = 64;
+const unsigned int MQ_QUEUE_SHARE_FLOOR = 100; // Permille of class rate spread evenly over queues, thus moved flows aren't starved
+const unsigned int MQ_QUEUE_SHARE_STEP = 20; // Permille, smaller moves of the measured split don't touch the classes
  
 enum EnumNsFileType { CONFTYPE, CLASSTYPE };
-enum EnumUnits { BITS = 1, KBITS = 1000, MBITS = 1000000, BYTES = 8, KBYTES = 8000, MBYTES = 8000000 };
+enum EnumUnits { BITS = 1, KBITS = 1000, MBITS = 1000000, GBITS = 1000000000, BYTES = 8, KBYTES = 8000, MBYTES = 8000000, GBYTES = 8000000000ULL };
 enum EnumFlowDirection { DWLOAD, UPLOAD, UNSPEC };
 enum EnumNsClassType { STANDARD_CLASS, VIRTUAL, WRAPPER, DONOTSHAPE };
 enum EnumTcObjectType { QOS_CLASS, QOS_QDISC, QOS_FILTER };
-enum EnumTcQdiscType { HTB, NOQDISC, SFQ, ESFQ };
+enum EnumTcQdiscType { HTB, NOQDISC, SFQ, ESFQ, MQ, FQ_CODEL, CAKE, FQ };
 enum EnumTcFilterType { U32, FW  };
 enum EnumTcOperation { QOS_ADD, QOS_MOD, QOS_REP, QOS_DEL };
 enum EnumLang { EN, PL_UTF8 };
 enum EnumStatusShowClasses { SC_ALL, SC_ACTIVE, SC_WORKING, SC_FALSE };
 enum EnumStatusShowSum { SS_TOP, SS_BOTTOM, SS_FALSE };
+enum EnumStatusFileFormat { SF_TEXT, SF_CSV, SF_JSON };
 
 extern std::string pidfile;
 extern std::string confdir;
@@ -40,18 +47,21 @@ extern std::string conffile;
 extern std::string classfile;
 extern std::string vardir;
 extern std::string iptfile;
+extern std::string ip6tfile;
 extern std::string svinfofile;
 
 extern class Config *config;
 extern class IfacesMap *ifaces;
 extern class Iptables *ipt;
 extern class Logger *log;
+extern class StringPool *strpool;
 extern class Sys *sys;
 extern class Tests *test;
 
 extern void sig_exit_daemonizer_ok(int);
 extern void sig_exit_daemonizer_error(int);
 extern void sig_exit_supervisor(int);
+extern void sig_reload_supervisor(int);
 
 #endif
 
@@ -0,0 +1,986 @@
+/*
+ *      NiceShaper - Dynamic Traffic Management
+ *
+ *      Copyright (C) 2004-2016 Mariusz Jedwabny <mariusz@jedwabny.net>
+ *
+ *      This file is subject to the terms and conditions of the GNU General Public
+ *      License.  See the file COPYING in the main directory of this archive for
+ *      more details.
+ */
+
+#include "nftables.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter_ipv4.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nf_conntrack_common.h>
+#include <endian.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+#include <vector>
+
+#include "main.h"
+#include "aux.h"
+#include "logger.h"
+
+NfTables::NfTables()
+{
+    Fd = -1;
+    Seq = time(NULL);
+    AckSeq = 0;
+    SetId = 0;
+    LastMsg = 0;
+}
+
+NfTables::~NfTables()
+{
+    close();
+}
+
+int NfTables::open()
+{
+    struct sockaddr_nl local;
+
+    if (Fd != -1) return 0;
+
+    Fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_NETFILTER);
+    if (Fd == -1) { log->error(707, strerror(errno)); return -1; }
+
+    memset(&local, 0, sizeof(local));
+    local.nl_family = AF_NETLINK;
+    if (bind(Fd, (struct sockaddr *)&local, sizeof(local)) == -1) {
+        log->error(707, strerror(errno));
+        close();
+        return -1;
+    }
+
+    return 0;
+}
+
+void NfTables::close()
+{
+    if (Fd != -1) ::close(Fd);
+
+    Fd = -1;
+}
+
+void NfTables::begin()
+{
+    size_t msg;
+
+    Batch.clear();
+    LastMsg = 0;
+
+    msg = msgBegin(NFNL_MSG_BATCH_BEGIN, NLM_F_REQUEST, AF_UNSPEC);
+    reinterpret_cast<struct nfgenmsg *>(&Batch[msg + NLMSG_HDRLEN])->res_id = htons(NFNL_SUBSYS_NFTABLES);
+    msgEnd(msg);
+}
+
+void NfTables::replaceTable(std::string table)
+{
+    size_t msg;
+
+    // Creation of the existing table is a no-op, thus the deletion never fails and remains
+    // of killed instance are replaced the same way as the running rules are
+    delTable(table);
+
+    msg = msgBegin((NFNL_SUBSYS_NFTABLES << 8) | NFT_MSG_NEWTABLE, NLM_F_REQUEST | NLM_F_CREATE, NFPROTO_INET);
+    attrPutStr(NFTA_TABLE_NAME, table);
+    msgEnd(msg);
+}
+
+void NfTables::delTable(std::string table)
+{
+    size_t msg;
+
+    msg = msgBegin((NFNL_SUBSYS_NFTABLES << 8) | NFT_MSG_NEWTABLE, NLM_F_REQUEST | NLM_F_CREATE, NFPROTO_INET);
+    attrPutStr(NFTA_TABLE_NAME, table);
+    msgEnd(msg);
+
+    msg = msgBegin((NFNL_SUBSYS_NFTABLES << 8) | NFT_MSG_DELTABLE, NLM_F_REQUEST, NFPROTO_INET);
+    attrPutStr(NFTA_TABLE_NAME, table);
+    msgEnd(msg);
+}
+
+int NfTables::addChain(std::string table, std::string chain)
+{
+    size_t msg, hook;
+    __u32 hooknum;
+
+    // Chains named after iptables hooks are attached to them with mangle priority
+    if (chain == "PREROUTING") hooknum = NF_INET_PRE_ROUTING;
+    else if (chain == "POSTROUTING") hooknum = NF_INET_POST_ROUTING;
+    else hooknum = NF_INET_NUMHOOKS;
+
+    msg = msgBegin((NFNL_SUBSYS_NFTABLES << 8) | NFT_MSG_NEWCHAIN, NLM_F_REQUEST | NLM_F_CREATE, NFPROTO_INET);
+    attrPutStr(NFTA_CHAIN_TABLE, table);
+    attrPutStr(NFTA_CHAIN_NAME, chain);
+    if (hooknum != NF_INET_NUMHOOKS) {
+        hook = nestBegin(NFTA_CHAIN_HOOK);
+        attrPut32(NFTA_HOOK_HOOKNUM, htonl(hooknum));
+        attrPut32(NFTA_HOOK_PRIORITY, htonl(static_cast<__u32>(NF_IP_PRI_MANGLE)));
+        nestEnd(hook);
+        attrPut32(NFTA_CHAIN_POLICY, htonl(NF_ACCEPT));
+        attrPutStr(NFTA_CHAIN_TYPE, "filter");
+    }
+    msgEnd(msg);
+
+    return 0;
+}
+
+int NfTables::addRule(std::string table, std::string rule, __u64 packets, __u64 bytes)
+{
+    std::vector <std::string> tokens;
+    size_t msg, exprs;
+    unsigned int n;
+
+    n = 0;
+    while (aux::awk(rule, ++n).size()) tokens.push_back(aux::awk(rule, n));
+
+    if ((tokens.size() < 2) || (tokens.at(0) != "-A")) { log->error(708, rule); return -1; }
+
+    msg = msgBegin((NFNL_SUBSYS_NFTABLES << 8) | NFT_MSG_NEWRULE, NLM_F_REQUEST | NLM_F_CREATE | NLM_F_APPEND, NFPROTO_INET);
+    attrPutStr(NFTA_RULE_TABLE, table);
+    attrPutStr(NFTA_RULE_CHAIN, tokens.at(1));
+    exprs = nestBegin(NFTA_RULE_EXPRESSIONS);
+    if (ruleExpressions(tokens, packets, bytes) == -1) {
+        Batch.resize(msg);
+        log->error(708, rule);
+        return -1;
+    }
+    nestEnd(exprs);
+    msgEnd(msg);
+
+    return 0;
+}
+
+int NfTables::commit()
+{
+    struct sockaddr_nl peer;
+    struct nlmsghdr *nlh;
+    struct nlmsgerr *err;
+    char buf[RECV_BUF_SIZE];
+    int sndbuf, len;
+    int result = -1;
+    size_t msg;
+
+    if (Fd == -1) return -1;
+
+    // The last change is acknowledged, it's enough to know the whole transaction went through
+    reinterpret_cast<struct nlmsghdr *>(&Batch[LastMsg])->nlmsg_flags |= NLM_F_ACK;
+    AckSeq = reinterpret_cast<struct nlmsghdr *>(&Batch[LastMsg])->nlmsg_seq;
+
+    msg = msgBegin(NFNL_MSG_BATCH_END, NLM_F_REQUEST, AF_UNSPEC);
+    reinterpret_cast<struct nfgenmsg *>(&Batch[msg + NLMSG_HDRLEN])->res_id = htons(NFNL_SUBSYS_NFTABLES);
+    msgEnd(msg);
+
+    // Transaction has to be sent in one message, socket buffer is enlarged to fit it
+    sndbuf = Batch.size() + RECV_BUF_SIZE;
+    if (setsockopt(Fd, SOL_SOCKET, SO_SNDBUFFORCE, &sndbuf, sizeof(sndbuf)) == -1) {
+        setsockopt(Fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    }
+
+    memset(&peer, 0, sizeof(peer));
+    peer.nl_family = AF_NETLINK;
+    if (sendto(Fd, &Batch[0], Batch.size(), 0, (struct sockaddr *)&peer, sizeof(peer)) == -1) {
+        log->error(707, strerror(errno));
+        Batch.clear();
+        return -1;
+    }
+
+    Batch.clear();
+
+    // Kernel processes the transaction within sendto(), answers are already queued
+    while ((len = recv(Fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, static_cast<unsigned int>(len)); nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type != NLMSG_ERROR) continue;
+            err = (struct nlmsgerr *)NLMSG_DATA(nlh);
+            if (err->error) {
+                log->error(707, strerror(-err->error));
+                result = -1;
+                AckSeq = 0;
+            }
+            else if (AckSeq && (nlh->nlmsg_seq == AckSeq)) result = 0;
+        }
+    }
+
+    if ((len == -1) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+        log->error(707, strerror(errno));
+        result = -1;
+    }
+
+    return result;
+}
+
+int NfTables::addSet(std::string table, std::string set, bool map)
+{
+    size_t msg;
+
+    msg = msgBegin((NFNL_SUBSYS_NFTABLES << 8) | NFT_MSG_NEWSET, NLM_F_REQUEST | NLM_F_CREATE, NFPROTO_INET);
+    attrPutStr(NFTA_SET_TABLE, table);
+    attrPutStr(NFTA_SET_NAME, set);
+    attrPut32(NFTA_SET_FLAGS, htonl(map ? (NFT_SET_MAP | NFT_SET_EXPR) : NFT_SET_EXPR));
+    attrPut32(NFTA_SET_KEY_TYPE, htonl(TYPE_IPADDR));
+    attrPut32(NFTA_SET_KEY_LEN, htonl(sizeof(__u32)));
+    if (map) {
+        attrPut32(NFTA_SET_DATA_TYPE, htonl(TYPE_MARK));
+        attrPut32(NFTA_SET_DATA_LEN, htonl(sizeof(__u32)));
+    }
+    attrPut32(NFTA_SET_ID, htonl(++SetId));
+    // Each element counts packets of its own host
+    exprCounter(0, 0, NFTA_SET_EXPR);
+    msgEnd(msg);
+
+    return 0;
+}
+
+void NfTables::addSetElements(std::string table, std::string set, std::vector <__u32> &keys, std::vector <__u32> &data, std::vector <__u64> &packets, std::vector <__u64> &bytes)
+{
+    size_t msg = 0, list = 0, elem, nest;
+
+    for (unsigned int n=0; n<keys.size(); n++) {
+        // Nested attribute length is 16 bits, thus elements are split between messages
+        if (!(n % SET_ELEMS_PER_MSG)) {
+            if (n) {
+                nestEnd(list);
+                msgEnd(msg);
+            }
+            msg = msgBegin((NFNL_SUBSYS_NFTABLES << 8) | NFT_MSG_NEWSETELEM, NLM_F_REQUEST | NLM_F_CREATE, NFPROTO_INET);
+            attrPutStr(NFTA_SET_ELEM_LIST_TABLE, table);
+            attrPutStr(NFTA_SET_ELEM_LIST_SET, set);
+            list = nestBegin(NFTA_SET_ELEM_LIST_ELEMENTS);
+        }
+        elem = nestBegin(NFTA_LIST_ELEM);
+        nest = nestBegin(NFTA_SET_ELEM_KEY);
+        attrPut(NFTA_DATA_VALUE, &keys.at(n), sizeof(__u32));
+        nestEnd(nest);
+        if (n < data.size()) {
+            nest = nestBegin(NFTA_SET_ELEM_DATA);
+            attrPut(NFTA_DATA_VALUE, &data.at(n), sizeof(__u32));
+            nestEnd(nest);
+        }
+        exprCounter(packets.at(n), bytes.at(n), NFTA_SET_ELEM_EXPR);
+        nestEnd(elem);
+    }
+
+    if (keys.size()) {
+        nestEnd(list);
+        msgEnd(msg);
+    }
+}
+
+int NfTables::readChainCounters(std::string table, std::string chain, std::vector <__u64> &packets, std::vector <__u64> &bytes)
+{
+    std::vector <std::string> replies;
+    const char *attrs[NFTA_RULE_MAX+1];
+    int lens[NFTA_RULE_MAX+1];
+    const char *exprs, *expr;
+    int exprs_len, expr_len;
+    unsigned int type;
+    size_t msg;
+
+    packets.clear();
+    bytes.clear();
+
+    Batch.clear();
+    msg = msgBegin((NFNL_SUBSYS_NFTABLES << 8) | NFT_MSG_GETRULE, NLM_F_REQUEST | NLM_F_DUMP, NFPROTO_INET);
+    attrPutStr(NFTA_RULE_TABLE, table);
+    attrPutStr(NFTA_RULE_CHAIN, chain);
+    msgEnd(msg);
+
+    if (dump(NFT_MSG_NEWRULE, replies) == -1) return -1;
+
+    // Rules are dumped in order of the chain, each one carries single counter
+    for (unsigned int n=0; n<replies.size(); n++) {
+        packets.push_back(0);
+        bytes.push_back(0);
+        attrParse(replies.at(n).data(), replies.at(n).size(), attrs, lens, NFTA_RULE_MAX);
+        exprs = attrs[NFTA_RULE_EXPRESSIONS];
+        exprs_len = lens[NFTA_RULE_EXPRESSIONS];
+        while ((expr = attrNext(exprs, exprs_len, type, expr_len))) {
+            counterParse(expr, expr_len, packets.back(), bytes.back());
+        }
+    }
+
+    return 0;
+}
+
+int NfTables::readSetCounters(std::string table, std::string set, std::vector <__u32> &keys, std::vector <__u64> &packets, std::vector <__u64> &bytes)
+{
+    std::vector <std::string> replies;
+    const char *list_attrs[NFTA_SET_ELEM_LIST_MAX+1];
+    int list_lens[NFTA_SET_ELEM_LIST_MAX+1];
+    const char *elem_attrs[NFTA_SET_ELEM_MAX+1];
+    int elem_lens[NFTA_SET_ELEM_MAX+1];
+    const char *key_attrs[NFTA_DATA_MAX+1];
+    int key_lens[NFTA_DATA_MAX+1];
+    const char *elems, *elem, *exprs, *expr;
+    int elems_len, elem_len, exprs_len, expr_len;
+    unsigned int type;
+    __u32 key;
+    size_t msg;
+
+    keys.clear();
+    packets.clear();
+    bytes.clear();
+
+    Batch.clear();
+    msg = msgBegin((NFNL_SUBSYS_NFTABLES << 8) | NFT_MSG_GETSETELEM, NLM_F_REQUEST | NLM_F_DUMP, NFPROTO_INET);
+    attrPutStr(NFTA_SET_ELEM_LIST_TABLE, table);
+    attrPutStr(NFTA_SET_ELEM_LIST_SET, set);
+    msgEnd(msg);
+
+    if (dump(NFT_MSG_NEWSETELEM, replies) == -1) return -1;
+
+    // Elements come in order of the hash, they are identified by the key
+    for (unsigned int n=0; n<replies.size(); n++) {
+        attrParse(replies.at(n).data(), replies.at(n).size(), list_attrs, list_lens, NFTA_SET_ELEM_LIST_MAX);
+        elems = list_attrs[NFTA_SET_ELEM_LIST_ELEMENTS];
+        elems_len = list_lens[NFTA_SET_ELEM_LIST_ELEMENTS];
+        while ((elem = attrNext(elems, elems_len, type, elem_len))) {
+            attrParse(elem, elem_len, elem_attrs, elem_lens, NFTA_SET_ELEM_MAX);
+            if (elem_attrs[NFTA_SET_ELEM_KEY] == NULL) continue;
+            attrParse(elem_attrs[NFTA_SET_ELEM_KEY], elem_lens[NFTA_SET_ELEM_KEY], key_attrs, key_lens, NFTA_DATA_MAX);
+            if ((key_attrs[NFTA_DATA_VALUE] == NULL) || (key_lens[NFTA_DATA_VALUE] != sizeof(__u32))) continue;
+            memcpy(&key, key_attrs[NFTA_DATA_VALUE], sizeof(__u32));
+            keys.push_back(key);
+            packets.push_back(0);
+            bytes.push_back(0);
+            if (elem_attrs[NFTA_SET_ELEM_EXPR]) {
+                counterParse(elem_attrs[NFTA_SET_ELEM_EXPR], elem_lens[NFTA_SET_ELEM_EXPR], packets.back(), bytes.back());
+            }
+            exprs = elem_attrs[NFTA_SET_ELEM_EXPRESSIONS];
+            exprs_len = elem_lens[NFTA_SET_ELEM_EXPRESSIONS];
+            while ((expr = attrNext(exprs, exprs_len, type, expr_len))) {
+                counterParse(expr, expr_len, packets.back(), bytes.back());
+            }
+        }
+    }
+
+    return 0;
+}
+
+int NfTables::dump(__u8 msg_type, std::vector <std::string> &replies)
+{
+    struct sockaddr_nl peer;
+    struct nlmsghdr *nlh;
+    char buf[RECV_BUF_SIZE];
+    int len;
+    bool done = false;
+
+    replies.clear();
+
+    if (Fd == -1) return -1;
+
+    memset(&peer, 0, sizeof(peer));
+    peer.nl_family = AF_NETLINK;
+    if (sendto(Fd, &Batch[0], Batch.size(), 0, (struct sockaddr *)&peer, sizeof(peer)) == -1) {
+        log->error(707, strerror(errno));
+        Batch.clear();
+        return -1;
+    }
+    Batch.clear();
+
+    while (!done) {
+        len = recv(Fd, buf, sizeof(buf), 0);
+        if (len <= 0) { log->error(707, strerror(errno)); return -1; }
+        for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, static_cast<unsigned int>(len)); nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type == NLMSG_DONE) { done = true; break; }
+            if (nlh->nlmsg_type == NLMSG_ERROR) {
+                log->error(707, strerror(-((struct nlmsgerr *)NLMSG_DATA(nlh))->error));
+                return -1;
+            }
+            if (nlh->nlmsg_flags & NLM_F_DUMP_INTR) { log->error(707, "NLM_F_DUMP_INTR"); return -1; }
+            if ((nlh->nlmsg_type & 0xFF) != msg_type) continue;
+            if (nlh->nlmsg_len < NLMSG_SPACE(sizeof(struct nfgenmsg))) continue;
+            // Attributes follow the nfgenmsg header
+            replies.push_back(std::string((char *)NLMSG_DATA(nlh) + NLMSG_ALIGN(sizeof(struct nfgenmsg)), nlh->nlmsg_len - NLMSG_SPACE(sizeof(struct nfgenmsg))));
+        }
+    }
+
+    return 0;
+}
+
+const char *NfTables::attrNext(const char *&data, int &len, unsigned int &type, int &payload_len)
+{
+    const struct nlattr *attr;
+    const char *payload;
+
+    if ((data == NULL) || (len < static_cast<int>(NLA_HDRLEN))) return NULL;
+
+    attr = reinterpret_cast<const struct nlattr *>(data);
+    if ((attr->nla_len < NLA_HDRLEN) || (attr->nla_len > len)) return NULL;
+
+    type = attr->nla_type & NLA_TYPE_MASK;
+    payload = data + NLA_HDRLEN;
+    payload_len = attr->nla_len - NLA_HDRLEN;
+
+    len -= NLA_ALIGN(attr->nla_len);
+    data += NLA_ALIGN(attr->nla_len);
+
+    return payload;
+}
+
+void NfTables::attrParse(const char *data, int len, const char *attrs[], int lens[], unsigned int max)
+{
+    const char *payload;
+    unsigned int type;
+    int payload_len;
+
+    for (unsigned int n=0; n<=max; n++) {
+        attrs[n] = NULL;
+        lens[n] = 0;
+    }
+
+    while ((payload = attrNext(data, len, type, payload_len))) {
+        if (type > max) continue;
+        attrs[type] = payload;
+        lens[type] = payload_len;
+    }
+}
+
+void NfTables::counterParse(const char *expr, int len, __u64 &packets, __u64 &bytes)
+{
+    const char *attrs[NFTA_EXPR_MAX+1];
+    int lens[NFTA_EXPR_MAX+1];
+    const char *counter_attrs[NFTA_COUNTER_MAX+1];
+    int counter_lens[NFTA_COUNTER_MAX+1];
+    __u64 value;
+
+    attrParse(expr, len, attrs, lens, NFTA_EXPR_MAX);
+    if ((attrs[NFTA_EXPR_NAME] == NULL) || strncmp(attrs[NFTA_EXPR_NAME], "counter", lens[NFTA_EXPR_NAME])) return;
+    if (attrs[NFTA_EXPR_DATA] == NULL) return;
+
+    attrParse(attrs[NFTA_EXPR_DATA], lens[NFTA_EXPR_DATA], counter_attrs, counter_lens, NFTA_COUNTER_MAX);
+    if (counter_lens[NFTA_COUNTER_PACKETS] == sizeof(__u64)) {
+        memcpy(&value, counter_attrs[NFTA_COUNTER_PACKETS], sizeof(__u64));
+        packets = be64toh(value);
+    }
+    if (counter_lens[NFTA_COUNTER_BYTES] == sizeof(__u64)) {
+        memcpy(&value, counter_attrs[NFTA_COUNTER_BYTES], sizeof(__u64));
+        bytes = be64toh(value);
+    }
+}
+
+int NfTables::ruleExpressions(std::vector <std::string> &tokens, __u64 packets, __u64 bytes)
+{
+    std::string option, value, target, set_mark;
+    unsigned char ifname[IFNAMSIZ];
+    unsigned char byte_val, byte_mask;
+    unsigned char addr6[16], mask6[16], zero6[16];
+    __u32 addr, mask, from, to, bit, zero;
+    __u16 from16, to16, mask16;
+    bool negation = false;
+    bool ipv6 = false;
+    int bits;
+    __u32 op;
+
+    zero = 0;
+    memset(zero6, 0, sizeof(zero6));
+
+    // Table holds rules of both families, each one tests its own first, IPv6 ones are tagged with -6
+    for (unsigned int n=2; n<tokens.size(); n++) {
+        if (tokens.at(n) == "-6") ipv6 = true;
+    }
+    byte_val = ipv6 ? NFPROTO_IPV6 : NFPROTO_IPV4;
+    exprMeta(NFT_META_NFPROTO);
+    exprCmp(NFT_CMP_EQ, &byte_val, 1);
+
+    for (unsigned int n=2; n<tokens.size(); n++) {
+        option = tokens.at(n);
+        if (option == "!") { negation = true; continue; }
+        if (option == "-6") continue;
+        if (option == "-m") { n++; continue; }
+        if (n+1 >= tokens.size()) return -1;
+        value = tokens.at(++n);
+        // Negation is also given after the option, e.g. -s ! 10.0.0.1
+        if (value == "!") {
+            negation = true;
+            if (n+1 >= tokens.size()) return -1;
+            value = tokens.at(++n);
+        }
+        op = negation ? NFT_CMP_NEQ : NFT_CMP_EQ;
+
+        if (option == "-p") {
+            if (value == "tcp") byte_val = IPPROTO_TCP;
+            else if (value == "udp") byte_val = IPPROTO_UDP;
+            else if (value == "icmp") byte_val = IPPROTO_ICMP;
+            else if (ipv6 && (value == "ipv6-icmp")) byte_val = IPPROTO_ICMPV6;
+            else return -1;
+            // Protocol of IPv6 is the one behind extension headers, as ip6tables sees it
+            if (ipv6) exprMeta(NFT_META_L4PROTO);
+            else exprPayload(NFT_PAYLOAD_NETWORK_HEADER, 9, 1);
+            exprCmp(op, &byte_val, 1);
+        }
+        else if (ipv6 && ((option == "-s") || (option == "-d"))) {
+            if ((bits = parseAddr6(value, addr6, mask6)) == -1) return -1;
+            if (!bits && !negation) continue;
+            exprPayload(NFT_PAYLOAD_NETWORK_HEADER, (option == "-s") ? 8 : 24, 16);
+            if (bits != 128) exprBitwise(16, mask6, zero6);
+            exprCmp(op, addr6, 16);
+        }
+        else if ((option == "-s") || (option == "-d")) {
+            if (parseAddr(value, addr, mask) == -1) return -1;
+            if (!mask && !negation) continue;
+            exprPayload(NFT_PAYLOAD_NETWORK_HEADER, (option == "-s") ? 12 : 16, 4);
+            if (mask != 0xFFFFFFFF) exprBitwise(4, &mask, &zero);
+            addr &= mask;
+            exprCmp(op, &addr, 4);
+        }
+        else if ((option == "-i") || (option == "-o")) {
+            if (value.size() >= IFNAMSIZ) return -1;
+            memset(ifname, 0, sizeof(ifname));
+            memcpy(ifname, value.c_str(), value.size());
+            exprMeta((option == "-i") ? NFT_META_IIFNAME : NFT_META_OIFNAME);
+            // Trailing + is a wildcard of iptables, otherwise the terminating zero is compared too
+            if (value.at(value.size()-1) == '+') exprCmp(op, ifname, value.size()-1);
+            else exprCmp(op, ifname, value.size()+1);
+        }
+        else if ((option == "--sport") || (option == "--dport") || (option == "--length")) {
+            if (parseRange(value, 0xFFFF, from, to) == -1) return -1;
+            // Payload length of IPv6 doesn't count its 40 bytes header
+            if ((option == "--length") && ipv6) {
+                if (to < 40) return -1;
+                from = (from < 40) ? 0 : from-40;
+                to -= 40;
+                exprPayload(NFT_PAYLOAD_NETWORK_HEADER, 4, 2);
+            }
+            else if (option == "--length") exprPayload(NFT_PAYLOAD_NETWORK_HEADER, 2, 2);
+            else exprPayload(NFT_PAYLOAD_TRANSPORT_HEADER, (option == "--sport") ? 0 : 2, 2);
+            from16 = htons(from);
+            to16 = htons(to);
+            if (from == to) exprCmp(op, &from16, 2);
+            else exprRange(negation ? NFT_RANGE_NEQ : NFT_RANGE_EQ, &from16, &to16, 2);
+        }
+        else if (option == "--state") {
+            if (value == "invalid") bit = NF_CT_STATE_INVALID_BIT;
+            else if (value == "established") bit = NF_CT_STATE_BIT(IP_CT_ESTABLISHED);
+            else if (value == "related") bit = NF_CT_STATE_BIT(IP_CT_RELATED);
+            else if (value == "new") bit = NF_CT_STATE_BIT(IP_CT_NEW);
+            else if (value == "untracked") bit = NF_CT_STATE_UNTRACKED_BIT;
+            else return -1;
+            exprCt(NFT_CT_STATE);
+            exprBitwise(4, &bit, &zero);
+            exprCmp(negation ? NFT_CMP_EQ : NFT_CMP_NEQ, &zero, 4);
+        }
+        else if (option == "--tos") {
+            // Symbolic names of the tos match compare only the tos bits
+            if (value == "Minimize-Delay") { from = 0x10; to = 0x3F; }
+            else if (value == "Maximize-Throughput") { from = 0x08; to = 0x3F; }
+            else if (value == "Maximize-Reliability") { from = 0x04; to = 0x3F; }
+            else if (value == "Minimize-Cost") { from = 0x02; to = 0x3F; }
+            else if (value == "Normal-Service") { from = 0x00; to = 0x3F; }
+            else if (parseValueMask(value, 0xFF, from, to) == -1) return -1;
+            if ((from > 0xFF) || (to > 0xFF)) return -1;
+            byte_val = from & to;
+            byte_mask = to;
+            // Traffic class of IPv6 lies across the first two bytes, behind the version
+            if (ipv6) {
+                from16 = htons(byte_val << 4);
+                mask16 = htons(byte_mask << 4);
+                exprPayload(NFT_PAYLOAD_NETWORK_HEADER, 0, 2);
+                exprBitwise(2, &mask16, &zero);
+                exprCmp(op, &from16, 2);
+                negation = false;
+                continue;
+            }
+            exprPayload(NFT_PAYLOAD_NETWORK_HEADER, 1, 1);
+            if (byte_mask != 0xFF) exprBitwise(1, &byte_mask, &zero);
+            exprCmp(op, &byte_val, 1);
+        }
+        else if ((option == "--ttl-lt") || (option == "--ttl-gt") || (option == "--ttl")
+                || (option == "--hl-lt") || (option == "--hl-gt") || (option == "--hl-eq")) {
+            if (parseRange(value, 0xFF, from, to) == -1) return -1;
+            byte_val = from;
+            // Hop limit of IPv6 is where ttl is kept
+            exprPayload(NFT_PAYLOAD_NETWORK_HEADER, ipv6 ? 7 : 8, 1);
+            if ((option == "--ttl-lt") || (option == "--hl-lt")) exprCmp(NFT_CMP_LT, &byte_val, 1);
+            else if ((option == "--ttl-gt") || (option == "--hl-gt")) exprCmp(NFT_CMP_GT, &byte_val, 1);
+            else exprCmp(op, &byte_val, 1);
+        }
+        else if (option == "--mark") {
+            if (parseValueMask(value, 0xFFFFFFFF, from, to) == -1) return -1;
+            from &= to;
+            exprMeta(NFT_META_MARK);
+            if (to != 0xFFFFFFFF) exprBitwise(4, &to, &zero);
+            exprCmp(op, &from, 4);
+        }
+        else if ((option == "--saddr-lookup") || (option == "--daddr-lookup") || (option == "--saddr-mark-map") || (option == "--daddr-mark-map")) {
+            // Own options of the installer, the address is looked up in a set compiled of host rules
+            if (negation) return -1;
+            exprPayload(NFT_PAYLOAD_NETWORK_HEADER, (option.at(2) == 's') ? 12 : 16, 4);
+            if (option.find("-map") == std::string::npos) {
+                exprLookup(value, false);
+            }
+            else {
+                exprLookup(value, true);
+                exprMetaSet(NFT_META_MARK);
+            }
+        }
+        else if (option == "-j") {
+            target = value;
+        }
+        else if (option == "--set-mark") {
+            set_mark = value;
+        }
+        else return -1;
+
+        negation = false;
+    }
+
+    exprCounter(packets, bytes);
+
+    if (target.empty()) return 0;
+
+    if (target == "MARK") {
+        if (parseValueMask(set_mark, 0xFFFFFFFF, from, to) == -1) return -1;
+        // The same as MARK target does, mark = (mark & ~(mask|value)) ^ value
+        if (to == 0xFFFFFFFF) {
+            exprImmediateData(&from, 4);
+        }
+        else {
+            mask = ~(to | from);
+            exprMeta(NFT_META_MARK);
+            exprBitwise(4, &mask, &from);
+        }
+        exprMetaSet(NFT_META_MARK);
+    }
+    else if (target == "ACCEPT") exprVerdict(NF_ACCEPT, "");
+    else if (target == "RETURN") exprVerdict(NFT_RETURN, "");
+    else if (target == "IMQ") return -1;
+    else exprVerdict(NFT_JUMP, target);
+
+    return 0;
+}
+
+int NfTables::parseAddr(std::string arg, __u32 &addr, __u32 &mask)
+{
+    struct in_addr in;
+    std::string buf;
+    size_t pos;
+    unsigned int bits;
+
+    pos = arg.find('/');
+    buf = arg.substr(0, pos);
+    if (inet_pton(AF_INET, buf.c_str(), &in) != 1) return -1;
+    addr = in.s_addr;
+    mask = 0xFFFFFFFF;
+
+    if (pos == std::string::npos) return 0;
+
+    buf = arg.substr(pos+1);
+    if (inet_pton(AF_INET, buf.c_str(), &in) == 1) {
+        mask = in.s_addr;
+    }
+    else {
+        if (buf.empty() || (buf.find_first_not_of("0123456789") != std::string::npos)) return -1;
+        bits = aux::str_to_uint(buf);
+        if (bits > 32) return -1;
+        mask = bits ? htonl(0xFFFFFFFF << (32 - bits)) : 0;
+    }
+
+    return 0;
+}
+
+int NfTables::parseAddr6(std::string arg, unsigned char *addr, unsigned char *mask)
+{
+    std::string buf;
+    size_t pos;
+    unsigned int bits = 128;
+    int result;
+
+    pos = arg.find('/');
+    buf = arg.substr(0, pos);
+    if (inet_pton(AF_INET6, buf.c_str(), addr) != 1) return -1;
+
+    if (pos != std::string::npos) {
+        buf = arg.substr(pos+1);
+        if (buf.empty() || (buf.find_first_not_of("0123456789") != std::string::npos)) return -1;
+        bits = aux::str_to_uint(buf);
+        if (bits > 128) return -1;
+    }
+
+    result = bits;
+    for (unsigned int n=0; n<16; n++) {
+        mask[n] = (bits >= 8) ? 0xFF : (0xFF << (8 - bits)) & 0xFF;
+        bits = (bits >= 8) ? bits-8 : 0;
+        addr[n] &= mask[n];
+    }
+
+    return result;
+}
+
+int NfTables::parseRange(std::string arg, __u32 max, __u32 &from, __u32 &to)
+{
+    size_t pos;
+    std::string buf;
+
+    pos = arg.find(':');
+    buf = arg.substr(0, pos);
+    if (buf.empty() || (buf.find_first_not_of("0123456789") != std::string::npos)) return -1;
+    from = strtoul(buf.c_str(), NULL, 10);
+    to = from;
+
+    if (pos != std::string::npos) {
+        buf = arg.substr(pos+1);
+        if (buf.empty() || (buf.find_first_not_of("0123456789") != std::string::npos)) return -1;
+        to = strtoul(buf.c_str(), NULL, 10);
+    }
+
+    if ((from > max) || (to > max) || (from > to)) return -1;
+
+    return 0;
+}
+
+int NfTables::parseValueMask(std::string arg, __u32 max, __u32 &value, __u32 &mask)
+{
+    size_t pos;
+    char *end;
+
+    pos = arg.find('/');
+
+    value = strtoul(arg.substr(0, pos).c_str(), &end, 0);
+    if (*end || !arg.substr(0, pos).size()) return -1;
+    mask = max;
+
+    if (pos != std::string::npos) {
+        mask = strtoul(arg.substr(pos+1).c_str(), &end, 0);
+        if (*end || !arg.substr(pos+1).size()) return -1;
+    }
+
+    return 0;
+}
+
+size_t NfTables::msgBegin(__u16 type, __u16 flags, __u8 family)
+{
+    struct nlmsghdr nlh;
+    struct nfgenmsg nfg;
+    size_t msg = Batch.size();
+
+    memset(&nlh, 0, sizeof(nlh));
+    nlh.nlmsg_type = type;
+    nlh.nlmsg_flags = flags;
+    nlh.nlmsg_seq = ++Seq;
+
+    memset(&nfg, 0, sizeof(nfg));
+    nfg.nfgen_family = family;
+    nfg.version = NFNETLINK_V0;
+
+    Batch.resize(msg + NLMSG_HDRLEN + NLMSG_ALIGN(sizeof(nfg)), 0);
+    memcpy(&Batch[msg], &nlh, sizeof(nlh));
+    memcpy(&Batch[msg + NLMSG_HDRLEN], &nfg, sizeof(nfg));
+
+    if ((type != NFNL_MSG_BATCH_BEGIN) && (type != NFNL_MSG_BATCH_END)) LastMsg = msg;
+
+    return msg;
+}
+
+void NfTables::msgEnd(size_t msg)
+{
+    reinterpret_cast<struct nlmsghdr *>(&Batch[msg])->nlmsg_len = Batch.size() - msg;
+}
+
+void NfTables::attrPut(__u16 type, const void *data, size_t len)
+{
+    struct nlattr attr;
+    size_t pos = Batch.size();
+
+    attr.nla_type = type;
+    attr.nla_len = NLA_HDRLEN + len;
+
+    Batch.resize(pos + NLA_HDRLEN + NLA_ALIGN(len), 0);
+    memcpy(&Batch[pos], &attr, sizeof(attr));
+    if (len) memcpy(&Batch[pos + NLA_HDRLEN], data, len);
+}
+
+void NfTables::attrPutStr(__u16 type, std::string data)
+{
+    attrPut(type, data.c_str(), data.size()+1);
+}
+
+void NfTables::attrPut32(__u16 type, __u32 data)
+{
+    attrPut(type, &data, sizeof(data));
+}
+
+void NfTables::attrPut64(__u16 type, __u64 data)
+{
+    attrPut(type, &data, sizeof(data));
+}
+
+size_t NfTables::nestBegin(__u16 type)
+{
+    size_t nest = Batch.size();
+
+    attrPut(type | NLA_F_NESTED, NULL, 0);
+
+    return nest;
+}
+
+void NfTables::nestEnd(size_t nest)
+{
+    reinterpret_cast<struct nlattr *>(&Batch[nest])->nla_len = Batch.size() - nest;
+}
+
+size_t NfTables::exprBegin(const char *name, __u16 type)
+{
+    size_t elem;
+
+    elem = nestBegin(type);
+    attrPutStr(NFTA_EXPR_NAME, name);
+    nestBegin(NFTA_EXPR_DATA);
+
+    return elem;
+}
+
+void NfTables::exprEnd(size_t elem)
+{
+    size_t data;
+
+    // Data is the second attribute of the element, right after the name
+    data = elem + NLA_HDRLEN + NLA_ALIGN(reinterpret_cast<struct nlattr *>(&Batch[elem + NLA_HDRLEN])->nla_len);
+    nestEnd(data);
+    nestEnd(elem);
+}
+
+void NfTables::exprPayload(__u32 base, __u32 offset, __u32 len)
+{
+    size_t elem = exprBegin("payload");
+
+    attrPut32(NFTA_PAYLOAD_DREG, htonl(NFT_REG_1));
+    attrPut32(NFTA_PAYLOAD_BASE, htonl(base));
+    attrPut32(NFTA_PAYLOAD_OFFSET, htonl(offset));
+    attrPut32(NFTA_PAYLOAD_LEN, htonl(len));
+    exprEnd(elem);
+}
+
+void NfTables::exprMeta(__u32 key)
+{
+    size_t elem = exprBegin("meta");
+
+    attrPut32(NFTA_META_DREG, htonl(NFT_REG_1));
+    attrPut32(NFTA_META_KEY, htonl(key));
+    exprEnd(elem);
+}
+
+void NfTables::exprMetaSet(__u32 key)
+{
+    size_t elem = exprBegin("meta");
+
+    attrPut32(NFTA_META_KEY, htonl(key));
+    attrPut32(NFTA_META_SREG, htonl(NFT_REG_1));
+    exprEnd(elem);
+}
+
+void NfTables::exprCt(__u32 key)
+{
+    size_t elem = exprBegin("ct");
+
+    attrPut32(NFTA_CT_DREG, htonl(NFT_REG_1));
+    attrPut32(NFTA_CT_KEY, htonl(key));
+    exprEnd(elem);
+}
+
+void NfTables::exprBitwise(__u32 len, const void *mask, const void *xor_data)
+{
+    size_t elem = exprBegin("bitwise");
+    size_t nest;
+
+    attrPut32(NFTA_BITWISE_SREG, htonl(NFT_REG_1));
+    attrPut32(NFTA_BITWISE_DREG, htonl(NFT_REG_1));
+    attrPut32(NFTA_BITWISE_LEN, htonl(len));
+    nest = nestBegin(NFTA_BITWISE_MASK);
+    attrPut(NFTA_DATA_VALUE, mask, len);
+    nestEnd(nest);
+    nest = nestBegin(NFTA_BITWISE_XOR);
+    attrPut(NFTA_DATA_VALUE, xor_data, len);
+    nestEnd(nest);
+    exprEnd(elem);
+}
+
+void NfTables::exprCmp(__u32 op, const void *data, __u32 len)
+{
+    size_t elem = exprBegin("cmp");
+    size_t nest;
+
+    attrPut32(NFTA_CMP_SREG, htonl(NFT_REG_1));
+    attrPut32(NFTA_CMP_OP, htonl(op));
+    nest = nestBegin(NFTA_CMP_DATA);
+    attrPut(NFTA_DATA_VALUE, data, len);
+    nestEnd(nest);
+    exprEnd(elem);
+}
+
+void NfTables::exprRange(__u32 op, const void *from, const void *to, __u32 len)
+{
+    size_t elem = exprBegin("range");
+    size_t nest;
+
+    attrPut32(NFTA_RANGE_SREG, htonl(NFT_REG_1));
+    attrPut32(NFTA_RANGE_OP, htonl(op));
+    nest = nestBegin(NFTA_RANGE_FROM_DATA);
+    attrPut(NFTA_DATA_VALUE, from, len);
+    nestEnd(nest);
+    nest = nestBegin(NFTA_RANGE_TO_DATA);
+    attrPut(NFTA_DATA_VALUE, to, len);
+    nestEnd(nest);
+    exprEnd(elem);
+}
+
+void NfTables::exprCounter(__u64 packets, __u64 bytes, __u16 type)
+{
+    size_t elem = exprBegin("counter", type);
+
+    // Counters carried over from the replaced rules
+    attrPut64(NFTA_COUNTER_BYTES, htobe64(bytes));
+    attrPut64(NFTA_COUNTER_PACKETS, htobe64(packets));
+    exprEnd(elem);
+}
+
+void NfTables::exprLookup(std::string set, bool map)
+{
+    size_t elem = exprBegin("lookup");
+
+    attrPutStr(NFTA_LOOKUP_SET, set);
+    attrPut32(NFTA_LOOKUP_SREG, htonl(NFT_REG_1));
+    if (map) attrPut32(NFTA_LOOKUP_DREG, htonl(NFT_REG_1));
+    exprEnd(elem);
+}
+
+void NfTables::exprImmediateData(const void *data, __u32 len)
+{
+    size_t elem = exprBegin("immediate");
+    size_t nest;
+
+    attrPut32(NFTA_IMMEDIATE_DREG, htonl(NFT_REG_1));
+    nest = nestBegin(NFTA_IMMEDIATE_DATA);
+    attrPut(NFTA_DATA_VALUE, data, len);
+    nestEnd(nest);
+    exprEnd(elem);
+}
+
+void NfTables::exprVerdict(int code, std::string chain)
+{
+    size_t elem = exprBegin("immediate");
+    size_t data, verdict;
+
+    attrPut32(NFTA_IMMEDIATE_DREG, htonl(NFT_REG_VERDICT));
+    data = nestBegin(NFTA_IMMEDIATE_DATA);
+    verdict = nestBegin(NFTA_DATA_VERDICT);
+    attrPut32(NFTA_VERDICT_CODE, htonl(static_cast<__u32>(code)));
+    if (chain.size()) attrPutStr(NFTA_VERDICT_CHAIN, chain);
+    nestEnd(verdict);
+    nestEnd(data);
+    exprEnd(elem);
+}
@@ -0,0 +1,84 @@
+#ifndef NFTABLES_H
+#define NFTABLES_H
+
+#include <asm/types.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+#include <linux/netfilter/nf_tables.h>
+
+#include "main.h"
+
+// In-process installer of the NiceShaper rules, it talks to nf_tables over netlink.
+// Rules are given in the same text form as for iptables-restore and all changes
+// made between begin() and commit() are applied by the kernel in a single transaction.
+// The table is of inet family, rules of IPv6 matches are tagged with -6.
+class NfTables {
+    public:
+        NfTables();
+        ~NfTables();
+        int open();
+        void close();
+        //
+        void begin();
+        void replaceTable(std::string);
+        void delTable(std::string);
+        int addChain(std::string, std::string);
+        int addRule(std::string, std::string, __u64, __u64);
+        int addSet(std::string, std::string, bool);
+        void addSetElements(std::string, std::string, std::vector <__u32> &, std::vector <__u32> &, std::vector <__u64> &, std::vector <__u64> &);
+        int commit();
+        //
+        int readChainCounters(std::string, std::string, std::vector <__u64> &, std::vector <__u64> &);
+        int readSetCounters(std::string, std::string, std::vector <__u32> &, std::vector <__u64> &, std::vector <__u64> &);
+    private:
+        int ruleExpressions(std::vector <std::string> &, __u64, __u64);
+        int parseAddr(std::string, __u32 &, __u32 &);
+        int parseAddr6(std::string, unsigned char *, unsigned char *);
+        int parseRange(std::string, __u32, __u32 &, __u32 &);
+        int parseValueMask(std::string, __u32, __u32 &, __u32 &);
+        //
+        size_t msgBegin(__u16, __u16, __u8);
+        void msgEnd(size_t);
+        void attrPut(__u16, const void *, size_t);
+        void attrPutStr(__u16, std::string);
+        void attrPut32(__u16, __u32);
+        void attrPut64(__u16, __u64);
+        size_t nestBegin(__u16);
+        void nestEnd(size_t);
+        //
+        int dump(__u8, std::vector <std::string> &);
+        const char *attrNext(const char *&, int &, unsigned int &, int &);
+        void attrParse(const char *, int, const char *[], int [], unsigned int);
+        void counterParse(const char *, int, __u64 &, __u64 &);
+        //
+        size_t exprBegin(const char *, __u16 = NFTA_LIST_ELEM);
+        void exprEnd(size_t);
+        void exprPayload(__u32, __u32, __u32);
+        void exprMeta(__u32);
+        void exprMetaSet(__u32);
+        void exprCt(__u32);
+        void exprBitwise(__u32, const void *, const void *);
+        void exprCmp(__u32, const void *, __u32);
+        void exprRange(__u32, const void *, const void *, __u32);
+        void exprCounter(__u64, __u64, __u16 = NFTA_LIST_ELEM);
+        void exprLookup(std::string, bool);
+        void exprImmediateData(const void *, __u32);
+        void exprVerdict(int, std::string);
+        //
+        int Fd;
+        __u32 Seq;
+        __u32 AckSeq;
+        __u32 SetId;
+        size_t LastMsg;
+        std::vector <char> Batch;
+        static const unsigned int RECV_BUF_SIZE = 65536;
+        static const unsigned int SET_ELEMS_PER_MSG = 256;
+        // Types of keys and data as nft names them, kernel keeps them for listing only
+        static const __u32 TYPE_IPADDR = 7;
+        static const __u32 TYPE_MARK = 19;
+};
+
+#endif
@@ -11,9 +11,12 @@
 #include "niceshaper.h"
 
 #include <sys/time.h>
+#include <time.h>
 #include <stdlib.h>
 #include <cstdio>
+#include <cstring>
 
+#include <map>
 #include <vector>
 #include <string>
 #include <iostream>
@@ -25,15 +28,22 @@
 #include "aux.h"
 #include "sys.h"
 #include "ifaces.h"
+#include "quotastore.h"
+#include "shmstatus.h"
 #include "tests.h"
 
-NiceShaper::NiceShaper(std::string section_name, unsigned int section_id, unsigned int waitingroom_id, bool sao_container)
+NiceShaper::NiceShaper(std::string section_name, unsigned int section_id, unsigned int waitingroom_id, bool sao_container, SectionArena *arena)
 {
     SectionName = section_name;
     SectionId = section_id;
     WaitingRoomId = waitingroom_id;
     SAOContainter = sao_container;
+    Arena = arena;
     Reload = 2 * 1000 * 1000; // 2 seconds
+    ReloadMin = 0;
+    ReloadMax = 0;
+    ReloadCurr = 0;
+    WorkingPrev = 0;
     CrossBar = 1;
     SectionHtbCeil = 0;
     SectionShape = 0;
@@ -47,26 +57,51 @@ NiceShaper::NiceShaper(std::string section_name, unsigned int section_id, unsign
     IptRequiredToCheckTraffic = false;
     DnswDoNotShape = false;
     DnswWrapper = false;
+    CongestionSignalBacklog = false;
+    CtActivation = false;
+    TriggerMinute = 0;
+    TriggerTimeCurr.Dmin = 0;
+    TriggerTimeCurr.Wday = 0;
+    TriggerTimeCurr.Mday = 0;
+    TriggerTimeCurr.MdayLast = false;
 }
 
 NiceShaper::~NiceShaper()
 {
-    for (unsigned int n=0; n<NsClasses.size(); n++) delete NsClasses.at(n); 
+    for (unsigned int n=0; n<NsClasses.size(); n++) Arena->Classes.destroy(NsClasses.at(n)); 
+    for (unsigned int n=0; n<NsClassesDnswStubs.size(); n++) Arena->Classes.destroy(NsClassesDnswStubs.at(n)); 
 
     NsClasses.clear();
+    NsClassesDnswStubs.clear();
 }
 
-int NiceShaper::init(std::vector <std::string> &fpv_conffile, std::vector <std::string> &fpv_classfile)
+int NiceShaper::init()
+{
+    // Classes are already prepared, maybe in parallel with other sections
+    if (NsClasses.empty()) return 0;
+
+    if (initQos() == -1) return -1;
+
+    return 0;
+}
+
+int NiceShaper::prepare(std::vector <std::string> &fpv_conffile, ClassFilePartition &partition)
 {
     std::string buf;
     std::string option, param, value;
     std::string iface;
-    std::vector <std::string> fpv_myclasses, fpv_myclasses_dnswstubs;
+    std::vector <std::string> fpv_myclasses_dnswstubs;
+    std::vector <std::string> fpv_noclasses;
+    std::vector <std::string> *fpv_myclasses;
     std::vector <std::string>::iterator fpvi, fpvi_begin, fpvi_end, fpvi_tmp; 
-    unsigned int dnsw_before;
-    bool mydatablock, mydatablockdnswstubs;
+    std::map <std::string, std::vector <std::string> >::iterator sci;
+    std::map <std::string, std::vector <unsigned int> >::iterator shi;
+    unsigned int dnsw_before, dnsw_header;
+    bool mydatablockdnswstubs;
     unsigned int max_htb_burst = 0;
     unsigned int max_htb_cburst = 0;
+    unsigned int reload_bound;
+    std::vector <unsigned int> trigger_minutes;
     NsClass* nsclass_template;    
     std::string nsclass_name;
     std::vector <std::string> nsclasses_registered;
@@ -103,6 +138,22 @@ int NiceShaper::init(std::vector <std::string> &fpv_conffile, std::vector <std::
                 else if (param == "htb-cburst") {
                     SectionHtbCBurst = aux::unit_convert (value, BYTES);
                 }
+                else if (param == "congestion-signal") {
+                    if (value == "backlog") CongestionSignalBacklog = true;
+                    else if (value == "none") CongestionSignalBacklog = false;
+                    else { log->error(SectionName, 11, *fpvi); }
+                }
+                else if ((param == "reload-min") || (param == "reload-max")) {
+                    reload_bound = static_cast<unsigned int>(aux::str_to_double(value)*1000*1000);
+                    if ((reload_bound < 100*1000) || (reload_bound > (60*1000*1000))) { log->error(SectionName, 13, *fpvi); }
+                    else if (param == "reload-min") ReloadMin = reload_bound;
+                    else ReloadMax = reload_bound;
+                }
+                else if (param == "activation") {
+                    if (value == "conntrack") CtActivation = true;
+                    else if (value == "rounds") CtActivation = false;
+                    else { log->error(SectionName, 11, *fpvi); }
+                }
                 else { log->error(SectionName, 11, *fpvi); }
             } 
             else if (option == "reload") 
@@ -133,14 +184,22 @@ int NiceShaper::init(std::vector <std::string> &fpv_conffile, std::vector <std::
         if (!SectionShape) log->error(SectionName, 20, ""); 
         if (FlowDirection == UNSPEC) log->error(SectionName, 21, "");
         if (SectionShape > SectionHtbCeil ) log->error(SectionName, 40, "");
+        // Interval adapts only within given bounds, the missing one is the reload itself
+        if (ReloadMin || ReloadMax) {
+            if (!ReloadMin) ReloadMin = Reload;
+            if (!ReloadMax) ReloadMax = Reload;
+            if ((ReloadMin > Reload) || (ReloadMax < Reload)) log->error(SectionName, 79, "");
+        }
     }
     else {
         SectionHtbCeil = MAX_RATE;
         SectionShape = MAX_RATE;
     }
 
+    ReloadCurr = Reload;
+
     /* Initialize template object with default values */
-    nsclass_template = new NsClass(SectionName, SectionId, WaitingRoomId, FlowDirection, SectionShape);
+    nsclass_template = new NsClass(SectionName, SectionId, WaitingRoomId, FlowDirection, SectionShape, Arena);
 
     if (!SAOContainter) {
         // Classes defaults
@@ -156,6 +215,9 @@ int NiceShaper::init(std::vector <std::string> &fpv_conffile, std::vector <std::
             else if ((option == "htb") || (option == "sfq") || (option == "esfq")) {
                 if (nsclass_template->store(*fpvi) == -1) return -1;
             }    
+            else if ((option == "fq_codel") || (option == "cake") || (option == "fq")) {
+                if (nsclass_template->store(*fpvi) == -1) return -1;
+            }    
             else if ((option == "alter") || (option == "quota")) {
                 if (nsclass_template->store(*fpvi) == -1) return -1;
             }
@@ -170,47 +232,35 @@ int NiceShaper::init(std::vector <std::string> &fpv_conffile, std::vector <std::
         }
     }
 
-    mydatablock = false;
-    mydatablockdnswstubs = false;
-    dnsw_before = 0; 
-    fpvi=fpv_classfile.begin();
-    while (fpvi != fpv_classfile.end()) 
-    {
-        option = aux::awk(*fpvi, 1);
-        if (!SAOContainter) {
-            if ((option == "class") || (option == "class-virtual")) {
-                if (aux::awk(*fpvi, 2) == SectionName) {
-                    mydatablock = true;
-                    mydatablockdnswstubs = false;
-                    dnsw_before++;
-                }
-                else {
-                    mydatablock = false;
-                    mydatablockdnswstubs = false;
+    // Partition is shared by sections prepared at the same time, thus it's only read here
+    if (SAOContainter) {
+        fpv_myclasses = &partition.DnswClasses;
+    }
+    else {
+        sci = partition.SectionsClasses.find(SectionName);
+        if (sci != partition.SectionsClasses.end()) fpv_myclasses = &sci->second;
+        else fpv_myclasses = &fpv_noclasses;
+        // Stubs of wrapper and do-not-shape classes remember how many classes of this section precede them
+        shi = partition.SectionsHeaders.find(SectionName);
+        dnsw_before = 0; 
+        dnsw_header = 0;
+        fpvi = partition.DnswClasses.begin();
+        while (fpvi != partition.DnswClasses.end())
+        {
+            option = aux::awk(*fpvi, 1);
+            fpv_myclasses_dnswstubs.push_back(*fpvi);       
+            if ((option == "class-wrapper") || (option == "class-do-not-shape")) {
+                if (shi != partition.SectionsHeaders.end()) {
+                    while ((dnsw_before < shi->second.size()) && (shi->second.at(dnsw_before) < partition.DnswHeaders.at(dnsw_header))) dnsw_before++;
                 }
+                fpv_myclasses_dnswstubs.push_back("_dnswstub-before_ " + aux::int_to_str(dnsw_before));
+                dnsw_header++;
             }
-            else if ((option == "class-wrapper") || (option == "class-do-not-shape")) {
-                mydatablock = false;
-                mydatablockdnswstubs = true;
-            }
-        }
-        else {
-            if ((option == "class-wrapper") || (option == "class-do-not-shape")) mydatablock = true;
-            else if ((option == "class") || (option == "class-virtual")) mydatablock = false;
-        }
-
-        if (mydatablock) {
-            fpv_myclasses.push_back(*fpvi);
-        }
-        else if (mydatablockdnswstubs) {
-            fpv_myclasses_dnswstubs.push_back(*fpvi);       
-            if ((option == "class-wrapper") || (option == "class-do-not-shape")) fpv_myclasses_dnswstubs.push_back("_dnswstub-before_ " + aux::int_to_str(dnsw_before));
+            fpvi++;
         }
-
-        fpvi++;
     }
 
-    if (!fpv_myclasses.size()) {
+    if (!fpv_myclasses->size()) {
         if (SAOContainter) return 0;
         else {
             log->error(SectionName, 23, "");
@@ -219,14 +269,14 @@ int NiceShaper::init(std::vector <std::string> &fpv_conffile, std::vector <std::
     }
 
     /* Initialize NsClass objects, using template object and extra parameters */     
-    fpvi=fpv_myclasses.begin();
-    while (fpvi != fpv_myclasses.end())
+    fpvi=fpv_myclasses->begin();
+    while (fpvi != fpv_myclasses->end())
     {
         option = aux::awk (*fpvi, 1);
         param = aux::awk (*fpvi, 2);
         if (aux::is_in_vector(config->ProperClassesTypes, option)) {
             // Create class object
-            NsClasses.push_back (new NsClass(*nsclass_template));
+            NsClasses.push_back (new (Arena->Classes.alloc()) NsClass(*nsclass_template));
             // Completing section interfaces and class names
             if ((option == "class") || (option == "class-virtual")) {
                 iface = aux::trim_dev(aux::awk(*fpvi, 3));
@@ -239,7 +289,10 @@ int NiceShaper::init(std::vector <std::string> &fpv_conffile, std::vector <std::
                 nsclass_name = aux::awk(*fpvi, 3);
             }
             if (!ifaces->isValidSysDev(iface)) { log->error (SectionName, 16, *fpvi); return -1; }
-            if (!aux::is_in_vector(SectionIfaces, iface)) SectionIfaces.push_back(iface);
+            if (!aux::is_in_vector(SectionIfaces, iface)) {
+                SectionIfaces.push_back(iface);
+                SectionIfacesHandles.push_back(ifaces->handle(iface));
+            }
             if (aux::is_in_vector(nsclasses_registered, nsclass_name)) { log->error (SectionName, 863, *fpvi); return -1; }
             nsclasses_registered.push_back(nsclass_name);
         }
@@ -260,7 +313,7 @@ int NiceShaper::init(std::vector <std::string> &fpv_conffile, std::vector <std::
                     continue;
                 }
                 mydatablockdnswstubs = true;
-                NsClassesDnswStubs.push_back(new NsClass(SectionName, SectionId, WaitingRoomId, FlowDirection, SectionShape));
+                NsClassesDnswStubs.push_back(new (Arena->Classes.alloc()) NsClass(SectionName, SectionId, WaitingRoomId, FlowDirection, SectionShape, Arena));
                 NsClassesDnswStubs.back()->setAsDnswStub();
                 if (option == "class-wrapper") DnswWrapper = true;
                 else if (config->getStatusShowDoNotShape() && (option == "class-do-not-shape")) DnswDoNotShape = true;
@@ -278,6 +331,8 @@ int NiceShaper::init(std::vector <std::string> &fpv_conffile, std::vector <std::
     for (unsigned int n=0; n < NsClasses.size(); n++) {
         if (NsClasses.at(n)->validateParams() == -1) return -1;
         if (NsClasses.at(n)->prepareQosClass() == -1) return -1;
+        NsClasses.at(n)->getTriggerMinutes(trigger_minutes);
+        for (unsigned int m=0; m < trigger_minutes.size(); m++) Triggers.add(trigger_minutes.at(m), n);
         if (NsClasses.at(n)->htbBurst() > max_htb_burst) max_htb_burst = NsClasses.at(n)->htbBurst();
         if (NsClasses.at(n)->htbCBurst() > max_htb_cburst) max_htb_cburst = NsClasses.at(n)->htbCBurst();
         // Check for iptables requirement
@@ -293,20 +348,21 @@ int NiceShaper::init(std::vector <std::string> &fpv_conffile, std::vector <std::
         if (!IptRequiredToCheckTraffic) IptRequiredToCheckTraffic = NsClassesDnswStubs.at(n)->getIptRequiredToCheckTraffic();
     }
 
+    hostsIndexBuild();
+
     if (SectionHtbBurst && max_htb_burst && (SectionHtbBurst < max_htb_burst)) { sys->rtnlClose(); log->error (SectionName, 802); return -1; }
     else if (!SectionHtbBurst && max_htb_burst) SectionHtbBurst = max_htb_burst;
 
     if (SectionHtbCBurst && max_htb_cburst && (SectionHtbCBurst < max_htb_cburst)) { sys->rtnlClose(); log->error (SectionName, 802); return -1; }
     else if (!SectionHtbCBurst && max_htb_cburst) SectionHtbCBurst = max_htb_cburst;
 
-    if (initQos() == -1) return -1;
-   
     return 0;
 }
 
 int NiceShaper::initQos()
 {
     std::string iface;
+    unsigned int htb_trees, htb_major;
 
     // Initialize common HTB classes and filters
     if (sys->rtnlOpen() == -1) { return -1; }
@@ -319,9 +375,14 @@ int NiceShaper::initQos()
 
             if (!ifaces->isValidSysDev(iface)) { sys->rtnlClose(); log->error (SectionName, 16, iface); return -1; }
 
-            if (sys->setQosClass(QOS_ADD, ifaces->index(iface), 0, SectionId, SectionHtbCeil, SectionHtbCeil, 5, aux::compute_quantum(SectionHtbCeil), SectionHtbBurst, SectionHtbCBurst) == -1) { sys->rtnlClose(); return -1; }
-            if (sys->setQosClass(QOS_ADD, ifaces->index(iface), SectionId, WaitingRoomId, (SectionHtbCeil-SectionShape), (SectionHtbCeil-SectionShape), 5, aux::compute_quantum((SectionHtbCeil-SectionShape)), 0, 0) == -1) { sys->rtnlClose(); return -1; }
-            if (sys->setQosQdisc(QOS_ADD, ifaces->index(iface), WaitingRoomId, WaitingRoomId, SFQ, 10) == -1) { sys->rtnlClose(); return -1; }
+            // Section ceil is repeated in each tree, classes' ceils split SectionShape over them
+            htb_trees = ifaces->htbTrees(ifaces->handle(iface));
+            for (unsigned int m=0; m < htb_trees; m++) {
+                htb_major = ifaces->htbMajor(ifaces->handle(iface), m);
+                if (sys->setQosClass(QOS_ADD, ifaces->index(iface), 0, SectionId, SectionHtbCeil, SectionHtbCeil, 5, aux::compute_quantum(SectionHtbCeil), SectionHtbBurst, SectionHtbCBurst, htb_major) == -1) { sys->rtnlClose(); return -1; }
+                if (sys->setQosClass(QOS_ADD, ifaces->index(iface), SectionId, WaitingRoomId, (SectionHtbCeil-SectionShape)/htb_trees, (SectionHtbCeil-SectionShape)/htb_trees, 5, aux::compute_quantum((SectionHtbCeil-SectionShape)/htb_trees), 0, 0, htb_major) == -1) { sys->rtnlClose(); return -1; }
+                if (sys->setQosQdisc(QOS_ADD, ifaces->index(iface), WaitingRoomId, ifaces->htbLeafHandle(ifaces->handle(iface), WaitingRoomId), SFQ, 10, 0, htb_major, NULL) == -1) { sys->rtnlClose(); return -1; }
+            }
         }
     }
 
@@ -349,6 +410,143 @@ int NiceShaper::recoverQos()
     return 0;
 }
 
+int NiceShaper::prepareQosFilters()
+{
+    for (unsigned int n=0; n<NsClasses.size(); n++) {
+        if (NsClasses.at(n)->prepareQosFilters() == -1) return -1;
+    }
+
+    return 0;
+}
+
+int NiceShaper::reload(NiceShaper *fresh)
+{
+    NsClass *nsclass;
+    std::map <std::string, NsClass *> classes_index;
+    std::map <std::string, NsClass *>::iterator cii;
+    std::vector <NsClass *> nsclasses_created;
+    unsigned int nsclasses_kept = 0;
+    __u64 counter_day, counter_week, counter_month;
+    int result = 0;
+
+    // Fresh object is prepared from the new classes file, but only the differences are applied
+    // to the kernel, thus shaping of untouched classes goes on without any break
+    for (unsigned int n=0; n<NsClasses.size(); n++) {
+        classes_index[NsClasses.at(n)->getHeader()] = NsClasses.at(n);
+    }
+
+    for (unsigned int n=0; n<fresh->NsClasses.size(); n++) {
+        nsclass = fresh->NsClasses.at(n);
+        cii = classes_index.find(nsclass->getHeader());
+        if ((cii != classes_index.end()) && (cii->second->getDefinition() == nsclass->getDefinition())) {
+            // Untouched class keeps its running state
+            fresh->NsClasses.at(n) = cii->second;
+            nsclasses_kept++;
+            Arena->Classes.destroy(nsclass);
+            classes_index.erase(cii);
+            continue;
+        }
+        if (cii != classes_index.end()) {
+            cii->second->getQuotaCounters(counter_day, counter_week, counter_month);
+            nsclass->setQuotaCounters(counter_day, counter_week, counter_month);
+        }
+        nsclass->resyncRawBytes();
+        nsclasses_created.push_back(nsclass);
+    }
+
+    if (sys->rtnlOpen() == -1) result = -1;
+    else {
+        // Removed and changed classes are taken down first, changed ones may reuse the same filters handles
+        for (cii = classes_index.begin(); cii != classes_index.end(); cii++) {
+            if (cii->second->remove() == -1) { result = -1; break; }
+        }
+        for (unsigned int n=0; (result != -1) && (n < nsclasses_created.size()); n++) {
+            if (nsclasses_created.at(n)->addQosFilters() == -1) result = -1;
+            else if ((nsclasses_created.at(n)->type() == WRAPPER) && (nsclasses_created.at(n)->add() == -1)) result = -1;
+        }
+        sys->rtnlClose();
+    }
+
+    for (cii = classes_index.begin(); cii != classes_index.end(); cii++) Arena->Classes.destroy(cii->second);
+
+    NsClasses.swap(fresh->NsClasses);
+    fresh->NsClasses.clear();
+
+    for (unsigned int n=0; n<NsClassesDnswStubs.size(); n++) Arena->Classes.destroy(NsClassesDnswStubs.at(n));
+    NsClassesDnswStubs.swap(fresh->NsClassesDnswStubs);
+    fresh->NsClassesDnswStubs.clear();
+    for (unsigned int n=0; n<NsClassesDnswStubs.size(); n++) NsClassesDnswStubs.at(n)->resyncRawBytes();
+
+    IptRequired = fresh->IptRequired;
+    IptRequiredToCheckActivity = fresh->IptRequiredToCheckActivity;
+    IptRequiredToCheckTraffic = fresh->IptRequiredToCheckTraffic;
+    DnswDoNotShape = fresh->DnswDoNotShape;
+    DnswWrapper = fresh->DnswWrapper;
+    IptOrderedCounters.clear();
+    IptOrderedCountersDnsw.clear();
+
+    // Wheel slots point to positions within the new classes order
+    Triggers = fresh->Triggers;
+    TriggerMinute = 0;
+
+    // Kept classes came from this object, thus the index of the fresh one is void
+    hostsIndexBuild();
+
+    delete fresh;
+
+    if (result == -1) {
+        log->setReqRecoverQos(true);
+        return -1;
+    }
+
+    log->info(SectionName, 15, aux::int_to_str(nsclasses_kept) + "/" + aux::int_to_str(static_cast<unsigned int>(NsClasses.size())));
+
+    return 0;
+}
+
+void NiceShaper::hostsIndexBuild()
+{
+    std::vector <std::string> addrs;
+
+    HostsIndex.clear();
+
+    if (!CtActivation || SAOContainter) return;
+
+    for (unsigned int n=0; n < NsClasses.size(); n++) {
+        if (NsClasses.at(n)->type() != STANDARD_CLASS) continue;
+        addrs.clear();
+        NsClasses.at(n)->getHostAddrs(addrs);
+        for (unsigned int m=0; m < addrs.size(); m++) HostsIndex.insert(std::pair <std::string, NsClass *> (addrs.at(m), NsClasses.at(n)));
+    }
+}
+
+int NiceShaper::activateHosts(std::vector <std::string> &addrs, time_t tv_sec)
+{
+    std::pair <std::multimap <std::string, NsClass *>::iterator, std::multimap <std::string, NsClass *>::iterator> range;
+    std::multimap <std::string, NsClass *>::iterator hi;
+    std::vector <NsClass *> nsclasses_waiting;
+
+    if (HostsIndex.empty()) return 0;
+
+    for (unsigned int n=0; n < addrs.size(); n++) {
+        range = HostsIndex.equal_range(addrs.at(n));
+        for (hi = range.first; hi != range.second; hi++) {
+            if (!hi->second->getActive() && !hi->second->getQosInitialized()) nsclasses_waiting.push_back(hi->second);
+        }
+    }
+
+    if (nsclasses_waiting.empty()) return 0;
+
+    // Class leaves the waiting room at once, the next round sets its rate among the others
+    if (sys->rtnlOpen() == -1) return -1;
+    for (unsigned int n=0; n < nsclasses_waiting.size(); n++) {
+        if (nsclasses_waiting.at(n)->activate(tv_sec) == -1) { sys->rtnlClose(); log->setReqRecoverQos(true); return -1; }
+    }
+    sys->rtnlClose();
+
+    return nsclasses_waiting.size();
+}
+
 EnumFlowDirection NiceShaper::getFlowDirection() 
 { 
     return FlowDirection; 
@@ -397,14 +595,16 @@ int NiceShaper::receiptIptTraffic (std::vector <__u64> &ipt_ordered_counters, st
 int NiceShaper::qosCheckClassesBytes()
 {
     NsClass *iterclass;
-    std::string iface;
     __u32 qos_class_id;
-    __u64 qos_class_bytes;
+    __u64 qos_class_bytes, qos_class_bytes_sum;
+    __u64 leaf_drops_sum;
+    __u32 leaf_backlog_sum;
+    unsigned int htb_trees, proceeded_trees;
+    int htb_tree;
     bool proceeded;
 
-    for (unsigned int n=0; n < SectionIfaces.size(); n++) {
-        iface = SectionIfaces.at(n);
-        if (sys->qosCheck(ifaces->index(iface), QOS_CLASS) == -1) { return -1; }
+    for (unsigned int n=0; n < SectionIfacesHandles.size(); n++) {
+        if (sys->qosCheck(ifaces->index(SectionIfacesHandles.at(n)), QOS_CLASS, 1) == -1) { return -1; }
     }
 
     for (unsigned int n=0; n < (NsClasses.size() + NsClassesDnswStubs.size()); n++) {
@@ -422,12 +622,28 @@ int NiceShaper::qosCheckClassesBytes()
             }
             iterclass = NsClassesDnswStubs.at(n-NsClasses.size());
             if (iterclass->type() != WRAPPER) continue;
+            if (iterclass->dnswStubClassIdSync() == -1) return -1;
         }
+        // Class is the sum of its copies in all HTB trees of the interface
+        htb_trees = ifaces->htbTrees(iterclass->getDevHandle());
+        proceeded_trees = 0;
+        qos_class_bytes_sum = 0;
+        leaf_backlog_sum = 0;
+        leaf_drops_sum = 0;
         for (unsigned int m=0; m < sys->QosClassesBytes.size(); m++) {
+            if (sys->QosClassesBytes.at(m)->IfIndex != static_cast<int>(iterclass->getDevId())) continue;
             qos_class_id = sys->QosClassesBytes.at(m)->QosClassId;
             qos_class_bytes = sys->QosClassesBytes.at(m)->Bytes;
-            if (qos_class_id == iterclass->qosClassId()) {
-                iterclass->proceedReceiptTraffic(qos_class_bytes);
+            if (TC_H_MIN(qos_class_id) != TC_H_MIN(iterclass->qosClassId())) continue;
+            htb_tree = ifaces->htbTree(iterclass->getDevHandle(), TC_H_MAJ(qos_class_id) >> 16);
+            if (htb_tree == -1) continue;
+            iterclass->proceedReceiptTreeBytes(htb_tree, qos_class_bytes);
+            qos_class_bytes_sum += qos_class_bytes;
+            leaf_backlog_sum += sys->QosClassesBytes.at(m)->Backlog;
+            leaf_drops_sum += sys->QosClassesBytes.at(m)->Drops;
+            if (++proceeded_trees == htb_trees) {
+                iterclass->proceedReceiptTraffic(qos_class_bytes_sum);
+                iterclass->proceedReceiptLeafStats(leaf_backlog_sum, leaf_drops_sum);
                 m=sys->QosClassesBytes.size();
                 proceeded = true;
             }
@@ -444,19 +660,22 @@ int NiceShaper::qosCheckClassesBytes()
 
 int NiceShaper::qosCheckFiltersHits()
 {
-    std::string iface;
+    int iface_handle;
     __u32 qos_filter_id;
     __u64 qos_filter_hits;
     int res;
-    unsigned int proceeded_filters_hits;
+    unsigned int proceeded_filters_hits, htb_trees;
 
-    for (unsigned int n=0; n < SectionIfaces.size(); n++) {
-        iface = SectionIfaces.at(n);
-        if (sys->qosCheck(ifaces->index(iface), QOS_FILTER) == -1) return -1;
+    for (unsigned int n=0; n < SectionIfacesHandles.size(); n++) {
+        for (unsigned int m=0; m < ifaces->htbTrees(SectionIfacesHandles.at(n)); m++) {
+            if (sys->qosCheck(ifaces->index(SectionIfacesHandles.at(n)), QOS_FILTER, ifaces->htbMajor(SectionIfacesHandles.at(n), m)) == -1) return -1;
+        }
     }
 
     for (unsigned int n=0; n < NsClasses.size(); n++) {
-        iface = NsClasses.at(n)->getDev();
+        iface_handle = NsClasses.at(n)->getDevHandle();
+        // Each filter is repeated in every HTB tree of the interface
+        htb_trees = ifaces->htbTrees(iface_handle);
         proceeded_filters_hits = 0;
         if (!NsClasses.at(n)->getUseQosFilter()) continue;
         if (NsClasses.at(n)->getIptRequiredToCheckActivity()) continue;
@@ -469,22 +688,22 @@ int NiceShaper::qosCheckFiltersHits()
                 proceeded_filters_hits++;
             }
             else if (res == 1) {
-                proceeded_filters_hits = NsClasses.at(n)->getTcFiltersNum();
+                proceeded_filters_hits = NsClasses.at(n)->getTcFiltersNum() * htb_trees;
                 m = sys->QosFiltersHits.size();
             }
         }
-        if (proceeded_filters_hits < NsClasses.at(n)->getTcFiltersNum()) {
+        if (proceeded_filters_hits < (NsClasses.at(n)->getTcFiltersNum() * htb_trees)) {
             // Workaround for impossible to read last filter on 3.14 and several newer kernels under x86
-            if ((proceeded_filters_hits == (NsClasses.at(n)->getTcFiltersNum()-1)) && 
-                    (NsClasses.at(n)->getTcFilterU32MaxId() == ifaces->getTcFilterU32MaxId(iface)) &&
-                    (NsClasses.at(n)->getTcFilterU32MaxId() != ifaces->getTcFilterU32MinId(iface))) {
-                if (ifaces->getWAMissLastU32Used(iface)) {
+            if ((proceeded_filters_hits == ((NsClasses.at(n)->getTcFiltersNum()-1) * htb_trees)) && 
+                    (NsClasses.at(n)->getTcFilterU32MaxId() == ifaces->getTcFilterU32MaxId(iface_handle)) &&
+                    (NsClasses.at(n)->getTcFilterU32MaxId() != ifaces->getTcFilterU32MinId(iface_handle))) {
+                if (ifaces->getWAMissLastU32Used(iface_handle)) {
                     log->error(SectionName, 501);
                     return -1;
                 }
                 log->error(SectionName, 503);
                 if (NsClasses.at(n)->addWAMissLastU32() == -1) return -1;
-                ifaces->setWAMissLastU32Used(iface, true);
+                ifaces->setWAMissLastU32Used(iface_handle, true);
                 NsClasses.at(n)->proceedQosFilterHits(NsClasses.at(n)->getTcFilterU32MaxId(), 1);
                 continue;
             }
@@ -501,8 +720,28 @@ int NiceShaper::judge(struct timeval tv_curr, double round_duration)
 {
     unsigned int ipt_ordered_counters_offset = 0;
     __u64 ipt_ordered_counters_sum = 0;
+    struct TriggerTime *trigger_time = NULL;
+    bool triggers_full = false;
 
     if (SAOContainter) return 0;
+
+    // Local time is resolved once per minute for the whole section instead of per class and round,
+    // the trigger wheel tells which classes have time driven triggers due in that minute
+    TriggersDue.clear();
+    if ((tv_curr.tv_sec / 60) != TriggerMinute) {
+        if (triggerTimePrepare(tv_curr.tv_sec) != -1) {
+            TriggerMinute = tv_curr.tv_sec / 60;
+            triggers_full = (Triggers.advance(TriggerMinute, TriggerTimeCurr.Dmin, TriggersDue) == 1);
+        }
+    }
+    if (TriggerMinute) trigger_time = &TriggerTimeCurr;
+
+    if (triggers_full) {
+        for (unsigned int n=0; n < NsClasses.size(); n++) NsClasses.at(n)->proceedTriggers(TriggerTimeCurr);
+    }
+    else {
+        for (unsigned int n=0; n < TriggersDue.size(); n++) NsClasses.at(TriggersDue.at(n))->proceedTriggers(TriggerTimeCurr);
+    }
    
     sys->cleanAccountingHelpers();
 
@@ -538,7 +777,7 @@ int NiceShaper::judge(struct timeval tv_curr, double round_duration)
             NsClasses.at(n)->proceedReceiptIptCountersSum(ipt_ordered_counters_sum);
         }
 
-        NsClasses.at(n)->proceedReceiptedTraffic(tv_curr, round_duration);
+        NsClasses.at(n)->proceedReceiptedTraffic(tv_curr, round_duration, trigger_time);
     }
 
     if (DnswDoNotShape) {
@@ -558,7 +797,7 @@ int NiceShaper::judge(struct timeval tv_curr, double round_duration)
 
     if (DnswWrapper || DnswDoNotShape) {
         for (unsigned int n=0; n<NsClassesDnswStubs.size(); n++) {
-            NsClassesDnswStubs.at(n)->proceedReceiptedTraffic(tv_curr, round_duration);
+            NsClassesDnswStubs.at(n)->proceedReceiptedTraffic(tv_curr, round_duration, NULL);
         }
     }
 
@@ -568,6 +807,72 @@ int NiceShaper::judge(struct timeval tv_curr, double round_duration)
     if (applyChanges() == -1) { sys->rtnlClose(); return -1; }
     sys->rtnlClose();
 
+    reloadAdapt();
+
+    return 0;
+}
+
+__u64 NiceShaper::judgeGaining(std::vector <NsClass *> &ns_classes_enlargeable, __u64 sum_range_of_gaining, __u64 disparity)
+{
+    __u64 alignment = 0;
+    __u64 gained = 0;
+    NsClass *iterclass;
+
+    if (!disparity || !sum_range_of_gaining) return 0;
+
+    for (unsigned int n=0; n<ns_classes_enlargeable.size(); n++) {
+        iterclass=ns_classes_enlargeable.at(n);
+        alignment = disparity * (static_cast<double>(iterclass->nsCeil()-iterclass->nsLow()) / static_cast<double>(sum_range_of_gaining));
+        if ((iterclass->nsCeil() - iterclass->htbCeil()) > alignment) {
+            iterclass->incHtbCeil(alignment);
+            gained += alignment;
+        }
+        else {
+            gained += iterclass->nsCeil() - iterclass->htbCeil();
+            iterclass->setHtbCeil(iterclass->nsCeil());
+        }
+    }
+
+    return (gained < disparity) ? gained : disparity;
+}
+
+void NiceShaper::reloadAdapt()
+{
+    bool changing = (Working != WorkingPrev);
+
+    WorkingPrev = Working;
+
+    if (!ReloadMin || !ReloadMax) return;
+
+    // Saturated section and classes coming and going need quick reaction, the interval is halved.
+    // Idle section backs off slowly, the one loaded in between drifts back to the reload value.
+    if (changing || (SectionTraffic >= (SectionShape / 10) * 9)) {
+        ReloadCurr = (ReloadCurr / 2 > ReloadMin) ? ReloadCurr / 2 : ReloadMin;
+    }
+    else if (SectionTraffic < (SectionShape / 2)) {
+        ReloadCurr = (ReloadCurr + ReloadCurr / 4 < ReloadMax) ? ReloadCurr + ReloadCurr / 4 : ReloadMax;
+    }
+    else if (ReloadCurr < Reload) {
+        ReloadCurr = (ReloadCurr + ReloadCurr / 4 < Reload) ? ReloadCurr + ReloadCurr / 4 : Reload;
+    }
+    else if (ReloadCurr > Reload) {
+        ReloadCurr = (ReloadCurr - ReloadCurr / 4 > Reload) ? ReloadCurr - ReloadCurr / 4 : Reload;
+    }
+}
+
+int NiceShaper::triggerTimePrepare(time_t tv_sec)
+{
+    struct tm ltime;
+
+    if (localtime_r(&tv_sec, &ltime) == NULL) return -1;
+    TriggerTimeCurr.Dmin = ltime.tm_hour*60+ltime.tm_min;
+    TriggerTimeCurr.Wday = ltime.tm_wday;
+    TriggerTimeCurr.Mday = ltime.tm_mday;
+
+    tv_sec += 86400;
+    if (localtime_r(&tv_sec, &ltime) == NULL) return -1;
+    TriggerTimeCurr.MdayLast = (ltime.tm_mday == 1);
+
     return 0;
 }
 
@@ -575,17 +880,19 @@ int NiceShaper::judgeV12()
 {
     enum JudgePhase { JP_REDUCING_ACCEL, JP_REDUCING_PRECISE, JP_GAINING } phase;
     unsigned int loop_counter = 0;
-    unsigned int section_traffic_prognosed = 0;
-    unsigned int disparity = 0;
-    unsigned int alignment = 0;
-    unsigned int acceptable_margin = 1 * KBITS;
-    unsigned int class_disparity = 0;
-    unsigned int min_class_disparity = 0;
-    unsigned int sum_inviolable_classes_traffic = 0;
-    unsigned int sum_range_of_gaining = 0;
+    __u64 section_traffic_prognosed = 0;
+    __u64 disparity = 0;
+    __u64 alignment = 0;
+    __u64 acceptable_margin = 1 * KBITS;
+    __u64 class_disparity = 0;
+    __u64 min_class_disparity = 0;
+    __u64 sum_inviolable_classes_traffic = 0;
+    __u64 sum_range_of_gaining = 0;
     double sum_grade_for_reducing = 0;
     std::vector <NsClass *> ns_classes_reducible;
     std::vector <NsClass *> ns_classes_enlargeable;
+    std::vector <NsClass *> ns_classes_congested;
+    __u64 sum_range_of_congested = 0;
     NsClass *iterclass;   
 
     SectionTraffic = 0;
@@ -620,8 +927,16 @@ int NiceShaper::judgeV12()
             }
 
             if (iterclass->htbCeil() < iterclass->nsCeil()) {
-                ns_classes_enlargeable.push_back(iterclass);
-                sum_range_of_gaining += (iterclass->nsCeil()-iterclass->nsLow());
+                // Queueing in leaf shows which classes are really limited by their ceil, 
+                // thus free bandwidth is given to them first.
+                if (CongestionSignalBacklog && iterclass->congested()) {
+                    ns_classes_congested.push_back(iterclass);
+                    sum_range_of_congested += (iterclass->nsCeil()-iterclass->nsLow());
+                }
+                else {
+                    ns_classes_enlargeable.push_back(iterclass);
+                    sum_range_of_gaining += (iterclass->nsCeil()-iterclass->nsLow());
+                }
             }
         }
     }
@@ -699,14 +1014,9 @@ int NiceShaper::judgeV12()
             }
         }
         else if (phase == JP_GAINING) {
-            for (unsigned int n=0; n<ns_classes_enlargeable.size(); n++) {
-                iterclass=ns_classes_enlargeable.at(n);
-                alignment = disparity * (static_cast<double>(iterclass->nsCeil()-iterclass->nsLow()) / static_cast<double>(sum_range_of_gaining));
-                if ((iterclass->nsCeil() - iterclass->htbCeil()) > alignment) {
-                    iterclass->incHtbCeil(alignment);
-                }
-                else iterclass->setHtbCeil(iterclass->nsCeil());
-            }
+            // Congested classes are served first, the rest gets what they can't take
+            disparity -= judgeGaining(ns_classes_congested, sum_range_of_congested, disparity);
+            judgeGaining(ns_classes_enlargeable, sum_range_of_gaining, disparity);
             return 0;
         }
 
@@ -741,7 +1051,14 @@ int NiceShaper::statusUnformatted(std::vector <std::string> &status_table)
 
     if (config->getStatusShowSum() != SS_FALSE)
     {
-        sum = "sum(classes:" + aux::int_to_str(Working) + ") " + aux::int_to_str(SectionShape) + " " + aux::int_to_str(SectionShape) + " " + aux::int_to_str(SectionTraffic);
+        sum = "sum(classes:";
+        aux::append_u64(sum, Working);
+        sum += ") ";
+        aux::append_u64(sum, SectionShape);
+        sum += ' ';
+        aux::append_u64(sum, SectionShape);
+        sum += ' ';
+        aux::append_u64(sum, SectionTraffic);
     }   
 
     if (config->getStatusShowSum() == SS_TOP) 
@@ -774,22 +1091,51 @@ int NiceShaper::statusUnformatted(std::vector <std::string> &status_table)
     return 0;
 }
 
-std::vector <std::string> NiceShaper::dumpQuotaCounters ()
+int NiceShaper::dumpQuotaRecords (std::vector <QuotaJournalRecord> &records, bool all)
+{
+    __u64 counter_day, counter_week, counter_month;
+    QuotaJournalRecord record;
+
+    records.clear();
+
+    for (unsigned int n=0; n<NsClasses.size(); n++) {
+        NsClasses.at(n)->getQuotaCounters(counter_day, counter_week, counter_month);
+        if (!NsClasses.at(n)->getQuotaDirty() && !(all && (counter_day || counter_week || counter_month))) continue;
+
+        memset(&record, 0, sizeof(QuotaJournalRecord));
+        strncpy(record.Name, NsClasses.at(n)->name().c_str(), sizeof(record.Name)-1);
+        record.TotalDay = counter_day;
+        record.TotalWeek = counter_week;
+        record.TotalMonth = counter_month;
+        records.push_back(record);
+
+        NsClasses.at(n)->setQuotaDirty(false);
+    }
+
+    return 0;
+}
+
+int NiceShaper::setQuotaRecords (std::vector <QuotaJournalRecord> &records)
 {
-    std::vector <std::string> counters_table;
-    std::string counters;
+    std::map <std::string, NsClass *> classes_index;
+    std::map <std::string, NsClass *>::iterator cii;
 
     for (unsigned int n=0; n<NsClasses.size(); n++) {
-        counters = NsClasses.at(n)->dumpQuotaCounters();
-        if (!counters.empty()) counters_table.push_back(counters);
+        classes_index[NsClasses.at(n)->name()] = NsClasses.at(n);
     }
 
-    return counters_table;
+    for (unsigned int n=0; n<records.size(); n++) {
+        cii = classes_index.find(std::string(records.at(n).Name, strnlen(records.at(n).Name, sizeof(records.at(n).Name))));
+        if (cii == classes_index.end()) continue;
+        cii->second->setQuotaCounters(records.at(n).TotalDay, records.at(n).TotalWeek, records.at(n).TotalMonth);
+    }
+
+    return 0;
 }
 
 int NiceShaper::setQuotaCounters (std::vector <std::string> &counters_table)
 {
-    unsigned int counter_day, counter_week, counter_month;
+    __u64 counter_day, counter_week, counter_month;
     std::vector <std::string>::iterator fpvi, fpvi_end;
     std::string class_name = "";
 
@@ -801,9 +1147,9 @@ int NiceShaper::setQuotaCounters (std::vector <std::string> &counters_table)
         class_name = aux::awk(*fpvi, 1); 
         for (unsigned int n=0; n<NsClasses.size(); n++) {    
             if (class_name == NsClasses.at(n)->name()) { 
-                counter_day = aux::str_to_uint(aux::awk (*fpvi, 2));
-                counter_week = aux::str_to_uint(aux::awk (*fpvi, 3));
-                counter_month = aux::str_to_uint(aux::awk (*fpvi, 4));
+                counter_day = aux::str_to_u64(aux::awk (*fpvi, 2));
+                counter_week = aux::str_to_u64(aux::awk (*fpvi, 3));
+                counter_month = aux::str_to_u64(aux::awk (*fpvi, 4));
                 NsClasses.at(n)->setQuotaCounters (counter_day, counter_week, counter_month); 
                 break; 
             }
@@ -814,5 +1160,33 @@ int NiceShaper::setQuotaCounters (std::vector <std::string> &counters_table)
     return 0;
 }
 
+int NiceShaper::shmStatusFill (std::vector <ShmStatusRecord> &records)
+{
+    __u64 counter_day, counter_week, counter_month;
+    NsClass *nsclass;
+
+    records.resize(NsClasses.size());
 
+    for (unsigned int n=0; n<NsClasses.size(); n++) {
+        nsclass = NsClasses.at(n);
+        ShmStatusRecord &record = records.at(n);
+
+        memset(&record, 0, sizeof(ShmStatusRecord));
+        strncpy(record.SectionName, SectionName.c_str(), sizeof(record.SectionName)-1);
+        strncpy(record.Name, nsclass->name().c_str(), sizeof(record.Name)-1);
+        record.ClassId = nsclass->qosClassId();
+        if (nsclass->getActive()) record.Flags |= SHM_STATUS_ACTIVE;
+        record.Traffic = nsclass->traffic();
+        record.HtbCeil = nsclass->htbCeil();
+        record.OldHtbCeil = nsclass->oldHtbCeil();
+        nsclass->getQuotaCounters(counter_day, counter_week, counter_month);
+        record.QuotaDay = counter_day;
+        record.QuotaWeek = counter_week;
+        record.QuotaMonth = counter_month;
+        record.LeafBacklog = nsclass->leafBacklog();
+        record.LeafDrops = nsclass->leafDrops();
+    }
+
+    return 0;
+}
 
@@ -3,14 +3,22 @@
 
 #include <sys/time.h>
 
+#include <map>
+
 #include "class.h"
+#include "config.h"
+#include "quotastore.h"
+#include "shmstatus.h"
 
 class NiceShaper {
     public:
-        NiceShaper(std::string, unsigned int, unsigned int, bool);
+        NiceShaper(std::string, unsigned int, unsigned int, bool, SectionArena *);
         ~NiceShaper();
-        int init(std::vector <std::string> &, std::vector <std::string> &);
+        int init();
+        int prepare(std::vector <std::string> &, ClassFilePartition &);
         int initQos();
+        int prepareQosFilters();
+        int reload(NiceShaper *);
         int recoverQos();
         EnumFlowDirection getFlowDirection();
         void setIptRequired(bool);
@@ -19,37 +27,60 @@ class NiceShaper {
         bool getIptRequiredToCheck();
         int receiptIptTraffic (std::vector <__u64> &, std::vector <__u64> &);
         int judge(struct timeval, double);
+        int activateHosts(std::vector <std::string> &, time_t);
+        bool getCtActivation() { return CtActivation; }
         int statusUnformatted(std::vector <std::string> &);
-        std::vector <std::string> dumpQuotaCounters ();
+        int dumpQuotaRecords (std::vector <QuotaJournalRecord> &, bool);
+        int setQuotaRecords (std::vector <QuotaJournalRecord> &);
         int setQuotaCounters (std::vector <std::string> &);
-        unsigned int getReload() { return Reload; };
+        int shmStatusFill (std::vector <ShmStatusRecord> &);
+        unsigned int getClassesCount() { return NsClasses.size(); }
+        unsigned int getReload() { return ReloadCurr; };
     private:
         int qosCheckClassesBytes();
         int qosCheckFiltersHits();
         int judgeV12();
+        __u64 judgeGaining(std::vector <NsClass *> &, __u64, __u64);
+        int triggerTimePrepare(time_t);
         int applyChanges();  
+        void hostsIndexBuild();
+        void reloadAdapt();
         //
         std::string SectionName; 
         unsigned int SectionId;
         unsigned int WaitingRoomId;
-        unsigned int SectionHtbCeil;
-        unsigned int SectionShape;
+        __u64 SectionHtbCeil;
+        __u64 SectionShape;
         unsigned int Reload;
+        unsigned int ReloadMin; // Adaptive interval bounds, both 0 for fixed one
+        unsigned int ReloadMax;
+        unsigned int ReloadCurr;
+        unsigned int WorkingPrev;
         EnumFlowDirection FlowDirection;
         std::vector <std::string> SectionIfaces;
+        std::vector <int> SectionIfacesHandles;
         bool SAOContainter;
         bool IptRequired;
         bool IptRequiredToCheckActivity;
         bool IptRequiredToCheckTraffic;
         bool DnswDoNotShape;
         bool DnswWrapper;
-        unsigned int SectionTraffic;
+        bool CongestionSignalBacklog;
+        bool CtActivation;
+        __u64 SectionTraffic;
         unsigned int SectionHtbBurst;
         unsigned int SectionHtbCBurst;
         unsigned int Working;
         double CrossBar;     
+        time_t TriggerMinute;
+        struct TriggerTime TriggerTimeCurr;
+        TriggerWheel Triggers;
+        std::vector <unsigned int> TriggersDue;
+        SectionArena *Arena; // Owned by the worker, the reloaded classes are allocated there too
         std::vector <NsClass *> NsClasses;
         std::vector <NsClass *> NsClassesDnswStubs;
+        // Host addresses of standard classes, new flows of them are activated between rounds
+        std::multimap <std::string, NsClass *> HostsIndex;
         std::vector <__u64> IptOrderedCounters;
         std::vector <__u64> IptOrderedCountersDnsw;
 };
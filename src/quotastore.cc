@@ -0,0 +1,252 @@
+/*
+ *      NiceShaper - Dynamic Traffic Management
+ *
+ *      Copyright (C) 2004-2016 Mariusz Jedwabny <mariusz@jedwabny.net>
+ *
+ *      This file is subject to the terms and conditions of the GNU General Public
+ *      License.  See the file COPYING in the main directory of this archive for
+ *      more details.
+ */
+
+#include "quotastore.h"
+
+#include <cstring>
+#include <cstddef>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+QuotaStore::QuotaStore(std::string path)
+{
+    Path = path;
+    Fd = -1;
+    JournalRecords = 0;
+    // First flush always writes a fresh journal
+    NeedCompact = true;
+    Latest.clear();
+    Pending.clear();
+    pthread_mutex_init(&PendingLock, NULL);
+}
+
+QuotaStore::~QuotaStore()
+{
+    if (Fd != -1) close(Fd);
+
+    pthread_mutex_destroy(&PendingLock);
+}
+
+int QuotaStore::load(std::vector <QuotaJournalRecord> &records, unsigned int &damaged)
+{
+    struct stat journal_stat;
+    struct QuotaJournalHeader *header;
+    struct QuotaJournalRecord *journal;
+    std::map <std::string, unsigned int> records_index;
+    std::map <std::string, unsigned int>::iterator rii;
+    std::string name;
+    size_t journal_size;
+    unsigned int journal_count;
+    int fd;
+    void *segment;
+
+    records.clear();
+    damaged = 0;
+
+    fd = open(Path.c_str(), O_RDONLY);
+    if (fd == -1) return -1;
+
+    if ((fstat(fd, &journal_stat) == -1) || (static_cast<size_t>(journal_stat.st_size) < sizeof(struct QuotaJournalHeader))) {
+        close(fd);
+        return -1;
+    }
+
+    journal_size = journal_stat.st_size;
+    segment = mmap(NULL, journal_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (segment == MAP_FAILED) return -1;
+
+    header = reinterpret_cast<struct QuotaJournalHeader *>(segment);
+    if ((header->Magic != QUOTA_JOURNAL_MAGIC) || (header->Version != QUOTA_JOURNAL_VERSION) || (header->RecordSize != sizeof(struct QuotaJournalRecord))) {
+        munmap(segment, journal_size);
+        return -1;
+    }
+
+    journal = reinterpret_cast<struct QuotaJournalRecord *>(reinterpret_cast<char *>(segment) + sizeof(struct QuotaJournalHeader));
+    journal_count = (journal_size - sizeof(struct QuotaJournalHeader)) / sizeof(struct QuotaJournalRecord);
+
+    // Journal is replayed in order, the latest record of each class wins.
+    // Damaged records (e.g. torn write while crashing) are skipped.
+    for (unsigned int n=0; n<journal_count; n++) {
+        if (checksum(journal[n]) != journal[n].Checksum) {
+            damaged++;
+            continue;
+        }
+
+        name = std::string(journal[n].Name, strnlen(journal[n].Name, sizeof(journal[n].Name)));
+        rii = records_index.find(name);
+        if (rii == records_index.end()) {
+            records_index[name] = records.size();
+            records.push_back(journal[n]);
+        }
+        else {
+            records.at(rii->second) = journal[n];
+        }
+    }
+
+    munmap(segment, journal_size);
+
+    pthread_mutex_lock(&PendingLock);
+    for (unsigned int n=0; n<records.size(); n++) {
+        Latest[std::string(records.at(n).Name, strnlen(records.at(n).Name, sizeof(records.at(n).Name)))] = records.at(n);
+    }
+    NeedCompact = true;
+    pthread_mutex_unlock(&PendingLock);
+
+    return 0;
+}
+
+int QuotaStore::stage(std::vector <QuotaJournalRecord> &records)
+{
+    // Called from reload path, memory only
+    pthread_mutex_lock(&PendingLock);
+    for (unsigned int n=0; n<records.size(); n++) {
+        Latest[std::string(records.at(n).Name)] = records.at(n);
+        Pending.push_back(records.at(n));
+    }
+    pthread_mutex_unlock(&PendingLock);
+
+    return 0;
+}
+
+int QuotaStore::flush()
+{
+    std::vector <QuotaJournalRecord> records;
+    std::map <std::string, QuotaJournalRecord>::iterator li;
+    bool need_compact;
+
+    pthread_mutex_lock(&PendingLock);
+
+    if (Pending.empty() && !NeedCompact) {
+        pthread_mutex_unlock(&PendingLock);
+        return 0;
+    }
+
+    need_compact = NeedCompact || ((JournalRecords + Pending.size()) > (QUOTA_JOURNAL_COMPACT_RATIO * Latest.size() + QUOTA_JOURNAL_COMPACT_MIN));
+
+    if (need_compact) {
+        for (li = Latest.begin(); li != Latest.end(); li++) records.push_back(li->second);
+        Pending.clear();
+    }
+    else {
+        records.swap(Pending);
+    }
+
+    NeedCompact = false;
+
+    pthread_mutex_unlock(&PendingLock);
+
+    if (need_compact) {
+        if (compact(records) == -1) return -1;
+    }
+    else {
+        if (append(records) == -1) return -1;
+    }
+
+    return 0;
+}
+
+int QuotaStore::append(std::vector <QuotaJournalRecord> &records)
+{
+    size_t size = records.size() * sizeof(struct QuotaJournalRecord);
+
+    if (records.empty()) return 0;
+
+    for (unsigned int n=0; n<records.size(); n++) {
+        records.at(n).Checksum = checksum(records.at(n));
+    }
+
+    if ((Fd == -1) || (write(Fd, &records[0], size) != static_cast<ssize_t>(size)) || (fdatasync(Fd) == -1)) {
+        // Journal is rewritten from the latest counters at next flush
+        return requestCompact();
+    }
+
+    JournalRecords += records.size();
+
+    return 0;
+}
+
+int QuotaStore::compact(std::vector <QuotaJournalRecord> &records)
+{
+    std::string path_tmp = Path + ".tmp";
+    std::vector <char> buf;
+    struct QuotaJournalHeader header;
+    int fd;
+
+    header.Magic = QUOTA_JOURNAL_MAGIC;
+    header.Version = QUOTA_JOURNAL_VERSION;
+    header.RecordSize = sizeof(struct QuotaJournalRecord);
+    header.Reserved = 0;
+
+    for (unsigned int n=0; n<records.size(); n++) {
+        records.at(n).Checksum = checksum(records.at(n));
+    }
+
+    buf.resize(sizeof(struct QuotaJournalHeader) + records.size() * sizeof(struct QuotaJournalRecord));
+    memcpy(&buf[0], &header, sizeof(struct QuotaJournalHeader));
+    if (records.size()) memcpy(&buf[sizeof(struct QuotaJournalHeader)], &records[0], records.size() * sizeof(struct QuotaJournalRecord));
+
+    fd = open(path_tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) return requestCompact();
+
+    if ((write(fd, &buf[0], buf.size()) != static_cast<ssize_t>(buf.size())) || (fdatasync(fd) == -1)) {
+        close(fd);
+        unlink(path_tmp.c_str());
+        return requestCompact();
+    }
+
+    close(fd);
+
+    if (rename(path_tmp.c_str(), Path.c_str()) == -1) {
+        unlink(path_tmp.c_str());
+        return requestCompact();
+    }
+
+    if (Fd != -1) close(Fd);
+    Fd = open(Path.c_str(), O_WRONLY | O_APPEND);
+    if (Fd == -1) return requestCompact();
+
+    JournalRecords = records.size();
+
+    return 0;
+}
+
+int QuotaStore::requestCompact()
+{
+    // Latest counters are kept in memory, thus nothing is lost if write fails
+    pthread_mutex_lock(&PendingLock);
+    NeedCompact = true;
+    pthread_mutex_unlock(&PendingLock);
+
+    return -1;
+}
+
+__u32 QuotaStore::checksum(struct QuotaJournalRecord &record)
+{
+    const unsigned char *data = reinterpret_cast<const unsigned char *>(&record);
+    __u32 hash = 2166136261U;
+
+    // FNV-1a over the record without the checksum field itself
+    for (size_t n=0; n<offsetof(struct QuotaJournalRecord, Checksum); n++) {
+        hash ^= data[n];
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
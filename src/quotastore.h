@@ -0,0 +1,58 @@
+#ifndef QUOTASTORE_H
+#define QUOTASTORE_H
+
+#include <linux/types.h>
+#include <pthread.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "main.h"
+
+const __u32 QUOTA_JOURNAL_MAGIC = 0x4E53514A; // "NSQJ"
+const __u32 QUOTA_JOURNAL_VERSION = 1;
+// Journal is compacted if it's grown to this many times of the live counters
+const unsigned int QUOTA_JOURNAL_COMPACT_RATIO = 4;
+const unsigned int QUOTA_JOURNAL_COMPACT_MIN = 1024;
+
+struct QuotaJournalHeader {
+    __u32 Magic;
+    __u32 Version;
+    __u32 RecordSize;
+    __u32 Reserved;
+};
+
+struct QuotaJournalRecord {
+    char Name[MAX_CLASS_NAME_SIZE+4];
+    __u64 TotalDay;
+    __u64 TotalWeek;
+    __u64 TotalMonth;
+    __u32 Reserved;
+    __u32 Checksum;
+};
+
+class QuotaStore {
+    public:
+        QuotaStore(std::string);
+        ~QuotaStore();
+        int load(std::vector <QuotaJournalRecord> &, unsigned int &);
+        int stage(std::vector <QuotaJournalRecord> &);
+        int flush();
+        std::string getPath() { return Path; }
+    private:
+        int append(std::vector <QuotaJournalRecord> &);
+        int compact(std::vector <QuotaJournalRecord> &);
+        int requestCompact();
+        __u32 checksum(struct QuotaJournalRecord &);
+        //
+        std::string Path;
+        int Fd;
+        unsigned int JournalRecords;
+        bool NeedCompact;
+        std::map <std::string, QuotaJournalRecord> Latest;
+        std::vector <QuotaJournalRecord> Pending;
+        pthread_mutex_t PendingLock;
+};
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ *      NiceShaper - Dynamic Traffic Management
+ *
+ *      Copyright (C) 2004-2016 Mariusz Jedwabny <mariusz@jedwabny.net>
+ *
+ *      This file is subject to the terms and conditions of the GNU General Public
+ *      License.  See the file COPYING in the main directory of this archive for
+ *      more details.
+ */
+
+#include "shmstatus.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+ShmStatus::ShmStatus()
+{
+    Path = "";
+    Header = NULL;
+    Records = NULL;
+    SegmentSize = 0;
+    Owner = false;
+}
+
+ShmStatus::~ShmStatus()
+{
+    detach();
+}
+
+int ShmStatus::create(std::string path, unsigned int records_count)
+{
+    std::string path_tmp = path + ".tmp";
+    int fd;
+    void *segment;
+
+    detach();
+
+    SegmentSize = sizeof(struct ShmStatusHeader) + records_count * sizeof(struct ShmStatusRecord);
+
+    // Segment is prepared aside and renamed over the old one, readers never see the path missing
+    fd = open(path_tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) return -1;
+
+    // Readers don't need to be privileged, umask of supervisor is too strict
+    fchmod(fd, 0644);
+
+    if (ftruncate(fd, SegmentSize) == -1) {
+        close(fd);
+        unlink(path_tmp.c_str());
+        return -1;
+    }
+
+    segment = mmap(NULL, SegmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (segment == MAP_FAILED) {
+        unlink(path_tmp.c_str());
+        return -1;
+    }
+
+    Header = reinterpret_cast<struct ShmStatusHeader *>(segment);
+    Records = reinterpret_cast<struct ShmStatusRecord *>(reinterpret_cast<char *>(segment) + sizeof(struct ShmStatusHeader));
+
+    Header->Magic = SHM_STATUS_MAGIC;
+    Header->Version = SHM_STATUS_VERSION;
+    Header->HeaderSize = sizeof(struct ShmStatusHeader);
+    Header->RecordSize = sizeof(struct ShmStatusRecord);
+    Header->RecordsCount = records_count;
+    Header->Seq = 0;
+    Header->UpdateSec = 0;
+    Header->UpdateUsec = 0;
+
+    if (rename(path_tmp.c_str(), path.c_str()) == -1) {
+        munmap(Header, SegmentSize);
+        unlink(path_tmp.c_str());
+        Header = NULL;
+        Records = NULL;
+        SegmentSize = 0;
+        return -1;
+    }
+
+    Path = path;
+    Owner = true;
+
+    return 0;
+}
+
+void ShmStatus::handOver()
+{
+    // Path already leads to the new segment, the old one is only marked as retired
+    if (Owner && (Header != NULL)) {
+        Header->Magic = 0;
+        __sync_synchronize();
+    }
+
+    Owner = false;
+}
+
+void ShmStatus::publish(unsigned int first_record, std::vector <ShmStatusRecord> &records)
+{
+    volatile __u32 *seq;
+    struct timeval tv_curr;
+    unsigned int count;
+
+    if (!Owner || (Header == NULL)) return;
+    if (records.empty() || (first_record >= Header->RecordsCount)) return;
+
+    count = records.size();
+    if ((first_record + count) > Header->RecordsCount) count = Header->RecordsCount - first_record;
+
+    gettimeofday(&tv_curr, NULL);
+
+    seq = &Header->Seq;
+
+    (*seq)++;
+    __sync_synchronize();
+
+    memcpy(Records + first_record, &records[0], count * sizeof(struct ShmStatusRecord));
+    Header->UpdateSec = tv_curr.tv_sec;
+    Header->UpdateUsec = tv_curr.tv_usec;
+
+    __sync_synchronize();
+    (*seq)++;
+}
+
+int ShmStatus::attach(std::string path)
+{
+    struct stat segment_stat;
+    int fd;
+    void *segment;
+
+    detach();
+
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) return -1;
+
+    if ((fstat(fd, &segment_stat) == -1) || (static_cast<size_t>(segment_stat.st_size) < sizeof(struct ShmStatusHeader))) {
+        close(fd);
+        return -1;
+    }
+
+    SegmentSize = segment_stat.st_size;
+    segment = mmap(NULL, SegmentSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (segment == MAP_FAILED) return -1;
+
+    Path = path;
+    Owner = false;
+    Header = reinterpret_cast<struct ShmStatusHeader *>(segment);
+    Records = reinterpret_cast<struct ShmStatusRecord *>(reinterpret_cast<char *>(segment) + sizeof(struct ShmStatusHeader));
+
+    if ((Header->Magic != SHM_STATUS_MAGIC) || (Header->Version != SHM_STATUS_VERSION)
+            || (Header->HeaderSize != sizeof(struct ShmStatusHeader)) || (Header->RecordSize != sizeof(struct ShmStatusRecord))
+            || (SegmentSize < (sizeof(struct ShmStatusHeader) + Header->RecordsCount * sizeof(struct ShmStatusRecord)))) {
+        detach();
+        return -1;
+    }
+
+    return 0;
+}
+
+int ShmStatus::snapshot(std::vector <ShmStatusRecord> &records, struct timeval &tv_update)
+{
+    volatile __u32 *seq;
+    __u32 seq_begin, seq_end;
+    unsigned int count;
+
+    if (Header == NULL) return -1;
+
+    // Supervisor replaces the segment on reload, the retired one is left for the new one
+    if (Header->Magic != SHM_STATUS_MAGIC) {
+        if (attach(std::string(Path)) == -1) return -1;
+    }
+
+    seq = &Header->Seq;
+    count = Header->RecordsCount;
+    records.resize(count);
+
+    for (unsigned int n=0; n<SHM_STATUS_READ_RETRIES; n++) {
+        seq_begin = *seq;
+        if (seq_begin & 1) continue;
+        __sync_synchronize();
+
+        if (count) memcpy(&records[0], Records, count * sizeof(struct ShmStatusRecord));
+        tv_update.tv_sec = Header->UpdateSec;
+        tv_update.tv_usec = Header->UpdateUsec;
+
+        __sync_synchronize();
+        seq_end = *seq;
+        if (seq_begin == seq_end) return 0;
+    }
+
+    return -1;
+}
+
+void ShmStatus::detach()
+{
+    if (Header != NULL) {
+        if (Owner) {
+            Header->Magic = 0;
+            __sync_synchronize();
+            unlink(Path.c_str());
+        }
+        munmap(Header, SegmentSize);
+    }
+
+    Path = "";
+    Header = NULL;
+    Records = NULL;
+    SegmentSize = 0;
+    Owner = false;
+}
+
@@ -0,0 +1,67 @@
+#ifndef SHMSTATUS_H
+#define SHMSTATUS_H
+
+#include <linux/types.h>
+#include <sys/time.h>
+
+#include <string>
+#include <vector>
+
+#include "main.h"
+
+// Layout of the status segment shared with local readers (mrtg, graphing agents, etc.).
+// Any change of below structures requires SHM_STATUS_VERSION to be increased.
+const __u32 SHM_STATUS_MAGIC = 0x4E535354; // "NSST"
+const __u32 SHM_STATUS_VERSION = 2;
+const unsigned int SHM_STATUS_READ_RETRIES = 1000;
+
+const __u32 SHM_STATUS_ACTIVE = 0x1;
+
+struct ShmStatusHeader {
+    __u32 Magic;
+    __u32 Version;
+    __u32 HeaderSize;
+    __u32 RecordSize;
+    __u32 RecordsCount;
+    __u32 Seq; // Odd while the writer is inside, readers have to retry
+    __u64 UpdateSec;
+    __u64 UpdateUsec;
+};
+
+struct ShmStatusRecord {
+    char SectionName[MAX_SECTION_NAME_SIZE+1];
+    char Name[MAX_CLASS_NAME_SIZE+4];
+    __u32 ClassId;
+    __u32 Flags;
+    __u64 Traffic;
+    __u64 HtbCeil;
+    __u64 OldHtbCeil;
+    __u64 QuotaDay;
+    __u64 QuotaWeek;
+    __u64 QuotaMonth;
+    __u32 LeafBacklog; // Bytes queued in leaf qdisc
+    __u32 LeafDrops; // Packets dropped during the last round
+};
+
+class ShmStatus {
+    public:
+        ShmStatus();
+        ~ShmStatus();
+        // Writer side, used by supervisor
+        int create(std::string, unsigned int);
+        void publish(unsigned int, std::vector <ShmStatusRecord> &);
+        void handOver();
+        std::string getPath() { return Path; }
+        // Reader side, no syscalls after attach until the segment is replaced
+        int attach(std::string);
+        int snapshot(std::vector <ShmStatusRecord> &, struct timeval &);
+        void detach();
+    private:
+        std::string Path;
+        struct ShmStatusHeader *Header;
+        struct ShmStatusRecord *Records;
+        size_t SegmentSize;
+        bool Owner;
+};
+
+#endif
@@ -16,9 +16,14 @@
 #include <sys/types.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <pwd.h>
+#include <grp.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <poll.h>
 #include <unistd.h>
 
 #include <iostream>
@@ -29,9 +34,11 @@
 #include "main.h"
 #include "aux.h"
 #include "config.h"
+#include "conntrack.h"
 #include "ifaces.h"
 #include "iptables.h"
 #include "logger.h"
+#include "shmstatus.h"
 #include "talk.h"
 #include "tests.h"
 #include "worker.h"
@@ -39,14 +46,24 @@
 Supervisor::Supervisor()
 {
     ControllerHandlerSocket = 0;
+    ControllerHandlerUnixSocket = 0;
     ControllerHandlersCreated = false;
     ControllerHandlerGoHome = 0;
 
     StatusWriterCreated = false;
     StatusWriterGoHome = 0;
 
+    QuotaWriterCreated = false;
+    QuotaWriterGoHome = 0;
+
     StatusFileOutOfDate = false;
 
+    ReloadRequested = 0;
+
+    ShmStat = NULL;
+
+    CtListener = NULL;
+
     Initialized = false;
 
     SAOContainterRequired = false;
@@ -62,6 +79,7 @@ Supervisor::~Supervisor()
 
     if (ControllerHandlersCreated) ControllerHandlerGoHome = MAX_CONTROLLER_HANDLERS;
     if (StatusWriterCreated) StatusWriterGoHome = 1;
+    if (QuotaWriterCreated) QuotaWriterGoHome = 1;
 
     pthread_mutex_unlock(&ThreadsExitRequestLock);
 
@@ -79,6 +97,10 @@ Supervisor::~Supervisor()
     }
 
     if (ControllerHandlerSocket) close (ControllerHandlerSocket);
+    if (ControllerHandlerUnixSocket) {
+        close (ControllerHandlerUnixSocket);
+        unlink (config->getListenerSocketPath().c_str());
+    }
 
     if (StatusWriterCreated) {
         do {
@@ -89,6 +111,19 @@ Supervisor::~Supervisor()
         } while (ret != 0);
     }
 
+    if (QuotaWriterCreated) {
+        do {
+            usleep (100000);
+            pthread_mutex_lock(&ThreadsExitRequestLock);
+            ret = QuotaWriterGoHome;
+            pthread_mutex_unlock(&ThreadsExitRequestLock);
+        } while (ret != 0);
+    }
+
+    if (ShmStat != NULL) delete ShmStat;
+
+    if (CtListener != NULL) delete CtListener;
+
     for (unsigned int n=0; n<Workers.size(); n++) {
         delete Workers.at(n);
     }
@@ -104,6 +139,7 @@ Supervisor::~Supervisor()
     pthread_mutex_destroy(&ThreadsExitRequestLock);
     pthread_mutex_destroy(&ControllerHandlerLock);
     pthread_mutex_destroy(&StatusFileOutOfDateLock);
+    pthread_mutex_destroy(&RunningConfigLock);
 }
 
 int Supervisor::init()
@@ -111,6 +147,7 @@ int Supervisor::init()
     struct stat vardir_stat;
     struct timeval tv_supervisor_socket;
     struct sockaddr_in address; 
+    struct sockaddr_un unix_address;
     int yes = 1;
 
     // Empty running sections list
@@ -120,7 +157,6 @@ int Supervisor::init()
     // Check for vardir
     if ((stat(vardir.c_str(), &vardir_stat) == -1) || (!S_ISDIR(vardir_stat.st_mode))) {
         log->warning(14, vardir);
-        ipt->setFallback(true);
     }
     
     // Check for executables
@@ -143,6 +179,25 @@ int Supervisor::init()
         return -1;
     }
     listen (ControllerHandlerSocket, 10);
+
+    // Local tools are authorized by credentials of the peer process instead of password
+    if (config->getListenerSocketPath().size()) {
+        ControllerHandlerUnixSocket = socket (AF_UNIX, SOCK_STREAM, 0);
+        setsockopt (ControllerHandlerUnixSocket, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *)&tv_supervisor_socket, sizeof(struct timeval));
+        memset(&unix_address, 0, sizeof(unix_address));
+        unix_address.sun_family = AF_UNIX;
+        strncpy(unix_address.sun_path, config->getListenerSocketPath().c_str(), sizeof(unix_address.sun_path)-1);
+        // TCP listener is already bound, thus the socket can only be a leftover of killed instance
+        unlink (unix_address.sun_path);
+        if (bind (ControllerHandlerUnixSocket, (struct sockaddr *) &unix_address, sizeof(unix_address)) == -1) {
+            log->error (51, config->getListenerSocketPath());
+            close (ControllerHandlerUnixSocket);
+            ControllerHandlerUnixSocket = 0;
+            return -1;
+        }
+        chmod (unix_address.sun_path, 0600);
+        listen (ControllerHandlerUnixSocket, 10);
+    }
  
     Initialized = true;
 
@@ -159,6 +214,7 @@ int Supervisor::entry (std::vector <std::string> &fpv_conffile, std::vector <std
     std::string section_name;
     bool sao_container;
     std::ofstream ofd;
+    ClassFilePartition partition;
     FPVConfFile = fpv_conffile;
     FPVClassFile = fpv_classfile;
 
@@ -176,11 +232,13 @@ int Supervisor::entry (std::vector <std::string> &fpv_conffile, std::vector <std
     // Publish listening address, and port, and password for loopback client connections
     ofd.open(svinfofile.c_str());
     if (!ofd.is_open()) { log->error(48, svinfofile); return -1; }
-    ofd << config->getListenerIp() << ":" << config->getListenerPort() << ":" << config->getListenerPassword() << '\n';
+    ofd << config->getListenerIp() << ":" << config->getListenerPort() << ":" << config->getListenerPassword() << ":" << config->getListenerSocketPath() << '\n';
     ofd.close();
 
     if (prepareEnvironment(fpv_conffile, fpv_classfile) == -1) return -1; 
 
+    if (config->partitionClassFile(fpv_classfile, partition) == -1) return -1;
+
     for (unsigned int n=0; n<=config->RunningSections.size(); n++) {
         if (n) {
             section_name = config->RunningSections.at(n-1);
@@ -193,10 +251,16 @@ int Supervisor::entry (std::vector <std::string> &fpv_conffile, std::vector <std
         }
 
         Workers.push_back(new Worker(section_name, FIRST_SECTION_ID+n, FIRST_WAITINGROOM_ID+n, sao_container));
-        if (!sao_container || (sao_container && SAOContainterRequired)) {
-            if (Workers.at(n)->init(fpv_conffile, fpv_classfile) == -1) { log->error(section_name, 30); return -1; }
-            if (n) Workers.at(n)->getIptRequirementsIfRequired(dwload_ipt_required, dwload_ipt_required_to_check, upload_ipt_required, upload_ipt_required_to_check);
-        }
+        if (!sao_container || (sao_container && SAOContainterRequired)) log->info(3, section_name);
+    }
+
+    // Classes objects of all sections are built at the same time, kernel is set up section by section afterwards
+    if (prepareWorkers(fpv_conffile, partition) == -1) return -1;
+
+    for (unsigned int n=0; n<Workers.size(); n++) {
+        if ((n==0) && !SAOContainterRequired) continue;
+        if (Workers.at(n)->init() == -1) { log->error(Workers.at(n)->getSectionName(), 30); return -1; }
+        if (n) Workers.at(n)->getIptRequirementsIfRequired(dwload_ipt_required, dwload_ipt_required_to_check, upload_ipt_required, upload_ipt_required_to_check);
     }
 
     ipt->setRequirementsIfRequired(dwload_ipt_required, dwload_ipt_required_to_check, upload_ipt_required, upload_ipt_required_to_check);
@@ -214,6 +278,20 @@ int Supervisor::entry (std::vector <std::string> &fpv_conffile, std::vector <std
         system (buf.c_str());
     }
 
+    if (config->getStatusShmPath().size()) shmStatusInit();
+
+    // Sections are fixed until restart, thus the listener is set up once
+    for (unsigned int n=1; n<Workers.size(); n++) {
+        if (!Workers.at(n)->getCtActivation()) continue;
+        CtListener = new CtEvents;
+        // Without the listener classes are activated by rounds as usual
+        if (CtListener->open() == -1) {
+            delete CtListener;
+            CtListener = NULL;
+        }
+        break;
+    }
+
     return 0;
 }
 
@@ -224,6 +302,7 @@ int Supervisor::loop ()
     double round_duration;
     bool htb_fallback_fully_initialized = false;
     bool sections_all_reloaded = false;
+    bool ct_activation_failed = false;
     std::vector <__u64> ipt_ordered_counters;
     std::vector <__u64> ipt_ordered_counters_dnsw;
     Worker *next_worker = NULL;
@@ -231,6 +310,7 @@ int Supervisor::loop ()
     struct timeval next_worker_tv;
     pthread_t controller_handler_tid[MAX_CONTROLLER_HANDLERS];
     pthread_t status_writer_tid[1];
+    pthread_t quota_writer_tid[1];
 
     reloadsVectorInit();
 
@@ -244,6 +324,11 @@ int Supervisor::loop ()
         return -1;
     }
 
+    if (pthread_mutex_init(&RunningConfigLock, NULL) != 0) {
+        log->error(403);
+        return -1;
+    }
+
     for (unsigned int n=0; n<MAX_CONTROLLER_HANDLERS; n++) {
         if (pthread_create(&(controller_handler_tid[n]), NULL, &Supervisor::controllerHandlerThreadEntry, this) < 0) {
             log->error(402);
@@ -252,8 +337,28 @@ int Supervisor::loop ()
         ControllerHandlersCreated = true;
     }
 
+    if (pthread_create(&(quota_writer_tid[0]), NULL, &Supervisor::quotaWriterThreadEntry, this) < 0) {
+        log->error(407);
+        return -1;
+    }
+    QuotaWriterCreated = true;
+
     while (true)
     {
+        if (ReloadRequested) {
+            ReloadRequested = 0;
+            reload();
+            if (log->getReqRecoverQos()) {
+                if (recoverQos() == -1) return -1;
+                htb_fallback_fully_initialized = false;
+                sections_all_reloaded = false;
+            }
+            if (log->getReqRecoverIpt()) {
+                if (recoverIpt() == -1) return -1;
+            }
+            reloadsVectorInit();
+        }
+
         next_worker_vid = ReloadsVector.at(0)->WorkerVID;
         next_worker_tv = ReloadsVector.at(0)->TVReloadDemand;
         next_worker = Workers.at(next_worker_vid);
@@ -265,7 +370,19 @@ int Supervisor::loop ()
 
         while (timercmp(&next_worker->TVSleepCurr, &next_worker_tv, <))
         {
+            if (ReloadRequested) break;
+
             timersub(&next_worker_tv, &next_worker->TVSleepCurr, &tv_sleep_duration); 
+
+            // New flows are served while waiting for the next round
+            if (CtListener != NULL) {
+                if (ctEventsWait(tv_sleep_duration) == -1) {
+                    ct_activation_failed = true;
+                    break;
+                }
+                gettimeofday (&next_worker->TVSleepCurr, NULL);
+                continue;
+            }
  
             if (tv_sleep_duration.tv_sec) {
                 if (sleep(static_cast<unsigned int>(tv_sleep_duration.tv_sec)) != 0) {
@@ -283,6 +400,21 @@ int Supervisor::loop ()
             gettimeofday (&next_worker->TVSleepCurr, NULL);
         }
 
+        // Reload demands are scheduled from scratch after classes reload
+        if (ReloadRequested) continue;
+
+        if (ct_activation_failed) {
+            ct_activation_failed = false;
+            if (sections_all_reloaded && log->getReqRecoverQos()) {
+                if (recoverQos() == -1) return -1;
+                reloadsVectorInit();
+                htb_fallback_fully_initialized = false;
+                sections_all_reloaded = false;
+                continue;
+            }
+            else return -1;
+        }
+
         gettimeofday(&next_worker->TVSleepPrev, NULL);
 
         if (next_worker->getIptRequiredToCheck()) {
@@ -329,6 +461,8 @@ int Supervisor::loop ()
         StatusFileOutOfDate = true;
         pthread_mutex_unlock(&StatusFileOutOfDateLock);
 
+        if (ShmStat != NULL) next_worker->shmStatusPublish(ShmStat);
+
         next_worker->incReloadsCounter();
  
         tv_reload_demand = next_worker->TVSleepPrev;
@@ -366,6 +500,38 @@ int Supervisor::loop ()
     }
 }
 
+int Supervisor::ctEventsWait(struct timeval tv_timeout)
+{
+    struct pollfd pfd;
+    struct timeval tv_curr;
+    std::vector <std::string> addrs;
+    int timeout_msec;
+    int res;
+
+    pfd.fd = CtListener->fd();
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    // Rounded up, the round is never started before its time
+    timeout_msec = tv_timeout.tv_sec * 1000 + (tv_timeout.tv_usec + 999) / 1000;
+
+    res = poll(&pfd, 1, timeout_msec);
+    if ((res == -1) && (errno == EINTR)) return 0;
+    if (res <= 0) return 0;
+
+    if (CtListener->receive(addrs) == -1) return 0;
+    if (addrs.empty()) return 0;
+
+    gettimeofday(&tv_curr, NULL);
+
+    for (unsigned int n=1; n<Workers.size(); n++) {
+        if (!Workers.at(n)->getCtActivation()) continue;
+        if (Workers.at(n)->activateHosts(addrs, tv_curr.tv_sec) == -1) return -1;
+    }
+
+    return 0;
+}
+
 int Supervisor::reloadsVectorInit()
 {
     struct timeval tv_reload_cur, tv_reload_demand;
@@ -394,6 +560,10 @@ int Supervisor::reloadsVectorInsert(unsigned int worker_vid, struct timeval tv_r
 {
     WorkerReloadDemand *worker_reload_demand = NULL;
 
+    // Intervals aren't whole seconds, demands have to stay comparable
+    tv_reload_demand.tv_sec += tv_reload_demand.tv_usec / 1000000;
+    tv_reload_demand.tv_usec %= 1000000;
+
     worker_reload_demand = new WorkerReloadDemand(worker_vid, tv_reload_demand);
 
     for (unsigned int n=0; n<ReloadsVector.size(); n++)
@@ -431,6 +601,115 @@ int Supervisor::recoverIpt()
     return 0;       
 }
 
+int Supervisor::reload()
+{
+    bool dwload_ipt_required = false;
+    bool dwload_ipt_required_to_check = false;
+    bool upload_ipt_required = false;
+    bool upload_ipt_required_to_check = false;
+    std::vector <std::string> fpv_classfile;
+    ClassFilePartition partition;
+    std::set <std::string> topology_prev, topology;
+    std::set <std::string>::iterator ti;
+    ShmStatus *shm_stat_prev;
+
+    log->info(14, classfile);
+    log->setErrorLogged(false);
+
+    if (config->loadClassFile(confdir, classfile, fpv_classfile, FPVClassFile) == -1) {
+        log->error(869);
+        log->setErrorLogged(false);
+        return -1;
+    }
+
+    // Interfaces and sections are set up at start, any change there requires restart
+    classesTopology(FPVClassFile, topology_prev);
+    classesTopology(fpv_classfile, topology);
+    if (topology != topology_prev) {
+        for (ti = topology.begin(); ti != topology.end(); ti++) {
+            if (!topology_prev.count(*ti)) log->error(868, *ti);
+        }
+        for (ti = topology_prev.begin(); ti != topology_prev.end(); ti++) {
+            if (!topology.count(*ti)) log->error(868, *ti);
+        }
+        log->error(869);
+        log->setErrorLogged(false);
+        return -1;
+    }
+
+    config->partitionClassFile(fpv_classfile, partition);
+
+    // All sections have to accept new classes before any of them is changed
+    for (unsigned int n=0; n<Workers.size(); n++) {
+        if ((n==0) && !SAOContainterRequired) continue;
+        if (Workers.at(n)->reloadClassesPrepare(FPVConfFile, partition) == -1) {
+            for (unsigned int m=0; m<Workers.size(); m++) Workers.at(m)->reloadClassesCancel();
+            log->error(Workers.at(n)->getSectionName(), 869);
+            log->setErrorLogged(false);
+            return -1;
+        }
+        if (n) Workers.at(n)->getIptRequirementsIfRequired(dwload_ipt_required, dwload_ipt_required_to_check, upload_ipt_required, upload_ipt_required_to_check, true);
+    }
+
+    if (ipt->validate(fpv_classfile, Workers, dwload_ipt_required, upload_ipt_required) == -1) {
+        for (unsigned int n=0; n<Workers.size(); n++) Workers.at(n)->reloadClassesCancel();
+        log->error(869);
+        log->setErrorLogged(false);
+        return -1;
+    }
+
+    for (unsigned int n=0; n<Workers.size(); n++) {
+        if ((n==0) && !SAOContainterRequired) continue;
+        // Failed section is recovered from the new classes at once
+        Workers.at(n)->reloadClassesApply();
+    }
+
+    pthread_mutex_lock(&RunningConfigLock);
+    FPVClassFile.swap(fpv_classfile);
+    pthread_mutex_unlock(&RunningConfigLock);
+
+    if (ipt->reload(FPVClassFile, Workers, dwload_ipt_required, dwload_ipt_required_to_check, upload_ipt_required, upload_ipt_required_to_check) == -1) {
+        log->setReqRecoverIpt(true);
+    }
+
+    // Records of sections are laid out by classes counts, the new segment replaces the old one in place
+    shm_stat_prev = ShmStat;
+    ShmStat = NULL;
+    if (config->getStatusShmPath().size()) shmStatusInit();
+    if (shm_stat_prev != NULL) {
+        if ((ShmStat != NULL) && (ShmStat->getPath() == shm_stat_prev->getPath())) shm_stat_prev->handOver();
+        delete shm_stat_prev;
+    }
+
+    log->setErrorLogged(false);
+
+    pthread_mutex_lock(&StatusFileOutOfDateLock);
+    StatusFileOutOfDate = true;
+    pthread_mutex_unlock(&StatusFileOutOfDateLock);
+
+    return 0;
+}
+
+int Supervisor::classesTopology(std::vector <std::string> &fpv_classfile, std::set <std::string> &topology)
+{
+    std::string option;
+
+    topology.clear();
+
+    for (unsigned int n=0; n<fpv_classfile.size(); n++) {
+        option = aux::awk(fpv_classfile.at(n), 1);
+        if ((option == "class") || (option == "class-virtual")) {
+            if (!aux::is_in_vector(config->RunningSections, aux::trim_dev(aux::awk(fpv_classfile.at(n), 2)))) continue;
+            topology.insert(aux::trim_dev(aux::awk(fpv_classfile.at(n), 2)) + " " + aux::trim_dev(aux::awk(fpv_classfile.at(n), 3)));
+        }
+        else if ((option == "class-wrapper") || (option == "class-do-not-shape")) {
+            topology.insert(option + " " + aux::trim_dev(aux::awk(fpv_classfile.at(n), 2)));
+        }
+    }
+
+    return 0;
+}
+
 int Supervisor::recoverQos()
 {
     bool recover_success = false;
@@ -441,7 +720,7 @@ int Supervisor::recoverQos()
         log->info(12);
         log->setReqRecoverQos(false);
         recover_success = false;
-        ifaces->discover();
+        ifaces->refresh();
         if (ifaces->initHtbOnControlled() == -1) continue;
         recover_success = true;
         for (unsigned int n=0; n<Workers.size(); n++) {
@@ -496,6 +775,95 @@ int Supervisor::recoverMissU32Perf()
     return 0;
 }
 
+int Supervisor::shmStatusInit()
+{
+    unsigned int records_count = 0;
+
+    // Each section gets its own range of records, thus sections are published independently
+    for (unsigned int n=1; n<Workers.size(); n++) {
+        Workers.at(n)->setShmFirstRecord(records_count);
+        records_count += Workers.at(n)->getClassesCount();
+    }
+
+    ShmStat = new ShmStatus;
+
+    if (ShmStat->create(config->getStatusShmPath(), records_count) == -1) {
+        log->warning(19, config->getStatusShmPath());
+        delete ShmStat;
+        ShmStat = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int Supervisor::prepareWorkers(std::vector <std::string> &fpv_conffile, ClassFilePartition &partition)
+{
+    struct WorkersPrepareJob job;
+    std::vector <pthread_t> prepare_tids;
+    pthread_t tid;
+    long cpus;
+
+    job.Owner = this;
+    job.FPVConfFile = &fpv_conffile;
+    job.Partition = &partition;
+    job.Next = 0;
+
+    for (unsigned int n=0; n<Workers.size(); n++) {
+        if ((n==0) && !SAOContainterRequired) continue;
+        job.Queue.push_back(n);
+    }
+
+    job.Results.resize(job.Queue.size(), -1);
+
+    if (pthread_mutex_init(&job.Lock, NULL) != 0) {
+        log->error(406);
+        return -1;
+    }
+
+    // Current thread prepares sections too, thus it goes on alone if helpers can't be created
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long n=1; (n < cpus) && (static_cast<unsigned long>(n) < job.Queue.size()); n++) {
+        if (pthread_create(&tid, NULL, &Supervisor::prepareWorkersThreadEntry, &job) != 0) break;
+        prepare_tids.push_back(tid);
+    }
+
+    prepareWorkersThread(&job);
+
+    for (unsigned int n=0; n<prepare_tids.size(); n++) pthread_join(prepare_tids.at(n), NULL);
+
+    pthread_mutex_destroy(&job.Lock);
+
+    // Error logged by one section fails the others as well, the first of them is reported
+    for (unsigned int n=0; n<job.Queue.size(); n++) {
+        if (job.Results.at(n) == -1) {
+            log->error(Workers.at(job.Queue.at(n))->getSectionName(), 30);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void *Supervisor::prepareWorkersThread(struct WorkersPrepareJob *job)
+{
+    unsigned int n;
+
+    while (true) {
+        pthread_mutex_lock(&job->Lock);
+        if (job->Next >= job->Queue.size()) {
+            pthread_mutex_unlock(&job->Lock);
+            break;
+        }
+        n = job->Next++;
+        pthread_mutex_unlock(&job->Lock);
+
+        job->Results.at(n) = Workers.at(job->Queue.at(n))->prepare(*job->FPVConfFile, *job->Partition);
+    }
+
+    return 0;
+}
+
 void *Supervisor::controllerHandlerThreadEntry(void *arg)
 {
     Supervisor *supervisor_ptr = reinterpret_cast<Supervisor *>(arg);
@@ -514,6 +882,9 @@ void *Supervisor::controllerHandler()
     std::string buf;
     EnumUnits request_status_unit = config->getStatusUnit();
     class Talk *talk;
+    struct ucred peer_cred;
+    socklen_t peer_cred_size;
+    bool peer_trusted;
     int connection_socket;
     int fd_max;
     int select_result;
@@ -540,6 +911,10 @@ void *Supervisor::controllerHandler()
             FD_ZERO (&rfds);
             FD_SET (ControllerHandlerSocket, &rfds);
             fd_max = ControllerHandlerSocket + 1;
+            if (ControllerHandlerUnixSocket) {
+                FD_SET (ControllerHandlerUnixSocket, &rfds);
+                if (ControllerHandlerUnixSocket >= fd_max) fd_max = ControllerHandlerUnixSocket + 1;
+            }
             tv_select_timeout.tv_sec = 0; // ControllerHandlerGoHome checking interval
             tv_select_timeout.tv_usec = 100000;
             select_result = select(fd_max, &rfds, NULL, NULL, &tv_select_timeout);
@@ -553,7 +928,18 @@ void *Supervisor::controllerHandler()
             continue;
         }
 
-        connection_socket = accept (ControllerHandlerSocket, NULL, NULL);
+        peer_trusted = false;
+        if (ControllerHandlerUnixSocket && FD_ISSET(ControllerHandlerUnixSocket, &rfds)) {
+            connection_socket = accept (ControllerHandlerUnixSocket, NULL, NULL);
+            // Root and the user NiceShaper works as don't need the password, others still may give it
+            peer_cred_size = sizeof(peer_cred);
+            if ((connection_socket >= 0) && (getsockopt(connection_socket, SOL_SOCKET, SO_PEERCRED, &peer_cred, &peer_cred_size) == 0)) {
+                if ((peer_cred.uid == 0) || (peer_cred.uid == geteuid())) peer_trusted = true;
+            }
+        }
+        else {
+            connection_socket = accept (ControllerHandlerSocket, NULL, NULL);
+        }
 
         if (connection_socket < 0) {
             log->error("supervisor", 301);
@@ -594,7 +980,7 @@ void *Supervisor::controllerHandler()
 
             result_table.clear();
 
-            if (request_local_password != config->getListenerPassword()) {
+            if (!peer_trusted && (request_local_password != config->getListenerPassword())) {
                 result_table.push_back(log->getErrorMessage(57));
                 usleep (1000000);
             }
@@ -614,11 +1000,13 @@ void *Supervisor::controllerHandler()
                         }                       
                     }
                     else if (request_show_running == "classes") {
+                        pthread_mutex_lock(&RunningConfigLock);
                         for (unsigned int n=0; n<FPVClassFile.size(); n++) {
                             buf = FPVClassFile.at(n);
                             if (aux::is_in_vector(config->ProperClassesTypes, aux::awk(buf, 1))) result_table.push_back("\n" + buf);
                             else result_table.push_back("    " + buf);
                         }
+                        pthread_mutex_unlock(&RunningConfigLock);
                     }
                     else {
                         result_table.push_back(log->getErrorMessage(810));
@@ -637,6 +1025,14 @@ void *Supervisor::controllerHandler()
     pthread_exit(NULL);
 }
 
+void *Supervisor::prepareWorkersThreadEntry(void *arg)
+{
+    struct WorkersPrepareJob *job = reinterpret_cast<struct WorkersPrepareJob *>(arg);
+    job->Owner->prepareWorkersThread(job);
+
+    return 0;
+}
+
 void *Supervisor::statusWriterThreadEntry(void *arg)
 {
     Supervisor *supervisor_ptr = reinterpret_cast<Supervisor *>(arg);
@@ -648,11 +1044,22 @@ void *Supervisor::statusWriterThreadEntry(void *arg)
 void *Supervisor::statusWriter()
 {
     std::vector <std::string> status_table;
-    std::string buf;
+    std::string status_buf, status_footer;
     struct timeval tv_status_curr, tv_status_prev;
-    int fd;
+    struct passwd *status_file_passwd;
+    struct group *status_file_group;
+    EnumStatusFileFormat status_format = config->getStatusFileFormat();
     bool out_of_date, out_of_time;
 
+    // Temporary file replaces the status file, thus has to get the same owner, group, and mode
+    status_file_passwd = getpwnam(config->getStatusFileOwner().c_str());
+    StatusFileUid = (status_file_passwd != NULL) ? status_file_passwd->pw_uid : static_cast<uid_t>(-1);
+    status_file_group = getgrnam(config->getStatusFileGroup().c_str());
+    StatusFileGid = (status_file_group != NULL) ? status_file_group->gr_gid : static_cast<gid_t>(-1);
+    StatusFileMode = strtol(config->getStatusFileMode().c_str(), NULL, 8) & 07777;
+
+    if (status_format == SF_TEXT) status_footer = "Powered by NiceShaper\nhttp://niceshaper.jedwabny.net\n";
+
     while (true)
     {
         out_of_date = false;
@@ -684,25 +1091,36 @@ void *Supervisor::statusWriter()
         } while (!out_of_date || !out_of_time);
 
         status_table.clear();
-        fd = open(config->getStatusFilePath().c_str(), O_RDWR | O_TRUNC);
+        status_buf.clear();
 
-        for (unsigned int n=1; n<Workers.size(); n++) 
-        {
-            Workers.at(n)->statusFormattedAppend(config->getStatusUnit(), status_table);
-            status_table.push_back(std::string(""));
-        }
+        if (status_format == SF_TEXT) {
+            for (unsigned int n=1; n<Workers.size(); n++) 
+            {
+                Workers.at(n)->statusFormattedAppend(config->getStatusUnit(), status_table);
+                status_table.push_back(std::string(""));
+            }
 
-        for (unsigned int n=0; n<status_table.size(); n++)
-        {
-            buf = status_table.at(n);
-            write(fd, (buf + "\n").c_str(), buf.size()+1);
+            for (unsigned int n=0; n<status_table.size(); n++)
+            {
+                status_buf += status_table.at(n) + "\n";
+            }
+        }
+        else if (status_format == SF_CSV) {
+            status_buf = "section,class,ceil,last_ceil,traffic\n";
+            for (unsigned int n=1; n<Workers.size(); n++) {
+                Workers.at(n)->statusSerializedAppend(SF_CSV, status_buf);
+            }
+        }
+        else if (status_format == SF_JSON) {
+            status_buf = "{\"sections\":[";
+            for (unsigned int n=1; n<Workers.size(); n++) {
+                if (n > 1) status_buf += ",";
+                Workers.at(n)->statusSerializedAppend(SF_JSON, status_buf);
+            }
+            status_buf += "]}\n";
         }
 
-        buf = "Powered by NiceShaper\n";
-        write(fd, buf.c_str(), buf.size());
-        buf = "http://niceshaper.jedwabny.net\n";
-        write(fd, buf.c_str(), buf.size());
-        close(fd);
+        statusFileWrite(status_buf, status_footer);
  
         pthread_mutex_lock(&StatusFileOutOfDateLock);
         StatusFileOutOfDate = false;
@@ -711,6 +1129,77 @@ void *Supervisor::statusWriter()
 }
 
 
+void *Supervisor::quotaWriterThreadEntry(void *arg)
+{
+    Supervisor *supervisor_ptr = reinterpret_cast<Supervisor *>(arg);
+    supervisor_ptr->quotaWriter();
+
+    return 0;
+}
+
+void *Supervisor::quotaWriter()
+{
+    unsigned int ticks = 0;
+
+    // Quota counters are staged by workers during reload, disk writes are done here
+    while (true)
+    {
+        pthread_mutex_lock(&ThreadsExitRequestLock);
+        if (QuotaWriterGoHome > 0)
+        {
+            QuotaWriterGoHome--;
+            pthread_mutex_unlock(&ThreadsExitRequestLock);
+            pthread_exit(NULL);
+        }
+        pthread_mutex_unlock(&ThreadsExitRequestLock);
+        usleep(100000);
+
+        if (++ticks < 10) continue;
+        ticks = 0;
+
+        for (unsigned int n=1; n<Workers.size(); n++) {
+            Workers.at(n)->quotaCountersFlush();
+        }
+    }
+}
+
+int Supervisor::statusFileWrite(std::string &status_buf, std::string &status_footer)
+{
+    std::string status_file_tmp = config->getStatusFilePath() + ".tmp";
+    struct iovec status_iov[2];
+    ssize_t status_size;
+    int fd;
+
+    // Readers must never see an empty or partially written file, so the whole 
+    // status is written aside and renamed over the status file at once
+    fd = open(status_file_tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) return -1;
+
+    status_iov[0].iov_base = const_cast<char *>(status_buf.data());
+    status_iov[0].iov_len = status_buf.size();
+    status_iov[1].iov_base = const_cast<char *>(status_footer.data());
+    status_iov[1].iov_len = status_footer.size();
+    status_size = status_buf.size() + status_footer.size();
+
+    if ((writev(fd, status_iov, status_footer.empty() ? 1 : 2) != status_size) 
+            || (config->getStatusFileFsync() && (fsync(fd) == -1))) {
+        close(fd);
+        unlink(status_file_tmp.c_str());
+        return -1;
+    }
+
+    fchown(fd, StatusFileUid, StatusFileGid);
+    fchmod(fd, StatusFileMode);
+    close(fd);
+
+    if (rename(status_file_tmp.c_str(), config->getStatusFilePath().c_str()) == -1) {
+        unlink(status_file_tmp.c_str());
+        return -1;
+    }
+
+    return 0;
+}
+
 int Supervisor::prepareEnvironment (std::vector <std::string> &fpv_conffile, std::vector <std::string> &fpv_classfile)
 {
     std::vector <std::string>::iterator fpvi, fpvi_begin, fpvi_end;
@@ -718,7 +1207,7 @@ int Supervisor::prepareEnvironment (std::vector <std::string> &fpv_conffile, std
     std::string option, value1, value2, value3;
     std::string iface = "";
     std::string section = "";
-    unsigned int section_htb_ceil;
+    __u64 section_htb_ceil;
 
     fpvi = fpv_classfile.begin();                                                
     while (fpvi < fpv_classfile.end()) { 
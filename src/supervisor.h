@@ -1,10 +1,29 @@
 #ifndef SUPERVISOR_H
 #define SUPERVISOR_H
 
+#include <sys/types.h>
+#include <signal.h>
+
+#include <set>
+
 #include "main.h"
 
+#include "config.h"
+#include "shmstatus.h"
 #include "worker.h"
 
+class Supervisor;
+
+struct WorkersPrepareJob {
+    Supervisor *Owner;
+    std::vector <std::string> *FPVConfFile;
+    ClassFilePartition *Partition;
+    std::vector <unsigned int> Queue; // Numbers of workers to prepare
+    std::vector <int> Results;
+    unsigned int Next;
+    pthread_mutex_t Lock;
+};
+
 class Supervisor {
     public:
         Supervisor();
@@ -12,17 +31,28 @@ class Supervisor {
         int init();
         int entry(std::vector <std::string> &, std::vector <std::string> &);
         int loop();
+        void requestReload() { ReloadRequested = 1; }
     private:
+        int reload();
+        int prepareWorkers(std::vector <std::string> &, ClassFilePartition &);
+        int classesTopology(std::vector <std::string> &, std::set <std::string> &);
         int reloadsVectorInit(); 
         int reloadsVectorInsert(unsigned int, struct timeval);
         int recoverQos();
         int recoverIpt();
         int recoverMissU32Perf();
+        int ctEventsWait(struct timeval);
+        int shmStatusInit();
         // Threads methods
         static void *controllerHandlerThreadEntry(void *);
         static void *statusWriterThreadEntry(void *);
+        static void *quotaWriterThreadEntry(void *);
+        static void *prepareWorkersThreadEntry(void *);
         void *controllerHandler();
         void *statusWriter();
+        void *quotaWriter();
+        void *prepareWorkersThread(struct WorkersPrepareJob *);
+        int statusFileWrite(std::string &, std::string &);
         ///
         int fillAccountingHelper();
         int prepareEnvironment(std::vector <std::string> &, std::vector <std::string> &);
@@ -31,14 +61,24 @@ class Supervisor {
         pthread_mutex_t ThreadsExitRequestLock;
         pthread_mutex_t ControllerHandlerLock;
         pthread_mutex_t StatusFileOutOfDateLock;
+        pthread_mutex_t RunningConfigLock;
         int ControllerHandlerSocket;
+        int ControllerHandlerUnixSocket;
         bool ControllerHandlersCreated;
         bool StatusWriterCreated;
+        bool QuotaWriterCreated;
         volatile unsigned int ControllerHandlerGoHome; // As my child says "Idź do domu!" which means "Go home!" when he scares away insects and bad dogs:)
         volatile unsigned int StatusWriterGoHome;
+        volatile unsigned int QuotaWriterGoHome;
         bool StatusFileOutOfDate;
+        volatile sig_atomic_t ReloadRequested;
+        uid_t StatusFileUid;
+        gid_t StatusFileGid;
+        mode_t StatusFileMode;
         bool SAOContainterRequired;
         std::vector <Worker *> Workers;
+        ShmStatus *ShmStat;
+        class CtEvents *CtListener;
         std::vector <WorkerReloadDemand *> ReloadsVector;
         std::vector <std::string> FPVConfFile;
         std::vector <std::string> FPVClassFile;
@@ -21,6 +21,10 @@
 #include <linux/pkt_sched.h>
 #include <linux/pkt_cls.h>
 #include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/tc_act/tc_mirred.h>
+#include <net/if.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <time.h>
 #include <sys/time.h>
@@ -35,13 +39,17 @@
 
 #include "main.h"
 #include "aux.h"
+#include "config.h"
 #include "logger.h"
 #include "ifaces.h"
 
-QosClassBytes::QosClassBytes(__u32 qos_class_id, __u64 bytes)
+QosClassBytes::QosClassBytes(int if_index, __u32 qos_class_id, __u64 bytes, __u32 backlog, __u32 drops)
 {
+    IfIndex = if_index;
     QosClassId = qos_class_id;
     Bytes = bytes;
+    Backlog = backlog;
+    Drops = drops;
 }
 
 QosClassBytes::~QosClassBytes()
@@ -96,9 +104,9 @@ void Sys::rtnlClose()
  */
 
 int Sys::setQosClass(EnumTcOperation operation, int iface_index, unsigned int tc_parent_id, unsigned int tc_class_id, 
-                unsigned int tc_class_rate, unsigned int tc_class_ceil,
+                __u64 tc_class_rate, __u64 tc_class_ceil,
                 unsigned int tc_class_prio, unsigned int tc_class_quantum,
-                unsigned int buffer, unsigned int cbuffer)
+                unsigned int buffer, unsigned int cbuffer, unsigned int htb_major)
 {
     struct {
         struct nlmsghdr     n;
@@ -107,6 +115,7 @@ int Sys::setQosClass(EnumTcOperation operation, int iface_index, unsigned int tc
     } req;
     char  k[16];
     struct tc_htb_opt htb_opt;
+    __u64 rate64, ceil64;
     __u32 rtab[256], ctab[256];
     int cell_log=-1, ccell_log = -1;
     unsigned mtu = 1600; /* eth packet len */
@@ -141,8 +150,8 @@ int Sys::setQosClass(EnumTcOperation operation, int iface_index, unsigned int tc
     req.t.tcm_ifindex = iface_index;
     req.t.tcm_family = AF_UNSPEC;
 
-    if (computeQosClassId(1, tc_class_id, &req.t.tcm_handle) == -1) return -1;
-    if (computeQosClassId(1, tc_parent_id, &req.t.tcm_parent) == -1) return -1;
+    if (computeQosClassId(htb_major, tc_class_id, &req.t.tcm_handle) == -1) return -1;
+    if (computeQosClassId(htb_major, tc_parent_id, &req.t.tcm_parent) == -1) return -1;
 
     strncpy(k, "htb", sizeof(k)-1);
 
@@ -152,33 +161,38 @@ int Sys::setQosClass(EnumTcOperation operation, int iface_index, unsigned int tc
     htb_opt.prio = tc_class_prio;
     htb_opt.quantum = tc_class_quantum;
 
-    htb_opt.rate.rate = tc_class_rate/8;
-    htb_opt.ceil.rate = tc_class_ceil/8;
+    // Rates above 32 bits (about 34Gb/s) are saturated in tc_ratespec and passed as RATE64/CEIL64
+    rate64 = tc_class_rate/8;
+    ceil64 = tc_class_ceil/8;
+    htb_opt.rate.rate = (rate64 >= (1ULL << 32)) ? ~0U : rate64;
+    htb_opt.ceil.rate = (ceil64 >= (1ULL << 32)) ? ~0U : ceil64;
 
     /* compute minimal allowed burst from rate; mtu is added here to make
        sure that buffer is larger than mtu and to have some safeguard space */
-    if (!buffer) buffer = htb_opt.rate.rate / getHz() + mtu;
-    if (!cbuffer) cbuffer = htb_opt.ceil.rate / getHz() + mtu;
+    if (!buffer) buffer = MAX(rate64 / getHz() + mtu, rate64 * HTB_MIN_BURST_USEC / TIME_UNITS_PER_SEC);
+    if (!cbuffer) cbuffer = MAX(ceil64 / getHz() + mtu, ceil64 * HTB_MIN_BURST_USEC / TIME_UNITS_PER_SEC);
     htb_opt.ceil.overhead = 0;
     htb_opt.rate.overhead = 0;
 
     htb_opt.ceil.mpu = mpu;
     htb_opt.rate.mpu = mpu;
 
-    if (qosCalcRtable(cell_log, mtu, &htb_opt.rate, rtab) < 0) {
+    if (qosCalcRtable(cell_log, mtu, &htb_opt.rate, rate64, rtab) < 0) {
         log->error(53, "htb: failed to calculate rate table");
         return -1;
     }
-    htb_opt.buffer = qosCalcXmittime(htb_opt.rate.rate, buffer);
+    htb_opt.buffer = qosCalcXmittime(rate64, buffer);
 
-    if (qosCalcRtable(ccell_log, mtu, &htb_opt.ceil, ctab) < 0) {
+    if (qosCalcRtable(ccell_log, mtu, &htb_opt.ceil, ceil64, ctab) < 0) {
         log->error(53, "htb: failed to calculate ceil rate table");
         return -1;
     }
-    htb_opt.cbuffer = qosCalcXmittime(htb_opt.ceil.rate, cbuffer);
+    htb_opt.cbuffer = qosCalcXmittime(ceil64, cbuffer);
 
     tail = (struct rtattr*)(((char*)&req.n) + NLMSG_ALIGN(req.n.nlmsg_len));
     RTNetlink::addattr_l(&req.n, 1024, TCA_OPTIONS, NULL, 0);
+    if (rate64 >= (1ULL << 32)) RTNetlink::addattr_l(&req.n, 1124, TCA_HTB_RATE64, &rate64, sizeof(rate64));
+    if (ceil64 >= (1ULL << 32)) RTNetlink::addattr_l(&req.n, 1224, TCA_HTB_CEIL64, &ceil64, sizeof(ceil64));
     RTNetlink::addattr_l(&req.n, 2024, TCA_HTB_PARMS, &htb_opt, sizeof(htb_opt));
     RTNetlink::addattr_l(&req.n, 3024, TCA_HTB_RTAB, rtab, 1024);
     RTNetlink::addattr_l(&req.n, 4024, TCA_HTB_CTAB, ctab, 1024);
@@ -192,7 +206,7 @@ int Sys::setQosClass(EnumTcOperation operation, int iface_index, unsigned int tc
     return 0;
 }
 
-int Sys::setQosQdisc (EnumTcOperation operation, int iface_index, unsigned int tc_parent_id, unsigned int tc_handle_id, EnumTcQdiscType tc_qdisc_kind, int qdisc_param1)
+int Sys::setQosQdisc (EnumTcOperation operation, int iface_index, unsigned int tc_parent_id, unsigned int tc_handle_id, EnumTcQdiscType tc_qdisc_kind, int qdisc_param1, int qdisc_param2, unsigned int parent_major, struct QosLeafOpts *leaf_opts)
 {
     char  k[16];
     struct {
@@ -202,11 +216,15 @@ int Sys::setQosQdisc (EnumTcOperation operation, int iface_index, unsigned int t
         char            buf[(64*1024)];
     } req;
     struct tc_sfq_qopt sfq_opt;
+    struct tc_esfq_qopt esfq_opt;
     struct tc_htb_glob htb_opt;
     struct rtattr *tail;
+    __u32 fq_buckets_log;
+    int res;
     memset(&req, 0, sizeof(req));
     memset(&k, 0, sizeof(k));
     memset(&sfq_opt,0,sizeof(sfq_opt));
+    memset(&esfq_opt,0,sizeof(esfq_opt));
     memset(&htb_opt,0,sizeof(htb_opt));
 
     // Set flags
@@ -230,15 +248,25 @@ int Sys::setQosQdisc (EnumTcOperation operation, int iface_index, unsigned int t
     req.t.tcm_ifindex = iface_index;
     req.t.tcm_family = AF_UNSPEC;
 
-    if (computeQosClassId(1, tc_parent_id, &req.t.tcm_parent) == -1) return -1;
+    if (computeQosClassId(parent_major, tc_parent_id, &req.t.tcm_parent) == -1) return -1;
     if (operation == QOS_DEL) {
-        RTNetlink::rtnl_tell(NetlinkHandle, &req.n);
+        // Interface without own root qdisc is the same as cleared one
+        if (tc_parent_id == TC_H_ROOT) NetlinkHandle->ignore_errno = ENOENT;
+        res = RTNetlink::rtnl_tell(NetlinkHandle, &req.n);
+        NetlinkHandle->ignore_errno = 0;
+        if ((tc_parent_id == TC_H_ROOT) && (res < 0)) return -1;
         return 0;
     }
-    if (computeQosQdiscHandle(tc_handle_id, &req.t.tcm_handle) == -1) return -1;
+    // Zeroed handle is left to the kernel, which picks an unused one
+    if (tc_handle_id && (computeQosQdiscHandle(tc_handle_id, &req.t.tcm_handle) == -1)) return -1;
 
     if (tc_qdisc_kind == SFQ) strncpy(k, "sfq", sizeof(k)-1);
     else if (tc_qdisc_kind == HTB) strncpy(k, "htb", sizeof(k)-1);
+    else if (tc_qdisc_kind == ESFQ) strncpy(k, "esfq", sizeof(k)-1);
+    else if (tc_qdisc_kind == MQ) strncpy(k, "mq", sizeof(k)-1);
+    else if (tc_qdisc_kind == FQ_CODEL) strncpy(k, "fq_codel", sizeof(k)-1);
+    else if (tc_qdisc_kind == CAKE) strncpy(k, "cake", sizeof(k)-1);
+    else if (tc_qdisc_kind == FQ) strncpy(k, "fq", sizeof(k)-1);
     else return -1;
 
     if (k[0])
@@ -248,6 +276,12 @@ int Sys::setQosQdisc (EnumTcOperation operation, int iface_index, unsigned int t
         sfq_opt.perturb_period = qdisc_param1;
         RTNetlink::addattr_l(&req.n, 1024, TCA_OPTIONS, &sfq_opt, sizeof(sfq_opt));
     } 
+    else if (tc_qdisc_kind == ESFQ) {
+        // Zeroed quantum, limit, divisor, flows and depth are kernel defaults
+        esfq_opt.perturb_period = qdisc_param1;
+        esfq_opt.hash_kind = qdisc_param2;
+        RTNetlink::addattr_l(&req.n, 1024, TCA_OPTIONS, &esfq_opt, sizeof(esfq_opt));
+    }
     else if (tc_qdisc_kind == HTB) {
         tail = (struct rtattr*)(((char*)&req.n) + NLMSG_ALIGN(req.n.nlmsg_len));
         htb_opt.version = 3;
@@ -258,13 +292,200 @@ int Sys::setQosQdisc (EnumTcOperation operation, int iface_index, unsigned int t
         RTNetlink::addattr_l(&req.n, 2024, TCA_HTB_INIT, &htb_opt, NLMSG_ALIGN(sizeof(htb_opt)));
         tail->rta_len = (char *) (struct rtattr*)(((char*)&req.n) + NLMSG_ALIGN(req.n.nlmsg_len)) - (char *) tail;
     }
+    else if ((tc_qdisc_kind == FQ_CODEL) || (tc_qdisc_kind == CAKE) || (tc_qdisc_kind == FQ)) {
+        tail = (struct rtattr*)(((char*)&req.n) + NLMSG_ALIGN(req.n.nlmsg_len));
+        RTNetlink::addattr_l(&req.n, 1024, TCA_OPTIONS, NULL, 0);
+        if ((tc_qdisc_kind == FQ_CODEL) && leaf_opts) {
+            if (leaf_opts->Target) RTNetlink::addattr_l(&req.n, 1024, TCA_FQ_CODEL_TARGET, &leaf_opts->Target, sizeof(__u32));
+            if (leaf_opts->Interval) RTNetlink::addattr_l(&req.n, 1024, TCA_FQ_CODEL_INTERVAL, &leaf_opts->Interval, sizeof(__u32));
+            if (leaf_opts->Flows) RTNetlink::addattr_l(&req.n, 1024, TCA_FQ_CODEL_FLOWS, &leaf_opts->Flows, sizeof(__u32));
+            if (leaf_opts->Limit) RTNetlink::addattr_l(&req.n, 1024, TCA_FQ_CODEL_LIMIT, &leaf_opts->Limit, sizeof(__u32));
+            if (leaf_opts->MemoryLimit) RTNetlink::addattr_l(&req.n, 1024, TCA_FQ_CODEL_MEMORY_LIMIT, &leaf_opts->MemoryLimit, sizeof(__u32));
+        }
+        else if ((tc_qdisc_kind == CAKE) && leaf_opts) {
+            // Cake is left unlimited, HTB class above does the shaping
+            if (leaf_opts->Target) RTNetlink::addattr_l(&req.n, 1024, TCA_CAKE_TARGET, &leaf_opts->Target, sizeof(__u32));
+            if (leaf_opts->Interval) RTNetlink::addattr_l(&req.n, 1024, TCA_CAKE_RTT, &leaf_opts->Interval, sizeof(__u32));
+            if (leaf_opts->MemoryLimit) RTNetlink::addattr_l(&req.n, 1024, TCA_CAKE_MEMORY, &leaf_opts->MemoryLimit, sizeof(__u32));
+        }
+        else if ((tc_qdisc_kind == FQ) && leaf_opts) {
+            if (leaf_opts->Limit) RTNetlink::addattr_l(&req.n, 1024, TCA_FQ_PLIMIT, &leaf_opts->Limit, sizeof(__u32));
+            if (leaf_opts->Flows) {
+                // fq takes buckets as a power of two
+                for (fq_buckets_log = 0; (fq_buckets_log < 31) && ((1U << fq_buckets_log) < leaf_opts->Flows); fq_buckets_log++);
+                RTNetlink::addattr_l(&req.n, 1024, TCA_FQ_BUCKETS_LOG, &fq_buckets_log, sizeof(__u32));
+            }
+        }
+        tail->rta_len = (char *) (struct rtattr*)(((char*)&req.n) + NLMSG_ALIGN(req.n.nlmsg_len)) - (char *) tail;
+    }
+
+    if (RTNetlink::rtnl_tell(NetlinkHandle, &req.n) < 0) return -1;
+
+    return 0;
+}
+
+int Sys::setLinkUp(int iface_index)
+{
+    struct {
+        struct nlmsghdr     n;
+        struct ifinfomsg    i;
+        char            buf[256];
+    } req;
+
+    memset(&req, 0, sizeof(req));
+
+    req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.n.nlmsg_flags = NLM_F_REQUEST;
+    req.n.nlmsg_type = RTM_NEWLINK;
+    req.i.ifi_family = AF_UNSPEC;
+    req.i.ifi_index = iface_index;
+    req.i.ifi_change = IFF_UP;
+    req.i.ifi_flags = IFF_UP;
+
+    if (RTNetlink::rtnl_tell(NetlinkHandle, &req.n) < 0) return -1;
+
+    return 0;
+}
+
+int Sys::addIfbLink(std::string iface_name)
+{
+    struct {
+        struct nlmsghdr     n;
+        struct ifinfomsg    i;
+        char            buf[256];
+    } req;
+    struct rtattr *tail;
+    char k[16], name[IFNAMSIZ];
+
+    memset(&req, 0, sizeof(req));
+    memset(k, 0, sizeof(k));
+    memset(name, 0, sizeof(name));
+    strncpy(name, iface_name.c_str(), sizeof(name)-1);
+    strncpy(k, "ifb", sizeof(k)-1);
+
+    req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.n.nlmsg_flags = NLM_F_REQUEST|NLM_F_CREATE|NLM_F_EXCL;
+    req.n.nlmsg_type = RTM_NEWLINK;
+    req.i.ifi_family = AF_UNSPEC;
+
+    RTNetlink::addattr_l(&req.n, sizeof(req), IFLA_IFNAME, name, strlen(name)+1);
+    tail = (struct rtattr*)(((char*)&req.n) + NLMSG_ALIGN(req.n.nlmsg_len));
+    RTNetlink::addattr_l(&req.n, sizeof(req), IFLA_LINKINFO, NULL, 0);
+    RTNetlink::addattr_l(&req.n, sizeof(req), IFLA_INFO_KIND, k, strlen(k)+1);
+    tail->rta_len = (char *) (struct rtattr*)(((char*)&req.n) + NLMSG_ALIGN(req.n.nlmsg_len)) - (char *) tail;
+
+    if (RTNetlink::rtnl_tell(NetlinkHandle, &req.n) < 0) return -1;
+
+    return 0;
+}
+
+int Sys::delLink(int iface_index)
+{
+    struct {
+        struct nlmsghdr     n;
+        struct ifinfomsg    i;
+    } req;
+
+    memset(&req, 0, sizeof(req));
+
+    req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.n.nlmsg_flags = NLM_F_REQUEST;
+    req.n.nlmsg_type = RTM_DELLINK;
+    req.i.ifi_family = AF_UNSPEC;
+    req.i.ifi_index = iface_index;
+
+    if (RTNetlink::rtnl_tell(NetlinkHandle, &req.n) < 0) return -1;
+
+    return 0;
+}
+
+int Sys::setIngressRedirect(EnumTcOperation operation, int iface_index, int target_index)
+{
+    struct {
+        struct nlmsghdr     n;
+        struct tcmsg        t;
+        char            buf[1024];
+    } req;
+    struct tcu32sel sel;
+    struct tc_mirred mirred;
+    struct rtattr *options, *actions, *action, *action_options;
+    char k[16];
+    int res;
+
+    memset(&req, 0, sizeof(req));
+    memset(k, 0, sizeof(k));
+
+    req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct tcmsg));
+    req.t.tcm_ifindex = iface_index;
+    req.t.tcm_family = AF_UNSPEC;
+    req.t.tcm_parent = TC_H_INGRESS;
+
+    if (operation == QOS_DEL) {
+        // Filters go together with the qdisc, interface without one is the same as cleared
+        req.n.nlmsg_flags = NLM_F_REQUEST;
+        req.n.nlmsg_type = RTM_DELQDISC;
+        NetlinkHandle->ignore_errno = ENOENT;
+        res = RTNetlink::rtnl_tell(NetlinkHandle, &req.n);
+        NetlinkHandle->ignore_errno = 0;
+        return (res < 0) ? -1 : 0;
+    }
+    else if (operation != QOS_ADD) {
+        return -1;
+    }
+
+    req.n.nlmsg_flags = NLM_F_REQUEST|NLM_F_EXCL|NLM_F_CREATE;
+    req.n.nlmsg_type = RTM_NEWQDISC;
+    req.t.tcm_handle = TC_H_MAKE(TC_H_INGRESS, 0);
+    strncpy(k, "ingress", sizeof(k)-1);
+    RTNetlink::addattr_l(&req.n, sizeof(req), TCA_KIND, k, strlen(k)+1);
+    RTNetlink::addattr_l(&req.n, sizeof(req), TCA_OPTIONS, NULL, 0);
+
+    if (RTNetlink::rtnl_tell(NetlinkHandle, &req.n) < 0) return -1;
+
+    // match u32 0 0 action mirred egress redirect dev <target>
+    memset(&req, 0, sizeof(req));
+    memset(&sel, 0, sizeof(sel));
+    memset(&mirred, 0, sizeof(mirred));
+
+    req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct tcmsg));
+    req.n.nlmsg_flags = NLM_F_REQUEST|NLM_F_EXCL|NLM_F_CREATE;
+    req.n.nlmsg_type = RTM_NEWTFILTER;
+    req.t.tcm_ifindex = iface_index;
+    req.t.tcm_family = AF_UNSPEC;
+    req.t.tcm_parent = TC_H_MAKE(TC_H_INGRESS, 0);
+    req.t.tcm_info = TC_H_MAKE(1<<16, htons(ETH_P_ALL));
+
+    sel.sel.flags = TC_U32_TERMINAL;
+    sel.sel.nkeys = 1;
+    mirred.action = TC_ACT_STOLEN;
+    mirred.eaction = TCA_EGRESS_REDIR;
+    mirred.ifindex = target_index;
+
+    strncpy(k, "u32", sizeof(k)-1);
+    RTNetlink::addattr_l(&req.n, sizeof(req), TCA_KIND, k, strlen(k)+1);
+    options = (struct rtattr*)(((char*)&req.n) + NLMSG_ALIGN(req.n.nlmsg_len));
+    RTNetlink::addattr_l(&req.n, sizeof(req), TCA_OPTIONS, NULL, 0);
+    RTNetlink::addattr_l(&req.n, sizeof(req), TCA_U32_SEL, &sel, sizeof(sel.sel)+sizeof(struct tc_u32_key));
+    actions = (struct rtattr*)(((char*)&req.n) + NLMSG_ALIGN(req.n.nlmsg_len));
+    RTNetlink::addattr_l(&req.n, sizeof(req), TCA_U32_ACT, NULL, 0);
+    action = (struct rtattr*)(((char*)&req.n) + NLMSG_ALIGN(req.n.nlmsg_len));
+    RTNetlink::addattr_l(&req.n, sizeof(req), 1, NULL, 0);
+    strncpy(k, "mirred", sizeof(k)-1);
+    RTNetlink::addattr_l(&req.n, sizeof(req), TCA_ACT_KIND, k, strlen(k)+1);
+    action_options = (struct rtattr*)(((char*)&req.n) + NLMSG_ALIGN(req.n.nlmsg_len));
+    RTNetlink::addattr_l(&req.n, sizeof(req), TCA_ACT_OPTIONS, NULL, 0);
+    RTNetlink::addattr_l(&req.n, sizeof(req), TCA_MIRRED_PARMS, &mirred, sizeof(mirred));
+    action_options->rta_len = (char *) (struct rtattr*)(((char*)&req.n) + NLMSG_ALIGN(req.n.nlmsg_len)) - (char *) action_options;
+    action->rta_len = (char *) (struct rtattr*)(((char*)&req.n) + NLMSG_ALIGN(req.n.nlmsg_len)) - (char *) action;
+    actions->rta_len = (char *) (struct rtattr*)(((char*)&req.n) + NLMSG_ALIGN(req.n.nlmsg_len)) - (char *) actions;
+    options->rta_len = (char *) (struct rtattr*)(((char*)&req.n) + NLMSG_ALIGN(req.n.nlmsg_len)) - (char *) options;
 
     if (RTNetlink::rtnl_tell(NetlinkHandle, &req.n) < 0) return -1;
 
     return 0;
 }
 
-int Sys::setQosFilter(EnumTcOperation operation, int iface_index, unsigned int tc_handle_id, unsigned int tc_flowid_id, EnumTcFilterType tc_filter_kind, struct tcu32sel *tc_u32_selector)
+int Sys::setQosFilter(EnumTcOperation operation, int iface_index, unsigned int tc_handle_id, unsigned int tc_flowid_id, EnumTcFilterType tc_filter_kind, struct tcu32sel *tc_u32_selector, unsigned int htb_major)
 {
     struct {
         struct nlmsghdr     n;
@@ -296,8 +517,10 @@ int Sys::setQosFilter(EnumTcOperation operation, int iface_index, unsigned int t
 
     req.t.tcm_ifindex = iface_index;
     req.t.tcm_family = AF_UNSPEC;
+    if (computeQosQdiscHandle(htb_major, &req.t.tcm_parent) == -1) return -1;
 
-    protocol = htons(0x0800);
+    // Filters of IPv6 matches share the table with IPv4 ones, thus it takes all protocols
+    protocol = config->getIpv6() ? htons(ETH_P_ALL) : htons(ETH_P_IP);
 
     if (tc_filter_kind == U32) {
         strncpy(k, "u32", sizeof(k)-1);
@@ -317,7 +540,7 @@ int Sys::setQosFilter(EnumTcOperation operation, int iface_index, unsigned int t
         unsigned hhandle;
         tail = (struct rtattr*)(((char*)&req.n) + NLMSG_ALIGN(req.n.nlmsg_len));
         RTNetlink::addattr_l(&req.n, 16384, TCA_OPTIONS, NULL, 0);
-        if (computeQosClassId(1, tc_flowid_id, &hhandle) == -1) {
+        if (computeQosClassId(htb_major, tc_flowid_id, &hhandle) == -1) {
             log->error(53, "htb: Illegal _classid_");
             return -1;
         }
@@ -352,7 +575,7 @@ int Sys::cleanAccountingHelpers()
     return 0;
 }
 
-int Sys::qosCheck(int iface_index, EnumTcObjectType tc_scope_object)
+int Sys::qosCheck(int iface_index, EnumTcObjectType tc_scope_object, unsigned int htb_major)
 {
     struct tcmsg t;
     char d[16];
@@ -372,6 +595,8 @@ int Sys::qosCheck(int iface_index, EnumTcObjectType tc_scope_object)
     else if (tc_scope_object == QOS_FILTER) {
         rtm_type = RTM_GETTFILTER;
         t.tcm_info = TC_H_MAKE(prio<<16, protocol);
+        // Filters are dumped per qdisc, classes of all the qdiscs at once
+        if (computeQosQdiscHandle(htb_major, &t.tcm_parent) == -1) return -1;
     }
     else {
         log->error(999, "int Sys::qosCheck");
@@ -397,6 +622,7 @@ int Sys::qosCheckClassesBytes(const struct sockaddr_nl *who, struct nlmsghdr *n)
     struct rtattr *tb[TCA_MAX+1];
     struct rtattr *tbs[TCA_STATS_MAX + 1];
     struct gnet_stats_basic bs = {0};
+    struct gnet_stats_queue qs = {0};
     class QosClassBytes *s;
     int len = n->nlmsg_len;
 
@@ -429,7 +655,9 @@ int Sys::qosCheckClassesBytes(const struct sockaddr_nl *who, struct nlmsghdr *n)
     if (!tbs[TCA_STATS_BASIC]) return 0;
 
     memcpy(&bs, RTA_DATA(tbs[TCA_STATS_BASIC]), MIN(RTA_PAYLOAD(tbs[TCA_STATS_BASIC]), sizeof(bs)));
-    s = new QosClassBytes(t->tcm_handle, bs.bytes);
+    // Backlog of HTB class is the one of its leaf qdisc, drops are those at enqueue
+    if (tbs[TCA_STATS_QUEUE]) memcpy(&qs, RTA_DATA(tbs[TCA_STATS_QUEUE]), MIN(RTA_PAYLOAD(tbs[TCA_STATS_QUEUE]), sizeof(qs)));
+    s = new QosClassBytes(t->tcm_ifindex, t->tcm_handle, bs.bytes, qs.backlog, qs.drops);
     QosClassesBytes.push_back(s);
 
     return 0;
@@ -608,11 +836,11 @@ int Sys::getHz()
     return HZ;
 }
 
-int Sys::qosCalcRtable(int cell_log, unsigned mtu, struct tc_ratespec *r, __u32 *rtab)
+int Sys::qosCalcRtable(int cell_log, unsigned mtu, struct tc_ratespec *r, __u64 rate64, __u32 *rtab)
 {
     int i;
     unsigned sz;
-    unsigned bps = r->rate;
+    __u64 bps = rate64;
     unsigned mpu = r->mpu;
 
     if (mtu == 0)
@@ -634,12 +862,12 @@ int Sys::qosCalcRtable(int cell_log, unsigned mtu, struct tc_ratespec *r, __u32
     return cell_log;
 }
 
-unsigned Sys::qosCalcXmittime(unsigned rate, unsigned size)
+unsigned Sys::qosCalcXmittime(__u64 rate, unsigned size)
 {
     return qosCoreTime2tick(TIME_UNITS_PER_SEC*((double)size/rate));
 }
 
-unsigned Sys::qosCoreTime2tick(unsigned time)
+unsigned Sys::qosCoreTime2tick(double time)
 {
     return time*TickInUsec;
 }
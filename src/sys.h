@@ -3,6 +3,7 @@
 
 #define TIME_UNITS_PER_SEC  1000000
 #define PREFIXLEN_SPECIFIED 1
+#define HTB_MIN_BURST_USEC  100 // Timer slack has to be covered by burst in multi-gigabit classes
 
 #include <string>
 #include <vector>
@@ -20,19 +21,51 @@ typedef struct rfy
     __u32 data[8];
 } inet_prefix;
 
+// ESFQ isn't part of the mainline kernel, thus its options are declared here
+enum EnumEsfqHash { ESFQ_HASH_CLASSIC, ESFQ_HASH_DST, ESFQ_HASH_SRC };
+
+struct tc_esfq_qopt
+{
+    unsigned quantum;
+    int perturb_period;
+    __u32 limit;
+    unsigned divisor;
+    unsigned flows;
+    unsigned hash_kind;
+    unsigned depth;
+};
+
+// Options of fq_codel, cake and fq leaves, zeroed ones are left to kernel defaults
+struct QosLeafOpts
+{
+    __u32 Target; // usec
+    __u32 Interval; // usec
+    __u32 Flows;
+    __u32 Limit; // packets
+    __u32 MemoryLimit; // bytes
+};
+
+// Matches pack into keys at offsets 8 (proto), 12 (srcip), 16 (dstip) and 20 (ports),
+// IPv6 ones into the version word, 4 (proto), 8-20 (srcip), 24-36 (dstip) and 40 (ports),
+// thus a few keys are enough and every filter doesn't carry 2KB of unused ones
+const unsigned int U32_SEL_MAX_KEYS = 12;
+
 struct tcu32sel
 {
     struct tc_u32_sel sel;
-    struct tc_u32_key keys[128];
+    struct tc_u32_key keys[U32_SEL_MAX_KEYS];
 };
 
 class QosClassBytes
 {
     public:
-        QosClassBytes(__u32, __u64);
+        QosClassBytes(int, __u32, __u64, __u32, __u32);
         ~QosClassBytes();
+    int IfIndex; // Minors are given per interface, the same one may occur on each of them
     __u32 QosClassId;
     __u64 Bytes;
+    __u32 Backlog; // Bytes waiting in the leaf
+    __u32 Drops;
 };
 
 class QosFilterHits
@@ -53,11 +86,15 @@ class Sys
         int rtnlOpen();
         void rtnlClose();
         int setQosClass(EnumTcOperation, int, unsigned int, unsigned int, 
-                    unsigned, unsigned, unsigned, unsigned, unsigned int, unsigned int); // cmd, ifindex, parent_id, class_id, rate, ceil, prio, quantum, burst, cburst
-        int setQosQdisc(EnumTcOperation, int, unsigned int, unsigned int, EnumTcQdiscType, int); // cmd, ifindex, parent_id, handle_id, qdisc_type, htb->default|sfq->perturb
-        int setQosFilter(EnumTcOperation, int, unsigned int, unsigned int, EnumTcFilterType, struct tcu32sel *); // cmd, ifindex, handle_id, flow_id, tc_filter_kind
+                    __u64, __u64, unsigned, unsigned, unsigned int, unsigned int, unsigned int); // cmd, ifindex, parent_id, class_id, rate, ceil, prio, quantum, burst, cburst, htb_major
+        int setQosQdisc(EnumTcOperation, int, unsigned int, unsigned int, EnumTcQdiscType, int, int, unsigned int, struct QosLeafOpts *); // cmd, ifindex, parent_id, handle_id (0 - kernel assigned), qdisc_type, htb->default|sfq,esfq->perturb, esfq->hash, parent_major, fq_codel,cake,fq->options
+        int setLinkUp(int); // ifindex
+        int addIfbLink(std::string);
+        int delLink(int); // ifindex
+        int setIngressRedirect(EnumTcOperation, int, int); // cmd, ifindex, ifindex of target
+        int setQosFilter(EnumTcOperation, int, unsigned int, unsigned int, EnumTcFilterType, struct tcu32sel *, unsigned int); // cmd, ifindex, handle_id, flow_id, tc_filter_kind, htb_major
         int cleanAccountingHelpers();
-        int qosCheck(int, EnumTcObjectType);
+        int qosCheck(int, EnumTcObjectType, unsigned int); // ifindex, scope, htb_major of filters
         int qosCheckClassesBytes(const struct sockaddr_nl *who, struct nlmsghdr *n);
         int qosCheckFiltersHits(const struct sockaddr_nl *who, struct nlmsghdr *n);
         int computeQosClassId(unsigned int, unsigned int, __u32 *h);
@@ -69,10 +106,10 @@ class Sys
         std::vector <class QosFilterHits *> QosFiltersHits;
     private:
         int getHz();
-        int qosCalcRtable(int cell_log, unsigned mtu, struct tc_ratespec *r, __u32 *rtab);
+        int qosCalcRtable(int cell_log, unsigned mtu, struct tc_ratespec *r, __u64 rate64, __u32 *rtab);
         int qosCalcSizeTable(struct tc_sizespec *s, __u16 **stab);
-        unsigned qosCalcXmittime(unsigned rate, unsigned size);
-        unsigned qosCoreTime2tick(unsigned time);
+        unsigned qosCalcXmittime(__u64 rate, unsigned size);
+        unsigned qosCoreTime2tick(double time);
         unsigned qosAdjustSize(unsigned, unsigned);
         double TickInUsec;
         double ClockFactor;
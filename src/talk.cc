@@ -10,7 +10,9 @@
 
 #include "talk.h"
 
+#include <arpa/inet.h>
 #include <cstring>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <iostream>
@@ -21,7 +23,8 @@
 
 Talk::Talk ()
 {
-    // Nothing
+    // Peer version is learned from the first received message, new requests are sent in version 2
+    Version = PROTO_V2;
 }
 
 Talk::~Talk ()
@@ -36,7 +39,7 @@ int Talk::sendBool(int pipe, bool value)
     if (value == true) cbuf = BOOL_TRUE;
     else cbuf = BOOL_FALSE;
 
-    if (write(pipe, &cbuf, 1) == -1) { log->error(312, "int Talk::sendBool"); return -1; }
+    if (writeFull(pipe, &cbuf, 1) == -1) { log->error(312, "int Talk::sendBool"); return -1; }
     
     return 0;    
 }
@@ -62,92 +65,225 @@ int Talk::recvBool(int pipe, bool &value)
 
 int Talk::sendText(int pipe, std::string msg)
 {
-    std::string msg_portion;
+    std::vector <std::string> msgv;
     std::string buf;
-    unsigned int pos;
 
     if (msg.size() > MAX_LONG_BUF_SIZE) { log->error(313, "int Talk::sendText"); return -1; }
 
-    pos = 0;
+    if (Version == PROTO_V2) {
+        msgv.push_back(msg);
+        return sendFrame(pipe, msgv);
+    }
 
-    do {
-        msg_portion = msg.substr(pos, MAX_MESSAGE_SIZE);
-        buf = static_cast<char>(msg_portion.size() + PROTO_BASE);
-        buf += msg_portion;
-        write (pipe, buf.c_str(), buf.size());
-        pos += MAX_MESSAGE_SIZE;    
-    } while (msg_portion.size() == MAX_MESSAGE_SIZE);
+    encodeTextV1(buf, msg);
+    if (writeFull(pipe, buf.c_str(), buf.size()) == -1) { log->error(312, "int Talk::sendText"); return -1; }
 
     return 0;
 }
 
 int Talk::recvText(int pipe, std::string &msg)
 {
-    char buf[MAX_MESSAGE_SIZE];
+    std::vector <std::string> msgv;
     char cbuf;
-    //int msg_len, got_msg_len;
-    unsigned int msg_len;
-    int msg_len_got;
-    bool is_another_portion;
 
     msg = "";
 
-    do {
-        if (read(pipe, &cbuf, 1) != 1) { log->error(310, "int Talk::recvText"); return -1; }
+    if (readFull(pipe, &cbuf, 1) == -1) { log->error(310, "int Talk::recvText"); return -1; }
 
-        msg_len = static_cast<unsigned int>(cbuf) - static_cast<unsigned int>(PROTO_BASE);
+    if (cbuf != PROTO_V2) {
+        Version = PROTO_V1;
+        return recvTextV1(pipe, cbuf, msg);
+    }
 
-        if (msg_len > MAX_MESSAGE_SIZE) { log->error(313, "int Talk::recvText"); return -1; }
+    Version = PROTO_V2;
+    if (recvFrame(pipe, msgv) == -1) return -1;
+    if (msgv.size() != 1) { log->error(311, "int Talk::recvText"); return -1; }
+    if (msgv.at(0).size() > MAX_LONG_BUF_SIZE) { log->error(313, "int Talk::recvText"); return -1; }
 
-        if (msg_len < MAX_MESSAGE_SIZE) is_another_portion = false;
-        else if (msg_len == MAX_MESSAGE_SIZE) is_another_portion = true;
+    msg.swap(msgv.at(0));
 
-        msg_len_got = 0;
-        strcpy(buf, "");
-        buf[msg_len]=0;
-        while (msg_len)
-        {
-            if ((msg_len_got=read(pipe, buf+msg_len_got, msg_len)) <= 0 ) { log->error(310, "int Talk::recvText"); return -1; }
-            msg_len -= static_cast<unsigned int>(msg_len_got);
-        }
-        msg += std::string(buf);
-        if (msg.size() > MAX_LONG_BUF_SIZE) { log->error(313, "int Talk::recvText"); return -1; }
-    } while (is_another_portion);
-    
     return 0;
 }
 
 int Talk::sendTextVector(int pipe, std::vector <std::string> &msgv)
 {
     std::string buf;
-    unsigned int pos = 0;
 
-    while (pos < msgv.size()) {
-        if (sendBool(pipe, true) == -1) { return -1; };
-        if (sendText(pipe, msgv.at(pos)) == -1) { return -1; }
-        pos++; 
+    if (Version == PROTO_V2) return sendFrame(pipe, msgv);
+
+    // Old client gets the same stream of booleans and chunks as before, but with a single write
+    for (unsigned int n=0; n < msgv.size(); n++) {
+        if (msgv.at(n).size() > MAX_LONG_BUF_SIZE) { log->error(313, "int Talk::sendTextVector"); return -1; }
+        buf += BOOL_TRUE;
+        encodeTextV1(buf, msgv.at(n));
     }
+    buf += BOOL_FALSE;
 
-    if (sendBool(pipe, false) == -1) { return -1; };
+    if (writeFull(pipe, buf.c_str(), buf.size()) == -1) { log->error(312, "int Talk::sendTextVector"); return -1; }
 
     return 0;
 }
  
 int Talk::recvTextVector(int pipe, std::vector <std::string> &msgv)
 {
-    std::string msg;
-    bool another_part = false;
+    char cbuf;
 
     msgv.clear();
- 
+
+    // Request went out in version 2, old daemon rejects it instead of replying in version 1
+    if (readFull(pipe, &cbuf, 1) == -1) { log->error(310, "int Talk::recvTextVector"); return -1; }
+    if (cbuf != PROTO_V2) { log->error(311, "int Talk::recvTextVector"); return -1; }
+
+    return recvFrame(pipe, msgv);
+}
+
+int Talk::sendFrame(int pipe, std::vector <std::string> &msgv)
+{
+    char header[FRAME_HEADER_SIZE];
+    struct iovec iov[2];
+    size_t payload_size = 0;
+    size_t pos = 0;
+    __u32 len;
+    ssize_t sent;
+    int iov_pos = 0;
+
+    for (unsigned int n=0; n < msgv.size(); n++) payload_size += sizeof(__u32) + msgv.at(n).size();
+    if (payload_size > MAX_FRAME_SIZE) { log->error(313, "int Talk::sendFrame"); return -1; }
+
+    // Whole table is serialized into one buffer, thus it costs a single syscall in most cases
+    Buffer.resize(payload_size);
+    for (unsigned int n=0; n < msgv.size(); n++) {
+        len = htonl(msgv.at(n).size());
+        memcpy(&Buffer[pos], &len, sizeof(__u32));
+        pos += sizeof(__u32);
+        if (msgv.at(n).size()) memcpy(&Buffer[pos], msgv.at(n).data(), msgv.at(n).size());
+        pos += msgv.at(n).size();
+    }
+
+    header[0] = PROTO_V2;
+    header[1] = 0; // Flags
+    len = htonl(payload_size);
+    memcpy(header+2, &len, sizeof(__u32));
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = FRAME_HEADER_SIZE;
+    iov[1].iov_base = payload_size ? &Buffer[0] : NULL;
+    iov[1].iov_len = payload_size;
+
+    while (iov_pos < 2) {
+        sent = writev(pipe, iov + iov_pos, 2 - iov_pos);
+        if (sent <= 0) { log->error(312, "int Talk::sendFrame"); return -1; }
+        while ((iov_pos < 2) && (static_cast<size_t>(sent) >= iov[iov_pos].iov_len)) {
+            sent -= iov[iov_pos].iov_len;
+            iov_pos++;
+        }
+        if (iov_pos < 2) {
+            iov[iov_pos].iov_base = reinterpret_cast<char *>(iov[iov_pos].iov_base) + sent;
+            iov[iov_pos].iov_len -= sent;
+        }
+    }
+
+    return 0;
+}
+
+int Talk::recvFrame(int pipe, std::vector <std::string> &msgv)
+{
+    char header[FRAME_HEADER_SIZE];
+    size_t payload_size, pos;
+    __u32 len;
+
+    msgv.clear();
+
+    // Version byte is already consumed by the caller
+    if (readFull(pipe, header+1, FRAME_HEADER_SIZE-1) == -1) { log->error(310, "int Talk::recvFrame"); return -1; }
+    if (header[1] != 0) { log->error(311, "int Talk::recvFrame"); return -1; }
+
+    memcpy(&len, header+2, sizeof(__u32));
+    payload_size = ntohl(len);
+    if (payload_size > MAX_FRAME_SIZE) { log->error(313, "int Talk::recvFrame"); return -1; }
+
+    Buffer.resize(payload_size);
+    if (payload_size && (readFull(pipe, &Buffer[0], payload_size) == -1)) { log->error(310, "int Talk::recvFrame"); return -1; }
+
+    pos = 0;
+    while (pos < payload_size) {
+        if ((payload_size - pos) < sizeof(__u32)) { log->error(311, "int Talk::recvFrame"); return -1; }
+        memcpy(&len, &Buffer[pos], sizeof(__u32));
+        len = ntohl(len);
+        pos += sizeof(__u32);
+        if ((payload_size - pos) < len) { log->error(311, "int Talk::recvFrame"); return -1; }
+        msgv.push_back(std::string(&Buffer[pos], len));
+        pos += len;
+    }
+
+    return 0;
+}
+
+void Talk::encodeTextV1(std::string &buf, std::string &msg)
+{
+    std::string msg_portion;
+    unsigned int pos = 0;
+
+    do {
+        msg_portion = msg.substr(pos, MAX_MESSAGE_SIZE);
+        buf += static_cast<char>(msg_portion.size() + PROTO_BASE);
+        buf += msg_portion;
+        pos += MAX_MESSAGE_SIZE;    
+    } while (msg_portion.size() == MAX_MESSAGE_SIZE);
+}
+
+int Talk::recvTextV1(int pipe, char cbuf, std::string &msg)
+{
+    char buf[MAX_MESSAGE_SIZE];
+    unsigned int msg_len;
+    bool is_another_portion;
+
+    msg = "";
+
+    // Length of the first portion is already read by the caller
     while (true) {
-        if (recvBool(pipe, another_part) == -1) { return -1; }
-        if (!another_part) return 0;
-        if (recvText(pipe, msg) == -1) { return -1; };
-        msgv.push_back(msg);
+        msg_len = static_cast<unsigned int>(cbuf) - static_cast<unsigned int>(PROTO_BASE);
+
+        if (msg_len > MAX_MESSAGE_SIZE) { log->error(313, "int Talk::recvText"); return -1; }
+
+        is_another_portion = (msg_len == MAX_MESSAGE_SIZE);
+
+        if (msg_len && (readFull(pipe, buf, msg_len) == -1)) { log->error(310, "int Talk::recvText"); return -1; }
+        msg.append(buf, msg_len);
+        if (msg.size() > MAX_LONG_BUF_SIZE) { log->error(313, "int Talk::recvText"); return -1; }
+
+        if (!is_another_portion) break;
+        if (readFull(pipe, &cbuf, 1) == -1) { log->error(310, "int Talk::recvText"); return -1; }
     }
-   
+    
     return 0;
 }
 
+int Talk::readFull(int pipe, char *buf, size_t size)
+{
+    ssize_t got;
+
+    while (size) {
+        got = read(pipe, buf, size);
+        if (got <= 0) return -1;
+        buf += got;
+        size -= got;
+    }
+
+    return 0;
+}
+
+int Talk::writeFull(int pipe, const char *buf, size_t size)
+{
+    ssize_t sent;
+
+    while (size) {
+        sent = write(pipe, buf, size);
+        if (sent <= 0) return -1;
+        buf += sent;
+        size -= sent;
+    }
+
+    return 0;
+}
 
@@ -20,6 +20,14 @@ class Talk
         int sendTextVector(int pipe, std::vector <std::string> &);
         int recvTextVector(int pipe, std::vector <std::string> &);
     private:
+        // Framing of protocol version 2
+        int sendFrame(int pipe, std::vector <std::string> &);
+        int recvFrame(int pipe, std::vector <std::string> &);
+        // Chunked protocol of version 1, still spoken with old clients, new client talks to new daemon only
+        void encodeTextV1(std::string &, std::string &);
+        int recvTextV1(int pipe, char, std::string &);
+        int readFull(int pipe, char *, size_t);
+        int writeFull(int pipe, const char *, size_t);
         //
         static const char BOOL_TRUE = 0x1E;
         static const char BOOL_FALSE = 0x1F;
@@ -27,6 +35,16 @@ class Talk
         static const char PROTO_BASE = 0x20;
         //
         static const unsigned int MAX_MESSAGE_SIZE = 0x7F - 0x01 - static_cast<unsigned int>(PROTO_BASE);
+        // Version 2 frame starts with a byte which is neither chunk length nor boolean of version 1,
+        // followed by flags byte (reserved for compression, always 0) and 32-bit payload length.
+        // Payload is a sequence of texts, each prefixed by its 32-bit length, all in network order.
+        static const char PROTO_V1 = 0x01; // Never sent, only marks old peer
+        static const char PROTO_V2 = 0x02;
+        static const unsigned int FRAME_HEADER_SIZE = 6;
+        static const unsigned int MAX_FRAME_SIZE = 0x4000000; // 64MB
+        //
+        char Version;
+        std::vector <char> Buffer; // Reused by following frames of the connection
 };
 
 #endif
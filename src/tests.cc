@@ -41,8 +41,19 @@ Tests::~Tests ()
 bool Tests::validIp(std::string ipaddr)
 {
     struct in_addr inaddr;
+    char ipaddr_canonical[INET_ADDRSTRLEN];
+    // Reentrant, sections are prepared in parallel threads
     if ( !inet_aton( ipaddr.c_str(), &inaddr )) return false;
-    if ( ipaddr.c_str() != std::string(inet_ntoa( inaddr ))) return false;
+    if ( inet_ntop( AF_INET, &inaddr, ipaddr_canonical, sizeof(ipaddr_canonical)) == NULL ) return false;
+    if ( ipaddr != std::string(ipaddr_canonical)) return false;
+    return true;
+}
+
+bool Tests::validIp6(std::string ipaddr)
+{
+    struct in6_addr in6addr;
+
+    if (inet_pton(AF_INET6, ipaddr.c_str(), &in6addr) != 1) return false;
     return true;
 }
 
@@ -107,6 +118,13 @@ bool Tests::ifaceIsImq(std::string iface)
     return false;
 }
 
+bool Tests::ifaceIsIfb(std::string iface)
+{
+    if (iface.substr(0, 3) == "ifb") return true;
+
+    return false;
+}
+
 std::string Tests::whichExecutable (std::string path)
 {
     std::string buf;
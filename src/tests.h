@@ -12,6 +12,7 @@ class Tests
         Tests();
         ~Tests();
         bool validIp(std::string);
+        bool validIp6(std::string);
         bool validPort(int);
         bool solidIpMask(std::string);
         bool fileExists(std::string); 
@@ -19,6 +20,7 @@ class Tests
         bool fileIsWriteable(std::string); 
         bool fileIsExecutable(std::string);
         bool ifaceIsImq(std::string);
+        bool ifaceIsIfb(std::string);
         std::string whichExecutable(std::string);
         void timerReset();
         void timerPrint();
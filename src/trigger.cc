@@ -114,6 +114,18 @@ int TriggerAlter::store (std::string buf)
     return 0;
 }
 
+void TriggerAlter::getMinutes (std::vector <unsigned int> &minutes)
+{
+    if (!UseTrigger) return;
+    if (!UseNsLow && !UseNsCeil) return;
+
+    // Time-period is inclusive, trigger goes down a minute after its end
+    minutes.push_back(TimePeriodFrom);
+    minutes.push_back((TimePeriodTo + 1) % TRIGGER_WHEEL_SLOTS);
+
+    return;
+}
+
 int TriggerAlter::check(unsigned int dmin)
 {
     if (!UseTrigger) return 0;
@@ -147,6 +159,7 @@ TriggerQuota::TriggerQuota ()
     TotalWeek = 0;
     TotalMonth = 0;
     TotalMinor = 0;
+    Dirty = false;
     IsDayResetted = false;
     IsWeekResetted = false;
     IsMonthResetted = false;
@@ -205,44 +218,54 @@ int TriggerQuota::store (std::string buf)
             ResetMday = aux::str_to_uint(value);
             if (!aux::is_uint(value) || (ResetMday > 31)) { log->error(102, buf); return -1; }
         }
+        // Journal of counters is common for all classes
+        else if (param == "flush-interval") { log->error(151, buf); return -1; }
         else { log->error (11, buf); return -1; }
     }
 
     return 0;
 }
 
-int TriggerQuota::readQuota (std::string arg, unsigned int &res)
+int TriggerQuota::readQuota (std::string arg, __u64 &res)
 {
     size_t pos = 0;
     std::string sub;
 
     pos = arg.find_first_not_of ("0123456789");
     if (arg.empty() || (pos == 0)) { return -1; }
-    if (pos == std::string::npos) { res = aux::str_to_uint(arg); return 0; };
+    if (pos == std::string::npos) { res = aux::str_to_u64(arg); return 0; };
     
     sub = arg.substr(pos, std::string::npos);
 
-    if ((sub == "MB") || (sub == "mB")) res = aux::str_to_uint(arg);
-    else if ((sub == "GB") || (sub == "gB")) res = aux::str_to_uint(arg)*1000;
-    else if ((sub == "TB") || (sub == "tB")) res = aux::str_to_uint(arg)*1000000;
+    if ((sub == "MB") || (sub == "mB")) res = aux::str_to_u64(arg);
+    else if ((sub == "GB") || (sub == "gB")) res = aux::str_to_u64(arg)*1000;
+    else if ((sub == "TB") || (sub == "tB")) res = aux::str_to_u64(arg)*1000000;
     else {
         log->warning(13, arg);
-        res = aux::str_to_uint(arg);
+        res = aux::str_to_u64(arg);
     }
 
     return 0;
 }
 
-int TriggerQuota::totalize (unsigned int rate)
+int TriggerQuota::totalize (__u64 rate)
 {
-    unsigned int total_major = 0;
+    __u64 total_major = 0;
 
     TotalMinor += (rate >> 3); // bits -> Bytes
     total_major = (TotalMinor >> 20); // take out MBytes
     TotalMinor ^= (total_major << 20); // detach taked out MBytes (TotalMinor % 1048576)
+    if (!total_major) return 0;
     if (LimitDay) TotalDay += total_major;
     if (LimitWeek) TotalWeek += total_major;
     if (LimitMonth) TotalMonth += total_major;
+    if (LimitDay || LimitWeek || LimitMonth) Dirty = true;
+
+    // Report limit crossing, trigger is switched by check()
+    if (Active || (!UseNsLow && !UseNsCeil)) return 0;
+    if ((LimitDay && (TotalDay > LimitDay)) ||
+            (LimitWeek && (TotalWeek > LimitWeek)) ||
+            (LimitMonth && (TotalMonth > LimitMonth))) return 1;
 
     return 0;
 }
@@ -255,17 +278,17 @@ int TriggerQuota::check (unsigned int dmin, unsigned int wday, unsigned int mday
     if (!UseNsLow && !UseNsCeil) return 0;
 
     if (LimitDay) {
-        if ((dmin == ResetDmin) && (!IsDayResetted)) { TotalDay = 0; IsDayResetted = true; }
+        if ((dmin == ResetDmin) && (!IsDayResetted)) { TotalDay = 0; IsDayResetted = true; Dirty = true; }
         else if (dmin != ResetDmin) IsDayResetted = false;
     }
 
     if (LimitWeek) {
-        if ((wday == ResetWday) && (!IsWeekResetted)) { TotalWeek = 0; IsWeekResetted = true; }
+        if ((wday == ResetWday) && (!IsWeekResetted)) { TotalWeek = 0; IsWeekResetted = true; Dirty = true; }
         else if (wday != ResetWday) IsWeekResetted = false;
     }
 
     if (LimitMonth) {
-        if (((mday == ResetMday) || (mday_last && (mday < ResetMday))) && (!IsMonthResetted)) { TotalMonth = 0; IsMonthResetted = true; }
+        if (((mday == ResetMday) || (mday_last && (mday < ResetMday))) && (!IsMonthResetted)) { TotalMonth = 0; IsMonthResetted = true; Dirty = true; }
         else if ((mday != ResetMday) && !(mday_last && (mday < ResetMday))) IsMonthResetted = false;
     }
 
@@ -287,16 +310,21 @@ int TriggerQuota::check (unsigned int dmin, unsigned int wday, unsigned int mday
     return 0;
 }
 
-std::string TriggerQuota::dumpCounters ()
+void TriggerQuota::getMinutes (std::vector <unsigned int> &minutes)
 {
-    if (TotalDay || TotalWeek || TotalMonth) {
-        return (aux::int_to_str(TotalDay) + " " + aux::int_to_str(TotalWeek) + " " + aux::int_to_str(TotalMonth));
+    if (!UseNsLow && !UseNsCeil) return;
+
+    // Reset flags are cleared at the minute following the reset
+    if (LimitDay) {
+        minutes.push_back(ResetDmin);
+        minutes.push_back((ResetDmin + 1) % TRIGGER_WHEEL_SLOTS);
     }
+    if (LimitWeek || LimitMonth) minutes.push_back(0);
 
-    return "";
+    return;
 }
 
-void TriggerQuota::setCounters (unsigned int counter_day, unsigned int counter_week, unsigned int counter_month)
+void TriggerQuota::setCounters (__u64 counter_day, __u64 counter_week, __u64 counter_month)
 {
     TotalDay = counter_day;
     TotalWeek = counter_week;
@@ -305,3 +333,51 @@ void TriggerQuota::setCounters (unsigned int counter_day, unsigned int counter_w
     return;
 }
 
+void TriggerQuota::getCounters (__u64 &counter_day, __u64 &counter_week, __u64 &counter_month)
+{
+    counter_day = TotalDay;
+    counter_week = TotalWeek;
+    counter_month = TotalMonth;
+
+    return;
+}
+
+TriggerWheel::TriggerWheel ()
+{
+    Slots.resize(TRIGGER_WHEEL_SLOTS);
+    LastMinute = 0;
+    LastDmin = 0;
+}
+
+TriggerWheel::~TriggerWheel ()
+{
+}
+
+void TriggerWheel::add (unsigned int dmin, unsigned int item)
+{
+    std::vector <unsigned int> &slot = Slots.at(dmin % TRIGGER_WHEEL_SLOTS);
+
+    if (aux::is_in_vector(slot, item)) return;
+    slot.push_back(item);
+
+    return;
+}
+
+int TriggerWheel::advance (time_t minute, unsigned int dmin, std::vector <unsigned int> &due)
+{
+    bool full = false;
+
+    due.clear();
+
+    // Startup, skipped minutes, clock or timezone changes require all triggers to be evaluated
+    if (!LastMinute || (minute != (LastMinute + 1)) || (dmin != ((LastDmin + 1) % TRIGGER_WHEEL_SLOTS))) full = true;
+
+    LastMinute = minute;
+    LastDmin = dmin;
+
+    if (full) return 1;
+
+    due = Slots.at(dmin % TRIGGER_WHEEL_SLOTS);
+
+    return 0;
+}
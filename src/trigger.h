@@ -1,6 +1,23 @@
 #ifndef TRIGGER_H
 #define TRIGGER_H
 
+#include <linux/types.h>
+#include <time.h>
+
+#include <vector>
+
+// Local time context of a round, computed once per section and shared by all classes
+struct TriggerTime {
+    unsigned int Dmin;
+    unsigned int Wday;
+    unsigned int Mday;
+    bool MdayLast;
+};
+
+// Alter time-periods and quota resets have minute resolution and repeat daily,
+// week and month resets are cascaded from the midnight slot
+const unsigned int TRIGGER_WHEEL_SLOTS = 1440;
+
 class Trigger {
     public:
         Trigger ();
@@ -8,13 +25,13 @@ class Trigger {
         bool isActive () { return Active; }
         bool isUseNsLow () { return UseNsLow; }
         bool isUseNsCeil () { return UseNsCeil; }
-        unsigned int &getTriggerNsLowRef() { return TriggerNsLow; }
-        unsigned int &getTriggerNsCeilRef() { return TriggerNsCeil; }
+        __u64 &getTriggerNsLowRef() { return TriggerNsLow; }
+        __u64 &getTriggerNsCeilRef() { return TriggerNsCeil; }
         void setActive (bool active) { Active = active; } 
     protected:
         int storeReplaced (std::string);
-        unsigned int TriggerNsLow;
-        unsigned int TriggerNsCeil;
+        __u64 TriggerNsLow;
+        __u64 TriggerNsCeil;
         bool UseNsLow;
         bool UseNsCeil;
         bool UseTrigger;
@@ -28,6 +45,7 @@ class TriggerAlter : public Trigger {
         ~TriggerAlter ();
         int store (std::string);
         int check (unsigned int);
+        void getMinutes (std::vector <unsigned int> &);
     private:
         unsigned int TimePeriodFrom;
         unsigned int TimePeriodTo;
@@ -38,26 +56,42 @@ class TriggerQuota : public Trigger {
         TriggerQuota ();
         ~TriggerQuota ();
         int store (std::string);
-        int totalize (unsigned int);
+        int totalize (__u64);
         int check (unsigned int, unsigned int, unsigned int, bool);
-        std::string dumpCounters ();
-        void setCounters (unsigned int, unsigned int, unsigned int);
+        void getMinutes (std::vector <unsigned int> &);
+        void setCounters (__u64, __u64, __u64);
+        void getCounters (__u64 &, __u64 &, __u64 &);
+        bool isDirty () { return Dirty; }
+        void setDirty (bool dirty) { Dirty = dirty; }
     private:
-        int readQuota (std::string, unsigned int &);
-        unsigned int LimitDay;
-        unsigned int LimitWeek;
-        unsigned int LimitMonth;
+        int readQuota (std::string, __u64 &);
+        __u64 LimitDay;
+        __u64 LimitWeek;
+        __u64 LimitMonth;
         unsigned int ResetDmin;
         unsigned int ResetWday;
         unsigned int ResetMday;
-        unsigned int TotalDay;
-        unsigned int TotalWeek;
-        unsigned int TotalMonth;
-        unsigned int TotalMinor;
+        __u64 TotalDay;
+        __u64 TotalWeek;
+        __u64 TotalMonth;
+        __u64 TotalMinor;
+        bool Dirty;
         bool IsDayResetted;
         bool IsWeekResetted;
         bool IsMonthResetted;
 };
 
+class TriggerWheel {
+    public:
+        TriggerWheel ();
+        ~TriggerWheel ();
+        void add (unsigned int, unsigned int);
+        int advance (time_t, unsigned int, std::vector <unsigned int> &);
+    private:
+        std::vector < std::vector <unsigned int> > Slots;
+        time_t LastMinute;
+        unsigned int LastDmin;
+};
+
 #endif
 
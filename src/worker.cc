@@ -23,6 +23,7 @@
 #include <vector>
 
 #include "config.h"
+#include "arena.h"
 #include "aux.h"
 #include "logger.h"
 #include "ifaces.h"
@@ -36,6 +37,8 @@ Worker::Worker(std::string section_name, unsigned int section_id, unsigned int w
     WaitingRoomId = waitingroom_id;
     SAOContainter = sao_container; 
     QuotaFile = "";
+    QuotaCountersStore = NULL;
+    QuotaFlushFailed = false;
     ReloadsCounter = 0;        
     CycleReportMinMsec = 0;
     CycleReportMaxMsec = 0;
@@ -43,14 +46,22 @@ Worker::Worker(std::string section_name, unsigned int section_id, unsigned int w
     CycleReportCounter = 0;
     CycleReportInitialized = false;
     StatusTableUnformatted.clear();
+    ShmFirstRecord = 0;
+    ShmRecords.clear();
     NS = NULL;
+    NSReloaded = NULL;
 }
 
 Worker::~Worker()
 {
-    if (QuotaFile.size()) quotaCountersSave();    
+    if (QuotaCountersStore != NULL) {
+        quotaCountersSave(false);
+        quotaCountersFlush();
+        delete QuotaCountersStore;
+    }
 
     if (NS != NULL) delete NS;
+    if (NSReloaded != NULL) delete NSReloaded;
 
     if (!SAOContainter) pthread_mutex_destroy(&StatusTableUnformattedLock);
 }
@@ -64,21 +75,29 @@ void Worker::statusTableUnformattedLockUnlockWithTrylock()
     if ((result == 0) || (result == EBUSY)) pthread_mutex_unlock(&StatusTableUnformattedLock);
 }
 
-int Worker::init(std::vector <std::string> &fpv_conffile, std::vector <std::string> &fpv_classfile)
+int Worker::prepare(std::vector <std::string> &fpv_conffile, ClassFilePartition &partition)
+{
+    // Called in parallel for all sections, thus nothing is done here with the kernel
+    NS = new NiceShaper(SectionName, SectionId, WaitingRoomId, SAOContainter, &Arena);
+
+    if (NS->prepare(fpv_conffile, partition) == -1) return -1;
+
+    return 0;
+}
+
+int Worker::init()
 {
     struct stat vardir_stat;
     struct timeval tv_curr;
 
-    log->info(3, SectionName);
-
     if (!SAOContainter) {
         QuotaFile = vardir + "/" + SectionName + ".quota";
         if ((stat(vardir.c_str(), &vardir_stat) == -1) || (!S_ISDIR(vardir_stat.st_mode))) QuotaFile = "";
     }
 
-    NS = new NiceShaper(SectionName, SectionId, WaitingRoomId, SAOContainter);
+    if (NS == NULL) return -1;
 
-    if (NS->init(fpv_conffile, fpv_classfile) == -1) {
+    if (NS->init() == -1) {
         log->error(SectionName, 30);
         return -1;
     }
@@ -86,9 +105,10 @@ int Worker::init(std::vector <std::string> &fpv_conffile, std::vector <std::stri
     if (SAOContainter) return 0;
 
     if (QuotaFile.size()) {
+        QuotaCountersStore = new QuotaStore(QuotaFile + ".journal");
         quotaCountersLoad();
-        rename (QuotaFile.c_str(), (QuotaFile+".bak").c_str());
-        quotaCountersSave();
+        quotaCountersSave(true);
+        quotaCountersFlush();
     }
 
     gettimeofday (&tv_curr, NULL);
@@ -114,11 +134,59 @@ int Worker::recoverQos()
     return 0;   
 }
 
+int Worker::reloadClassesPrepare(std::vector <std::string> &fpv_conffile, ClassFilePartition &partition)
+{
+    reloadClassesCancel();
+
+    NSReloaded = new NiceShaper(SectionName, SectionId, WaitingRoomId, SAOContainter, &Arena);
+
+    if ((NSReloaded->prepare(fpv_conffile, partition) == -1) || (NSReloaded->prepareQosFilters() == -1)) {
+        reloadClassesCancel();
+        return -1;
+    }
+
+    return 0;
+}
+
+int Worker::reloadClassesApply()
+{
+    int result;
+
+    if (NSReloaded == NULL) return -1;
+
+    // Status readers walk through the classes of this section
+    if (!SAOContainter) pthread_mutex_lock(&StatusTableUnformattedLock);
+
+    result = NS->reload(NSReloaded);
+    NSReloaded = NULL;
+    StatusTableUnformatted.clear();
+
+    if (!SAOContainter) pthread_mutex_unlock(&StatusTableUnformattedLock);
+
+    if (result == -1) return -1;
+
+    if (QuotaCountersStore != NULL) quotaCountersSave(true);
+
+    return 0;
+}
+
+void Worker::reloadClassesCancel()
+{
+    if (NSReloaded != NULL) delete NSReloaded;
+
+    NSReloaded = NULL;
+}
+
 unsigned int Worker::getSectionReload()
 {
     return NS->getReload();
 }
 
+unsigned int Worker::getClassesCount()
+{
+    return NS->getClassesCount();
+}
+
 EnumFlowDirection Worker::getFlowDirection() 
 { 
     return NS->getFlowDirection();
@@ -144,16 +212,21 @@ bool Worker::getIptRequiredToCheck()
     return NS->getIptRequiredToCheck();
 }
 
-void Worker::getIptRequirementsIfRequired(bool &dwload_ipt_required, bool &dwload_ipt_required_to_check, bool &upload_ipt_required, bool &upload_ipt_required_to_check)
+void Worker::getIptRequirementsIfRequired(bool &dwload_ipt_required, bool &dwload_ipt_required_to_check, bool &upload_ipt_required, bool &upload_ipt_required_to_check, bool reloaded)
 {
-    if (NS->getIptRequired()) {
-        if (NS->getFlowDirection() == DWLOAD) dwload_ipt_required = true;
-        else if (NS->getFlowDirection() == UPLOAD) upload_ipt_required = true;
+    NiceShaper *ns = NS;
+
+    // Requirements of classes prepared for reload but not applied yet
+    if (reloaded && (NSReloaded != NULL)) ns = NSReloaded;
+
+    if (ns->getIptRequired()) {
+        if (ns->getFlowDirection() == DWLOAD) dwload_ipt_required = true;
+        else if (ns->getFlowDirection() == UPLOAD) upload_ipt_required = true;
     }
 
-    if (NS->getIptRequiredToCheck()) {
-        if (NS->getFlowDirection() == DWLOAD) dwload_ipt_required_to_check = true;
-        else if (NS->getFlowDirection() == UPLOAD) upload_ipt_required_to_check = true;
+    if (ns->getIptRequiredToCheck()) {
+        if (ns->getFlowDirection() == DWLOAD) dwload_ipt_required_to_check = true;
+        else if (ns->getFlowDirection() == UPLOAD) upload_ipt_required_to_check = true;
     }
 }
 
@@ -190,7 +263,6 @@ int Worker::receiptIptTraffic (std::vector <__u64> &ipt_ordered_counters, std::v
 int Worker::reload(struct timeval tv_curr, double round_duration)
 {
     unsigned int cycle_report_rewrite_sec = 3600;
-    unsigned int quota_counters_rewrite_sec = 300;
     std::string buf = "";
 
     pthread_mutex_lock(&StatusTableUnformattedLock);
@@ -210,61 +282,83 @@ int Worker::reload(struct timeval tv_curr, double round_duration)
             "avg: " + aux::int_to_str(CycleReportSumMsec/CycleReportCounter/1000) + "." + aux::int_to_str(((CycleReportSumMsec/CycleReportCounter) % 1000) ,3) + "s "
             "max: " + aux::int_to_str(CycleReportMaxMsec/1000) + "." + aux::int_to_str((CycleReportMaxMsec % 1000), 3) + "s";
         log->info(SectionName, 9, buf);
+        log->info(SectionName, 18, memoryReport());
         CycleReportPrevSec = tv_curr.tv_sec;
         CycleReportInitialized = false;
     }
 
-    // Save quota counters
-    if ((tv_curr.tv_sec-QuotaSavePrevSec) >= quota_counters_rewrite_sec ) {
-        quotaCountersSave(); 
+    // Stage changed quota counters, the journal is written by the supervisor's quota writer thread
+    if ((QuotaCountersStore != NULL) && ((tv_curr.tv_sec-QuotaSavePrevSec) >= config->getQuotaFlushInterval())) {
+        quotaCountersSave(false); 
         QuotaSavePrevSec = tv_curr.tv_sec;
     }
 
     return 0;
 }
 
-int Worker::statusFormattedAppend(EnumUnits status_unit, std::vector <std::string> &status_table)
+int Worker::activateHosts(std::vector <std::string> &addrs, time_t tv_sec)
 {
-    const int max_rate_size = aux::int_to_str(MAX_RATE).size() + 4;
-    std::string status_row;
-    std::string buf;
+    int result;
 
+    // Classes are read by the controller handlers at the same time
     pthread_mutex_lock(&StatusTableUnformattedLock);
+    result = NS->activateHosts(addrs, tv_sec);
+    if (result > 0) StatusTableUnformatted.clear();
+    pthread_mutex_unlock(&StatusTableUnformattedLock);
 
-    if (StatusTableUnformatted.empty()) {
-        NS->statusUnformatted(StatusTableUnformatted);
-    }
+    return result;
+}
 
-    pthread_mutex_unlock(&StatusTableUnformattedLock);
+bool Worker::getCtActivation()
+{
+    return NS->getCtActivation();
+}
+
+int Worker::statusFormattedAppend(EnumUnits status_unit, std::vector <std::string> &status_table)
+{
+    const unsigned int max_rate_size = aux::int_to_str(MAX_RATE).size() + 4;
+    const char *fields[STATUS_ROW_FIELDS];
+    unsigned int fields_len[STATUS_ROW_FIELDS];
+    std::string buf;
+
+    statusTableUnformattedPrepare();
 
     for (unsigned int n=0; n<StatusTableUnformatted.size(); n++) {
-        status_row = StatusTableUnformatted.at(n);
+        const std::string &status_row = StatusTableUnformatted.at(n);
+        // Row is split once, numbers are read straight from it
+        statusRowSplit(status_row, fields, fields_len);
         // Name column
-        buf = statusUndent(aux::awk(status_row, 1), MAX_CLASS_NAME_SIZE) + "  ";
+        buf = statusUndent(std::string(fields[0], fields_len[0]), MAX_CLASS_NAME_SIZE) + "  ";
         if (n)
         {
             // Ceil column
-            if ( aux::awk(status_row, 2 ) != "-" ) {
-                buf += statusIndent((aux::int_to_str(aux::unit_convert(aux::awk(status_row, 2), status_unit)) + aux::unit_to_str(status_unit, 0)), max_rate_size) + " - ";
+            if (!statusFieldIsEmpty(fields[1], fields_len[1])) {
+                statusRateAppend(buf, fields[1], fields_len[1], status_unit, max_rate_size);
+                buf += " - ";
             }
             else {
-                buf += std::string(max_rate_size , ' ') + "   ";
+                buf.append(max_rate_size + 3, ' ');
             }
 
             // Last-Ceil column
-            if ( aux::awk( status_row, 3 ) != "-" ) {
-                buf += statusIndent((aux::int_to_str(aux::unit_convert(aux::awk(status_row, 3), status_unit)) + aux::unit_to_str(status_unit, 0)), max_rate_size ) + " ";
+            if (!statusFieldIsEmpty(fields[2], fields_len[2])) {
+                statusRateAppend(buf, fields[2], fields_len[2], status_unit, max_rate_size);
+                buf += " ";
             }
             else {
-                buf += std::string(max_rate_size, ' ') + " ";
+                buf.append(max_rate_size + 1, ' ');
             }
 
             // Last-Utilize column
-            if ( aux::awk(status_row, 4) != "-" ) {
-                buf += "( " + statusIndent((aux::int_to_str(aux::unit_convert(aux::awk(status_row, 4), status_unit)) + aux::unit_to_str(status_unit, 0)), max_rate_size) + " )";
+            if (!statusFieldIsEmpty(fields[3], fields_len[3])) {
+                buf += "( ";
+                statusRateAppend(buf, fields[3], fields_len[3], status_unit, max_rate_size);
+                buf += " )";
             }
             else {
-                buf += "( " + std::string(max_rate_size, ' ') + " )";
+                buf += "( ";
+                buf.append(max_rate_size, ' ');
+                buf += " )";
             }
         }
         else
@@ -280,6 +374,88 @@ int Worker::statusFormattedAppend(EnumUnits status_unit, std::vector <std::strin
     return 0;
 }
 
+int Worker::shmStatusPublish(ShmStatus *shm_status)
+{
+    NS->shmStatusFill(ShmRecords);
+    shm_status->publish(ShmFirstRecord, ShmRecords);
+
+    return 0;
+}
+
+int Worker::statusSerializedAppend(EnumStatusFileFormat status_format, std::string &status_buf)
+{
+    std::string status_row, name, sum;
+    bool first_class = true;
+
+    statusTableUnformattedPrepare();
+
+    if (status_format == SF_JSON) status_buf += "{\"section\":" + statusJsonString(SectionName) + ",\"classes\":[";
+
+    sum = "null";
+
+    // Row 0 is a header of the text table
+    for (unsigned int n=1; n<StatusTableUnformatted.size(); n++) {
+        status_row = StatusTableUnformatted.at(n);
+        name = aux::awk(status_row, 1);
+
+        if (status_format == SF_CSV) {
+            status_buf += SectionName + "," + name;
+            for (unsigned int i=2; i<=4; i++) {
+                status_buf += ",";
+                if (aux::awk(status_row, i) != "-") status_buf += aux::awk(status_row, i);
+            }
+            status_buf += "\n";
+        }
+        else if (status_format == SF_JSON) {
+            if (name.compare(0, 4, "sum(") == 0) {
+                sum = "{\"classes\":" + aux::awk(aux::awk(name, ":", 2), ")", 1) + ",\"ceil\":" + statusJsonValue(aux::awk(status_row, 2))
+                    + ",\"last_ceil\":" + statusJsonValue(aux::awk(status_row, 3)) + ",\"traffic\":" + statusJsonValue(aux::awk(status_row, 4)) + "}";
+                continue;
+            }
+            if (!first_class) status_buf += ",";
+            status_buf += "{\"name\":" + statusJsonString(name) + ",\"ceil\":" + statusJsonValue(aux::awk(status_row, 2))
+                + ",\"last_ceil\":" + statusJsonValue(aux::awk(status_row, 3)) + ",\"traffic\":" + statusJsonValue(aux::awk(status_row, 4)) + "}";
+            first_class = false;
+        }
+    }
+
+    if (status_format == SF_JSON) status_buf += "],\"sum\":" + sum + "}";
+
+    return 0;
+}
+
+void Worker::statusTableUnformattedPrepare()
+{
+    pthread_mutex_lock(&StatusTableUnformattedLock);
+
+    if (StatusTableUnformatted.empty()) {
+        NS->statusUnformatted(StatusTableUnformatted);
+    }
+
+    pthread_mutex_unlock(&StatusTableUnformattedLock);
+}
+
+std::string Worker::statusJsonValue(std::string arg)
+{
+    if (arg == "-") return "null";
+
+    return arg;
+}
+
+std::string Worker::statusJsonString(std::string arg)
+{
+    std::string res = "\"";
+
+    for (unsigned int n=0; n<arg.size(); n++) {
+        if ((arg[n] == '"') || (arg[n] == '\\')) res += std::string("\\") + arg[n];
+        else if (static_cast<unsigned char>(arg[n]) < 0x10) res += "\\u000" + aux::int_to_hex(static_cast<unsigned char>(arg[n]));
+        else if (static_cast<unsigned char>(arg[n]) < 0x20) res += "\\u00" + aux::int_to_hex(static_cast<unsigned char>(arg[n]));
+        else res += arg[n];
+    }
+
+    return res + "\"";
+}
+
 std::string Worker::statusUndent(std::string arg, unsigned int count)
 {
     std::string res = "";
@@ -292,6 +468,51 @@ std::string Worker::statusUndent(std::string arg, unsigned int count)
     return res;
 }
 
+void Worker::statusRowSplit(const std::string &status_row, const char *fields[], unsigned int fields_len[])
+{
+    const char *pos = status_row.c_str();
+
+    for (unsigned int n=0; n < STATUS_ROW_FIELDS; n++) {
+        while ((*pos == ' ') || (*pos == '\t')) pos++;
+        fields[n] = pos;
+        while (*pos && (*pos != ' ') && (*pos != '\t')) pos++;
+        fields_len[n] = pos - fields[n];
+    }
+}
+
+bool Worker::statusFieldIsEmpty(const char *field, unsigned int field_len)
+{
+    return (!field_len || ((field_len == 1) && (*field == '-')));
+}
+
+void Worker::statusRateAppend(std::string &dst, const char *field, unsigned int field_len, EnumUnits status_unit, unsigned int count)
+{
+    char buf[aux::RATE_CHARS_SIZE];
+    unsigned int len;
+    __u64 rate = 0;
+
+    for (unsigned int n=0; (n < field_len) && (field[n] >= '0') && (field[n] <= '9'); n++) rate = rate*10 + (field[n] - '0');
+
+    // Rendered in place, thousands of rows mustn't cost a temporary string per number
+    len = aux::rate_to_chars(buf, rate, status_unit);
+
+    if (count > len) dst.append(count-len, ' ');
+    dst.append(buf, (len < count) ? len : count);
+}
+
+std::string Worker::memoryReport()
+{
+    std::string buf;
+
+    // Counts of objects alive and sizes of memory taken by their arenas
+    buf = "classes: " + aux::int_to_str(Arena.Classes.count()) + "/" + aux::int_to_str(static_cast<unsigned int>(Arena.Classes.bytes()/1024)) + "KB";
+    buf += ", filters: " + aux::int_to_str(Arena.Filters.count()) + "/" + aux::int_to_str(static_cast<unsigned int>(Arena.Filters.bytes()/1024)) + "KB";
+    buf += ", cold parts: " + aux::int_to_str(static_cast<unsigned int>(Arena.Classes.count()*sizeof(NsClassCold)/1024)) + "KB";
+    buf += ", interned strings: " + aux::int_to_str(strpool->count()) + "/" + aux::int_to_str(static_cast<unsigned int>(strpool->bytes()/1024)) + "KB";
+
+    return buf;
+}
+
 std::string Worker::statusIndent(std::string arg, unsigned int count)
 {
     std::string res = "";
@@ -305,29 +526,28 @@ std::string Worker::statusIndent(std::string arg, unsigned int count)
     return res;
 }
 
-int Worker::quotaCountersSave()
+int Worker::quotaCountersSave(bool all)
 {
-    std::vector <std::string> quotas_table;
-    std::vector <std::string>::iterator qti;
-    std::ofstream ofd;
-
-    quotas_table = NS->dumpQuotaCounters();
+    NS->dumpQuotaRecords(QuotaRecords, all);
     
-    if (quotas_table.size()) {        
-        ofd.open(QuotaFile.c_str());
-        if (ofd.is_open()) {
-            qti = quotas_table.begin();
-            while (qti < quotas_table.end()) {
-                ofd << *qti + '\n';;
-                qti++;
-            }
-            ofd.close();
-        }
-        else {
-            log->error(SectionName, 27, QuotaFile);
-        }
+    if (QuotaRecords.size()) QuotaCountersStore->stage(QuotaRecords);
+
+    return 0;
+}
+
+int Worker::quotaCountersFlush()
+{
+    if (QuotaCountersStore == NULL) return 0;
+
+    // Retried at each flush, but logged once
+    if (QuotaCountersStore->flush() == -1) {
+        if (!QuotaFlushFailed) log->error(SectionName, 27, QuotaCountersStore->getPath());
+        QuotaFlushFailed = true;
+        return -1;
     }
 
+    QuotaFlushFailed = false;
+
     return 0;
 }
 
@@ -336,7 +556,15 @@ int Worker::quotaCountersLoad()
     std::vector <std::string> quota_counters_table;
     std::ifstream ifd;
     std::string buf;
+    unsigned int damaged;
+
+    if (QuotaCountersStore->load(QuotaRecords, damaged) == 0) {
+        if (damaged) log->warning(SectionName, 20, QuotaCountersStore->getPath());
+        NS->setQuotaRecords(QuotaRecords);
+        return 0;
+    }
 
+    // Counters saved in text format by previous versions
     ifd.open (QuotaFile.c_str());
     if (ifd.is_open()) {
         while (getline(ifd ,buf)) {
@@ -344,6 +572,7 @@ int Worker::quotaCountersLoad()
         }            
         ifd.close();
         if (quota_counters_table.size()) NS->setQuotaCounters(quota_counters_table);
+        rename (QuotaFile.c_str(), (QuotaFile+".bak").c_str());
     }
 
     return 0;
@@ -3,28 +3,41 @@
 
 #include "main.h"
 #include "niceshaper.h"
+#include "quotastore.h"
+#include "shmstatus.h"
 
 class Worker {
     public:
         Worker(std::string, unsigned int, unsigned int, bool);
         ~Worker();	
         //
-        int init(std::vector <std::string> &, std::vector <std::string> &);
+        int prepare(std::vector <std::string> &, ClassFilePartition &);
+        int init();
         int recoverQos();
+        int reloadClassesPrepare(std::vector <std::string> &, ClassFilePartition &);
+        int reloadClassesApply();
+        void reloadClassesCancel();
         int proceedRoundReportValues(struct timeval &, struct timeval &);
         int receiptIptTraffic (std::vector <__u64> &, std::vector <__u64> &);
         int reload(struct timeval, double);
+        int activateHosts(std::vector <std::string> &, time_t);
         int statusFormattedAppend(EnumUnits, std::vector <std::string> &);
+        int statusSerializedAppend(EnumStatusFileFormat, std::string &);
         void statusTableUnformattedLockUnlockWithTrylock();
+        int shmStatusPublish(ShmStatus *);
+        int quotaCountersFlush();
         //
         EnumFlowDirection getFlowDirection();
+        bool getCtActivation();
         void setIptRequired(bool);
         void setIptRequiredToCheckActivity(bool);
         bool getIptRequired();
         bool getIptRequiredToCheck();
-        void getIptRequirementsIfRequired(bool &, bool &, bool &, bool &);
+        void getIptRequirementsIfRequired(bool &, bool &, bool &, bool &, bool reloaded = false);
         std::string getSectionName() { return SectionName; }
         unsigned int getSectionReload();
+        unsigned int getClassesCount();
+        void setShmFirstRecord(unsigned int shm_first_record) { ShmFirstRecord = shm_first_record; }
         void resetReloadsCounter() { ReloadsCounter=0;}
         void incReloadsCounter() { ReloadsCounter++; }
         unsigned int getReloadsCounter() { return ReloadsCounter; }
@@ -34,7 +47,15 @@ class Worker {
    private:
         std::string statusUndent(std::string, unsigned int);
         std::string statusIndent(std::string, unsigned int);
-        int quotaCountersSave();
+        void statusRowSplit(const std::string &, const char *[], unsigned int []);
+        bool statusFieldIsEmpty(const char *, unsigned int);
+        void statusRateAppend(std::string &, const char *, unsigned int, EnumUnits, unsigned int);
+        static const unsigned int STATUS_ROW_FIELDS = 4; // Name, ceil, last ceil, traffic
+        std::string statusJsonValue(std::string);
+        std::string statusJsonString(std::string);
+        std::string memoryReport();
+        void statusTableUnformattedPrepare();
+        int quotaCountersSave(bool);
         int quotaCountersLoad();
         //
         std::string SectionName;
@@ -43,8 +64,13 @@ class Worker {
         unsigned int ReloadsCounter;
         std::vector <std::string> StatusTableUnformatted;
         pthread_mutex_t StatusTableUnformattedLock;
+        unsigned int ShmFirstRecord;
+        std::vector <ShmStatusRecord> ShmRecords;
         bool SAOContainter;
         std::string QuotaFile;
+        QuotaStore *QuotaCountersStore;
+        bool QuotaFlushFailed;
+        std::vector <QuotaJournalRecord> QuotaRecords;
         unsigned int QuotaSavePrevSec;
         unsigned int CycleReportPrevSec;
         unsigned int CycleReportMinMsec;
@@ -52,7 +78,9 @@ class Worker {
         unsigned int CycleReportSumMsec;
         unsigned int CycleReportCounter;
         bool CycleReportInitialized;
+        SectionArena Arena;
         class NiceShaper *NS;
+        class NiceShaper *NSReloaded;
 };
 
 class WorkerReloadDemand {